@@ -42,9 +42,10 @@
 #include "tap-ctl.h"
 
 int
-tap_ctl_open(const int id, const int minor, const char *params, int flags,
-	     const int prt_minor, const char *secondary, int timeout,
-	     const char* logpath, uint8_t key_size, uint8_t *encryption_key)
+tap_ctl_open_bm_cache(const int id, const int minor, const char *params,
+		      int flags, const int prt_minor, const char *secondary,
+		      int timeout, int bm_cache_size, const char* logpath,
+		      uint8_t key_size, uint8_t *encryption_key)
 {
 	int err;
 	tapdisk_message_t message;
@@ -55,6 +56,7 @@ tap_ctl_open(const int id, const int minor, const char *params, int flags,
 	message.u.params.devnum = minor;
 	message.u.params.prt_devnum = prt_minor;
 	message.u.params.req_timeout = timeout;
+	message.u.params.bm_cache_size = bm_cache_size;
 	message.u.params.flags = flags;
 
 	err = snprintf(message.u.params.path,
@@ -102,3 +104,13 @@ tap_ctl_open(const int id, const int minor, const char *params, int flags,
 
 	return err;
 }
+
+int
+tap_ctl_open(const int id, const int minor, const char *params, int flags,
+	     const int prt_minor, const char *secondary, int timeout,
+	     const char* logpath, uint8_t key_size, uint8_t *encryption_key)
+{
+	return tap_ctl_open_bm_cache(id, minor, params, flags, prt_minor,
+				     secondary, timeout, 0, logpath,
+				     key_size, encryption_key);
+}
@@ -49,20 +49,29 @@
 #include "compiler.h"
 
 int
-tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid, int poll_duration,
+tap_ctl_connect_xenblkif_ext(const pid_t pid, const domid_t domid,
+		const int devid, const int queue, int poll_duration,
 		int poll_idle_threshold,
 		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
-		int proto, const char *pool, const int minor)
+		int proto, const unsigned int flags, const char *pool, const int minor)
 {
     tapdisk_message_t message;
     int i, err;
 
 	memset(&message, 0, sizeof(message));
-    message.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT;
+    /*
+     * Older tapdisks ignore queue and flags in a plain connect, so only
+     * send what they would refuse when these matter.
+     */
+    if (queue || flags)
+        message.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT;
+    else
+        message.type = TAPDISK_MESSAGE_XENBLKIF_CONNECT;
     message.cookie = minor;
 
     message.u.blkif.domid = domid;
     message.u.blkif.devid = devid;
+    message.u.blkif.queue = queue;
     for (i = 0; i < 1 << order; i++)
         message.u.blkif.gref[i] = grefs[i];
     message.u.blkif.order = order;
@@ -70,6 +79,7 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
     message.u.blkif.proto = proto;
     message.u.blkif.poll_duration = poll_duration;
     message.u.blkif.poll_idle_threshold = poll_idle_threshold;
+    message.u.blkif.flags = flags;
     if (pool) {
         if (unlikely(strlen(pool) > (sizeof(message.u.blkif.pool) - 1))) {
             EPRINTF("pool name too long: %s\n", pool);
@@ -91,6 +101,16 @@ tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
     return err;
 }
 
+int
+tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int devid,
+		int poll_duration, int poll_idle_threshold,
+		const grant_ref_t * grefs, const int order, const evtchn_port_t port,
+		int proto, const char *pool, const int minor)
+{
+    return tap_ctl_connect_xenblkif_ext(pid, domid, devid, 0, poll_duration,
+            poll_idle_threshold, grefs, order, port, proto, 0, pool, minor);
+}
+
 int
 tap_ctl_disconnect_xenblkif(const pid_t pid, const domid_t domid,
         const int devid, struct timeval *timeout)
@@ -764,6 +764,9 @@ tap_cli_open_usage(FILE *stream)
 		"use secondary image (in mirror mode if no -s)] [-s "
 		"fail over to the secondary image on ENOSPC] "
 		"[-t request timeout in seconds] [-D no O_DIRECT] "
+		"[-b <n> cache up to n vhd bitmaps] "
+		"[-x route reads through a flattened extent map of the chain] "
+		"[-A read ahead of sequential reads] "
 		"[-C </path/to/logfile> insert log layer to track changed blocks] "
 		"[-E read encryption key from stdin]\n");
 }
@@ -772,7 +775,7 @@ static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args, *secondary, *logpath;
-	int c, pid, minor, flags, prt_minor, timeout;
+	int c, pid, minor, flags, prt_minor, timeout, bm_cache_size;
 	uint8_t *encryption_key;
 	ssize_t key_size = 0;
 
@@ -781,13 +784,14 @@ tap_cli_open(int argc, char **argv)
 	minor      = -1;
 	prt_minor  = -1;
 	timeout    = 0;
+	bm_cache_size = 0;
 	args       = NULL;
 	secondary  = NULL;
 	logpath    = NULL;
 	encryption_key = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:C:Eh")) != -1) {
+	while ((c = getopt(argc, argv, "a:RDm:p:e:r2:st:b:xAC:Eh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -821,6 +825,17 @@ tap_cli_open(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'b':
+			bm_cache_size = atoi(optarg);
+			if (bm_cache_size <= 0)
+				goto usage;
+			break;
+		case 'x':
+			flags |= TAPDISK_MESSAGE_FLAG_EXTENT_MAP;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_READAHEAD;
+			break;
 		case 'C': 
 			logpath = optarg;
 			flags |= TAPDISK_MESSAGE_FLAG_ADD_LOG;
@@ -858,8 +873,9 @@ tap_cli_open(int argc, char **argv)
 	if (pid == -1 || minor == -1 || !args)
 		goto usage;
 
-	return tap_ctl_open(pid, minor, args, flags, prt_minor, secondary,
-			    timeout, logpath, (uint8_t)key_size, encryption_key);
+	return tap_ctl_open_bm_cache(pid, minor, args, flags, prt_minor,
+				     secondary, timeout, bm_cache_size, logpath,
+				     (uint8_t)key_size, encryption_key);
 
 usage:
 	tap_cli_open_usage(stderr);
@@ -36,11 +36,13 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
@@ -112,7 +114,7 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 
 /* Open the disk file and initialize aio state. */
 int tdaio_open(td_driver_t *driver, const char *name,
-	       struct td_vbd_encryption *encryption, td_flag_t flags)
+	       struct td_vbd_open_params *params, td_flag_t flags)
 {
 	int i, fd, ret, o_flags;
 	struct tdaio_state *prv;
@@ -122,7 +124,8 @@ int tdaio_open(td_driver_t *driver, const char *name,
 
 	DPRINTF("block-aio open('%s')", name);
 
-	memset(prv, 0, sizeof(struct tdaio_state));
+	/* requests are initialised as they are handed out */
+	memset(prv, 0, offsetof(struct tdaio_state, aio_requests));
 
 	prv->aio_free_count = MAX_AIO_REQS;
 	for (i = 0; i < MAX_AIO_REQS; i++)
@@ -155,6 +158,12 @@ int tdaio_open(td_driver_t *driver, const char *name,
 		goto done;
 	}
 
+	{
+		struct stat st;
+		prv->blkdev = !fstat(fd, &st) && S_ISBLK(st.st_mode);
+	}
+	prv->sector_size = driver->info.sector_size;
+
         prv->fd = fd;
 
 done:
@@ -226,10 +235,125 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * There is no libaio command for discards, and a large BLKDISCARD can
+ * take seconds: they run on the offload pool, and only inline if there
+ * is none. If the file system or device can't do them, discards are
+ * ignored from then on.
+ */
+static void tdaio_discard_work(td_offload_job_t *job)
+{
+	struct aio_request *aio = container_of(job, struct aio_request, job);
+	struct tdaio_state *prv = aio->state;
+	uint64_t range[2];
+	int err;
+
+	range[0] = aio->treq.sec  * (uint64_t)prv->sector_size;
+	range[1] = aio->treq.secs * (uint64_t)prv->sector_size;
+
+	if (prv->blkdev)
+		err = ioctl(prv->fd, BLKDISCARD, range);
+	else
+		err = fallocate(prv->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range[0], range[1]);
+
+	aio->error = err ? -errno : 0;
+}
+
+static void tdaio_discard_done(td_offload_job_t *job)
+{
+	struct aio_request *aio = container_of(job, struct aio_request, job);
+	struct tdaio_state *prv = aio->state;
+	int err = aio->error;
+
+	if (err == -EOPNOTSUPP || err == -ENOTTY) {
+		if (!prv->no_discard)
+			DPRINTF("discard not supported: %s, ignoring discards\n",
+				strerror(-err));
+		prv->no_discard = 1;
+		err = 0;
+	}
+
+	td_complete_request(aio->treq, err);
+	prv->aio_free_list[prv->aio_free_count++] = aio;
+}
+
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (prv->no_discard) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	if (prv->aio_free_count == 0) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	if (!prv->offload)
+		prv->offload = tapdisk_offload_start(1) > 0 &&
+			!tapdisk_offload_get();
+
+	aio           = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq     = treq;
+	aio->state    = prv;
+	aio->job.work = tdaio_discard_work;
+	aio->job.done = tdaio_discard_done;
+
+	if (tapdisk_offload_submit(&aio->job)) {
+		tdaio_discard_work(&aio->job);
+		tdaio_discard_done(&aio->job);
+	}
+}
+
+static void tdaio_flush_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct aio_request *aio = (struct aio_request *)arg;
+	struct tdaio_state *prv = aio->state;
+
+	/* kernels before 4.18 can't do fdsync through aio */
+	if (err == -EINVAL)
+		err = fdatasync(prv->fd) ? -errno : 0;
+
+	td_complete_request(aio->treq, err);
+	prv->aio_free_list[prv->aio_free_count++] = aio;
+}
+
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_fdsync(&aio->tiocb, prv->fd, tdaio_flush_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	if (prv->offload)
+		tapdisk_offload_put();
+
 	close(prv->fd);
 
 	return 0;
@@ -267,6 +391,8 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_queue_flush     = tdaio_queue_flush,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
@@ -33,6 +33,7 @@
 
 #include "tapdisk.h"
 #include "tapdisk-queue.h"
+#include "tapdisk-offload.h"
 
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
@@ -43,12 +44,21 @@ struct aio_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdaio_state  *state;
+
+	/* discards run on the offload pool */
+	td_offload_job_t     job;
+	int                  error;
 };
 
 struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
 
+	int                  blkdev;
+	int                  no_discard;
+	int                  offload;
+	long                 sector_size;
+
 	int                  aio_free_count;
 	struct aio_request   aio_requests[MAX_AIO_REQS];
 	struct aio_request  *aio_free_list[MAX_AIO_REQS];
@@ -37,12 +37,16 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-shm-cache.h"
+#include "libvhd.h"
 #include "timeout-math.h"
 
 #ifdef DEBUG
@@ -53,66 +57,74 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
+/*
+ * Read data is cached in 4K pages, allocated from 2M slabs -- huge
+ * pages where the host has them -- up to a budget of
+ * TAPDISK3_BLOCK_CACHE_SIZE MiB (BLOCK_CACHE_DEFAULT_SIZE if unset).
+ *
+ * Replacement is 2Q: pages come in on a FIFO (A1in); once pushed out of
+ * there, only their number is remembered (A1out), and a page read again
+ * while remembered goes on an LRU (Am). Pages read once, as in a scan of
+ * the image, never displace those that are read over and over.
+ *
+ * Behind that, VHD files may also use the host-wide cache in shared
+ * memory (see tapdisk-shm-cache.h), under a tag made of the VHD's UUID
+ * and the file's mtime, so that other tapdisks reading the same parent
+ * find what this one read. Images on block devices don't share.
+ */
+#define BLOCK_CACHE_PAGE_SHIFT          12
+#define BLOCK_CACHE_PAGE_SIZE           (1 << BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS_SHIFT     (BLOCK_CACHE_PAGE_SHIFT - SECTOR_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS           (1 << BLOCK_CACHE_PAGE_SECS_SHIFT)
 
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
+#define BLOCK_CACHE_SLAB_SHIFT          21
+#define BLOCK_CACHE_SLAB_SIZE           (1 << BLOCK_CACHE_SLAB_SHIFT)
+#define BLOCK_CACHE_SLAB_PAGES          (1 << (BLOCK_CACHE_SLAB_SHIFT - BLOCK_CACHE_PAGE_SHIFT))
 
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
+#define BLOCK_CACHE_DEFAULT_SIZE        (10 << 20)
+#define BLOCK_CACHE_REQUESTS            TAPDISK_DATA_REQUESTS
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
+/* A1in and A1out sizes, in percent of the pages the budget holds */
+#define BLOCK_CACHE_A1IN_PERCENT        25
+#define BLOCK_CACHE_A1OUT_PERCENT       50
 
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+/* how often an idle cache checks whether memory got low, in seconds */
+#define BLOCK_CACHE_MEM_CHECK           1
+
+enum {
+	BLOCK_CACHE_A1IN,
+	BLOCK_CACHE_AM,
+	BLOCK_CACHE_A1OUT,
+};
 
 typedef struct block_cache              block_cache_t;
+typedef struct block_cache_page         block_cache_page_t;
+typedef struct block_cache_slab         block_cache_slab_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
+struct block_cache_slab {
 	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+	int                             hugetlb;
+	int                             nr_free;
+	uint16_t                        free[BLOCK_CACHE_SLAB_PAGES];
+	struct list_head                next;
 };
 
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
+/*
+ * A cached page, or on A1out, just the memory of one (@buf is NULL).
+ */
+struct block_cache_page {
+	uint64_t                        blk;
+	int                             queue;
 	char                           *buf;
-};
-
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
-};
-
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
-};
-
-struct radix_tree {
-	int                             height;
-	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
-
-	block_cache_t                  *cache;
+	block_cache_slab_t             *slab;
+	struct hlist_node               hash;
+	struct list_head                next;
 };
 
 struct block_cache_request {
 	int                             err;
-	char                           *buf;
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
@@ -122,7 +134,8 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        evictions;
+	uint64_t                        shm_hits;
 };
 
 struct block_cache {
@@ -137,375 +150,309 @@ struct block_cache {
 
 	event_id_t                      timeout_id;
 
-	radix_tree_t                    tree;
+	struct hlist_head              *hash;
+	int                             hash_shift;
 
-	block_cache_stats_t             stats;
-};
-
-static inline uint64_t
-radix_tree_calculate_size(int height)
-{
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
-}
+	struct list_head                a1in;
+	struct list_head                am;
+	struct list_head                a1out;
+	unsigned int                    nr_a1in;
+	unsigned int                    nr_am;
+	unsigned int                    nr_a1out;
 
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
-{
-	int height;
-	uint64_t tree_size;
+	unsigned int                    max_pages;
+	unsigned int                    max_a1in;
+	unsigned int                    max_a1out;
 
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
+	struct list_head                slabs;      /* with free pages */
+	struct list_head                slabs_full;
+	unsigned int                    nr_slabs;
+	unsigned int                    nr_hugetlb;
 
-	return height;
-}
+	int                             low_memory;
 
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
-{
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
-}
+	uint64_t                        shm_tag;    /* 0 if not shared */
 
-static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	return (node->height == 0);
-}
+	block_cache_stats_t             stats;
+};
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static inline unsigned int
+block_cache_capacity(block_cache_t *cache)
 {
-	return (node->height == tree->height);
+	return cache->low_memory ? 0 : cache->max_pages;
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
+static block_cache_slab_t *
+block_cache_allocate_slab(block_cache_t *cache)
 {
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
-}
+	block_cache_slab_t *slab;
+	void *buf;
+	int i;
 
-static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
-{
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
-}
+	slab = calloc(1, sizeof(block_cache_slab_t));
+	if (!slab)
+		return NULL;
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
-{
-	radix_tree_node_t *node;
+#ifdef MAP_HUGETLB
+	buf = mmap(NULL, BLOCK_CACHE_SLAB_SIZE, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (buf != MAP_FAILED) {
+		slab->hugetlb = 1;
+		cache->nr_hugetlb++;
+		goto out;
+	}
+#endif
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
+	buf = mmap(NULL, BLOCK_CACHE_SLAB_SIZE, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		free(slab);
 		return NULL;
+	}
 
-	node->height = height;
-	tree->nodes++;
+#ifdef MADV_HUGEPAGE
+	madvise(buf, BLOCK_CACHE_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
 
-	return node;
-}
+out:
+	slab->buf     = buf;
+	slab->nr_free = BLOCK_CACHE_SLAB_PAGES;
+	for (i = 0; i < BLOCK_CACHE_SLAB_PAGES; i++)
+		slab->free[i] = BLOCK_CACHE_SLAB_PAGES - 1 - i;
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
-{
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	list_add(&slab->next, &cache->slabs);
+	cache->nr_slabs++;
+
+	return slab;
 }
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
+static void
+block_cache_free_slab(block_cache_t *cache, block_cache_slab_t *slab)
 {
-	if (!node)
-		return;
+	list_del(&slab->next);
+	cache->nr_slabs--;
+	if (slab->hugetlb)
+		cache->nr_hugetlb--;
 
-	free(node);
-	tree->nodes--;
+	munmap(slab->buf, BLOCK_CACHE_SLAB_SIZE);
+	free(slab);
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+/*
+ * Takes a free page from the slabs, mapping another slab if that stays
+ * within the budget.
+ */
+static char *
+block_cache_get_buf(block_cache_t *cache, block_cache_slab_t **_slab)
 {
-	radix_tree_page_t *page;
-
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
-
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	block_cache_slab_t *slab;
+	uint64_t size;
 
-	return page;
-}
+	if (list_empty(&cache->slabs)) {
+		size = (uint64_t)(cache->nr_slabs + 1) * BLOCK_CACHE_SLAB_PAGES;
+		if (size > block_cache_capacity(cache))
+			return NULL;
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
+		if (!block_cache_allocate_slab(cache))
+			return NULL;
+	}
 
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	slab = list_first_entry(&cache->slabs, block_cache_slab_t, next);
+	if (!--slab->nr_free)
+		list_move(&slab->next, &cache->slabs_full);
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	*_slab = slab;
+	return slab->buf +
+		((size_t)slab->free[slab->nr_free] << BLOCK_CACHE_PAGE_SHIFT);
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * Returns a page to its slab. Slabs that empty out go back to the
+ * system if the cache holds more than its budget, i.e. after the
+ * budget shrank.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+block_cache_put_buf(block_cache_t *cache, block_cache_slab_t *slab,
+		    char *buf)
 {
-	int i;
+	uint64_t size;
 
-	if (!page)
-		return;
+	slab->free[slab->nr_free] = (buf - slab->buf) >> BLOCK_CACHE_PAGE_SHIFT;
+	if (!slab->nr_free++)
+		list_move(&slab->next, &cache->slabs);
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	if (slab->nr_free < BLOCK_CACHE_SLAB_PAGES)
+		return;
 
-	radix_tree_free_page(tree, page);
+	size = (uint64_t)cache->nr_slabs * BLOCK_CACHE_SLAB_PAGES;
+	if (size > block_cache_capacity(cache))
+		block_cache_free_slab(cache, slab);
 }
 
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+static inline struct hlist_head *
+block_cache_bucket(block_cache_t *cache, uint64_t blk)
 {
-	int i;
-
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
-		return;
-
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
-			continue;
-
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
-
-		break;
-	}
+	return cache->hash +
+		((blk * 0x9e37fffffffc0001ULL) >> (64 - cache->hash_shift));
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+static block_cache_page_t *
+block_cache_lookup(block_cache_t *cache, uint64_t blk)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	block_cache_page_t *page;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+	hlist_for_each_entry(page, block_cache_bucket(cache, blk), hash)
+		if (page->blk == blk)
+			return page;
 
-		if (!link->u.next)
-			return NULL;
-
-		node = link->u.next;
-	} while (1);
+	return NULL;
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+static void
+block_cache_remove_page(block_cache_t *cache, block_cache_page_t *page)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
-
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+	switch (page->queue) {
+	case BLOCK_CACHE_A1IN:
+		cache->nr_a1in--;
+		break;
+	case BLOCK_CACHE_AM:
+		cache->nr_am--;
+		break;
+	case BLOCK_CACHE_A1OUT:
+		cache->nr_a1out--;
+		break;
+	}
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
-		}
+	if (page->buf)
+		block_cache_put_buf(cache, page->slab, page->buf);
 
-		node = link->u.next;
-	} while (1);
+	list_del(&page->next);
+	hlist_del(&page->hash);
+	free(page);
 }
 
+/*
+ * Frees one page: the oldest on A1in if A1in is over its share (its
+ * number moves to A1out), the least recently used on Am otherwise.
+ */
 static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+block_cache_evict(block_cache_t *cache)
 {
-	int i;
-	radix_tree_page_t *page;
+	block_cache_page_t *page;
 
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+	if (!list_empty(&cache->a1in) &&
+	    (cache->nr_a1in > cache->max_a1in || list_empty(&cache->am))) {
+		page = list_last_entry(&cache->a1in, block_cache_page_t, next);
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+		DBG("%s: evicting page 0x%"PRIx64" from A1in\n",
+		    cache->name, page->blk);
 
-	return 0;
+		block_cache_put_buf(cache, page->slab, page->buf);
+		page->buf   = NULL;
+		page->slab  = NULL;
+		page->queue = BLOCK_CACHE_A1OUT;
+		list_move(&page->next, &cache->a1out);
+		cache->nr_a1in--;
+		cache->nr_a1out++;
 
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
-}
+		if (cache->nr_a1out > cache->max_a1out)
+			block_cache_remove_page(cache,
+				list_last_entry(&cache->a1out,
+						block_cache_page_t, next));
+	} else if (!list_empty(&cache->am)) {
+		page = list_last_entry(&cache->am, block_cache_page_t, next);
 
-static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	int i;
-	radix_tree_link_t *link;
+		DBG("%s: evicting page 0x%"PRIx64" from Am\n",
+		    cache->name, page->blk);
 
-	if (!node)
-		return;
-
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+		block_cache_remove_page(cache, page);
+	} else
+		return -ENOSPC;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
-
-		radix_tree_clear_link(link);
-	}
-
-	radix_tree_free_node(tree, node);
+	cache->stats.evictions++;
+	return 0;
 }
 
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
+static void
+block_cache_drop(block_cache_t *cache)
 {
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	block_cache_page_t *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &cache->a1in, next)
+		block_cache_remove_page(cache, page);
+	list_for_each_entry_safe(page, tmp, &cache->am, next)
+		block_cache_remove_page(cache, page);
+	list_for_each_entry_safe(page, tmp, &cache->a1out, next)
+		block_cache_remove_page(cache, page);
 }
 
-/*
- * returns 1 if @node is empty after pruning, 0 otherwise
- */
-static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+static void
+block_cache_insert(block_cache_t *cache, uint64_t blk, const char *data)
 {
-	int i, empty;
-	radix_tree_link_t *link;
-
-	empty = 1;
-	if (!node)
-		return empty;
-
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	block_cache_slab_t *slab;
+	block_cache_page_t *page;
+	char *buf;
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
+	page = block_cache_lookup(cache, blk);
+	if (page && page->buf)
+		return;
 
-			continue;
+	while (!(buf = block_cache_get_buf(cache, &slab)))
+		if (block_cache_evict(cache))
+			return;
+
+	/* eviction may have forgotten about it */
+	page = block_cache_lookup(cache, blk);
+	if (page) {
+		DBG("%s: page 0x%"PRIx64" seen before\n", cache->name, blk);
+		page->queue = BLOCK_CACHE_AM;
+		list_move(&page->next, &cache->am);
+		cache->nr_a1out--;
+		cache->nr_am++;
+	} else {
+		page = calloc(1, sizeof(block_cache_page_t));
+		if (!page) {
+			block_cache_put_buf(cache, slab, buf);
+			return;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
-
-		radix_tree_clear_link(link);
+		page->blk   = blk;
+		page->queue = BLOCK_CACHE_A1IN;
+		hlist_add_head(&page->hash, block_cache_bucket(cache, blk));
+		list_add(&page->next, &cache->a1in);
+		cache->nr_a1in++;
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
-
-	return empty;
+	page->buf  = buf;
+	page->slab = slab;
+	memcpy(buf, data, BLOCK_CACHE_PAGE_SIZE);
 }
 
 /*
- * walk tree and free any node that has been idle for too long
+ * Lets go of everything while tapdisk is short of memory.
  */
 static void
-radix_tree_prune(radix_tree_t *tree)
+block_cache_check_memory(block_cache_t *cache)
 {
-	struct timeval now;
+	int low_memory;
 
-	if (!tree->root)
+	low_memory = tapdisk_server_mem_mode() == LOW_MEMORY_MODE;
+	if (low_memory == cache->low_memory)
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	cache->low_memory = low_memory;
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-}
-
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
-{
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
-
-	return 0;
-}
-
-static inline void
-radix_tree_free(radix_tree_t *tree)
-{
-	radix_tree_destroy(tree);
+	if (low_memory) {
+		DPRINTF("%s: low memory, dropping %u cached pages\n",
+			cache->name, cache->nr_a1in + cache->nr_am);
+		block_cache_drop(cache);
+	}
 }
 
 static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
+block_cache_timeout_event(event_id_t id, char mode, void *private)
 {
-	radix_tree_t *tree;
-	block_cache_t *cache;
-
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
-
-	radix_tree_prune(tree);
+	block_cache_check_memory(private);
 }
 
 static inline block_cache_request_t *
@@ -524,18 +471,73 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static uint64_t
+block_cache_budget(void)
+{
+	const char *env;
+	long long mb;
+
+	env = getenv("TAPDISK3_BLOCK_CACHE_SIZE");
+	if (!env)
+		return BLOCK_CACHE_DEFAULT_SIZE;
+
+	mb = atoll(env);
+	if (mb < 0)
+		return BLOCK_CACHE_DEFAULT_SIZE;
+
+	return (uint64_t)mb << 20;
+}
+
+/*
+ * What names the image's contents across tapdisks: the VHD's UUID, and
+ * the mtime, which moves should anything (a coalesce) write to it.
+ *
+ * That only holds for files. Writing through a device node, as coalesce
+ * does on LVM, leaves its mtime alone, and on another host doesn't touch
+ * the local node at all: those images get no tag, and are not shared.
+ */
+static uint64_t
+block_cache_shm_tag(const char *name)
+{
+	struct {
+		uuid_t                  uuid;
+		int64_t                 sec;
+		int64_t                 nsec;
+	} key;
+	vhd_context_t vhd;
+	struct stat st;
+	int err;
+
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_FAST);
+	if (err)
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	uuid_copy(key.uuid, vhd.footer.uuid);
+	err = fstat(vhd.fd, &st);
+	vhd_close(&vhd);
+
+	if (err || !S_ISREG(st.st_mode))
+		return 0;
+
+	key.sec  = st.st_mtim.tv_sec;
+	key.nsec = st.st_mtim.tv_nsec;
+
+	return tapdisk_shm_cache_tag(&key, sizeof(key));
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name,
-		 struct td_vbd_encryption *encryption, td_flag_t flags)
+		 struct td_vbd_open_params *params, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
+	uint64_t budget;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != DEFAULT_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -545,27 +547,57 @@ block_cache_open(td_driver_t *driver, const char *name,
 
 	cache->sectors = driver->info.size;
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
-	if (err)
+	/* whole slabs */
+	budget = block_cache_budget();
+	budget = (budget + BLOCK_CACHE_SLAB_SIZE - 1) &
+		~((uint64_t)BLOCK_CACHE_SLAB_SIZE - 1);
+
+	cache->max_pages = budget >> BLOCK_CACHE_PAGE_SHIFT;
+	cache->max_a1in  = cache->max_pages * BLOCK_CACHE_A1IN_PERCENT / 100;
+	cache->max_a1out = cache->max_pages * BLOCK_CACHE_A1OUT_PERCENT / 100;
+
+	cache->hash_shift = 10;
+	while ((1U << cache->hash_shift) < cache->max_pages + cache->max_a1out)
+		cache->hash_shift++;
+
+	cache->hash = calloc(1 << cache->hash_shift, sizeof(struct hlist_head));
+	if (!cache->hash) {
+		err = -ENOMEM;
 		goto fail;
+	}
+
+	INIT_LIST_HEAD(&cache->a1in);
+	INIT_LIST_HEAD(&cache->am);
+	INIT_LIST_HEAD(&cache->a1out);
+	INIT_LIST_HEAD(&cache->slabs);
+	INIT_LIST_HEAD(&cache->slabs_full);
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
+	cache->low_memory = tapdisk_server_mem_mode() == LOW_MEMORY_MODE;
+
+	if (!tapdisk_shm_cache_attach()) {
+		cache->shm_tag = block_cache_shm_tag(cache->name);
+		if (!cache->shm_tag)
+			tapdisk_shm_cache_detach();
+	}
+
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
-							  TV_SECS(BLOCK_CACHE_PAGE_IDLETIME << 1),
-							  block_cache_prune_event,
+							  TV_SECS(BLOCK_CACHE_MEM_CHECK),
+							  block_cache_timeout_event,
 							  cache);
-	if (cache->timeout_id < 0)
+	if (cache->timeout_id < 0) {
+		err = cache->timeout_id;
 		goto fail;
+	}
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"budget: %"PRIu64" bytes, shared: %s\n",
+		cache->name, cache->sectors, budget,
+		cache->shm_tag ? "yes" : "no");
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -573,141 +605,140 @@ block_cache_open(td_driver_t *driver, const char *name,
 	return 0;
 
 fail:
+	if (cache->shm_tag)
+		tapdisk_shm_cache_detach();
+	free(cache->hash);
 	free(cache->name);
-	radix_tree_free(&cache->tree);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+
+	cache->low_memory = 1;
+	block_cache_drop(cache);
+
+	if (cache->shm_tag)
+		tapdisk_shm_cache_detach();
+
+	free(cache->hash);
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
+static void
+block_cache_hit(block_cache_t *cache, td_request_t treq)
 {
-	int i, n;
-	uint64_t cksm, *data;
+	block_cache_page_t *page;
+	uint64_t blk, sec, end, first, last;
 
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
+	cache->stats.hits += treq.secs;
 
-	for (i = 0; i < n; i++)
-		cksm += data[i];
+	first = treq.sec >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+	last  = (treq.sec + treq.secs - 1) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
 
-	return ~cksm;
-}
+	for (blk = first; blk <= last; blk++) {
+		page = block_cache_lookup(cache, blk);
 
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
+		if (page->queue == BLOCK_CACHE_AM)
+			list_move(&page->next, &cache->am);
 
-	cache->stats.hits += treq.secs;
+		sec = blk << BLOCK_CACHE_PAGE_SECS_SHIFT;
+		end = sec + BLOCK_CACHE_PAGE_SECS;
+		if (sec < treq.sec)
+			sec = treq.sec;
+		if (end > treq.sec + treq.secs)
+			end = treq.sec + treq.secs;
 
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		DBG("%s: block cache hit: sec 0x%08"PRIx64", secs %"PRIu64"\n",
+		    cache->name, sec, end - sec);
 
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		memcpy(treq.buf + ((sec - treq.sec) << SECTOR_SHIFT),
+		       page->buf + ((sec & (BLOCK_CACHE_PAGE_SECS - 1)) <<
+				    SECTOR_SHIFT),
+		       (end - sec) << SECTOR_SHIFT);
 	}
 
 	td_complete_request(treq, 0);
 }
 
+/*
+ * The read is in: cache the pages it covered entirely.
+ */
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_t *tree;
+	uint64_t blk, first, end;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
+	td_request_t treq;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	treq = breq->treq;
+
+	if (breq->err)
 		goto out;
-	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
+	first = (treq.sec + BLOCK_CACHE_PAGE_SECS - 1) >>
+		BLOCK_CACHE_PAGE_SECS_SHIFT;
+	end   = (treq.sec + treq.secs) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+
+	for (blk = first; blk < end; blk++) {
+		char *buf = treq.buf + (((blk << BLOCK_CACHE_PAGE_SECS_SHIFT) -
+					 treq.sec) << SECTOR_SHIFT);
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+		DBG("%s: populating page 0x%08"PRIx64"\n", cache->name, blk);
+		block_cache_insert(cache, blk, buf);
+
+		if (cache->shm_tag)
+			tapdisk_shm_cache_write(cache->shm_tag, blk, buf);
+	}
 
 out:
-	td_complete_request(breq->treq, breq->err);
+	td_complete_request(treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
 static void
 block_cache_miss(block_cache_t *cache, td_request_t treq)
 {
-	void *buf;
-	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	DBG("%s: block cache miss: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
 
 	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
+	if (cache->low_memory || (!cache->max_pages && !cache->shm_tag))
 		goto out;
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
-		block_cache_put_request(cache, breq);
-		goto out;
-	}
-
 	breq->treq    = treq;
 	breq->secs    = treq.secs;
 	breq->err     = 0;
-	breq->buf     = buf;
 	breq->cache   = cache;
 
-	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
@@ -715,29 +746,87 @@ out:
 	td_forward_request(clone);
 }
 
+/*
+ * Missed locally: try the shared cache, page by page, taking what it
+ * has in locally as well. Completes @treq and returns 0 if all of it
+ * was there.
+ */
+static int
+block_cache_shm_hit(block_cache_t *cache, td_request_t treq)
+{
+	uint64_t blk, sec, end, first, last;
+	char page[BLOCK_CACHE_PAGE_SIZE], *buf;
+	int err;
+
+	first = treq.sec >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+	last  = (treq.sec + treq.secs - 1) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+
+	for (blk = first; blk <= last; blk++) {
+		sec = blk << BLOCK_CACHE_PAGE_SECS_SHIFT;
+		end = sec + BLOCK_CACHE_PAGE_SECS;
+
+		if (sec >= treq.sec && end <= treq.sec + treq.secs)
+			buf = treq.buf + ((sec - treq.sec) << SECTOR_SHIFT);
+		else
+			buf = page;
+
+		err = tapdisk_shm_cache_read(cache->shm_tag, blk, buf);
+		if (err)
+			return err;
+
+		block_cache_insert(cache, blk, buf);
+
+		if (buf != page)
+			continue;
+
+		if (sec < treq.sec)
+			sec = treq.sec;
+		if (end > treq.sec + treq.secs)
+			end = treq.sec + treq.secs;
+
+		memcpy(treq.buf + ((sec - treq.sec) << SECTOR_SHIFT),
+		       page + ((sec & (BLOCK_CACHE_PAGE_SECS - 1)) <<
+			       SECTOR_SHIFT),
+		       (end - sec) << SECTOR_SHIFT);
+	}
+
+	DBG("%s: shared cache hit: sec 0x%08"PRIx64"\n", cache->name, treq.sec);
+
+	cache->stats.shm_hits += treq.secs;
+	td_complete_request(treq, 0);
+
+	return 0;
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	block_cache_page_t *page;
+	uint64_t blk, first, last;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
-		return td_forward_request(treq);
+	block_cache_check_memory(cache);
+
+	first = treq.sec >> BLOCK_CACHE_PAGE_SECS_SHIFT;
+	last  = (treq.sec + treq.secs - 1) >> BLOCK_CACHE_PAGE_SECS_SHIFT;
 
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
+	for (blk = first; blk <= last; blk++) {
+		page = block_cache_lookup(cache, blk);
+		if (!page || !page->buf)
+			goto miss;
 	}
 
-	return block_cache_hit(cache, treq, iov);
+	return block_cache_hit(cache, treq);
+
+miss:
+	if (cache->shm_tag && !block_cache_shm_hit(cache, treq))
+		return;
+
+	return block_cache_miss(cache, treq);
 }
 
 static void
@@ -776,8 +865,38 @@ block_cache_debug(td_driver_t *driver)
 
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	     "misses: %"PRIu64", evictions: %"PRIu64", "
+	     "shm hits: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses, stats->evictions,
+	     stats->shm_hits);
+	WARN("pages: A1in %u, Am %u, A1out %u, slabs: %u (%u huge)\n",
+	     cache->nr_a1in, cache->nr_am, cache->nr_a1out,
+	     cache->nr_slabs, cache->nr_hugetlb);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache = (block_cache_t *)driver->data;
+	block_cache_stats_t *stats = &cache->stats;
+
+	tapdisk_stats_field(st, "block_cache", "{");
+	tapdisk_stats_field(st, "size", "llu",
+			    (unsigned long long)(cache->nr_a1in + cache->nr_am) <<
+			    BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "budget", "llu",
+			    (unsigned long long)cache->max_pages <<
+			    BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "slabs", "u", cache->nr_slabs);
+	tapdisk_stats_field(st, "huge_slabs", "u", cache->nr_hugetlb);
+	tapdisk_stats_field(st, "reads", "llu", stats->reads);
+	tapdisk_stats_field(st, "hits", "llu", stats->hits);
+	tapdisk_stats_field(st, "misses", "llu", stats->misses);
+	tapdisk_stats_field(st, "evictions", "llu", stats->evictions);
+	tapdisk_stats_field(st, "shared", "d", !!cache->shm_tag);
+	tapdisk_stats_field(st, "shm_hits", "llu", stats->shm_hits);
+	tapdisk_stats_field(st, "low_memory", "d", cache->low_memory);
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -791,4 +910,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
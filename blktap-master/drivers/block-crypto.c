@@ -32,11 +32,14 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "list.h"
 #include "libvhd.h"
@@ -406,23 +409,148 @@ vhd_open_crypto(vhd_context_t *vhd, const uint8_t *key, size_t key_bytes, const
 	return 0;
 }
 
+/*
+ * An EVP context can only be driven by one thread at a time, and
+ * requests may be encrypted on the offload threads as well as the
+ * event loop. Each thread clones the cipher contexts of a vhd the
+ * first time it sees it; the key schedule is expanded once, at
+ * setkey, and only the tweak is reset per sector afterwards.
+ *
+ * Clones are kept on one list, keyed on tfm generation and thread,
+ * so vhd_close_crypto can free them all. Each thread remembers the
+ * clone it used last by generation only: generations are never
+ * reused, so a stale entry just misses and is never dereferenced.
+ */
+struct xts_thread_cipher {
+	unsigned int                    generation;
+	pthread_t                       thread;
+	struct crypto_blkcipher         cipher;
+	struct xts_thread_cipher       *next;
+};
+
+static pthread_mutex_t xts_ciphers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xts_thread_cipher *xts_ciphers;
+
+static __thread unsigned int xts_last_generation;
+static __thread struct crypto_blkcipher *xts_last_cipher;
+
+static struct crypto_blkcipher *
+xts_get_thread_cipher(struct crypto_blkcipher *tfm)
+{
+	struct xts_thread_cipher *tc;
+	pthread_t self;
+
+	if (xts_last_generation == tfm->generation)
+		return xts_last_cipher;
+
+	self = pthread_self();
+
+	pthread_mutex_lock(&xts_ciphers_lock);
+
+	for (tc = xts_ciphers; tc; tc = tc->next)
+		if (tc->generation == tfm->generation &&
+		    pthread_equal(tc->thread, self))
+			goto found;
+
+	tc = calloc(1, sizeof(*tc));
+	if (!tc) {
+		pthread_mutex_unlock(&xts_ciphers_lock);
+		return NULL;
+	}
+
+	EVP_CIPHER_CTX_init(&tc->cipher.en_ctx);
+	EVP_CIPHER_CTX_init(&tc->cipher.de_ctx);
+
+	if (!EVP_CIPHER_CTX_copy(&tc->cipher.en_ctx, &tfm->en_ctx) ||
+	    !EVP_CIPHER_CTX_copy(&tc->cipher.de_ctx, &tfm->de_ctx)) {
+		EVP_CIPHER_CTX_cleanup(&tc->cipher.en_ctx);
+		EVP_CIPHER_CTX_cleanup(&tc->cipher.de_ctx);
+		free(tc);
+		pthread_mutex_unlock(&xts_ciphers_lock);
+		return NULL;
+	}
+
+	tc->generation         = tfm->generation;
+	tc->thread             = self;
+	tc->cipher.generation  = tfm->generation;
+	tc->next               = xts_ciphers;
+	xts_ciphers            = tc;
+
+found:
+	pthread_mutex_unlock(&xts_ciphers_lock);
+
+	xts_last_generation = tc->generation;
+	xts_last_cipher     = &tc->cipher;
+
+	return &tc->cipher;
+}
+
+/*
+ * Frees the vhd's cipher and every thread's clone of it. No request
+ * on the vhd may be in flight, on any thread.
+ */
 void
+vhd_close_crypto(vhd_context_t *vhd)
+{
+	struct crypto_blkcipher *tfm = vhd->xts_tfm;
+	struct xts_thread_cipher **pp, *tc;
+
+	if (!tfm)
+		return;
+
+	pthread_mutex_lock(&xts_ciphers_lock);
+
+	pp = &xts_ciphers;
+	while ((tc = *pp)) {
+		if (tc->generation != tfm->generation) {
+			pp = &tc->next;
+			continue;
+		}
+
+		*pp = tc->next;
+		EVP_CIPHER_CTX_cleanup(&tc->cipher.en_ctx);
+		EVP_CIPHER_CTX_cleanup(&tc->cipher.de_ctx);
+		free(tc);
+	}
+
+	pthread_mutex_unlock(&xts_ciphers_lock);
+
+	EVP_CIPHER_CTX_cleanup(&tfm->en_ctx);
+	EVP_CIPHER_CTX_cleanup(&tfm->de_ctx);
+	free(tfm);
+	vhd->xts_tfm = NULL;
+}
+
+/*
+ * Whole-request transforms. XTS takes a fresh tweak for every data
+ * unit (sector), so the sectors can't be folded into a single cipher
+ * call, but the per-call cost is just the IV reset on a context that
+ * is already keyed. Safe to call from any thread.
+ */
+int
 vhd_crypto_decrypt(vhd_context_t *vhd, td_request_t *t)
 {
+	struct crypto_blkcipher *cipher;
+	uint8_t *buf;
 	int sec, ret;
 
-	for (sec = 0; sec < t->secs; sec++) {
-		ret = xts_aes_plain_decrypt(vhd->xts_tfm, t->sec + sec,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    (uint8_t *)t->buf +
-					    sec * VHD_SECTOR_SIZE,
-					    VHD_SECTOR_SIZE);
+	cipher = xts_get_thread_cipher(vhd->xts_tfm);
+	if (!cipher)
+		return -ENOMEM;
+
+	buf = (uint8_t *)t->buf;
+
+	for (sec = 0; sec < t->secs; sec++, buf += VHD_SECTOR_SIZE) {
+		ret = xts_aes_plain_decrypt(cipher, t->sec + sec,
+					    buf, buf, VHD_SECTOR_SIZE);
 		if (ret) {
-			DPRINTF("crypto decrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
+			EPRINTF("crypto decrypt of sector 0x%"PRIx64
+				" failed: %d\n", t->sec + sec, ret);
+			return -EIO;
 		}
 	}
+
+	return 0;
 }
 
 int
@@ -432,21 +560,32 @@ vhd_crypto_encrypt_block(vhd_context_t *vhd, sector_t sector, uint8_t *source,
 	return xts_aes_plain_encrypt(vhd->xts_tfm, sector, dst, source, block_size);
 }
 
-void
+int
 vhd_crypto_encrypt(vhd_context_t *vhd, td_request_t *t, char *orig_buf)
 {
+	struct crypto_blkcipher *cipher;
+	uint8_t *src, *dst;
 	int sec, ret;
 
+	cipher = xts_get_thread_cipher(vhd->xts_tfm);
+	if (!cipher)
+		return -ENOMEM;
+
+	src = (uint8_t *)orig_buf;
+	dst = (uint8_t *)t->buf;
+
 	for (sec = 0; sec < t->secs; sec++) {
-		ret = vhd_crypto_encrypt_block(
-			vhd, t->sec + sec,
-			(uint8_t *)orig_buf + sec * VHD_SECTOR_SIZE,
-			(uint8_t *)t->buf + sec * VHD_SECTOR_SIZE,
-			VHD_SECTOR_SIZE);
+		ret = xts_aes_plain_encrypt(cipher, t->sec + sec,
+					    dst, src, VHD_SECTOR_SIZE);
 		if (ret) {
-			DPRINTF("crypto encrypt failed: %d : TERMINATED\n", ret);
-			exit(1); /* XXX */
+			EPRINTF("crypto encrypt of sector 0x%"PRIx64
+				" failed: %d\n", t->sec + sec, ret);
+			return -EIO;
 		}
+		src += VHD_SECTOR_SIZE;
+		dst += VHD_SECTOR_SIZE;
 	}
+
+	return 0;
 }
 
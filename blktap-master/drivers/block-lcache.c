@@ -67,6 +67,7 @@
 #define TD_LCACHE_MAX_REQ               (MAX_REQUESTS*2)
 #define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
 					 sysconf(_SC_PAGE_SIZE))
+#define TD_LCACHE_BUFSECS               (TD_LCACHE_BUFSZ >> SECTOR_SHIFT)
 
 
 typedef struct lcache                   td_lcache_t;
@@ -174,7 +175,7 @@ lcache_close(td_driver_t *driver)
 
 static int
 lcache_open(td_driver_t *driver, const char *name,
-	    struct td_vbd_encryption *encryption, td_flag_t flags)
+	    struct td_vbd_open_params *params, td_flag_t flags)
 {
 	td_lcache_t *cache = driver->data;
 	int err;
@@ -329,6 +330,12 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	td_request_t clone;
 	td_lcache_req_t *req;
 
+	/* merged indirect segments may not fit a (locked) buffer: no caching */
+	if (treq.secs > TD_LCACHE_BUFSECS) {
+		td_forward_request(treq);
+		return;
+	}
+
 	req = lcache_alloc_request(cache);
 	if (!req) {
 		td_complete_request(treq, -EBUSY);
@@ -342,7 +342,7 @@ llpcache_close(td_driver_t *driver)
 
 static int
 llpcache_open(td_driver_t *driver, const char *name,
-	      struct td_vbd_encryption *encryption, td_flag_t flags)
+	      struct td_vbd_open_params *params, td_flag_t flags)
 {
 	td_llpcache_t *s = driver->data;
 	int i, err;
@@ -352,7 +352,7 @@ llpcache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < TD_LLPCACHE_MAX_REQ; i++)
 		llpcache_free_request(s, &s->reqv[i]);
 
-	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, encryption, &s->local);
+	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, params, &s->local);
 	if (err)
 		goto fail;
 
@@ -495,7 +495,7 @@ llecache_close(td_driver_t *driver)
 
 static int
 llecache_open(td_driver_t *driver, const char *name,
-	      struct td_vbd_encryption *encryption, td_flag_t flags)
+	      struct td_vbd_open_params *params, td_flag_t flags)
 {
 	td_llecache_t *s = driver->data;
 	int i, err;
@@ -505,7 +505,7 @@ llecache_open(td_driver_t *driver, const char *name,
 	for (i = 0; i < TD_LLECACHE_MAX_REQ; i++)
 		llecache_free_request(s, &s->reqv[i]);
 
-	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, encryption, &s->shared);
+	err = tapdisk_image_open(DISK_TYPE_VHD, name, flags, params, &s->shared);
 	if (err)
 		goto fail;
 
@@ -41,6 +41,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -49,26 +50,21 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-offload.h"
 #include "timeout-math.h"
 #include "log.h"
 #include "block-log.h"
 
-#define BITS_PER_LONG (sizeof(unsigned long) * 8)
-#define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
-
-#define BITMAP_ENTRY(_nr, _bmap) ((unsigned long*)(_bmap + sizeof(struct cbt_log_metadata)))[((_nr)/BITS_PER_LONG)]
-#define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
-
-static inline int test_bit(int nr, void* bmap)
-{
-	return (BITMAP_ENTRY(nr, bmap) >> BITMAP_SHIFT(nr)) & 1;
-}
-
-static inline void set_bit(int nr, void* bmap)
-{
-	BITMAP_ENTRY(nr, bmap) |= (1UL << BITMAP_SHIFT(nr));
-}
+/*
+ * The bitmap lives in a shared mapping of the log, written back in
+ * batches: once TDLOG_FLUSH_BATCH pages are dirty we start writeback,
+ * and every TDLOG_FLUSH_INTERVAL seconds we wait for it, on the offload
+ * pool rather than on the event loop.
+ */
+#define TDLOG_FLUSH_INTERVAL	5
+#define TDLOG_FLUSH_BATCH	256
 
 static inline uint64_t
 get_bit_for_sec(td_sector_t sector)
@@ -89,6 +85,7 @@ static int bitmap_init(struct tdlog_data *data, char *name)
 		EPRINTF("failed to open bitmap log file");
 		result = -1;
 	}
+	data->fd = fd;
 
 	if (result == 0) {
 		//data->size is in number of sectors, convert it to bytes
@@ -98,38 +95,382 @@ static int bitmap_init(struct tdlog_data *data, char *name)
 											sizeof(struct cbt_log_metadata));
 
 		data->bitmap = mmap(NULL, bmsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (!data->bitmap) {
+		if (data->bitmap == MAP_FAILED) {
 			EPRINTF("could not allocate dirty bitmap of size %"PRIu64, bmsize);
+			data->bitmap = NULL;
 			result = -1;
 		}
+	}
 
-		close (fd);
+	if (result == 0) {
+		data->map_size  = bmsize;
+		data->page_size = sysconf(_SC_PAGESIZE);
+		data->nr_pages  = (bmsize + data->page_size - 1) / data->page_size;
+		data->dirty     = calloc(BITS_TO_LONGS(data->nr_pages),
+					 sizeof(unsigned long));
+		if (!data->dirty) {
+			EPRINTF("could not allocate dirty page map");
+			result = -1;
+		}
+	}
+
+	if (result == 0) {
+		struct cbt_log_metadata *meta = data->bitmap;
+
+		data->managed = !!meta->consistent;
+		data->clean   = data->managed;
 	}
 
 	return result;
 }
 
+/*
+ * Syncs of the log run on the offload pool, one at a time, so that the
+ * event loop never waits on the log's storage. Writes only wait for the
+ * header to say the log is inconsistent, and only when that is due.
+ */
+enum {
+	TDLOG_SYNC_CLEAR,	/* header says inconsistent, release held writes */
+	TDLOG_SYNC_KICK,	/* start writeback of the dirty pages */
+	TDLOG_SYNC_FLUSH,	/* the dirty pages are on disk */
+	TDLOG_SYNC_SET,		/* header says consistent */
+};
+
+struct tdlog_sync {
+	td_offload_job_t	job;
+	struct tdlog_data*	data;	/* NULL once the log is closed */
+	int			op;
+	int			busy;
+	int			err;
+
+	/* what the job works on: it keeps them if the log closes under it */
+	void*			bitmap;
+	int			fd;
+	size_t			map_size;
+	size_t			page_size;
+	size_t			nr_pages;
+
+	/* the dirty pages handed to the job */
+	unsigned long*		dirty;
+	size_t			nr_dirty;
+};
+
+/*
+ * Write back the dirty pages of the mapping, one call per run of
+ * adjacent pages. With @wait, the pages are on disk when this returns;
+ * otherwise writeback is only started.
+ */
+static int bitmap_writeback(struct tdlog_sync *sync, int wait)
+{
+	size_t pg, end, off, len;
+	int err;
+
+	for (pg = 0; pg < sync->nr_pages; pg = end) {
+		if (!sync->dirty[pg / BITS_PER_LONG]) {
+			end = (pg / BITS_PER_LONG + 1) * BITS_PER_LONG;
+			continue;
+		}
+
+		if (!((sync->dirty[pg / BITS_PER_LONG] >> BITMAP_SHIFT(pg)) & 1)) {
+			end = pg + 1;
+			continue;
+		}
+
+		for (end = pg + 1; end < sync->nr_pages; end++)
+			if (!((sync->dirty[end / BITS_PER_LONG] >>
+			       BITMAP_SHIFT(end)) & 1))
+				break;
+
+		off = pg * sync->page_size;
+		len = (end - pg) * sync->page_size;
+		if (len > sync->map_size - off)
+			len = sync->map_size - off;
+
+		if (wait)
+			err = msync((char *)sync->bitmap + off, len, MS_SYNC);
+		else
+			err = sync_file_range(sync->fd, off, len,
+					      SYNC_FILE_RANGE_WRITE);
+		if (err) {
+			err = -errno;
+			EPRINTF("CBT: writeback of %zu bytes at %zu failed: %d\n",
+				len, off, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int bitmap_sync_header(struct tdlog_sync *sync)
+{
+	if (msync(sync->bitmap, sync->page_size, MS_SYNC))
+		return -errno;
+
+	return 0;
+}
+
+static void tdlog_sync_work(td_offload_job_t *job)
+{
+	struct tdlog_sync *sync = container_of(job, struct tdlog_sync, job);
+
+	switch (sync->op) {
+	case TDLOG_SYNC_CLEAR:
+	case TDLOG_SYNC_SET:
+		sync->err = bitmap_sync_header(sync);
+		break;
+	case TDLOG_SYNC_KICK:
+		sync->err = bitmap_writeback(sync, 0);
+		break;
+	case TDLOG_SYNC_FLUSH:
+		sync->err = bitmap_writeback(sync, 1);
+		break;
+	}
+}
+
+static void tdlog_sync_done(td_offload_job_t *job);
+
+static void tdlog_sync_submit(struct tdlog_data *data, int op)
+{
+	struct tdlog_sync *sync = data->sync;
+	size_t words = BITS_TO_LONGS(data->nr_pages);
+
+	sync->op   = op;
+	sync->busy = 1;
+	sync->err  = 0;
+
+	if (op == TDLOG_SYNC_KICK || op == TDLOG_SYNC_FLUSH) {
+		memcpy(sync->dirty, data->dirty, words * sizeof(unsigned long));
+		sync->nr_dirty = data->nr_dirty;
+		data->nr_kicked = data->nr_dirty;
+	}
+
+	/* pages dirtied from now on are for the next flush */
+	if (op == TDLOG_SYNC_FLUSH) {
+		memset(data->dirty, 0, words * sizeof(unsigned long));
+		data->nr_dirty  = 0;
+		data->nr_kicked = 0;
+	}
+
+	sync->job.work = tdlog_sync_work;
+	sync->job.done = tdlog_sync_done;
+
+	if (tapdisk_offload_submit(&sync->job)) {
+		tdlog_sync_work(&sync->job);
+		tdlog_sync_done(&sync->job);
+	}
+}
+
+/*
+ * Start whatever is due, most urgent first: held writes wait for the
+ * header, the header only says consistent once a flush found nothing
+ * new, and writeback is started early when pages pile up.
+ */
+static void tdlog_sync_next(struct tdlog_data *data)
+{
+	struct cbt_log_metadata *meta = data->bitmap;
+
+	if (data->sync->busy)
+		return;
+
+	if (data->nr_held) {
+		tdlog_sync_submit(data, TDLOG_SYNC_CLEAR);
+		return;
+	}
+
+	if (data->flush_wanted) {
+		if (data->nr_dirty) {
+			tdlog_sync_submit(data, TDLOG_SYNC_FLUSH);
+			return;
+		}
+
+		data->flush_wanted = 0;
+
+		if (data->managed && !data->clean) {
+			meta->consistent = 1;
+			data->clean = 1;
+			tdlog_sync_submit(data, TDLOG_SYNC_SET);
+			return;
+		}
+	}
+
+	if (data->nr_dirty - data->nr_kicked >= TDLOG_FLUSH_BATCH)
+		tdlog_sync_submit(data, TDLOG_SYNC_KICK);
+}
+
+static void tdlog_release_held(struct tdlog_data *data, int err)
+{
+	td_request_t *held = data->held;
+	int i, n = data->nr_held;
+
+	/* completions may queue more writes: start a new list */
+	data->held = NULL;
+	data->nr_held = 0;
+	data->held_size = 0;
+
+	for (i = 0; i < n; i++)
+		if (err)
+			td_complete_request(held[i], err);
+		else
+			td_forward_request(held[i]);
+
+	free(held);
+}
+
+static void tdlog_sync_free(struct tdlog_sync *sync)
+{
+	free(sync->dirty);
+	free(sync);
+}
+
+static void tdlog_sync_done(td_offload_job_t *job)
+{
+	struct tdlog_sync *sync = container_of(job, struct tdlog_sync, job);
+	struct tdlog_data *data = sync->data;
+	struct cbt_log_metadata *meta;
+	size_t i;
+
+	sync->busy = 0;
+
+	if (!data) {
+		munmap(sync->bitmap, sync->map_size);
+		close(sync->fd);
+		tdlog_sync_free(sync);
+		return;
+	}
+
+	meta = data->bitmap;
+
+	switch (sync->op) {
+	case TDLOG_SYNC_CLEAR:
+		if (sync->err) {
+			EPRINTF("CBT: could not mark log inconsistent: %d\n",
+				sync->err);
+			/* for all we know, it still says consistent */
+			data->clean = 1;
+		}
+		tdlog_release_held(data, sync->err);
+		break;
+
+	case TDLOG_SYNC_KICK:
+		break;
+
+	case TDLOG_SYNC_FLUSH:
+		if (sync->err) {
+			/* those pages are still to be written */
+			for (i = 0; i < BITS_TO_LONGS(data->nr_pages); i++) {
+				data->nr_dirty += __builtin_popcountl(
+					sync->dirty[i] & ~data->dirty[i]);
+				data->dirty[i] |= sync->dirty[i];
+			}
+			data->flush_wanted = 0;
+			break;
+		}
+		data->flushes++;
+		data->flushed_pages += sync->nr_dirty;
+		/* written to meanwhile: try again next time round */
+		if (data->nr_dirty)
+			data->flush_wanted = 0;
+		break;
+
+	case TDLOG_SYNC_SET:
+		if (sync->err) {
+			EPRINTF("CBT: could not mark log consistent: %d\n",
+				sync->err);
+			meta->consistent = 0;
+			data->clean = 0;
+		}
+		break;
+	}
+
+	tdlog_sync_next(data);
+}
+
+static void bitmap_timeout_event(event_id_t id, char mode, void *private)
+{
+	struct tdlog_data *data = private;
+
+	data->flush_wanted = 1;
+	tdlog_sync_next(data);
+}
+
+/*
+ * On close, everything is written back right here, no more writes are
+ * coming. A sync still in flight takes over the mapping and the fd.
+ */
 static int bitmap_free(struct tdlog_data *data)
 {
-	uint64_t bmsize;
-	int rc;
-	bmsize = bitmap_size(data->size * SECTOR_SIZE) + sizeof(struct cbt_log_metadata);
+	struct cbt_log_metadata *meta = data->bitmap;
+	struct tdlog_sync *sync = data->sync;
+	int orphan = sync && sync->busy;
+
 	if (data->bitmap) {
-		rc = munmap(data->bitmap, bmsize);
-		if (rc != 0) {
-			EPRINTF("Failed to unmap the bitmap block");
+		if (msync(data->bitmap, data->map_size, MS_SYNC))
+			EPRINTF("CBT: final writeback failed: %d\n", -errno);
+		else if (data->managed) {
+			meta->consistent = 1;
+			if (msync(data->bitmap, data->page_size, MS_SYNC))
+				EPRINTF("CBT: could not mark log consistent: "
+					"%d\n", -errno);
 		}
+
+		if (!orphan && munmap(data->bitmap, data->map_size))
+			EPRINTF("Failed to unmap the bitmap block");
+		data->bitmap = NULL;
 	}
 
+	if (data->fd != -1) {
+		if (!orphan)
+			close(data->fd);
+		data->fd = -1;
+	}
+
+	if (sync) {
+		if (orphan)
+			sync->data = NULL;
+		else
+			tdlog_sync_free(sync);
+		data->sync = NULL;
+	}
+
+	if (data->offload) {
+		tapdisk_offload_put();
+		data->offload = 0;
+	}
+
+	free(data->held);
+	data->held = NULL;
+
+	free(data->dirty);
+	data->dirty = NULL;
+
 	return 0;
 }
 
-static int bitmap_set(struct tdlog_data* data, uint64_t block, int count)
+static int tdlog_sync_init(struct tdlog_data *data)
 {
-	int i;
+	struct tdlog_sync *sync;
 
-	for (i = 0; i < count; i++)
-		set_bit(block + i, data->bitmap);
+	sync = calloc(1, sizeof(*sync));
+	if (!sync)
+		return -ENOMEM;
+
+	sync->dirty = calloc(BITS_TO_LONGS(data->nr_pages),
+			     sizeof(unsigned long));
+	if (!sync->dirty) {
+		free(sync);
+		return -ENOMEM;
+	}
+
+	sync->data      = data;
+	sync->bitmap    = data->bitmap;
+	sync->fd        = data->fd;
+	sync->map_size  = data->map_size;
+	sync->page_size = data->page_size;
+	sync->nr_pages  = data->nr_pages;
+	data->sync      = sync;
+
+	data->offload = tapdisk_offload_start(1) > 0 && !tapdisk_offload_get();
 
 	return 0;
 }
@@ -140,25 +481,48 @@ static int bitmap_set(struct tdlog_data* data, uint64_t block, int count)
 static int tdlog_close(td_driver_t* driver)
 {
 	struct tdlog_data* data = (struct tdlog_data*)driver->data;
+
+	if (data->timeout_id >= 0) {
+		tapdisk_server_unregister_event(data->timeout_id);
+		data->timeout_id = -1;
+	}
 	bitmap_free(data);
 
 	return 0;
 }
 
 static int tdlog_open(td_driver_t* driver, const char *name,
-		      struct td_vbd_encryption *encryption, td_flag_t flags)
+		      struct td_vbd_open_params *params, td_flag_t flags)
 {
 	struct tdlog_data* data = (struct tdlog_data*)driver->data;
 	int rc;
 
 	memset(data, 0, sizeof(*data));
 	data->size = driver->info.size;
+	data->fd = -1;
+	data->timeout_id = -1;
+
+	if ((rc = bitmap_init(data, driver->name)) ||
+	    (rc = tdlog_sync_init(data))) {
+		tdlog_close(driver);
+		return rc;
+	}
 
-	if ((rc = bitmap_init(data, driver->name))) {
+	data->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+							 -1, /* dummy fd */
+							 TV_SECS(TDLOG_FLUSH_INTERVAL),
+							 bitmap_timeout_event,
+							 data);
+	if (data->timeout_id < 0) {
+		rc = data->timeout_id;
 		tdlog_close(driver);
 		return rc;
 	}
 
+	DPRINTF("CBT: %s, flushing every %ds, consistency flag %s\n",
+		driver->name, TDLOG_FLUSH_INTERVAL,
+		data->managed ? "maintained" : "left clear");
+
 	return 0;
 }
 
@@ -175,8 +539,45 @@ static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
 	start_bit = get_bit_for_sec(treq.sec);
 	last_bit = get_bit_for_sec(treq.sec + treq.secs - 1);
 
-	bitmap_set(data, start_bit, (last_bit - start_bit) + 1);
-	td_forward_request(treq);
+	/*
+	 * New bits aren't on disk yet: the log must not claim to be
+	 * consistent before this write can land. Once the header is being
+	 * cleared, later writes queue behind it too, their bits may be
+	 * those of a write still held.
+	 */
+	if (bitmap_set(data, start_bit, (last_bit - start_bit) + 1) &&
+	    data->clean) {
+		struct cbt_log_metadata *meta = data->bitmap;
+
+		meta->consistent = 0;
+		data->clean = 0;
+	} else if (!data->nr_held) {
+		td_forward_request(treq);
+		tdlog_sync_next(data);
+		return;
+	}
+
+	if (data->nr_held == data->held_size) {
+		int size = data->held_size ? data->held_size * 2 : 16;
+		td_request_t *held;
+
+		held = realloc(data->held, size * sizeof(*held));
+		if (!held) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+		data->held = held;
+		data->held_size = size;
+	}
+
+	data->held[data->nr_held++] = treq;
+	tdlog_sync_next(data);
+}
+
+/* discarded blocks have changed as far as a backup is concerned */
+static void tdlog_queue_discard(td_driver_t* driver, td_request_t treq)
+{
+	tdlog_queue_write(driver, treq);
 }
 
 static int tdlog_get_parent_id(td_driver_t* driver, td_disk_id_t* id)
@@ -190,6 +591,20 @@ static int tdlog_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void tdlog_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdlog_data* data = (struct tdlog_data*)driver->data;
+
+	tapdisk_stats_field(st, "cbt", "{");
+	tapdisk_stats_field(st, "dirty_pages", "llu",
+			    (unsigned long long)data->nr_dirty);
+	tapdisk_stats_field(st, "flushes", "llu", data->flushes);
+	tapdisk_stats_field(st, "flushed_pages", "llu", data->flushed_pages);
+	tapdisk_stats_field(st, "consistent", "d",
+			    data->managed ? data->clean : -1);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_log = {
 	.disk_type          = "tapdisk_log",
 	.private_data_size  = sizeof(struct tdlog_data),
@@ -198,6 +613,8 @@ struct tap_disk tapdisk_log = {
 	.td_close           = tdlog_close,
 	.td_queue_read      = tdlog_queue_read,
 	.td_queue_write     = tdlog_queue_write,
+	.td_queue_discard   = tdlog_queue_discard,
 	.td_get_parent_id   = tdlog_get_parent_id,
 	.td_validate_parent = tdlog_validate_parent,
+	.td_stats           = tdlog_stats,
 };
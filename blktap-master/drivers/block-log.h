@@ -31,11 +31,107 @@
 #ifndef __BLOCK_LOG_H__
 #define __BLOCK_LOG_H__
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include "cbt-util.h"
+#include "scheduler.h"
+#include "tapdisk.h"
 
 struct tdlog_data {
 	uint64_t   	size;
 	void*		bitmap;
+
+	int		fd;
+	size_t		map_size;
+	size_t		page_size;
+	event_id_t	timeout_id;
+
+	/* pages of the mapping changed since the last flush */
+	unsigned long*	dirty;
+	size_t		nr_pages;
+	size_t		nr_dirty;
+	size_t		nr_kicked;
+
+	/* the log was consistent on open, and we keep it truthful */
+	int		managed;
+	/* the header says, or is about to, that the log is consistent */
+	int		clean;
+
+	/* syncs run off the event loop, see block-log.c */
+	struct tdlog_sync* sync;
+	int		offload;
+	int		flush_wanted;
+
+	/* writes waiting for the header to say inconsistent */
+	td_request_t*	held;
+	int		nr_held;
+	int		held_size;
+
+	uint64_t	flushes;
+	uint64_t	flushed_pages;
 };
 
+/*
+ * Bitmap and dirty page tracking for the write path. Kept here, rather
+ * than in block-log.c, so the tests can reach them.
+ */
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
+
+#define BITMAP_ENTRY(_nr, _bmap) ((unsigned long*)(_bmap + sizeof(struct cbt_log_metadata)))[((_nr)/BITS_PER_LONG)]
+#define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
+
+static inline int test_bit(int nr, void* bmap)
+{
+	return (BITMAP_ENTRY(nr, bmap) >> BITMAP_SHIFT(nr)) & 1;
+}
+
+static inline int page_dirty(struct tdlog_data *data, size_t pg)
+{
+	return (data->dirty[pg / BITS_PER_LONG] >> BITMAP_SHIFT(pg)) & 1;
+}
+
+static inline void mark_page_dirty(struct tdlog_data *data, void *addr)
+{
+	size_t pg = ((char *)addr - (char *)data->bitmap) / data->page_size;
+
+	if (!page_dirty(data, pg)) {
+		data->dirty[pg / BITS_PER_LONG] |= 1UL << BITMAP_SHIFT(pg);
+		data->nr_dirty++;
+	}
+}
+
+/*
+ * Set @count bits from @block, a word at a time. Returns the number of
+ * words which changed: zero means the range was logged already.
+ */
+static inline int bitmap_set(struct tdlog_data* data, uint64_t block, uint64_t count)
+{
+	unsigned long *map, mask;
+	uint64_t i, first, last;
+	int changed = 0;
+
+	map   = &BITMAP_ENTRY(0, data->bitmap);
+	first = block / BITS_PER_LONG;
+	last  = (block + count - 1) / BITS_PER_LONG;
+
+	for (i = first; i <= last; i++) {
+		mask = ~0UL;
+		if (i == first)
+			mask &= ~0UL << BITMAP_SHIFT(block);
+		if (i == last)
+			mask &= ~0UL >> (BITS_PER_LONG - 1 -
+					 BITMAP_SHIFT(block + count - 1));
+
+		if ((map[i] & mask) != mask) {
+			map[i] |= mask;
+			mark_page_dirty(data, &map[i]);
+			changed++;
+		}
+	}
+
+	return changed;
+}
+
 #endif
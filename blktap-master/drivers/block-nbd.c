@@ -42,6 +42,7 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "tapdisk.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
@@ -77,6 +78,9 @@ struct tdnbd_passed_fd {
 	int                     fd;
 } passed_fds[N_PASSED_FDS];
 
+/* fds arrive on the main thread, and are picked up by VBD workers */
+static pthread_mutex_t passed_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct nbd_queued_io {
 	char                   *buffer;
 	int                     len;
@@ -121,6 +125,9 @@ struct tdnbd_data
 
 	int                     flags;
 	int                     closed;
+
+	/* transmission flags from the server */
+	uint16_t                tflags;
 };
 
 int global_id = 0;
@@ -135,6 +142,8 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 {
 	int free_index = -1;
 	int i;
+
+	pthread_mutex_lock(&passed_fds_lock);
 	for (i = 0; i < N_PASSED_FDS; i++)
 		/* Check for unused slot before attempting to compare
 		 * names so that we never try to compare against the name
@@ -149,7 +158,7 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 		ERROR("Error - more than %d fds passed! cannot stash another",
 				N_PASSED_FDS);
 		close(fd);
-		return;
+		goto out;
 	}
 
 	/* There exists a possibility that the FD we are replacing is still
@@ -161,6 +170,8 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 	passed_fds[free_index].fd = fd;
 	strncpy(passed_fds[free_index].id, msg,
 			sizeof(passed_fds[free_index].id));
+out:
+	pthread_mutex_unlock(&passed_fds_lock);
 }
 
 static int
@@ -168,14 +179,17 @@ tdnbd_retrieve_passed_fd(const char *name)
 {
 	int fd, i;
 
+	pthread_mutex_lock(&passed_fds_lock);
 	for (i = 0; i < N_PASSED_FDS; i++) {
 		if (strncmp(name, passed_fds[i].id,
 					sizeof(passed_fds[i].id)) == 0) {
 			fd = passed_fds[i].fd;
 			passed_fds[i].fd = -1;
+			pthread_mutex_unlock(&passed_fds_lock);
 			return fd;
 		}
 	}
+	pthread_mutex_unlock(&passed_fds_lock);
 
 	ERROR("Couldn't find the fd named: %s", name);
 
@@ -335,6 +349,7 @@ tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 			return;
 
 		if (ntohl(pos->nreq.type) == TAPDISK_NBD_CMD_WRITE) {
+			/* no payload for NBD_CMD_WRITE_ZEROES etc. */
 			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
 				return;
 		}
@@ -408,7 +423,7 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	/* fill in the request */
 
 	req->treq = treq;
-	int id = global_id++;
+	int id = __atomic_fetch_add(&global_id, 1, __ATOMIC_RELAXED);
 	snprintf(req->nreq.handle, 8, "td%05x", id % 0xffff);
 
 	/* No response from a disconnect, so no need for a timeout */
@@ -512,6 +527,9 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 
 		break;
 	case TAPDISK_NBD_CMD_WRITE:
+	case TAPDISK_NBD_CMD_FLUSH:
+	case TAPDISK_NBD_CMD_TRIM:
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
 		td_complete_request(prv->curr_reply_req->treq, 0);
 
 		break;
@@ -557,127 +575,253 @@ tdnbd_wait_read(int fd)
 	return rc;
 }
 
+#define RECV_BUFFER_SIZE 256
+
 static int
-tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_recv_all(int sock, void *buf, size_t len)
 {
-#define RECV_BUFFER_SIZE 256
+	size_t got = 0;
+	int rc;
+
+	while (got < len) {
+		/*
+		 * We need to limit the time we spend in here as we're still
+		 * using blocking IO at this point
+		 */
+		if (tdnbd_wait_read(sock) <= 0) {
+			ERROR("Timeout in nbd_negotiate");
+			return -1;
+		}
+
+		rc = recv(sock, (char *)buf + got, len - got, 0);
+		if (rc <= 0) {
+			ERROR("Short read in negotiation (%d)\n", rc);
+			return -1;
+		}
+
+		got += rc;
+	}
+
+	return 0;
+}
+
+static int
+tdnbd_send_all(int sock, const void *buf, size_t len)
+{
+	size_t done = 0;
 	int rc;
+
+	while (done < len) {
+		rc = send(sock, (const char *)buf + done, len - done, 0);
+		if (rc <= 0) {
+			ERROR("Short write in negotiation (%d)\n", rc);
+			return -1;
+		}
+
+		done += rc;
+	}
+
+	return 0;
+}
+
+static int
+tdnbd_send_option(int sock, uint32_t option, const void *data, uint32_t len)
+{
+	struct nbd_option opt;
+
+	opt.magic  = htonll(NBD_OPTS_MAGIC);
+	opt.option = htonl(option);
+	opt.len    = htonl(len);
+
+	if (tdnbd_send_all(sock, &opt, sizeof(opt)))
+		return -1;
+
+	return len ? tdnbd_send_all(sock, data, len) : 0;
+}
+
+/*
+ * NBD_OPT_GO for the default export. Returns 1 if the server doesn't
+ * know the option, so the caller can fall back to NBD_OPT_EXPORT_NAME.
+ */
+static int
+tdnbd_opt_go(int sock, uint64_t *size, uint16_t *tflags)
+{
+	struct nbd_option_reply reply;
+	char request[6], data[RECV_BUFFER_SIZE];
+	uint32_t type, len;
+	uint16_t info;
+	bool have_info = false;
+
+	memset(request, 0, sizeof(request)); /* no name, no info requests */
+
+	if (tdnbd_send_option(sock, NBD_OPT_GO, request, sizeof(request)))
+		return -1;
+
+	for (;;) {
+		if (tdnbd_recv_all(sock, &reply, sizeof(reply)))
+			return -1;
+
+		if (ntohll(reply.magic) != NBD_OPT_REPLY_MAGIC ||
+		    ntohl(reply.option) != NBD_OPT_GO) {
+			ERROR("Bad option reply in negotiation");
+			return -1;
+		}
+
+		type = ntohl(reply.type);
+		len  = ntohl(reply.len);
+
+		if (len > sizeof(data)) {
+			ERROR("Option reply too large (%"PRIu32")", len);
+			return -1;
+		}
+
+		if (tdnbd_recv_all(sock, data, len))
+			return -1;
+
+		switch (type) {
+		case NBD_REP_INFO:
+			if (len < 2)
+				break;
+			memcpy(&info, data, sizeof(info));
+			if (ntohs(info) == NBD_INFO_EXPORT && len >= 12) {
+				memcpy(size, data + 2, sizeof(*size));
+				*size = ntohll(*size);
+				memcpy(tflags, data + 10, sizeof(*tflags));
+				*tflags = ntohs(*tflags);
+				have_info = true;
+			}
+			break;
+
+		case NBD_REP_ACK:
+			if (!have_info) {
+				ERROR("No export info from NBD_OPT_GO");
+				return -1;
+			}
+			return 0;
+
+		case NBD_REP_ERR_UNSUP:
+			return 1;
+
+		default:
+			if (type & NBD_REP_FLAG_ERROR) {
+				ERROR("NBD_OPT_GO refused (0x%x)", type);
+				return -1;
+			}
+			break;
+		}
+	}
+}
+
+static int
+tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+{
 	char buffer[RECV_BUFFER_SIZE];
 	uint64_t magic;
 	uint64_t size;
-	uint32_t flags;
-	int padbytes = 124;
+	uint32_t flags, cflags;
+	uint16_t hflags, tflags;
 	int sock = prv->socket;
+	int rc;
 
 	/*
 	 * NBD negotiation protocol: 
 	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 0x00420281861253L
-	 * then it sends a 64 bit bigendian size
-	 * then it sends a 32 bit bigendian flags
-	 * then it sends 124 bytes of nothing
-	 */
-
-	/*
-	 * We need to limit the time we spend in this function as we're still
-	 * using blocking IO at this point
+	 * Server sends 'NBDMAGIC', then either
+	 *
+	 * oldstyle: 0x00420281861253L, a 64 bit bigendian size, 32 bit
+	 * bigendian flags and 124 bytes of nothing, or
+	 *
+	 * newstyle: 'IHAVEOPT' and 16 bit handshake flags. We send our
+	 * flags, then NBD_OPT_GO (fixed newstyle) or NBD_OPT_EXPORT_NAME
+	 * for the size and transmission flags.
 	 */
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
 
-	rc = recv(sock, buffer, 8, 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(1) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
+	if (tdnbd_recv_all(sock, buffer, 8))
+		goto fail;
 
 	if (memcmp(buffer, "NBDMAGIC", 8) != 0) {
 		buffer[8] = 0;
 		ERROR("Error in NBD negotiation: got '%s'", buffer);
-		close(sock);
-		return -1;
+		goto fail;
 	}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+	if (tdnbd_recv_all(sock, &magic, sizeof(magic)))
+		goto fail;
 
-	rc = recv(sock, &magic, sizeof(magic), 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(2) (%d)\n", rc);
+	switch (ntohll(magic)) {
+	case NBD_NEGOTIATION_MAGIC:
+		if (tdnbd_recv_all(sock, &size, sizeof(size)) ||
+		    tdnbd_recv_all(sock, &flags, sizeof(flags)) ||
+		    tdnbd_recv_all(sock, buffer, 124))
+			goto fail;
 
-		return -1;
-	}
-
-	if (ntohll(magic) != NBD_NEGOTIATION_MAGIC) {
-		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
-				ntohll(magic));
-		close(sock);
-		return -1;
-	}
+		size = ntohll(size);
+		tflags = ntohl(flags) & 0xffff;
+		INFO("Got flags: %"PRIu32"", ntohl(flags));
+		break;
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+	case NBD_OPTS_MAGIC:
+		if (tdnbd_recv_all(sock, &hflags, sizeof(hflags)))
+			goto fail;
 
-	rc = recv(sock, &size, sizeof(size), 0);
-	if (rc < sizeof(size)) {
-		ERROR("Short read in negotiation(3) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
+		hflags = ntohs(hflags);
+		cflags = hflags & (NBD_FLAG_FIXED_NEWSTYLE |
+				   NBD_FLAG_NO_ZEROES);
+		cflags = htonl(cflags);
 
-	INFO("Got size: %"PRIu64"", ntohll(size));
+		if (tdnbd_send_all(sock, &cflags, sizeof(cflags)))
+			goto fail;
 
-	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+		rc = 1;
+		if (hflags & NBD_FLAG_FIXED_NEWSTYLE)
+			rc = tdnbd_opt_go(sock, &size, &tflags);
+		if (rc < 0)
+			goto fail;
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
-	}
+		if (rc) {
+			if (tdnbd_send_option(sock, NBD_OPT_EXPORT_NAME,
+					      NULL, 0))
+				goto fail;
 
-	rc = recv(sock, &flags, sizeof(flags), 0);
-	if (rc < sizeof(flags)) {
-		ERROR("Short read in negotiation(4) (%d)\n", rc);
-		close(sock);
-		return -1;
-	}
+			if (tdnbd_recv_all(sock, &size, sizeof(size)) ||
+			    tdnbd_recv_all(sock, &tflags, sizeof(tflags)))
+				goto fail;
 
-	INFO("Got flags: %"PRIu32"", ntohl(flags));
+			if (!(hflags & NBD_FLAG_NO_ZEROES) &&
+			    tdnbd_recv_all(sock, buffer, 124))
+				goto fail;
 
-	while (padbytes > 0) {
-		if (tdnbd_wait_read(sock) <= 0) {
-			ERROR("Timeout in nbd_negotiate");
-			close(sock);
-			return -1;
+			size   = ntohll(size);
+			tflags = ntohs(tflags);
 		}
 
-		rc = recv(sock, buffer, padbytes, 0);
-		if (rc < 0) {
-			ERROR("Bad read in negotiation(5) (%d)\n", rc);
-			close(sock);
-			return -1;
-		}
-		padbytes -= rc;
+		INFO("Got transmission flags: 0x%x", tflags);
+		break;
+
+	default:
+		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
+				ntohll(magic));
+		goto fail;
 	}
 
+	INFO("Got size: %"PRIu64"", size);
+
+	driver->info.size = size >> SECTOR_SHIFT;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info = 0;
+
+	/* without NBD_FLAG_HAS_FLAGS, the rest mean nothing */
+	prv->tflags = tflags & NBD_FLAG_HAS_FLAGS ? tflags : 0;
+
 	INFO("Successfully connected to NBD server");
 
 	fcntl(sock, F_SETFL, O_NONBLOCK);
 
 	return 0;
+
+fail:
+	close(sock);
+	return -1;
 }
 
 static int
@@ -743,7 +887,7 @@ static int tdnbd_close(td_driver_t*);
 
 static int
 tdnbd_open(td_driver_t* driver, const char* name,
-	   struct td_vbd_encryption *encryption, td_flag_t flags)
+	   struct td_vbd_open_params *params, td_flag_t flags)
 {
 	struct tdnbd_data *prv;
 	char peer_ip[256];
@@ -906,6 +1050,28 @@ tdnbd_queue_read(td_driver_t* driver, td_request_t treq)
 				treq, 0);
 }
 
+static int
+tdnbd_buf_is_zero(const char *buf, size_t len)
+{
+	const unsigned long *p = (const unsigned long *)buf;
+	size_t i, n = len / sizeof(*p);
+
+	for (i = 0; i < n; i++)
+		if (p[i])
+			return 0;
+
+	for (i = n * sizeof(*p); i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Writes of nothing but zeroes go out as NBD_CMD_WRITE_ZEROES, if the
+ * server takes it: no payload on the wire, and the server may not
+ * even need to allocate anything for them.
+ */
 static void
 tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 {
@@ -913,8 +1079,44 @@ tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 	int      size    = treq.secs * driver->info.sector_size;
 	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
 
-	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_WRITE,
-			offset, treq.buf, size, treq, 0);
+	if ((prv->tflags & NBD_FLAG_SEND_WRITE_ZEROES) &&
+	    tdnbd_buf_is_zero(treq.buf, size))
+		tdnbd_queue_request(prv, TAPDISK_NBD_CMD_WRITE_ZEROES,
+				offset, NULL, size, treq, 0);
+	else
+		tdnbd_queue_request(prv, TAPDISK_NBD_CMD_WRITE,
+				offset, treq.buf, size, treq, 0);
+}
+
+static void
+tdnbd_queue_discard(td_driver_t* driver, td_request_t treq)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	int      size    = treq.secs * driver->info.sector_size;
+	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
+
+	/* discards are advisory */
+	if (!(prv->tflags & NBD_FLAG_SEND_TRIM)) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_TRIM,
+			offset, NULL, size, treq, 0);
+}
+
+static void
+tdnbd_queue_flush(td_driver_t* driver, td_request_t treq)
+{
+	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+
+	/* a server that doesn't take flushes doesn't cache writes */
+	if (!(prv->tflags & NBD_FLAG_SEND_FLUSH)) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	tdnbd_queue_request(prv, TAPDISK_NBD_CMD_FLUSH, 0, NULL, 0, treq, 0);
 }
 
 static int
@@ -938,6 +1140,8 @@ struct tap_disk tapdisk_nbd = {
 	.td_close           = tdnbd_close,
 	.td_queue_read      = tdnbd_queue_read,
 	.td_queue_write     = tdnbd_queue_write,
+	.td_queue_discard   = tdnbd_queue_discard,
+	.td_queue_flush     = tdnbd_queue_flush,
 	.td_get_parent_id   = tdnbd_get_parent_id,
 	.td_validate_parent = tdnbd_validate_parent,
 };
@@ -124,7 +124,7 @@ static int get_image_info(int fd, td_disk_info_t *info)
 
 /* Open the disk file and initialize ram state. */
 int tdram_open (td_driver_t *driver, const char *name,
-		struct td_vbd_encryption *encryption, td_flag_t flags)
+		struct td_vbd_open_params *params, td_flag_t flags)
 {
 	char *p;
 	uint64_t size;
@@ -576,7 +576,7 @@ td_valve_close(td_driver_t *driver)
 
 static int
 td_valve_open(td_driver_t *driver, const char *name,
-	      struct td_vbd_encryption *encryption, td_flag_t flags)
+	      struct td_vbd_open_params *params, td_flag_t flags)
 {
 	td_valve_t *valve = driver->data;
 	int err;
@@ -67,6 +67,8 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "debug.h"
 #include "libvhd.h"
@@ -75,10 +77,12 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-server.h"
+#include "timeout-math.h"
+#include "tapdisk-offload.h"
 #include "block-crypto.h"
 
-unsigned int SPB;
-
 #define LIBBLOCKCRYPTO_NAME "libblockcrypto.so"
 
 #define DEBUGGING   2
@@ -90,10 +94,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, ALLOCS: %d\n",					\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_allocs);					\
 	} while(0)
 
 #if (DEBUGGING == 1)
@@ -112,10 +116,15 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE_MAX           65536
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
+/* metadata writes in flight: one per cached bitmap, the bat, and a spare */
+#define VHD_REQS_META(s)             ((s)->bm_cache_size + 2)
+
+#define VHD_BAT_ALLOCS               16  /* concurrent bat updates */
+#define VHD_RECLAIM_RETRIES          64  /* reclaims waiting for a slot */
+#define VHD_BAT_BATCH_SECS           8   /* max bat sectors per write */
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -124,6 +133,9 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_FLUSH                 9
+#define VHD_OP_ZERO_BLOCK_WRITE      10
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -132,6 +144,8 @@ unsigned int SPB;
 #define VHD_BM_NOT_CACHED            4
 #define VHD_BM_READ_PENDING          5
 
+#define VHD_ALLOC_PENDING            1
+
 #define VHD_FLAG_OPEN_RDONLY         1
 #define VHD_FLAG_OPEN_NO_CACHE       2
 #define VHD_FLAG_OPEN_QUIET          4
@@ -143,11 +157,16 @@ unsigned int SPB;
 
 #define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_RECLAIM         4
+#define VHD_FLAG_BAT_ZEROING         8
+#define VHD_FLAG_BAT_WRITE_QUEUED    16
+#define VHD_FLAG_BAT_FLUSH_ARMED     32
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOC_PENDING    16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -156,6 +175,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_DISCARD          4
 
 typedef uint8_t vhd_flag_t;
 
@@ -186,24 +206,54 @@ struct vhd_request {
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
+	uint64_t                  seqno;       /* metadata write order */
+	struct list_head          meta;        /* on meta_pending while
+						* being written */
+	td_offload_job_t          crypto_job;
+};
+
+/*
+ * A pending update of one bat entry: a block being allocated, or
+ * handed back. Updates are queued once the block is ready, and written
+ * out in batches covering all queued entries in nearby bat sectors.
+ */
+struct vhd_bat_alloc {
+	vhd_flag_t                status;
+	uint32_t                  blk;
+	uint64_t                  offset;      /* new bat entry */
+	uint64_t                  start_db;    /* reserved space, incl. gap */
+	struct vhd_request        req;         /* bat update, in the bitmap
+						* transaction if preallocating */
+	struct vhd_request        zero_req;    /* for initializing bitmaps */
+	struct vhd_transaction   *tx;          /* bitmap transaction waiting
+						* for the bat update */
+	struct timeval            start;
 };
 
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+	event_id_t                flush_event; /* writes queued updates */
+
+	int                       nr_allocs;
+	struct vhd_bat_alloc      allocs[VHD_BAT_ALLOCS];
+
+	/* emptied blocks to reclaim once a slot frees up */
+	int                       nr_reclaims;
+	uint32_t                  reclaims[VHD_RECLAIM_RETRIES];
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
 	vhd_flag_t                status;
 
+	struct vhd_bitmap        *hnext;       /* bitmap hash chain */
+	struct list_head          lru;         /* on bm_lru if cached,
+						* bm_free otherwise */
+
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
 	char                     *shadow;      /* in-memory bitmap changes are 
@@ -217,7 +267,8 @@ struct vhd_bitmap {
 						* transaction */
 	struct vhd_req_list       waiting;     /* pending requests that cannot
 					        * be serviced until this bitmap
-					        * is read from disk */
+					        * is read from disk, or its
+					        * block is zeroed */
 	struct vhd_request        req;
 };
 
@@ -238,17 +289,28 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	/**
+	 * Bitmap cache. Cached bitmaps are hashed by block number and
+	 * kept on bm_lru, least recently used first.
+	 */
+	uint32_t                  bm_cache_size;
+	uint32_t                  bm_hash_shift;
+	struct vhd_bitmap       **bm_hash;
+	struct list_head          bm_lru;
+	struct list_head          bm_free;
+	struct vhd_bitmap        *bitmap_list;
 
 	int                       vreq_free_count;
-	struct vhd_request       *vreq_free[VHD_REQS_DATA];
-	struct vhd_request        vreq_list[VHD_REQS_DATA];
+
+	/* flushes waiting for metadata writes issued before them */
+	uint64_t                  meta_seqno;
+	struct vhd_req_list       flush_queue;
+
+	/* bitmap and bat writes in flight, by seqno */
+	struct list_head          meta_pending;
+	int                       nr_meta_pending;
 
 	/* for redundant bitmap writes */
 	int                       padbm_size;
@@ -258,6 +320,9 @@ struct vhd_state {
 
 	td_driver_t              *driver;
 
+	/* holds a reference on the loop's offload channel */
+	int                       crypto_offload;
+
 	uint64_t                  queued;
 	uint64_t                  completed;
 	uint64_t                  returned;
@@ -265,6 +330,31 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  discards;
+	uint64_t                  reclaimed;
+	uint64_t                  reclaim_retries;
+	uint64_t                  reclaim_skipped;
+	uint64_t                  zero_writes;
+	uint64_t                  zero_bytes;
+	uint64_t                  flushes;
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
+
+	/* block allocations, reservation to BAT update */
+	int                       no_zero_range;
+	uint64_t                  allocs;
+	uint64_t                  alloc_usecs;
+	uint64_t                  alloc_max_usecs;
+	uint64_t                  bat_writes;
+	uint64_t                  bat_updates;
+
+	/*
+	 * Request pool, last: entries are cleared as they are freed, so
+	 * open and close leave the ones never used untouched.
+	 */
+	struct vhd_request       *vreq_free[VHD_REQS_DATA];
+	struct vhd_request        vreq_list[VHD_REQS_DATA];
 };
 
 /* Define access functions for VHD encryption */
@@ -273,13 +363,16 @@ struct crypto_interface
 	int (*vhd_open_crypto)(
 		vhd_context_t *, const uint8_t *, size_t,
 		const char *);
-	void (*vhd_crypto_encrypt)(
+	int (*vhd_crypto_encrypt)(
 		vhd_context_t *, td_request_t *, char *);
-	void (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+	int (*vhd_crypto_decrypt)(vhd_context_t *, td_request_t *);
+	/* optional: older crypto libraries don't have it */
+	void (*vhd_close_crypto)(vhd_context_t *);
 };
 
 static struct crypto_interface *crypto_interface = NULL;
 static void *crypto_handle;
+static pthread_mutex_t crypto_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
 #define set_vhd_flag(word, flag)   ((word) |= (flag))
@@ -289,72 +382,63 @@ static void *crypto_handle;
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static int __vhd_queue_request(struct vhd_state *, uint8_t, td_request_t);
+static void vhd_queue_discard(td_driver_t *, td_request_t);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * Zeroes to write from, shared by every VHD in the process and mapped
+ * once, big enough for preallocating opens. VBDs on other worker
+ * threads may have writes from it in flight at any time, so it is
+ * never unmapped; mapping it is retried until it works.
+ */
+static pthread_mutex_t    _vhd_zeros_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros = NULL;
-int                       _dev_zero = -1;
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
-	int err;
+	unsigned long size;
+	int fd, err = 0;
+	char *zeros;
+
+	pthread_mutex_lock(&_vhd_zeros_lock);
 
 	if (_vhd_zeros)
-		return 0;
+		goto out;
 
-	_vhd_zsize = 2 * getpagesize();
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
+	size = 2 * getpagesize() + VHD_BLOCK_SIZE;
 
-	_dev_zero = open("/dev/zero", O_RDONLY);
-	if (unlikely(_dev_zero == -1)) {
-		err = errno;
-		EPRINTF("failed to open /dev/zero: %s\n", strerror(err));
-		return -err;
+	fd = open("/dev/zero", O_RDONLY);
+	if (unlikely(fd == -1)) {
+		err = -errno;
+		EPRINTF("failed to open /dev/zero: %s\n", strerror(-err));
+		goto out;
 	}
 
-	_vhd_zeros = mmap(NULL, _vhd_zsize, PROT_READ,
-			  MAP_SHARED, _dev_zero, 0);
-	if (_vhd_zeros == MAP_FAILED) {
-		int _err;
-		err = errno;
-		EPRINTF("vhd_initialize failed: %s\n", strerror(err));
-		_vhd_zeros = NULL;
-		_vhd_zsize = 0;
-		_err = close(_dev_zero);
-		if (unlikely(_err == -1))
-			EPRINTF("failed to close /dev/zero: %s (error ignored)\n",
-					strerror(errno));
-		else
-			_dev_zero = -1;
-
-		return -err;
+	zeros = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (zeros == MAP_FAILED) {
+		err = -errno;
+		EPRINTF("vhd_initialize failed: %s\n", strerror(-err));
+	} else {
+		_vhd_zsize = size;
+		_vhd_zeros = zeros;
 	}
 
-	_vhd_master = s;
-	return 0;
+	if (unlikely(close(fd) == -1))
+		EPRINTF("failed to close /dev/zero: %s (error ignored)\n",
+			strerror(errno));
+
+out:
+	pthread_mutex_unlock(&_vhd_zeros_lock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
-		return;
-
 	free(s->padbm_buf);
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
-	if (_dev_zero != -1) {
-		int _err = close(_dev_zero);
-		if (unlikely(_err == -1))
-			EPRINTF("failed to close /dev/zero: %s (error ignored)\n",
-					strerror(errno));
-		else
-			_dev_zero = -1;
-	}
+	s->padbm_buf = NULL;
 }
 
 static char *
@@ -388,6 +472,15 @@ test_batmap(struct vhd_state *s, uint32_t blk)
 	return vhd_batmap_test(&s->vhd, &s->bat.batmap, blk);
 }
 
+static inline void
+clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+	if (test_batmap(s, blk)) {
+		vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+		DBG(TLOG_DBG, "block 0x%x no longer full\n", blk);
+	}
+}
+
 static int
 vhd_kill_footer(struct vhd_state *s)
 {
@@ -451,9 +544,13 @@ find_next_free_block(struct vhd_state *s)
 	return 0;
 }
 
+static void vhd_bat_flush_event(event_id_t, char, void *);
+
 static void
 vhd_free_bat(struct vhd_state *s)
 {
+	if (s->bat.flush_event > 0)
+		tapdisk_server_unregister_event(s->bat.flush_event);
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
@@ -500,12 +597,25 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_BATCH_SECS << VHD_SECTOR_SHIFT);
 	if (err)
 		goto fail;
 
 	s->bat.bat_buf = buf;
 
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		s->bat.flush_event =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						      -1, TV_INF,
+						      vhd_bat_flush_event, s);
+		if (s->bat.flush_event < 0) {
+			err = s->bat.flush_event;
+			s->bat.flush_event = 0;
+			goto fail;
+		}
+	}
+
 	return 0;
 
 fail:
@@ -519,14 +629,21 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (s->bitmap_list) {
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(s->bitmap_list);
+	s->bitmap_list = NULL;
+	free(s->bm_hash);
+	s->bm_hash = NULL;
+
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
 }
 
 static int
@@ -536,30 +653,46 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 	struct vhd_bitmap *bm;
 	void *map, *shadow;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
+
+	/* twice as many hash buckets as bitmaps, at least two */
+	s->bm_hash_shift = 32 - 1;
+	while ((1U << (32 - s->bm_hash_shift)) < 2 * s->bm_cache_size)
+		s->bm_hash_shift--;
+
+	s->bm_hash = calloc(1U << (32 - s->bm_hash_shift),
+			    sizeof(struct vhd_bitmap *));
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	if (!s->bm_hash || !s->bitmap_list) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign(&map, 512, map_size);
-		if (err)
+		if (err) {
+			err = -err;
 			goto fail;
+		}
 
 		bm->map = map;
 
 		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
+		if (err) {
+			err = -err;
 			goto fail;
+		}
 
 		bm->shadow = shadow;
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		list_add_tail(&bm->lru, &s->bm_free);
 	}
 
 	return 0;
@@ -699,6 +832,7 @@ __load_crypto(struct td_vbd_encryption *encryption)
 		crypto_interface->vhd_open_crypto = dummy_open_crypto;
 		crypto_interface->vhd_crypto_encrypt = NULL;
 		crypto_interface->vhd_crypto_decrypt = NULL;
+		crypto_interface->vhd_close_crypto = NULL;
 	} else {
 		dlerror();
 		crypto_handle = dlopen(LIBBLOCKCRYPTO_NAME, RTLD_LAZY);
@@ -714,12 +848,15 @@ __load_crypto(struct td_vbd_encryption *encryption)
 				 const char *))
 			dlsym (crypto_handle, "vhd_open_crypto");
 		crypto_interface->vhd_crypto_encrypt =
-			(void (*)(vhd_context_t *, td_request_t *,
+			(int (*)(vhd_context_t *, td_request_t *,
 				  char *))
 			dlsym(crypto_handle, "vhd_crypto_encrypt");
 		crypto_interface->vhd_crypto_decrypt =
-			(void (*)(vhd_context_t *, td_request_t *))
+			(int (*)(vhd_context_t *, td_request_t *))
 			dlsym(crypto_handle, "vhd_crypto_decrypt");
+		crypto_interface->vhd_close_crypto =
+			(void (*)(vhd_context_t *))
+			dlsym(crypto_handle, "vhd_close_crypto");
 
 		if (!crypto_interface->vhd_open_crypto ||
 		    !crypto_interface->vhd_crypto_encrypt ||
@@ -740,19 +877,61 @@ __load_and_open_crypto(vhd_context_t *vhd, struct td_vbd_encryption *encryption,
 {
 	int ret = 0;
 
-	if (!crypto_interface) {
+	/* VBDs on different worker threads may open at the same time */
+	pthread_mutex_lock(&crypto_lock);
+	if (!crypto_interface)
 		ret = __load_crypto(encryption);
-		if (ret)
-			return ret;
-	}
+	pthread_mutex_unlock(&crypto_lock);
+	if (ret)
+		return ret;
 
 	return crypto_interface->vhd_open_crypto(
 		vhd, encryption->encryption_key, encryption->key_size, name);
 }
 
+/*
+ * Encrypted images can hand their XTS work to a pool of threads
+ * (TAPDISK3_CRYPTO_THREADS, default none), so the event loop keeps
+ * queueing I/O while a request is being transformed. Without a pool,
+ * the transforms run inline as before.
+ */
+static void
+vhd_start_crypto_offload(struct vhd_state *s)
+{
+	const char *env;
+	int threads, err;
+
+	env = getenv("TAPDISK3_CRYPTO_THREADS");
+	if (!env)
+		return;
+
+	threads = atoi(env);
+	if (threads <= 0)
+		return;
+
+	err = tapdisk_offload_start(threads);
+	if (err < 0)
+		EPRINTF("%s: failed to start crypto threads: %d, "
+			"encrypting inline\n", s->vhd.file, err);
+	else if (err > 0)
+		s->crypto_offload = !tapdisk_offload_get();
+}
+
+static void
+vhd_stop_crypto(struct vhd_state *s)
+{
+	if (s->crypto_offload) {
+		tapdisk_offload_put();
+		s->crypto_offload = 0;
+	}
+
+	if (s->vhd.xts_tfm && crypto_interface->vhd_close_crypto)
+		crypto_interface->vhd_close_crypto(&s->vhd);
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name,
-	   struct td_vbd_encryption *encryption, vhd_flag_t flags)
+	   struct td_vbd_open_params *params, vhd_flag_t flags)
 {
         int i, o_flags, err;
 	struct vhd_state *s;
@@ -762,11 +941,19 @@ __vhd_open(td_driver_t *driver, const char *name,
 		libvhd_set_log_level(1);
 
 	s = (struct vhd_state *)driver->data;
-	memset(s, 0, sizeof(struct vhd_state));
+	memset(s, 0, offsetof(struct vhd_state, vreq_free));
 
 	s->flags  = flags;
 	s->driver = driver;
 
+	s->bm_cache_size = VHD_CACHE_SIZE;
+	if (params->bm_cache_size)
+		s->bm_cache_size = MIN(params->bm_cache_size,
+				       VHD_CACHE_SIZE_MAX);
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
+	INIT_LIST_HEAD(&s->meta_pending);
+
 	err = vhd_initialize(s);
 	if (err)
 		return err;
@@ -805,8 +992,6 @@ __vhd_open(td_driver_t *driver, const char *name,
 
 	vhd_log_open(s);
 
-	SPB = s->spb;
-
 	s->vreq_free_count = VHD_REQS_DATA;
 	for (i = 0; i < VHD_REQS_DATA; i++)
 		s->vreq_free[i] = s->vreq_list + i;
@@ -818,12 +1003,15 @@ __vhd_open(td_driver_t *driver, const char *name,
         DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%lu, inf:%u)\n",
 	    driver->info.size, driver->info.sector_size, driver->info.info);
 
-	err = __load_and_open_crypto(&s->vhd, encryption, name);
+	err = __load_and_open_crypto(&s->vhd, &params->encryption, name);
 	if (err) {
 		DPRINTF("failed to init crypto: %d\n", err);
 		goto fail;
 	}
 
+	if (s->vhd.xts_tfm)
+		vhd_start_crypto_offload(s);
+
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
 	    !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) {
 		err = vhd_kill_footer(s);
@@ -837,6 +1025,7 @@ __vhd_open(td_driver_t *driver, const char *name,
         return 0;
 
  fail:
+	vhd_stop_crypto(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -846,7 +1035,7 @@ __vhd_open(td_driver_t *driver, const char *name,
 
 static int
 _vhd_open(td_driver_t *driver, const char *name,
-	  struct td_vbd_encryption *encryption, td_flag_t flags)
+	  struct td_vbd_open_params *params, td_flag_t flags)
 {
 	vhd_flag_t vhd_flags = 0;
 
@@ -873,7 +1062,7 @@ _vhd_open(td_driver_t *driver, const char *name,
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
 		vhd_flags |= VHD_FLAG_OPEN_PREALLOCATE;
 
-	return __vhd_open(driver, name, encryption, vhd_flags);
+	return __vhd_open(driver, name, params, vhd_flags);
 }
 
 static void
@@ -938,12 +1127,13 @@ _vhd_close(td_driver_t *driver)
 
  free:
 	vhd_log_close(s);
+	vhd_stop_crypto(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
-	memset(s, 0, sizeof(struct vhd_state));
+	memset(s, 0, offsetof(struct vhd_state, vreq_free));
 
 	return 0;
 }
@@ -1075,6 +1265,26 @@ init_vhd_request(struct vhd_state *s, struct vhd_request *req)
 	req->state = s;
 }
 
+/*
+ * Metadata writes are numbered as they are issued, so the list of those
+ * in flight stays ordered, oldest first.
+ */
+static inline void
+start_meta_write(struct vhd_state *s, struct vhd_request *req)
+{
+	req->seqno = ++s->meta_seqno;
+	list_add_tail(&req->meta, &s->meta_pending);
+	s->nr_meta_pending++;
+	ASSERT(s->nr_meta_pending <= VHD_REQS_META(s));
+}
+
+static inline void
+finish_meta_write(struct vhd_state *s, struct vhd_request *req)
+{
+	list_del_init(&req->meta);
+	s->nr_meta_pending--;
+}
+
 static inline void
 init_tx(struct vhd_transaction *tx)
 {
@@ -1093,7 +1303,7 @@ add_to_transaction(struct vhd_transaction *tx, struct vhd_request *r)
 
 	DBG(TLOG_DBG, "blk: 0x%04"PRIx64", lsec: 0x%08"PRIx64", tx: %p, "
 	    "started: %d, finished: %d, status: %u\n",
-	    r->treq.sec / SPB, r->treq.sec, tx,
+	    r->treq.sec / r->state->spb, r->treq.sec, tx,
 	    tx->started, tx->finished, tx->status);
 }
 
@@ -1103,41 +1313,80 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+bat_alloc(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+	struct vhd_bat_alloc *alloc;
+
+	if (!s->bat.nr_allocs)
+		return NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_LOCKED) &&
+		    alloc->blk == blk)
+			return alloc;
+	}
+
+	return NULL;
+}
+
+static inline int
+bat_full(struct vhd_state *s)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
+	return s->bat.nr_allocs == VHD_BAT_ALLOCS;
 }
 
-static inline void
-lock_bat(struct vhd_state *s)
+static struct vhd_bat_alloc *
+lock_bat(struct vhd_state *s, uint32_t blk)
 {
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	int i;
+	struct vhd_bat_alloc *alloc;
+
+	ASSERT(!bat_alloc(s, blk));
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_LOCKED))
+			continue;
+
+		memset(alloc, 0, sizeof(*alloc));
+		alloc->blk = blk;
+		set_vhd_flag(alloc->status, VHD_FLAG_BAT_LOCKED);
+		init_vhd_request(s, &alloc->req);
+		alloc->req.op       = VHD_OP_BAT_WRITE;
+		alloc->req.treq.sec = (uint64_t)blk * s->spb;
+		s->bat.nr_allocs++;
+		return alloc;
+	}
+
+	return NULL;
 }
 
 static inline void
-unlock_bat(struct vhd_state *s)
+unlock_bat(struct vhd_state *s, struct vhd_bat_alloc *alloc)
 {
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	ASSERT(test_vhd_flag(alloc->status, VHD_FLAG_BAT_LOCKED));
+
+	alloc->status = 0;
+	s->bat.nr_allocs--;
 }
 
 static inline int
-bat_locked(struct vhd_state *s)
+bat_reclaiming(struct vhd_state *s, uint32_t blk)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	struct vhd_bat_alloc *alloc = bat_alloc(s, blk);
+
+	return alloc && test_vhd_flag(alloc->status, VHD_FLAG_BAT_RECLAIM);
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
+	bm->hnext  = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -1146,21 +1395,39 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline uint32_t
+bitmap_hash(struct vhd_state *s, uint32_t block)
+{
+	return (block * 0x9e3779b1U) >> s->bm_hash_shift;
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = s->bm_hash[bitmap_hash(s, block)]; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = &s->bm_hash[bitmap_hash(s, bm->blk)]; *pp; pp = &(*pp)->hnext)
+		if (*pp == bm) {
+			*pp = bm->hnext;
+			bm->hnext = NULL;
+			return;
+		}
+
+	ASSERT(0);
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1190,6 +1457,7 @@ bitmap_in_use(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
+		test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING) ||
 		test_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT) ||
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
@@ -1197,39 +1465,47 @@ bitmap_in_use(struct vhd_bitmap *bm)
 static inline int
 bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, n;
-
-	n = s->spb >> 3;
-	for (i = 0; i < n; i++)
-		if (bm->map[i] != (char)0xFF)
-			return 0;
+	if (!vhd_bitmap_full(&s->vhd, bm->map, 0, s->spb))
+		return 0;
 
 	DBG(TLOG_DBG, "bitmap 0x%04x full\n", bm->blk);
 	return 1;
 }
 
+static inline int
+bitmap_empty(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (vhd_bitmap_find(&s->vhd, bm->map, 0, s->spb, 1) != s->spb)
+		return 0;
+
+	DBG(TLOG_DBG, "bitmap 0x%04x empty\n", bm->blk);
+	return 1;
+}
+
+/*
+ * Evict the least recently used unlocked bitmap. The most recently used
+ * one is never a candidate, even if unlocked.
+ */
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bm->lru.next == &s->bm_lru)
+			break;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		if (bitmap_locked(bm))
+			continue;
+
+		ASSERT(!bitmap_in_use(bm));
+		unhash_bitmap(s, bm);
+		list_del_init(&bm->lru);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1239,8 +1515,9 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del_init(&bm->lru);
 	} else {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
@@ -1254,63 +1531,34 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_move_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	uint32_t h;
 
-	ASSERT(0);
+	ASSERT(!get_bitmap(s, bm->blk));
+
+	h = bitmap_hash(s, bm->blk);
+	bm->hnext = s->bm_hash[h];
+	s->bm_hash[h] = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	list_move_tail(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1335,9 +1583,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 		return -EINVAL;
 	}
 
+	/* the block is being handed back, wait until it is gone */
+	if (op == VHD_OP_DATA_WRITE && bat_reclaiming(s, blk))
+		return VHD_BM_BAT_LOCKED;
+
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    bat_full(s) && !bat_alloc(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1349,10 +1601,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
 	/* bump lru count */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1384,11 +1639,10 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
-			break;
+	ret = vhd_bitmap_find(&s->vhd, bm->map,
+			      sec, MIN(s->spb, sec + nr_secs), !value);
 
-	return ret;
+	return ret - sec;
 }
 
 static inline struct vhd_request *
@@ -1430,14 +1684,17 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 }
 
 static inline void
-aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+aio_prep_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
-	struct tiocb *tiocb = &req->tiocb;
-
-	td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
+	td_prep_write(&req->tiocb, s->vhd.fd, req->treq.buf,
 		      vhd_sectors_to_bytes(req->treq.secs),
 		      offset, vhd_complete, req);
-	td_queue_tiocb(s->driver, tiocb);
+}
+
+static inline void
+aio_submit_write(struct vhd_state *s, struct vhd_request *req)
+{
+	td_queue_tiocb(s->driver, &req->tiocb);
 
 	s->queued++;
 	s->writes++;
@@ -1445,106 +1702,272 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+static inline void
+aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+{
+	aio_prep_write(s, req, offset);
+	aio_submit_write(s, req);
+}
+
 /**
- * Reserves a new extent.
+ * Reserves a new extent for @blk, and a bat update for it.
  *
- * @returns a 64-bit unsigned integer where the error code is stored in the
- * upper 32 bits and the reserved block number is stored in the lower 32 bits.
- * If an error is returned (the upper 32 bits are not zero), the lower 32 bits
- * are undefined.
+ * Space is handed out right away, so that several blocks can be
+ * allocated at once. A gap may precede the block, to keep its data
+ * region page aligned.
  */
-static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+static int
+reserve_new_block(struct vhd_state *s, uint32_t blk,
+		  struct vhd_bat_alloc **_alloc)
 {
 	int gap = 0;
-
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	struct vhd_bat_alloc *alloc;
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
 	if (s->next_db + gap > UINT_MAX)
-		return (uint64_t)ENOSPC << 32;
+		return -ENOSPC;
+
+	alloc = lock_bat(s, blk);
+	if (!alloc)
+		return -EBUSY;
+
+	alloc->start_db = s->next_db;
+	alloc->offset   = s->next_db + gap;
+	gettimeofday(&alloc->start, NULL);
+
+	s->next_db = alloc->offset + s->spb + s->bm_secs;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, offset: 0x%08"PRIx64", gap: %d\n",
+	    blk, alloc->offset, gap);
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	*_alloc = alloc;
+	return 0;
+}
+
+/*
+ * Drops a failed allocation. Its space is given back if nothing was
+ * reserved after it, and no more writes to it are in flight.
+ */
+static void
+unreserve_new_block(struct vhd_state *s, struct vhd_bat_alloc *alloc)
+{
+	if (s->next_db == alloc->offset + s->spb + s->bm_secs)
+		s->next_db = alloc->start_db;
 
-	return s->next_db;
+	unlock_bat(s, alloc);
 }
 
-static int
+/*
+ * Writes out queued bat updates. Only one bat write is in flight at a
+ * time; it covers the lowest queued entry, and every other queued entry
+ * within VHD_BAT_BATCH_SECS sectors of it. Updates queued meanwhile go
+ * out with the next batch.
+ *
+ * Updates are not written as they are queued, but once per pass of the
+ * event loop (see queue_bat_write), so that every block allocated by
+ * the same batch of completions shares a single bat write.
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	uint32_t blk;
+	int i, n, nsecs;
 	char *buf;
+	uint32_t first, last, sec, nr_bat_secs;
 	uint64_t offset;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *alloc;
+
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
+
+	first = UINT_MAX;
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_QUEUED))
+			first = MIN(first, alloc->blk / 128);
+	}
+
+	if (first == UINT_MAX)
+		return;
+
+	nr_bat_secs = secs_round_up_no_zero(s->bat.bat.entries *
+					    sizeof(uint32_t));
+	last = first;
+	n    = 0;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (!test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_QUEUED))
+			continue;
+
+		sec = alloc->blk / 128;
+		if (sec >= first + VHD_BAT_BATCH_SECS || sec >= nr_bat_secs)
+			continue;
 
-	ASSERT(bat_locked(s));
+		last = MAX(last, sec);
+		clear_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_QUEUED);
+		set_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_STARTED);
+		n++;
+	}
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	req   = &s->bat.req;
+	buf   = s->bat.bat_buf;
+	nsecs = last - first + 1;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	start_meta_write(s, req);
+	memcpy(buf, &bat_entry(s, first * 128),
+	       vhd_sectors_to_bytes(nsecs));
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_STARTED))
+			((uint32_t *)buf)[alloc->blk - first * 128] =
+				alloc->offset;
+	}
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < nsecs * 128; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
+	offset         = s->vhd.header.table_offset + first * 512;
+	req->treq.secs = nsecs;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	s->bat_writes++;
+	s->bat_updates += n;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
-
-	return 0;
+	DBG(TLOG_DBG, "entries: %d, bat secs: %u-%u, "
+	    "table_offset: 0x%08"PRIx64"\n", n, first, last, offset);
 }
 
 static void
-schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+arm_bat_flush(struct vhd_state *s)
 {
-	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	int i;
 
-	init_vhd_request(s, req);
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_FLUSH_ARMED))
+		return;
 
-	offset         = vhd_sectors_to_bytes(lb_end);
-	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
-	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
-	req->next      = NULL;
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		if (test_vhd_flag(s->bat.allocs[i].status,
+				  VHD_FLAG_BAT_WRITE_QUEUED))
+			break;
+	if (i == VHD_BAT_ALLOCS)
+		return;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	if (!s->bat.flush_event ||
+	    tapdisk_server_event_set_timeout(s->bat.flush_event, TV_ZERO)) {
+		schedule_bat_write(s);
+		return;
+	}
 
-	lock_bitmap(bm);
-	add_to_transaction(&bm->tx, req);
-	aio_write(s, req, offset);
+	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_FLUSH_ARMED);
 }
 
-/* This is a performance optimization. When writing sequentially into full 
- * blocks, skipping (up-to-date) bitmaps causes an approx. 25% reduction in 
- * throughput. To prevent skipping, we issue redundant writes into the (padded) 
- * bitmap area just to make all writes sequential. This will help VHDs on raw 
- * block devices, while the FS-based VHDs shouldn't suffer much.
- *
- * Note that it only makes sense to perform this reduntant bitmap write if the 
- * block is completely full (i.e. the batmap entry is set). If the block is not 
- * completely full then one of the following two things will be true:
- *  1. we'll either be allocating new sectors in this block and writing its
+static void
+vhd_bat_flush_event(event_id_t id, char mode, void *private)
+{
+	struct vhd_state *s = private;
+
+	tapdisk_server_event_set_timeout(id, TV_INF);
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_FLUSH_ARMED);
+
+	schedule_bat_write(s);
+}
+
+/*
+ * All BAT slots are taken: remember the block and try again when a BAT
+ * write completes. What doesn't fit stays allocated, and is counted.
+ */
+static void
+defer_bat_reclaim(struct vhd_state *s, uint32_t blk)
+{
+	int i;
+
+	for (i = 0; i < s->bat.nr_reclaims; i++)
+		if (s->bat.reclaims[i] == blk)
+			return;
+
+	if (s->bat.nr_reclaims == VHD_RECLAIM_RETRIES) {
+		s->reclaim_skipped++;
+		return;
+	}
+
+	s->bat.reclaims[s->bat.nr_reclaims++] = blk;
+}
+
+static inline void
+queue_bat_write(struct vhd_state *s, struct vhd_bat_alloc *alloc)
+{
+	set_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_QUEUED);
+	arm_bat_flush(s);
+}
+
+/*
+ * Every sector of @bm has been discarded: drop the block from the BAT
+ * and punch out its data once the BAT write is on disk. The bitmap
+ * stays locked, and writes to the block are bounced, until then.
+ */
+static void
+schedule_bat_reclaim(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bat_alloc *alloc;
+
+	alloc = lock_bat(s, bm->blk);
+	if (!alloc) {
+		DBG(TLOG_DBG, "blk: 0x%04x, bat busy\n", bm->blk);
+		defer_bat_reclaim(s, bm->blk);
+		return;
+	}
+
+	alloc->offset = DD_BLK_UNUSED;
+	set_vhd_flag(alloc->status, VHD_FLAG_BAT_RECLAIM);
+	lock_bitmap(bm);
+
+	queue_bat_write(s, alloc);
+}
+
+static void
+schedule_zero_bm_write(struct vhd_state *s,
+		       struct vhd_bitmap *bm, struct vhd_bat_alloc *alloc)
+{
+	uint64_t offset;
+	struct vhd_request *req = &alloc->zero_req;
+
+	init_vhd_request(s, req);
+
+	offset         = vhd_sectors_to_bytes(alloc->start_db);
+	req->op        = VHD_OP_ZERO_BM_WRITE;
+	req->treq.sec  = (uint64_t)alloc->blk * s->spb;
+	req->treq.secs = (alloc->offset - alloc->start_db) + s->bm_secs;
+	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
+	req->next      = NULL;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
+	    alloc->blk, offset);
+
+	lock_bitmap(bm);
+	add_to_transaction(&bm->tx, req);
+	aio_write(s, req, offset);
+}
+
+/* This is a performance optimization. When writing sequentially into full 
+ * blocks, skipping (up-to-date) bitmaps causes an approx. 25% reduction in 
+ * throughput. To prevent skipping, we issue redundant writes into the (padded) 
+ * bitmap area just to make all writes sequential. This will help VHDs on raw 
+ * block devices, while the FS-based VHDs shouldn't suffer much.
+ *
+ * Note that it only makes sense to perform this reduntant bitmap write if the 
+ * block is completely full (i.e. the batmap entry is set). If the block is not 
+ * completely full then one of the following two things will be true:
+ *  1. we'll either be allocating new sectors in this block and writing its
  *     bitmap transactionally, which will be slow anyways; or
  *  2. the IO will be skipping over the unallocated sectors again, so the
  *     pattern will not be sequential anyways
@@ -1588,15 +2011,13 @@ static int
 update_bat(struct vhd_state *s, uint32_t blk)
 {
 	int err;
-	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (bat_alloc(s, blk))
 		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1610,69 +2031,70 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	if (lb_end >> 32) {
-		unlock_bat(s);
-		return -(lb_end >> 32);
-	}
-	schedule_zero_bm_write(s, bm, lb_end);
+	err = reserve_new_block(s, blk, &alloc);
+	if (err)
+		return err;
+
+	schedule_zero_bm_write(s, bm, alloc);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
 }
 
-static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+static void
+schedule_zero_block_write(struct vhd_state *s, struct vhd_bitmap *bm,
+			  struct vhd_bat_alloc *alloc)
 {
-	int err, gap;
 	uint64_t offset, size;
-	struct vhd_bitmap *bm;
-	ssize_t count;
-	uint64_t next_db;
+	struct vhd_request *req = &alloc->zero_req;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
-
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
+	init_vhd_request(s, req);
 
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
-	}
+	offset = vhd_sectors_to_bytes(alloc->start_db);
+	size   = vhd_sectors_to_bytes(alloc->offset - alloc->start_db +
+				      s->bm_secs + s->spb);
 
-	if (next_db > UINT_MAX)
-		return -ENOSPC;
+	req->op        = VHD_OP_ZERO_BLOCK_WRITE;
+	req->treq.sec  = (uint64_t)alloc->blk * s->spb;
+	req->treq.secs = size >> VHD_SECTOR_SHIFT;
+	req->treq.buf  = vhd_zeros(size);
+	req->next      = NULL;
 
-	s->next_db = next_db;
+	DBG(TLOG_DBG, "blk: 0x%04x, zeroing 0x%"PRIx64" bytes at 0x%08"PRIx64"\n",
+	    alloc->blk, size, offset);
 
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
+	set_vhd_flag(alloc->status, VHD_FLAG_BAT_ZEROING);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING);
+	lock_bitmap(bm);
+	aio_write(s, req, offset);
+}
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+/*
+ * Preallocates and zeroes a new block, then writes its BAT entry.
+ * Filesystems that support it zero the block with a single
+ * FALLOC_FL_ZERO_RANGE; otherwise a zero write is queued, and writes to
+ * the block wait on its bitmap until that completes.
+ *
+ * @returns 0 if writes to @blk may be issued, VHD_ALLOC_PENDING if they
+ * must wait, or a negative error.
+ */
+static int
+allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	uint64_t offset, size;
+	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
-	}
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
-	if (count != size) {
-		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
-		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
+	alloc = bat_alloc(s, blk);
+	if (alloc) {
+		if (alloc->req.error)
+			return -EBUSY;
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_ZEROING))
+			return VHD_ALLOC_PENDING;
+		return 0;
 	}
 
 	/* empty bitmap could already be in
@@ -1687,10 +2109,38 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	err = reserve_new_block(s, blk, &alloc);
+	if (err)
+		return err;
+
+	if (!s->no_zero_range) {
+		offset = vhd_sectors_to_bytes(alloc->start_db);
+		size   = vhd_sectors_to_bytes(s->next_db - alloc->start_db);
+
+		err = fallocate(s->vhd.fd, FALLOC_FL_ZERO_RANGE, offset, size);
+		if (!err)
+			goto zeroed;
+
+		err = -errno;
+		if (err != -EOPNOTSUPP && err != -ENOSYS && err != -EINVAL) {
+			ERR(s, err, "fallocate failed (offset %"PRIu64")\n",
+			    offset);
+			unreserve_new_block(s, alloc);
+			return err;
+		}
+
+		DPRINTF("%s: zero range not supported, zeroing blocks "
+			"with writes\n", s->vhd.file);
+		s->no_zero_range = 1;
+	}
+
+	schedule_zero_block_write(s, bm, alloc);
+	return VHD_ALLOC_PENDING;
+
+zeroed:
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	add_to_transaction(&bm->tx, &alloc->req);
+	queue_bat_write(s, alloc);
 
 	return 0;
 }
@@ -1745,6 +2195,59 @@ vhd_is_encrypted(struct vhd_state *s)
 	return s->vhd.xts_tfm != NULL;
 }
 
+static void
+vhd_encrypt_work(td_offload_job_t *job)
+{
+	struct vhd_request *req;
+	struct vhd_state *s;
+
+	req = container_of(job, struct vhd_request, crypto_job);
+	s   = req->state;
+
+	req->error = crypto_interface->vhd_crypto_encrypt(
+		&s->vhd, &req->treq, req->orig_buf);
+}
+
+static void
+vhd_encrypt_done(td_offload_job_t *job)
+{
+	struct vhd_request *req;
+	struct vhd_state *s;
+
+	req = container_of(job, struct vhd_request, crypto_job);
+	s   = req->state;
+
+	if (req->error) {
+		/* fail it like the write did */
+		s->queued++;
+		vhd_complete(req, &req->tiocb, req->error);
+		return;
+	}
+
+	aio_submit_write(s, req);
+}
+
+/*
+ * Encrypts req->orig_buf into the bounce buffer, then issues the
+ * (already transacted) write. With an offload pool, the write goes
+ * out from the event loop once a worker has done the transform.
+ */
+static void
+vhd_encrypt_and_write(struct vhd_state *s, struct vhd_request *req,
+		      uint64_t offset)
+{
+	aio_prep_write(s, req, offset);
+
+	req->crypto_job.work = vhd_encrypt_work;
+	req->crypto_job.done = vhd_encrypt_done;
+
+	if (!tapdisk_offload_submit(&req->crypto_job))
+		return;
+
+	vhd_encrypt_work(&req->crypto_job);
+	vhd_encrypt_done(&req->crypto_job);
+}
+
 static int
 schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 {
@@ -1771,10 +2274,13 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		else
 			err = update_bat(s, blk);
 
+		if (err == VHD_ALLOC_PENDING)
+			return __vhd_queue_request(s, VHD_OP_DATA_WRITE, treq);
+
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = bat_alloc(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1805,8 +2311,6 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	if (vhd_is_encrypted(s)) {
 		req->orig_buf = req->treq.buf;
 		req->treq.buf = crypto_buf;
-		crypto_interface->vhd_crypto_encrypt(
-			&s->vhd, &req->treq, req->orig_buf);
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BITMAP)) {
@@ -1825,12 +2329,15 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		   test_batmap(s, blk))
 		schedule_redundant_bm_write(s, blk);
 
-	aio_write(s, req, offset);
-
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
 	    s->vhd.file, treq.sec, blk, sec, treq.secs, offset, req->flags);
 
+	if (vhd_is_encrypted(s))
+		vhd_encrypt_and_write(s, req, offset);
+	else
+		aio_write(s, req, offset);
+
 	return 0;
 }
 
@@ -1892,14 +2399,15 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bat_alloc(s, blk));
+		offset = bat_alloc(s, blk)->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
 
 	req = &bm->req;
 	init_vhd_request(s, req);
+	start_meta_write(s, req);
 
 	req->treq.sec  = blk * s->spb;
 	req->treq.secs = s->bm_secs;
@@ -1934,7 +2442,8 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	blk = treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
 
-	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
+	ASSERT(bm && (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING) ||
+		      test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING)));
 
 	req = alloc_vhd_request(s);
 	if (!req)
@@ -1954,6 +2463,55 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * Allocation state at @sector, from the in-memory BAT, batmap and
+ * bitmap cache only. A bitmap we don't hold is fetched in the background
+ * and the caller told to come back later.
+ */
+static int
+vhd_block_status(td_driver_t *driver, td_sector_t sector, int secs,
+		 int *allocated)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint32_t blk, sec;
+	struct vhd_bitmap *bm;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		*allocated = 1;
+		return secs;
+	}
+
+	blk  = sector / s->spb;
+	sec  = sector % s->spb;
+	secs = MIN(secs, s->spb - sec);
+
+	if (blk >= s->vhd.header.max_bat_size)
+		return -EINVAL;
+
+	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
+		*allocated = 0;
+		return secs;
+	}
+
+	if (test_batmap(s, blk)) {
+		*allocated = 1;
+		return secs;
+	}
+
+	bm = get_bitmap(s, blk);
+	if (!bm) {
+		if (schedule_bitmap_read(s, blk))
+			return -EBUSY;
+		return -EAGAIN;
+	}
+
+	if (!bitmap_valid(bm))
+		return -EAGAIN;
+
+	*allocated = !!vhd_bitmap_test(&s->vhd, bm->map, sec);
+	return vhd_bitmap_run(&s->vhd, bm->map, sec, sec + secs);
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -2027,6 +2585,57 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Four words per round, so the OR chain compiles to vector loads.
+ * Request buffers always hold whole sectors.
+ */
+static int
+vhd_buf_is_zero(const void *buf, size_t len)
+{
+	const unsigned long *p = buf, *end = p + len / sizeof(*p);
+
+	for (; p + 4 <= end; p += 4)
+		if (p[0] | p[1] | p[2] | p[3])
+			return 0;
+
+	for (; p < end; p++)
+		if (*p)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * A write of zeroes over sectors which no image underneath us holds
+ * changes nothing a reader could see once those sectors are clear here
+ * too: that's a discard, which costs no I/O on unallocated blocks and
+ * only a bitmap update on allocated ones. Anything we can't tell from
+ * metadata already in memory is written out as usual.
+ */
+static int
+vhd_write_elidable(struct vhd_state *s, td_request_t treq)
+{
+	int n, allocated;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED ||
+	    test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+		return 0;
+
+	if (!vhd_buf_is_zero(treq.buf, vhd_sectors_to_bytes(treq.secs)))
+		return 0;
+
+	while (treq.secs) {
+		n = td_parent_block_status(treq, &allocated);
+		if (n <= 0 || allocated)
+			return 0;
+
+		treq.sec  += n;
+		treq.secs -= n;
+	}
+
+	return 1;
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -2035,6 +2644,13 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	if (vhd_write_elidable(s, treq)) {
+		s->zero_writes++;
+		s->zero_bytes += vhd_sectors_to_bytes(treq.secs);
+		vhd_queue_discard(driver, treq);
+		return;
+	}
+
 	while (treq.secs) {
 		int err;
 		uint8_t flags;
@@ -2112,6 +2728,232 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+static int
+schedule_data_discard(struct vhd_state *s, td_request_t treq)
+{
+	int i;
+	uint32_t blk, sec;
+	struct vhd_bitmap *bm;
+	struct vhd_request *req;
+
+	blk = treq.sec / s->spb;
+	sec = treq.sec % s->spb;
+	bm  = get_bitmap(s, blk);
+
+	ASSERT(bm && bitmap_valid(bm));
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	/* nothing to do but update the bitmap */
+	req->treq  = treq;
+	req->flags = VHD_FLAG_REQ_FINISHED;
+	req->op    = VHD_OP_DATA_DISCARD;
+	req->next  = NULL;
+
+	/* writes must not bypass the bitmap from here on */
+	clear_batmap(s, blk);
+	lock_bitmap(bm);
+	s->discards++;
+
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+		return 0;
+	}
+
+	add_to_transaction(&bm->tx, req);
+	bm->tx.finished++;
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_DISCARD);
+	for (i = 0; i < treq.secs; i++)
+		vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
+	    "nr_secs: 0x%04x\n", s->vhd.file, treq.sec, blk, sec, treq.secs);
+
+	if (transaction_completed(&bm->tx))
+		finish_data_transaction(s, bm);
+
+	return 0;
+}
+
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	/* in fixed disks, there is nothing to give back */
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	while (treq.secs) {
+		int err;
+		uint32_t blk;
+		td_request_t clone;
+		struct vhd_bitmap *bm;
+
+		err        = 0;
+		clone      = treq;
+		blk        = clone.sec / s->spb;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+
+		if (blk >= s->bat.bat.entries) {
+			err = -EINVAL;
+			goto fail;
+		}
+
+		bm = get_bitmap(s, blk);
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED ||
+		    bat_reclaiming(s, blk)) {
+			/* not allocated in this image */
+			td_complete_request(clone, 0);
+		} else if (!bm) {
+			err = schedule_bitmap_read(s, blk);
+			if (err)
+				goto fail;
+
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
+			if (err)
+				goto fail;
+		} else if (!bitmap_valid(bm)) {
+			err = __vhd_queue_request(s, VHD_OP_DATA_DISCARD, clone);
+			if (err)
+				goto fail;
+		} else {
+			err = schedule_data_discard(s, clone);
+			if (err)
+				goto fail;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		continue;
+
+	fail:
+		clone.secs = treq.secs;
+		td_complete_request(clone, err);
+		break;
+	}
+}
+
+/*
+ * Writes are only completed once their bitmap and BAT updates are on disk,
+ * so syncing the file covers them. Still, a flush waits for the metadata
+ * writes in flight when it arrived, so that it never races them.
+ */
+static uint64_t
+vhd_oldest_meta_write(struct vhd_state *s)
+{
+	if (list_empty(&s->meta_pending))
+		return UINT64_MAX;
+
+	return list_first_entry(&s->meta_pending,
+				struct vhd_request, meta)->seqno;
+}
+
+static void
+vhd_kick_flushes(struct vhd_state *s)
+{
+	uint64_t oldest;
+	struct vhd_request *req;
+
+	oldest = vhd_oldest_meta_write(s);
+
+	while ((req = s->flush_queue.head) && req->seqno < oldest) {
+		remove_from_req_list(&s->flush_queue, req);
+		req->next = NULL;
+
+		td_prep_fdsync(&req->tiocb, s->vhd.fd, vhd_complete, req);
+		td_queue_tiocb(s->driver, &req->tiocb);
+
+		s->queued++;
+		TRACE(s);
+	}
+}
+
+static void
+vhd_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_request *req;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: flush\n", s->vhd.file);
+
+	req = alloc_vhd_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq  = treq;
+	req->op    = VHD_OP_FLUSH;
+	req->seqno = s->meta_seqno;
+	req->next  = NULL;
+
+	add_to_tail(&s->flush_queue, req);
+	s->flushes++;
+
+	vhd_kick_flushes(s);
+}
+
+static void
+return_request(struct vhd_state *s, struct vhd_request *r, int err)
+{
+	td_complete_request(r->treq, err);
+	DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
+	    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
+	free_vhd_request(s, r);
+
+	s->returned++;
+	TRACE(s);
+}
+
+static void
+vhd_decrypt_work(td_offload_job_t *job)
+{
+	struct vhd_request *r;
+	struct vhd_state *s;
+
+	r = container_of(job, struct vhd_request, crypto_job);
+	s = r->state;
+
+	r->error = crypto_interface->vhd_crypto_decrypt(&s->vhd, &r->treq);
+}
+
+static void
+vhd_decrypt_done(td_offload_job_t *job)
+{
+	struct vhd_request *r;
+
+	r = container_of(job, struct vhd_request, crypto_job);
+	return_request(r->state, r, r->error);
+}
+
+/*
+ * Decrypts a completed read. Returns 1 if the request was handed to
+ * the offload pool, which will return it; otherwise it was decrypted
+ * in place, with the outcome in r->error.
+ */
+static int
+vhd_decrypt_read(struct vhd_request *r)
+{
+	r->crypto_job.work = vhd_decrypt_work;
+	r->crypto_job.done = vhd_decrypt_done;
+
+	if (!tapdisk_offload_submit(&r->crypto_job))
+		return 1;
+
+	vhd_decrypt_work(&r->crypto_job);
+	return 0;
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2132,8 +2974,14 @@ signal_completion(struct vhd_request *list, int error)
 		if (vhd_is_encrypted(s)) {
 			switch (r->op) {
 			case VHD_OP_DATA_READ:
-				crypto_interface->vhd_crypto_decrypt(
-					&s->vhd, &r->treq);
+				if (err)
+					break;
+				r->error = 0;
+				if (vhd_decrypt_read(r)) {
+					r = next;
+					continue;
+				}
+				err = r->error;
 				break;
 			case VHD_OP_DATA_WRITE:
 				free(r->treq.buf);
@@ -2141,14 +2989,8 @@ signal_completion(struct vhd_request *list, int error)
 				break;
 			}
 		}
-		td_complete_request(r->treq, err);
-		DBG(TLOG_DBG, "lsec: 0x%08"PRIx64", blk: 0x%04"PRIx64", "
-		    "err: %d\n", r->treq.sec, r->treq.sec / s->spb, err);
-		free_vhd_request(s, r);
+		return_request(s, r, err);
 		r    = next;
-
-		s->returned++;
-		TRACE(s);
 	}
 }
 
@@ -2179,7 +3021,13 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
+			if (r->op == VHD_OP_DATA_DISCARD) {
+				uint32_t sec = r->treq.sec % s->spb;
+				set_vhd_flag(tx->status, VHD_FLAG_TX_DISCARD);
+				for (i = 0; i < r->treq.secs; i++)
+					vhd_bitmap_clear(&s->vhd,
+							 bm->shadow, sec + i);
+			} else if (!r->error) {
 				uint32_t sec = r->treq.sec % s->spb;
 				for (i = 0; i < r->treq.secs; i++)
 					vhd_bitmap_set(&s->vhd,
@@ -2198,46 +3046,59 @@ static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
+	struct vhd_bat_alloc *alloc;
 
-	if (!bat_locked(s))
+	alloc = bat_alloc(s, bm->blk);
+	if (!alloc)
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_RECLAIM))
 		return;
 
-	if (!s->bat.req.error)
-		goto release;
+	/* bat update not done yet */
+	if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_ZEROING)       ||
+	    test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_QUEUED)  ||
+	    test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
 
-	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+	if (!alloc->req.error)
 		goto release;
 
+	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE)) {
+		unreserve_new_block(s, alloc);
+		return;
+	}
+
 	tx->closed = 1;
 	return;
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	unlock_bat(s, alloc);
 }
 
 static void
 finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
 {
-	int map_size;
+	int map_size, reclaim;
 	struct vhd_transaction *tx = &bm->tx;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", bm->blk, error);
+	reclaim   = 0;
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
 	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
 			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
+			struct vhd_bat_alloc *alloc = bat_alloc(s, bm->blk);
+			ASSERT(alloc);
+			ASSERT(test_vhd_flag(alloc->status,
+					     VHD_FLAG_BAT_WRITE_QUEUED) ||
+			       test_vhd_flag(alloc->status,
 					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
+			alloc->tx = tx;
 			return;
 		}
 	}
@@ -2250,6 +3111,8 @@ finish_bitmap_transaction(struct vhd_state *s,
 		memcpy(bm->map, bm->shadow, map_size);
 		if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
 			set_batmap(s, bm->blk);
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_DISCARD))
+			reclaim = bitmap_empty(s, bm);
 	}
 
 	/* transaction done; signal completions */
@@ -2261,6 +3124,9 @@ finish_bitmap_transaction(struct vhd_state *s,
 		unlock_bitmap(bm);
 
 	finish_bat_transaction(s, bm);
+
+	if (reclaim && !bitmap_in_use(bm))
+		schedule_bat_reclaim(s, bm);
 }
 
 static void
@@ -2279,80 +3145,262 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 }
 
 static void
-finish_bat_write(struct vhd_request *req)
+vhd_account_alloc(struct vhd_state *s, struct vhd_bat_alloc *alloc)
+{
+	struct timeval now, delta;
+	uint64_t usecs;
+
+	gettimeofday(&now, NULL);
+	TV_SUB(now, alloc->start, delta);
+	usecs = delta.tv_sec * 1000000ULL + delta.tv_usec;
+
+	s->allocs++;
+	s->alloc_usecs += usecs;
+	if (usecs > s->alloc_max_usecs)
+		s->alloc_max_usecs = usecs;
+}
+
+static void
+finish_bat_update(struct vhd_state *s, struct vhd_bat_alloc *alloc)
 {
+	int error;
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx;
-	struct vhd_state *s = req->state;
-
-	s->returned++;
-	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	bm    = get_bitmap(s, alloc->blk);
+	error = alloc->req.error;
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
+	DBG(TLOG_DBG, "blk 0x%04x, offset: 0x%08"PRIx64", err %d\n",
+	    alloc->blk, alloc->offset, error);
 	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
 	tx = &bm->tx;
 	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
+	if (!error) {
+		bat_entry(s, alloc->blk) = alloc->offset;
+		vhd_account_alloc(s, alloc);
 	} else
-		tx->error = req->error;
+		tx->error = error;
 
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
+		remove_from_req_list(&tx->requests, &alloc->req);
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
 	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+		if (alloc->tx)
+			finish_bitmap_transaction(s, bm, error);
 	}
 
 	finish_bat_transaction(s, bm);
 }
 
+static void
+finish_bat_reclaim(struct vhd_state *s, struct vhd_bat_alloc *alloc)
+{
+	int error;
+	uint32_t blk;
+	uint64_t offset;
+	struct vhd_bitmap *bm;
+
+	blk   = alloc->blk;
+	bm    = get_bitmap(s, blk);
+	error = alloc->req.error;
+
+	DBG(TLOG_DBG, "blk 0x%04x, err %d\n", blk, error);
+	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+
+	if (!error) {
+		offset = bat_entry(s, blk);
+		bat_entry(s, blk) = DD_BLK_UNUSED;
+		s->reclaimed++;
+
+		/* best effort: the block is gone from the BAT either way */
+		if (fallocate(s->vhd.fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      vhd_sectors_to_bytes(offset),
+			      vhd_sectors_to_bytes(s->bm_secs + s->spb)))
+			DBG(TLOG_INFO, "blk 0x%04x, punching hole failed: %d\n",
+			    blk, -errno);
+	}
+
+	unlock_bat(s, alloc);
+
+	unlock_bitmap(bm);
+	if (!error && !bitmap_in_use(bm))
+		free_vhd_bitmap(s, bm);
+}
+
+/*
+ * Reclaims deferred for want of a BAT slot. A block which was written
+ * to, or is busy, in the meantime is left alone; one whose bitmap was
+ * evicted can't be checked any more, and is counted as skipped.
+ */
+static void
+retry_bat_reclaims(struct vhd_state *s)
+{
+	int i, n;
+	uint32_t blk;
+	struct vhd_bitmap *bm;
+
+	n = s->bat.nr_reclaims;
+	s->bat.nr_reclaims = 0;
+
+	for (i = 0; i < n; i++) {
+		blk = s->bat.reclaims[i];
+		bm  = get_bitmap(s, blk);
+
+		if (!bm || !bitmap_valid(bm)) {
+			s->reclaim_skipped++;
+			continue;
+		}
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED || bat_alloc(s, blk) ||
+		    bitmap_locked(bm) || bitmap_in_use(bm) ||
+		    !bitmap_empty(s, bm))
+			continue;
+
+		s->reclaim_retries++;
+		schedule_bat_reclaim(s, bm);
+	}
+}
+
+static void
+finish_bat_write(struct vhd_request *req)
+{
+	int i;
+	struct vhd_bat_alloc *alloc;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	DBG(TLOG_DBG, "bat secs: %u, err %d\n", req->treq.secs, req->error);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	finish_meta_write(s, req);
+
+	/*
+	 * Completions below may queue more updates. They go out with the
+	 * next batch, once all of this one is done.
+	 */
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = &s->bat.allocs[i];
+		if (!test_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_STARTED))
+			continue;
+
+		clear_vhd_flag(alloc->status, VHD_FLAG_BAT_WRITE_STARTED);
+		alloc->req.error = req->error;
+
+		if (test_vhd_flag(alloc->status, VHD_FLAG_BAT_RECLAIM))
+			finish_bat_reclaim(s, alloc);
+		else
+			finish_bat_update(s, alloc);
+	}
+
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	retry_bat_reclaims(s);
+	arm_bat_flush(s);
+}
+
+static void
+finish_flush(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+
+	/* kernels before 4.18 can't do fdsync through aio */
+	if (req->error == -EINVAL)
+		req->error = fdatasync(s->vhd.fd) ? -errno : 0;
+
+	signal_completion(req, 0);
+}
+
 static void
 finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	blk = req->treq.sec / s->spb;
-	bm  = get_bitmap(s, blk);
+	blk   = req->treq.sec / s->spb;
+	bm    = get_bitmap(s, blk);
+	alloc = bat_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(alloc);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		unlock_bat(s, alloc);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
 	} else
-		schedule_bat_write(s);
+		queue_bat_write(s, alloc);
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
 }
 
+static void
+finish_zero_block_write(struct vhd_request *req)
+{
+	uint32_t blk;
+	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
+	struct vhd_request *r, *next;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	blk   = req->treq.sec / s->spb;
+	bm    = get_bitmap(s, blk);
+	alloc = bat_alloc(s, blk);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", blk, req->error);
+	ASSERT(alloc && test_vhd_flag(alloc->status, VHD_FLAG_BAT_ZEROING));
+	ASSERT(bm && bitmap_locked(bm) &&
+	       test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING));
+
+	r = bm->waiting.head;
+	clear_req_list(&bm->waiting);
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_ALLOC_PENDING);
+	clear_vhd_flag(alloc->status, VHD_FLAG_BAT_ZEROING);
+
+	if (req->error) {
+		unreserve_new_block(s, alloc);
+		unlock_bitmap(bm);
+		free_vhd_bitmap(s, bm);
+		return signal_completion(r, req->error);
+	}
+
+	add_to_transaction(&bm->tx, &alloc->req);
+	queue_bat_write(s, alloc);
+
+	/* the block is ready: resubmit the writes parked on it */
+	while (r) {
+		struct vhd_request tmp;
+
+		tmp  = *r;
+		next =  r->next;
+		free_vhd_request(s, r);
+
+		ASSERT(tmp.op == VHD_OP_DATA_WRITE);
+		vhd_queue_write(s->driver, tmp.treq);
+
+		r = next;
+	}
+}
+
 static int
 finish_redundant_bm_write(struct vhd_request *req)
 {
@@ -2405,12 +3453,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_DATA_DISCARD);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else if (tmp.op == VHD_OP_DATA_DISCARD)
+				vhd_queue_discard(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2447,6 +3498,7 @@ finish_bitmap_write(struct vhd_request *req)
 	ASSERT(test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	clear_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+	finish_meta_write(s, req);
 
 	finish_bitmap_transaction(s, bm, req->error);
 }
@@ -2541,6 +3593,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_zero_bm_write(req);
 		break;
 
+	case VHD_OP_ZERO_BLOCK_WRITE:
+		finish_zero_block_write(req);
+		break;
+
 	case VHD_OP_REDUNDANT_BM_WRITE:
 		finish_redundant_bm_write(req);
 		break;
@@ -2549,16 +3605,24 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_FLUSH:
+		finish_flush(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
 	}
+
+	if (s->flush_queue.head)
+		vhd_kick_flushes(s);
 }
 
 void 
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2568,6 +3632,12 @@ vhd_debug(td_driver_t *driver)
 	    s->writes, (s->writes ? ((float)s->write_size / s->writes) : 0.0));
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
+	DBG(TLOG_WARN, "DISCARDS: 0x%08"PRIx64", RECLAIMED: 0x%08"PRIx64", "
+	    "FLUSHES: 0x%08"PRIx64"\n", s->discards, s->reclaimed, s->flushes);
+	DBG(TLOG_WARN, "ALLOCS: 0x%08"PRIx64", AVG_ALLOC_USECS: %f, "
+	    "MAX_ALLOC_USECS: %"PRIu64"\n", s->allocs,
+	    (s->allocs ? ((float)s->alloc_usecs / s->allocs) : 0.0),
+	    s->alloc_max_usecs);
 
 	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%u total)\n", VHD_REQS_DATA);
 	for (i = 0; i < VHD_REQS_DATA; i++) {
@@ -2581,16 +3651,15 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%u total) hits: 0x%08"PRIx64", "
+	    "misses: 0x%08"PRIx64", evictions: 0x%08"PRIx64"\n",
+	    s->bm_cache_size, s->bm_hits, s->bm_misses, s->bm_evictions);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2616,11 +3685,22 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, allocs: %d, writes: 0x%08"PRIx64", "
+	    "updates: 0x%08"PRIx64"\n", s->bat.status, s->bat.nr_allocs,
+	    s->bat_writes, s->bat_updates);
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_bat_alloc *alloc = &s->bat.allocs[i];
+
+		if (!test_vhd_flag(alloc->status, VHD_FLAG_BAT_LOCKED))
+			continue;
+
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, "
+		    "offset: 0x%08"PRIx64", err: %d, tx: %p\n", i, alloc->blk,
+		    alloc->status, alloc->offset, alloc->req.error, alloc->tx);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2628,6 +3708,41 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "size", "lu", (unsigned long)s->bm_cache_size);
+	tapdisk_stats_field(st, "hits", "llu", s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu", s->bm_evictions);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "alloc", "{");
+	tapdisk_stats_field(st, "count", "llu", s->allocs);
+	tapdisk_stats_field(st, "usecs", "llu", s->alloc_usecs);
+	tapdisk_stats_field(st, "max_usecs", "llu", s->alloc_max_usecs);
+	tapdisk_stats_field(st, "pending", "d", s->bat.nr_allocs);
+	tapdisk_stats_field(st, "bat_writes", "llu", s->bat_writes);
+	tapdisk_stats_field(st, "bat_updates", "llu", s->bat_updates);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "discard", "{");
+	tapdisk_stats_field(st, "count", "llu", s->discards);
+	tapdisk_stats_field(st, "reclaimed", "llu", s->reclaimed);
+	tapdisk_stats_field(st, "reclaim_retries", "llu", s->reclaim_retries);
+	tapdisk_stats_field(st, "reclaim_pending", "d", s->bat.nr_reclaims);
+	tapdisk_stats_field(st, "reclaim_skipped", "llu", s->reclaim_skipped);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "zero_writes", "{");
+	tapdisk_stats_field(st, "count", "llu", s->zero_writes);
+	tapdisk_stats_field(st, "bytes", "llu", s->zero_bytes);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2636,7 +3751,11 @@ struct tap_disk tapdisk_vhd = {
 	.td_close           = _vhd_close,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_queue_flush     = vhd_queue_flush,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_block_status    = vhd_block_status,
 };
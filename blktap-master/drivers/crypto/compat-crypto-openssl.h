@@ -11,6 +11,7 @@ struct crypto_blkcipher
 {
 	EVP_CIPHER_CTX de_ctx;
 	EVP_CIPHER_CTX en_ctx;
+	unsigned int generation;
 };
 
 #endif
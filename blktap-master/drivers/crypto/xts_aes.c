@@ -42,9 +42,12 @@ struct crypto_blkcipher * xts_aes_setup(void)
 {
 	struct crypto_blkcipher *ret;
 
+	static unsigned int generation;
+
 	ret = calloc(1, sizeof(struct crypto_blkcipher));
 	if (!ret)
 		return NULL;
+	ret->generation = __sync_add_and_fetch(&generation, 1);
 	return ret;
 }
 
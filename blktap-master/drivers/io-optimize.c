@@ -211,6 +211,11 @@ merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (head->aio_lio_opcode != io->aio_lio_opcode)
 		return -EINVAL;
 
+	/* syncs carry no data to merge */
+	if (io->aio_lio_opcode != IO_CMD_PREAD &&
+	    io->aio_lio_opcode != IO_CMD_PWRITE)
+		return -EINVAL;
+
 	if (!contiguous_iocbs(head, io))
 		return -EINVAL;
 
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the per-iteration cost of scheduler_wait_for_events() with a
+ * large number of armed timers, none of which expire during the run. One
+ * zero-timeout tick event fires on every iteration and re-arms a random
+ * timer, the way ring polling and retry timers churn in tapdisk.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "scheduler.h"
+#include "timeout-math.h"
+
+#define SCHED_BENCH_TIMERS            10000
+#define SCHED_BENCH_ITERATIONS        100000
+
+static event_id_t *timers;
+static int n_timers;
+static unsigned long n_ticks;
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s [-n timers] [-i iterations] [-b epoll|select]\n",
+	       app);
+	exit(err);
+}
+
+static struct timeval
+random_timeout(void)
+{
+	return TV_SECS(60 + rand() % 540);
+}
+
+static void
+timer_cb(event_id_t id, char mode, void *private)
+{
+	fprintf(stderr, "timer %d fired unexpectedly\n", id);
+}
+
+static void
+tick_cb(event_id_t id, char mode, void *private)
+{
+	scheduler_t *s = private;
+	int err;
+
+	n_ticks++;
+
+	err = scheduler_event_set_timeout(s, timers[rand() % n_timers],
+					  random_timeout());
+	if (err) {
+		fprintf(stderr, "set_timeout failed: %s\n", strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static inline double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, i, err, iterations, backend;
+	scheduler_t s;
+	event_id_t tick;
+	double start, elapsed;
+
+	n_timers   = SCHED_BENCH_TIMERS;
+	iterations = SCHED_BENCH_ITERATIONS;
+	backend    = SCHEDULER_BACKEND_EPOLL;
+
+	while ((c = getopt(argc, argv, "n:i:b:h")) != -1) {
+		switch (c) {
+		case 'n':
+			n_timers = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'b':
+			if (!strcmp(optarg, "epoll"))
+				backend = SCHEDULER_BACKEND_EPOLL;
+			else if (!strcmp(optarg, "select"))
+				backend = SCHEDULER_BACKEND_SELECT;
+			else
+				usage(argv[0], EINVAL);
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (n_timers <= 0 || iterations <= 0)
+		usage(argv[0], EINVAL);
+
+	err = scheduler_initialize_backend(&s, backend);
+	if (err) {
+		fprintf(stderr, "scheduler init failed: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	timers = calloc(n_timers, sizeof(event_id_t));
+	if (!timers) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	srand(0);
+
+	start = now_ns();
+	for (i = 0; i < n_timers; i++) {
+		timers[i] = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT,
+						     -1, random_timeout(),
+						     timer_cb, NULL);
+		if (timers[i] < 0) {
+			fprintf(stderr, "register failed: %s\n",
+				strerror(-timers[i]));
+			return EXIT_FAILURE;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("registered %d timers: %.1f ns/timer\n",
+	       n_timers, elapsed / n_timers);
+
+	tick = scheduler_register_event(&s, SCHEDULER_POLL_TIMEOUT, -1,
+					TV_ZERO, tick_cb, &s);
+	if (tick < 0) {
+		fprintf(stderr, "register failed: %s\n", strerror(-tick));
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		err = scheduler_wait_for_events(&s);
+		if (err < 0) {
+			fprintf(stderr, "wait failed: %s\n", strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("%d iterations, %lu ticks: %.1f ns/iteration\n",
+	       iterations, n_ticks, elapsed / iterations);
+
+	start = now_ns();
+	for (i = 0; i < n_timers; i++)
+		scheduler_unregister_event(&s, timers[i]);
+	elapsed = now_ns() - start;
+
+	printf("unregistered %d timers: %.1f ns/timer\n",
+	       n_timers, elapsed / n_timers);
+
+	scheduler_destroy(&s);
+	free(timers);
+
+	return 0;
+}
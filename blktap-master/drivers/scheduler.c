@@ -36,7 +36,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
 
 #include "debug.h"
 #include "tapdisk.h"
@@ -58,12 +61,12 @@
 /**
  * Async-signal safe.
  */
-#define scheduler_for_each_event(s, event)	\
-	list_for_each_entry(event, &(s)->events, next)
-
 #define scheduler_for_each_event_safe(s, event, tmp)	\
 	list_for_each_entry_safe(event, tmp, &(s)->events, next)
 
+#define scheduler_hash(s, id)	\
+	(&(s)->hash[(unsigned int)(id) % SCHEDULER_HASH_SIZE])
+
 typedef struct event {
 	char                         mode;
 	char                         dead;
@@ -81,7 +84,7 @@ typedef struct event {
 	struct timeval               timeout;
 
 	/**
-	 * Expiration date in seconds after Epoch. Once current time
+	 * Expiration date on the CLOCK_MONOTONIC time line. Once current time
 	 * becomes larger than or equal to this value, the event is considered
 	 * expired and can be run. If event.timeout is set to infinity, this member
 	 * should not be used.
@@ -89,186 +92,418 @@ typedef struct event {
 	 */
 	struct timeval               deadline;
 
+	/* index into scheduler.timers, or -1 */
+	int                          heap_idx;
+
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+
+	/* on scheduler.hash */
+	struct list_head             hash;
+
+	/* on scheduler.ready, if pending */
+	struct list_head             ready;
+
+	/* on scheduler_fd.events, if mode has any SCHEDULER_POLL_FD bit */
+	struct list_head             fd_entry;
 } event_t;
 
+/*
+ * All events registered on the same file descriptor. The backend only
+ * ever sees the union of the modes of the live, unmasked events.
+ */
+struct scheduler_fd {
+	int                          fd;
+	char                         mode;
+	struct list_head             events;
+
+	/* on select_backend_data.fds */
+	struct list_head             next;
+};
+
+/*
+ * Deadlines are kept on the monotonic clock, so wall clock steps neither
+ * fire timers early nor stall them.
+ */
+static inline void
+scheduler_gettime(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec  = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static inline void
+scheduler_heap_set(scheduler_t *s, int idx, event_t *event)
+{
+	s->timers[idx]  = event;
+	event->heap_idx = idx;
+}
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_heap_sift_up(scheduler_t *s, int idx)
 {
-	struct timeval diff;
-	struct timeval now;
-	event_t *event;
+	event_t *event = s->timers[idx];
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
 
-	s->max_fd  = -1;
-	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+		if (!TV_BEFORE(event->deadline, s->timers[parent]->deadline))
+			break;
 
-	gettimeofday(&now, NULL);
+		scheduler_heap_set(s, idx, s->timers[parent]);
+		idx = parent;
+	}
 
-	scheduler_for_each_event(s, event) {
-		if (event->masked || event->dead)
-			continue;
+	scheduler_heap_set(s, idx, event);
+}
 
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+static void
+scheduler_heap_sift_down(scheduler_t *s, int idx)
+{
+	event_t *event = s->timers[idx];
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	for (;;) {
+		int child = 2 * idx + 1;
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		if (child >= s->n_timers)
+			break;
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT
-				&& !TV_IS_INF(event->timeout)) {
-			TV_SUB(event->deadline, now, diff);
-			if (TV_AFTER(diff, TV_ZERO))
-				s->timeout = TV_MIN(s->timeout, diff);
-			else
-				s->timeout = TV_ZERO;
-		}
+		if (child + 1 < s->n_timers &&
+		    TV_BEFORE(s->timers[child + 1]->deadline,
+			      s->timers[child]->deadline))
+			child++;
+
+		if (!TV_BEFORE(s->timers[child]->deadline, event->deadline))
+			break;
+
+		scheduler_heap_set(s, idx, s->timers[child]);
+		idx = child;
 	}
 
-	s->timeout = TV_MIN(s->timeout, s->max_timeout);
+	scheduler_heap_set(s, idx, event);
+}
+
+static int
+scheduler_heap_insert(scheduler_t *s, event_t *event)
+{
+	if (s->n_timers == s->max_timers) {
+		event_t **timers;
+		int n = MAX(s->max_timers * 2, 64);
+
+		timers = realloc(s->timers, n * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers     = timers;
+		s->max_timers = n;
+	}
+
+	scheduler_heap_set(s, s->n_timers++, event);
+	scheduler_heap_sift_up(s, event->heap_idx);
+
+	return 0;
+}
+
+static void
+scheduler_heap_remove(scheduler_t *s, event_t *event)
+{
+	int idx = event->heap_idx;
+	event_t *last;
+
+	ASSERT(idx >= 0 && idx < s->n_timers && s->timers[idx] == event);
+
+	event->heap_idx = -1;
+	last = s->timers[--s->n_timers];
+	if (last == event)
+		return;
+
+	scheduler_heap_set(s, idx, last);
+	if (idx > 0 && TV_BEFORE(last->deadline,
+				 s->timers[(idx - 1) / 2]->deadline))
+		scheduler_heap_sift_up(s, idx);
+	else
+		scheduler_heap_sift_down(s, idx);
+}
+
+static inline event_t *
+scheduler_heap_top(scheduler_t *s)
+{
+	return s->n_timers ? s->timers[0] : NULL;
+}
+
+/**
+ * Puts the event on the timer heap, or takes it off, according to its
+ * current state. Must be called whenever the deadline, the mask or the
+ * liveness of a timer event changes.
+ */
+static int
+scheduler_timer_update(scheduler_t *s, event_t *event)
+{
+	if (event->heap_idx >= 0)
+		scheduler_heap_remove(s, event);
+
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return 0;
+
+	if (event->dead || event->masked || event->pending)
+		return 0;
+
+	if (TV_IS_INF(event->timeout))
+		return 0;
+
+	return scheduler_heap_insert(s, event);
+}
+
+static void
+scheduler_timer_set_deadline(scheduler_t *s, event_t *event)
+{
+	if (TV_IS_INF(event->timeout))
+		/* initialise it to something meaningful */
+		event->deadline = TV_INF;
+	else {
+		struct timeval now;
+		scheduler_gettime(&now);
+		TV_ADD(now, event->timeout, event->deadline);
+	}
+
+	/* a failed insert only loses the wakeup, not the event */
+	if (scheduler_timer_update(s, event))
+		EPRINTF("failed to arm timer %d\n", event->id);
+}
+
+static inline void
+scheduler_event_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	if (!event->pending)
+		list_add_tail(&event->ready, &s->ready);
+
+	event->pending |= mode;
+
+	if (event->heap_idx >= 0)
+		scheduler_heap_remove(s, event);
 }
 
+static inline void
+scheduler_event_clear_pending(event_t *event)
+{
+	if (event->pending) {
+		list_del_init(&event->ready);
+		event->pending = 0;
+	}
+}
+
+/**
+ * Called by the backends for each fd found ready, @mode being a mask of
+ * SCHEDULER_POLL_*_FD. Returns the number of events made runnable.
+ */
 static int
-scheduler_check_fd_events(scheduler_t *s, int nfds)
+scheduler_fd_ready(scheduler_t *s, struct scheduler_fd *sfd, char mode)
 {
 	event_t *event;
+	int n = 0;
 
-	scheduler_for_each_event(s, event) {
-		if (!nfds)
-			break;
+	list_for_each_entry(event, &sfd->events, fd_entry) {
+		char pending;
 
-		if (event->dead)
+		if (event->dead || event->masked)
 			continue;
 
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
-			--nfds;
+		pending = event->mode & mode & SCHEDULER_POLL_FD;
+		if (pending) {
+			scheduler_event_set_pending(s, event, pending);
+			n++;
 		}
+	}
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
-			--nfds;
-		}
+	return n;
+}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
-			--nfds;
-		}
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	if (fd < 0 || fd >= s->n_fds)
+		return NULL;
+
+	return s->fds[fd];
+}
+
+static struct scheduler_fd *
+scheduler_alloc_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd;
+
+	if (fd >= s->n_fds) {
+		struct scheduler_fd **fds;
+		int n = MAX(s->n_fds * 2, 64);
+
+		while (n <= fd)
+			n *= 2;
+
+		fds = realloc(s->fds, n * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->n_fds, 0, (n - s->n_fds) * sizeof(*fds));
+		s->fds   = fds;
+		s->n_fds = n;
 	}
 
-	return nfds;
+	sfd = s->fds[fd];
+	if (sfd)
+		return sfd;
+
+	sfd = calloc(1, sizeof(*sfd));
+	if (!sfd)
+		return NULL;
+
+	sfd->fd = fd;
+	INIT_LIST_HEAD(&sfd->events);
+	INIT_LIST_HEAD(&sfd->next);
+	s->fds[fd] = sfd;
+
+	return sfd;
 }
 
 /**
- * Checks all scheduler events whose mode is set to SCHEDULER_POLL_TIMEOUT
- * whether their time out has elapsed, and if so it makes them runnable.
+ * Recomputes the interest set of @sfd and pushes it to the backend. The fd
+ * is forgotten once no events are left on it.
  */
-static void
-scheduler_check_timeouts(scheduler_t *s)
+static int
+scheduler_update_fd(scheduler_t *s, struct scheduler_fd *sfd)
 {
-	struct timeval now;
+	char old_mode = sfd->mode;
 	event_t *event;
+	int err = 0;
 
-	gettimeofday(&now, NULL);
+	sfd->mode = 0;
+	list_for_each_entry(event, &sfd->events, fd_entry)
+		if (!event->dead && !event->masked)
+			sfd->mode |= event->mode & SCHEDULER_POLL_FD;
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
+	if (sfd->mode != old_mode)
+		err = s->backend->sb_update(s, sfd, old_mode);
 
-		if (event->dead)
-			continue;
+	if (list_empty(&sfd->events)) {
+		s->fds[sfd->fd] = NULL;
+		free(sfd);
+	}
 
-		if (event->pending)
-			continue;
+	return err;
+}
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
+static void
+scheduler_prepare_timeout(scheduler_t *s)
+{
+	struct timeval diff;
+	struct timeval now;
+	event_t *event;
 
-		if (TV_IS_INF(event->timeout))
-			continue;
+	s->timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 
-		if (TV_BEFORE(now, event->deadline))
-			continue;
+	if (!list_empty(&s->ready)) {
+		s->timeout = TV_ZERO;
+		return;
+	}
+
+	event = scheduler_heap_top(s);
+	if (event) {
+		scheduler_gettime(&now);
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+		TV_SUB(event->deadline, now, diff);
+		if (TV_AFTER(diff, TV_ZERO))
+			s->timeout = TV_MIN(s->timeout, diff);
+		else
+			s->timeout = TV_ZERO;
 	}
+
+	s->timeout = TV_MIN(s->timeout, s->max_timeout);
 }
 
-static int
-scheduler_check_events(scheduler_t *s, int nfds)
+/**
+ * Makes all timers whose deadline has elapsed runnable. They are taken off
+ * the heap until their callback has run and re-armed them.
+ */
+static void
+scheduler_check_timeouts(scheduler_t *s)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	struct timeval now;
+	event_t *event;
 
-	scheduler_check_timeouts(s);
+	if (!s->n_timers)
+		return;
+
+	scheduler_gettime(&now);
 
-	return nfds;
+	while ((event = scheduler_heap_top(s))) {
+		if (TV_BEFORE(now, event->deadline))
+			break;
+
+		BUG_ON(event->masked || event->dead);
+
+		scheduler_heap_remove(s, event);
+		scheduler_event_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
+	}
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
-	if (event->mode & SCHEDULER_POLL_TIMEOUT
-			&& !TV_IS_INF(event->timeout)) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		TV_ADD(now, event->timeout, event->deadline);
-	}
+	if (event->mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_timer_set_deadline(s, event);
 
 	if (!event->masked)
 		event->cb(event->id, mode, event->private);
 }
 
+/*
+ * Events are taken off the ready list before their callback runs, so a
+ * recursive scheduler_wait_for_events continues with whatever is left.
+ */
 static int
 scheduler_run_events(scheduler_t *s)
 {
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	while (!list_empty(&s->ready)) {
 		char pending;
 
+		event = list_first_entry(&s->ready, event_t, ready);
+
+		/* NB. must clear before cb */
+		pending = event->pending;
+		scheduler_event_clear_pending(event);
+
 		if (event->dead)
 			continue;
 
-		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
 }
 
+static event_t *
+scheduler_find_event(scheduler_t *s, event_id_t id)
+{
+	event_t *event;
+
+	list_for_each_entry(event, scheduler_hash(s, id), hash)
+		if (event->id == id)
+			return event;
+
+	return NULL;
+}
+
 int
 scheduler_get_event_uuid(scheduler_t *s) {
 
-	int uuid_found;
-	event_t *event;
-
         if(unlikely(s->uuid < 0)) {
 		EPRINTF("scheduler uuid overflow detected");
                 s->uuid = 1;
@@ -276,19 +511,11 @@ scheduler_get_event_uuid(scheduler_t *s) {
         }
 
         if(unlikely(s->uuid_overflow == 1)) {
-                do {
-                        uuid_found = 1;
-                        scheduler_for_each_event(s, event) {
-                                if(event->id == s->uuid) {
-                                        uuid_found = 0;
-                                        s->uuid++;
-					if(s->uuid < 0)
-						s->uuid = 1;
-                                        break;
-                                }
-                        }
-
-                } while(!uuid_found);
+		while (scheduler_find_event(s, s->uuid)) {
+			s->uuid++;
+			if(s->uuid < 0)
+				s->uuid = 1;
+		}
         }
 	
 	return s->uuid++;
@@ -298,8 +525,9 @@ int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 struct timeval timeout, event_cb_t cb, void *private)
 {
+	struct scheduler_fd *sfd = NULL;
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -307,60 +535,124 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
-	event = calloc(1, sizeof(event_t));
-	if (!event)
-		return -ENOMEM;
+	if (mode & SCHEDULER_POLL_FD) {
+		if (fd < 0)
+			return -EBADF;
 
-	gettimeofday(&now, NULL);
+		sfd = scheduler_alloc_fd(s, fd);
+		if (!sfd)
+			return -ENOMEM;
+	}
+
+	event = calloc(1, sizeof(event_t));
+	if (!event) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->hash);
+	INIT_LIST_HEAD(&event->ready);
+	INIT_LIST_HEAD(&event->fd_entry);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	if (TV_IS_INF(event->timeout))
-		/* initialise it to something meaningful */
-		event->deadline = TV_INF;
-	else
-		TV_ADD(now, timeout, event->deadline);
+	event->heap_idx = -1;
 	event->cb       = cb;
 	event->private  = private;
 	event->id       = scheduler_get_event_uuid(s);
 	event->masked   = 0;
 
+	if (sfd) {
+		list_add_tail(&event->fd_entry, &sfd->events);
+		err = scheduler_update_fd(s, sfd);
+		if (err) {
+			list_del_init(&event->fd_entry);
+			free(event);
+			goto fail;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		scheduler_timer_set_deadline(s, event);
+		if (!TV_IS_INF(timeout) && event->heap_idx < 0) {
+			err = -ENOMEM;
+			goto fail_timer;
+		}
+	}
+
+	list_add_tail(&event->hash, scheduler_hash(s, event->id));
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
+
+fail_timer:
+	if (sfd)
+		list_del_init(&event->fd_entry);
+	free(event);
+fail:
+	if (sfd)
+		scheduler_update_fd(s, sfd);
+	return err;
 }
 
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
+	struct scheduler_fd *sfd;
 	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event || event->dead)
+		return;
+
+	event->dead = 1;
+	list_move_tail(&event->next, &s->dead);
+	scheduler_event_clear_pending(event);
+	scheduler_timer_update(s, event);
+
+	/* NB. the event itself stays around until scheduler_gc_events */
+	if (!list_empty(&event->fd_entry)) {
+		list_del_init(&event->fd_entry);
+		sfd = scheduler_get_fd(s, event->fd);
+		ASSERT(sfd);
+		scheduler_update_fd(s, sfd);
+	}
 }
 
 void
 scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 {
+	struct scheduler_fd *sfd;
 	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
-		}
+	event = scheduler_find_event(s, id);
+	if (!event)
+		return;
+
+	if (event->masked == !!masked)
+		return;
+
+	event->masked = !!masked;
+
+	if (event->dead)
+		return;
+
+	scheduler_timer_update(s, event);
+
+	if (list_empty(&event->fd_entry))
+		return;
+
+	sfd = scheduler_get_fd(s, event->fd);
+	ASSERT(sfd);
+	scheduler_update_fd(s, sfd);
 }
 
 static void
@@ -368,11 +660,11 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
-	scheduler_for_each_event_safe(s, event, next)
-		if (event->dead) {
-			list_del(&event->next);
-			free(event);
-		}
+	list_for_each_entry_safe(event, next, &s->dead, next) {
+		list_del(&event->next);
+		list_del(&event->hash);
+		free(event);
+	}
 }
 
 void
@@ -397,29 +689,23 @@ scheduler_wait_for_events(scheduler_t *s)
 		 * progress. */
 		goto out;
 
-	scheduler_prepare_events(s);
+	scheduler_prepare_timeout(s);
 
 	tv = s->timeout;
 
 	DBG("timeout: %ld.%ld, max_timeout: %ld.%ld\n",
 	    s->timeout.tv_sec, s->timeout.tv_usec, s->max_timeout.tv_sec, s->max_timeout.tv_usec);
 
-    do {
-    	ret = select(s->max_fd + 1, &s->read_fds, &s->write_fds,
-                &s->except_fds, &tv);
-        if (ret < 0) {
-            ret = -errno;
-            ASSERT(ret);
-        }
-    } while (ret == -EINTR);
+	do {
+		ret = s->backend->sb_wait(s, &tv);
+	} while (ret == -EINTR);
 
-    if (ret < 0) {
-        EPRINTF("select failed: %s\n", strerror(-ret));
-        goto out;
-    }
+	if (ret < 0) {
+		EPRINTF("%s failed: %s\n", s->backend->name, strerror(-ret));
+		goto out;
+	}
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_timeouts(s);
 
 	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
@@ -435,20 +721,356 @@ out:
 	return ret;
 }
 
-void
-scheduler_initialize(scheduler_t *s)
+/*
+ * select(2). Rebuilds the fd sets from the registered fds on every wait,
+ * which is O(fds) and bounded by FD_SETSIZE.
+ */
+
+struct select_backend_data {
+	fd_set                       read_fds;
+	fd_set                       write_fds;
+	fd_set                       except_fds;
+
+	struct list_head             fds;
+};
+
+static int
+scheduler_select_setup(scheduler_t *s)
+{
+	struct select_backend_data *data = s->backend_data;
+
+	INIT_LIST_HEAD(&data->fds);
+
+	return 0;
+}
+
+static int
+scheduler_select_update(scheduler_t *s, struct scheduler_fd *sfd,
+			char old_mode)
+{
+	struct select_backend_data *data = s->backend_data;
+
+	if (sfd->mode && sfd->fd >= FD_SETSIZE)
+		return -EMFILE;
+
+	if (!sfd->mode)
+		list_del_init(&sfd->next);
+	else if (!old_mode)
+		list_add_tail(&sfd->next, &data->fds);
+
+	return 0;
+}
+
+static int
+scheduler_select_wait(scheduler_t *s, struct timeval *tv)
 {
+	struct select_backend_data *data = s->backend_data;
+	struct scheduler_fd *sfd;
+	int ret, max_fd = -1;
+
+	FD_ZERO(&data->read_fds);
+	FD_ZERO(&data->write_fds);
+	FD_ZERO(&data->except_fds);
+
+	list_for_each_entry(sfd, &data->fds, next) {
+		if (sfd->mode & SCHEDULER_POLL_READ_FD)
+			FD_SET(sfd->fd, &data->read_fds);
+		if (sfd->mode & SCHEDULER_POLL_WRITE_FD)
+			FD_SET(sfd->fd, &data->write_fds);
+		if (sfd->mode & SCHEDULER_POLL_EXCEPT_FD)
+			FD_SET(sfd->fd, &data->except_fds);
+		max_fd = MAX(sfd->fd, max_fd);
+	}
+
+	ret = select(max_fd + 1, &data->read_fds, &data->write_fds,
+		     &data->except_fds, tv);
+	if (ret < 0)
+		return -errno;
+
+	list_for_each_entry(sfd, &data->fds, next) {
+		char mode = 0;
+
+		if (!ret)
+			break;
+
+		if (FD_ISSET(sfd->fd, &data->read_fds))
+			mode |= SCHEDULER_POLL_READ_FD;
+		if (FD_ISSET(sfd->fd, &data->write_fds))
+			mode |= SCHEDULER_POLL_WRITE_FD;
+		if (FD_ISSET(sfd->fd, &data->except_fds))
+			mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+		if (mode) {
+			scheduler_fd_ready(s, sfd, mode);
+			ret--;
+		}
+	}
+
+	return 0;
+}
+
+static const struct scheduler_backend scheduler_backend_select = {
+	.name        = "select",
+	.data_size   = sizeof(struct select_backend_data),
+	.sb_setup    = scheduler_select_setup,
+	.sb_update   = scheduler_select_update,
+	.sb_wait     = scheduler_select_wait,
+};
+
+/*
+ * epoll(7). Fds stay registered with the kernel across iterations and
+ * only the ready ones are returned, so a wait costs O(ready fds).
+ * Registrations are level-triggered, matching select(2) semantics.
+ */
+
+#define SCHEDULER_EPOLL_EVENTS       256
+
+struct epoll_backend_data {
+	int                          epfd;
+	struct epoll_event           events[SCHEDULER_EPOLL_EVENTS];
+};
+
+static int
+scheduler_epoll_setup(scheduler_t *s)
+{
+	struct epoll_backend_data *data = s->backend_data;
+
+	data->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (data->epfd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void
+scheduler_epoll_destroy(scheduler_t *s)
+{
+	struct epoll_backend_data *data = s->backend_data;
+
+	if (data->epfd >= 0) {
+		close(data->epfd);
+		data->epfd = -1;
+	}
+}
+
+static inline uint32_t
+scheduler_epoll_mode(char mode)
+{
+	uint32_t events = 0;
+
+	if (mode & SCHEDULER_POLL_READ_FD)
+		events |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		events |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		events |= EPOLLPRI;
+
+	return events;
+}
+
+static int
+scheduler_epoll_update(scheduler_t *s, struct scheduler_fd *sfd,
+		       char old_mode)
+{
+	struct epoll_backend_data *data = s->backend_data;
+	struct epoll_event ev;
+	int op, err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = scheduler_epoll_mode(sfd->mode);
+	ev.data.ptr = sfd;
+
+	if (!sfd->mode)
+		op = EPOLL_CTL_DEL;
+	else if (!old_mode)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	err = epoll_ctl(data->epfd, op, sfd->fd, &ev);
+	if (!err)
+		return 0;
+
+	err = -errno;
+
+	/*
+	 * The kernel drops a registration once the file is closed, which
+	 * callers are free to do before unregistering the event. The fd
+	 * number may even have been reused in the meantime.
+	 */
+	switch (op) {
+	case EPOLL_CTL_DEL:
+		if (err == -EBADF || err == -ENOENT)
+			err = 0;
+		break;
+	case EPOLL_CTL_MOD:
+		if (err == -ENOENT)
+			err = epoll_ctl(data->epfd, EPOLL_CTL_ADD, sfd->fd, &ev)
+				? -errno : 0;
+		break;
+	case EPOLL_CTL_ADD:
+		if (err == -EEXIST)
+			err = epoll_ctl(data->epfd, EPOLL_CTL_MOD, sfd->fd, &ev)
+				? -errno : 0;
+		break;
+	}
+
+	if (err)
+		EPRINTF("epoll_ctl(%d, fd %d, 0x%x) failed: %s\n",
+			op, sfd->fd, ev.events, strerror(-err));
+
+	return err;
+}
+
+static int
+scheduler_epoll_wait(scheduler_t *s, struct timeval *tv)
+{
+	struct epoll_backend_data *data = s->backend_data;
+	int i, n, timeout;
+
+	/* round up, so we don't spin on sub-millisecond deadlines */
+	timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+
+	n = epoll_wait(data->epfd, data->events,
+		       SCHEDULER_EPOLL_EVENTS, timeout);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		struct epoll_event *ev = &data->events[i];
+		struct scheduler_fd *sfd = ev->data.ptr;
+		char mode = 0;
+
+		if (ev->events & EPOLLIN)
+			mode |= SCHEDULER_POLL_READ_FD;
+		if (ev->events & EPOLLOUT)
+			mode |= SCHEDULER_POLL_WRITE_FD;
+		if (ev->events & EPOLLPRI)
+			mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+		/*
+		 * Hangups and errors are always reported. Hand them to
+		 * whoever is listening, they'll find out on the next
+		 * read or write. Dropping them would spin.
+		 */
+		if (ev->events & (EPOLLHUP | EPOLLERR))
+			mode |= SCHEDULER_POLL_READ_FD | SCHEDULER_POLL_WRITE_FD;
+
+		scheduler_fd_ready(s, sfd, mode);
+	}
+
+	return 0;
+}
+
+static const struct scheduler_backend scheduler_backend_epoll = {
+	.name        = "epoll",
+	.data_size   = sizeof(struct epoll_backend_data),
+	.sb_setup    = scheduler_epoll_setup,
+	.sb_destroy  = scheduler_epoll_destroy,
+	.sb_update   = scheduler_epoll_update,
+	.sb_wait     = scheduler_epoll_wait,
+};
+
+static void
+scheduler_free_backend(scheduler_t *s)
+{
+	if (s->backend) {
+		if (s->backend->sb_destroy)
+			s->backend->sb_destroy(s);
+		s->backend = NULL;
+	}
+
+	free(s->backend_data);
+	s->backend_data = NULL;
+}
+
+int
+scheduler_initialize_backend(scheduler_t *s, int backend)
+{
+	const struct scheduler_backend *sb;
+	int i, err;
+
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid  = 1;
 	s->depth = 0;
 	s->uuid_overflow = 0;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->timeout     = TV_SECS(SCHEDULER_MAX_TIMEOUT);
+	s->max_timeout = TV_SECS(SCHEDULER_MAX_TIMEOUT);
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->dead);
+	INIT_LIST_HEAD(&s->ready);
+	for (i = 0; i < SCHEDULER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&s->hash[i]);
+
+	switch (backend) {
+	case SCHEDULER_BACKEND_SELECT:
+		sb = &scheduler_backend_select;
+		break;
+	case SCHEDULER_BACKEND_EPOLL:
+		sb = &scheduler_backend_epoll;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	s->backend_data = calloc(1, sb->data_size);
+	if (!s->backend_data)
+		return -ENOMEM;
+
+	s->backend = sb;
+
+	err = sb->sb_setup(s);
+	if (err) {
+		scheduler_free_backend(s);
+		return err;
+	}
+
+	DPRINTF("scheduler backend: %s\n", sb->name);
+
+	return 0;
+}
+
+void
+scheduler_initialize(scheduler_t *s)
+{
+	int err;
+
+	err = scheduler_initialize_backend(s, SCHEDULER_BACKEND_EPOLL);
+	if (err) {
+		EPRINTF("failed to set up epoll scheduler: %s, "
+			"falling back to select\n", strerror(-err));
+		err = scheduler_initialize_backend(s, SCHEDULER_BACKEND_SELECT);
+		BUG_ON(err);
+	}
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *next;
+	int i;
+
+	scheduler_gc_events(s);
+
+	scheduler_for_each_event_safe(s, event, next) {
+		list_del(&event->next);
+		free(event);
+	}
+
+	free(s->timers);
+	s->timers     = NULL;
+	s->n_timers   = 0;
+	s->max_timers = 0;
+
+	for (i = 0; i < s->n_fds; i++)
+		free(s->fds[i]);
+	free(s->fds);
+	s->fds   = NULL;
+	s->n_fds = 0;
+
+	scheduler_free_backend(s);
 }
 
 int
@@ -461,22 +1083,15 @@ scheduler_event_set_timeout(scheduler_t *sched, event_id_t event_id, struct time
 	if (!event_id)
 		return -EINVAL;
 
-	scheduler_for_each_event(sched, event) {
-		if (event->id == event_id) {
-			if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-				return -EINVAL;
-			event->timeout = timeo;
-			if (TV_IS_INF(event->timeout))
-				event->deadline = TV_INF;
-			else {
-				struct timeval now;
-				gettimeofday(&now, NULL);
-				TV_ADD(now, event->timeout, event->deadline);
-			}
-			return 0;
-		}
-	}
+	event = scheduler_find_event(sched, event_id);
+	if (!event)
+		return -ENOENT;
 
-	return -ENOENT;
-}
+	if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
+		return -EINVAL;
 
+	event->timeout = timeo;
+	scheduler_timer_set_deadline(sched, event);
+
+	return 0;
+}
@@ -31,7 +31,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <sys/time.h>
 
 #include "list.h"
 
@@ -40,27 +40,86 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+#define SCHEDULER_HASH_SIZE          256
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct scheduler_fd;
+struct scheduler_backend;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	const struct scheduler_backend *backend;
+	void                        *backend_data;
 
+	/* all live events */
 	struct list_head             events;
 
+	/* unregistered events, freed once back at depth 1 */
+	struct list_head             dead;
+
+	/*
+	 * Binary min-heap of armed timers, keyed on their deadline. Only
+	 * live, unmasked events with a finite timeout are on it.
+	 */
+	struct event               **timers;
+	int                          n_timers;
+	int                          max_timers;
+
+	/* events with a non-zero pending mask, in dispatch order */
+	struct list_head             ready;
+
+	/* events hashed by id */
+	struct list_head             hash[SCHEDULER_HASH_SIZE];
+
+	/* per-fd registrations, indexed by fd */
+	struct scheduler_fd        **fds;
+	int                          n_fds;
+
 	int                          uuid;
 	int                          uuid_overflow;
-	int                          max_fd;
 	struct timeval               timeout;
 	struct timeval               max_timeout;
 	int                          depth;
 } scheduler_t;
 
+/*
+ * Scheduler backends only deal in file descriptors: the scheduler core
+ * aggregates the interest of all unmasked events on a fd, tells the
+ * backend when that interest changes, and gets told back which fds are
+ * ready.
+ */
+struct scheduler_backend {
+	const char                  *name;
+	size_t                       data_size;
 
+	int  (*sb_setup)            (scheduler_t *s);
+	void (*sb_destroy)          (scheduler_t *s);
+	int  (*sb_update)           (scheduler_t *s, struct scheduler_fd *sfd,
+				     char old_mode);
+	int  (*sb_wait)             (scheduler_t *s, struct timeval *timeout);
+};
+
+enum {
+	SCHEDULER_BACKEND_SELECT = 1,
+	SCHEDULER_BACKEND_EPOLL  = 2,
+};
+
+/**
+ * Initialises the scheduler with the epoll backend, falling back to
+ * select(2) if epoll is not available.
+ */
 void scheduler_initialize(scheduler_t *);
 
+/**
+ * Initialises the scheduler with the given SCHEDULER_BACKEND_*.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int scheduler_initialize_backend(scheduler_t *, int backend);
+void scheduler_destroy(scheduler_t *);
+
 /**
  * Registers an event.
  *
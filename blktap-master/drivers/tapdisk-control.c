@@ -105,6 +105,7 @@ struct tapdisk_ctl_conn {
 	struct {
 		int                      event_id;
 		int                      busy;
+		int                      again;
 	} in;
 
 	struct tapdisk_control_info *info;
@@ -120,6 +121,12 @@ struct tapdisk_ctl_conn {
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* run on the loop serving the VBD */
+
+/*
+ * How long a handler run on a worker may wait for the VBD, in seconds.
+ */
+#define TAPDISK_CTL_WORKER_SLICE 1
 
 struct tapdisk_control_info {
 	int (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *,
@@ -540,13 +547,59 @@ tapdisk_control_validate_request(tapdisk_message_t *request)
 	return 0;
 }
 
+struct tapdisk_control_list {
+	tapdisk_message_t           *entries;
+	int                          count;
+	int                          n;
+};
+
+static int
+tapdisk_control_count_vbds(void *private)
+{
+	struct tapdisk_control_list *list = private;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		list->count++;
+
+	return 0;
+}
+
+/*
+ * Runs on the loops serving the VBDs, so only collects the entries. They
+ * are sent from the main thread, which owns the connection.
+ */
+static int
+tapdisk_control_list_vbds(void *private)
+{
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *entry;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next) {
+		if (list->n == list->count)
+			break;
+
+		entry = &list->entries[list->n++];
+
+		entry->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
+		entry->u.list.state   = vbd->state;
+		entry->u.list.path[0] = 0;
+
+		if (vbd->name)
+			strncpy(entry->u.list.path, vbd->name,
+				sizeof(entry->u.list.path));
+	}
+
+	return 0;
+}
+
 static int
 tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 		tapdisk_message_t *request, tapdisk_message_t * const response)
 {
-	td_vbd_t *vbd;
-	struct list_head *head;
-	int count;
+	struct tapdisk_control_list list;
+	int i;
 
     ASSERT(conn);
     ASSERT(request);
@@ -555,26 +608,30 @@ tapdisk_control_list(struct tapdisk_ctl_conn *conn,
 	response->type = TAPDISK_MESSAGE_LIST_RSP;
 	response->cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
+	list.count = 0;
+	list.n     = 0;
 
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+	tapdisk_server_call_all(tapdisk_control_count_vbds, &list);
 
-	list_for_each_entry(vbd, head, next) {
-		response->u.list.count   = count--;
-		response->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response->u.list.state   = vbd->state;
-		response->u.list.path[0] = 0;
+	list.entries = calloc(list.count, sizeof(tapdisk_message_t));
+	if (list.count && !list.entries)
+		return -ENOMEM;
 
-		if (vbd->name)
-			strncpy(response->u.list.path, vbd->name,
-				sizeof(response->u.list.path));
+	tapdisk_server_call_all(tapdisk_control_list_vbds, &list);
+
+	for (i = 0; i < list.n; i++) {
+		response->u.list.count   = list.n - i;
+		response->u.list.minor   = list.entries[i].u.list.minor;
+		response->u.list.state   = list.entries[i].u.list.state;
+		memcpy(response->u.list.path, list.entries[i].u.list.path,
+		       sizeof(response->u.list.path));
 
 		tapdisk_control_write_message(conn, response);
 	}
 
-	response->u.list.count   = count;
+	free(list.entries);
+
+	response->u.list.count   = 0;
 	response->u.list.minor   = -1;
 	response->u.list.path[0] = 0;
 
@@ -731,6 +788,10 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_RDONLY;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_NO_O_DIRECT)
 		flags |= TD_OPEN_NO_O_DIRECT;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_EXTENT_MAP)
+		flags |= TD_OPEN_EXTENT_MAP;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_READAHEAD)
+		flags |= TD_OPEN_READAHEAD;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SHARED)
 		flags |= TD_OPEN_SHAREABLE;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ADD_CACHE)
@@ -788,8 +849,15 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 			goto out;
 		}
 		DPRINTF("Read encryption key for VHD\n");
-		vbd->encryption.key_size = key_size;
-		vbd->encryption.encryption_key = encryption_key;
+		vbd->open_params.encryption.key_size = key_size;
+		vbd->open_params.encryption.encryption_key = encryption_key;
+	}
+
+	if (request->u.params.bm_cache_size > 0) {
+		vbd->open_params.bm_cache_size =
+			request->u.params.bm_cache_size;
+		DPRINTF("Set bitmap cache size to %u\n",
+			vbd->open_params.bm_cache_size);
 	}
 
 	err = tapdisk_vbd_open_vdi(vbd, request->u.params.path, flags,
@@ -849,13 +917,43 @@ fail_close:
 	goto out;
 }
 
+/*
+ * Runs the loop of the VBD a handler is waiting for. On a worker, the
+ * main thread is blocked on the call and can't notice the connection go
+ * away, so give up after a slice, asking the main thread to call again
+ * for as long as the connection is open.
+ */
+static int
+tapdisk_control_iterate(struct tapdisk_ctl_conn *conn, struct timeval *until)
+{
+	struct timeval now;
+
+	if (tapdisk_server_is_worker()) {
+		gettimeofday(&now, NULL);
+
+		if (!timerisset(until)) {
+			*until = now;
+			until->tv_sec += TAPDISK_CTL_WORKER_SLICE;
+		} else if (TV_AFTER(now, *until)) {
+			conn->in.again = 1;
+			return -EAGAIN;
+		}
+
+		tapdisk_server_set_max_timeout(TAPDISK_CTL_WORKER_SLICE);
+	}
+
+	tapdisk_server_iterate();
+	return 0;
+}
+
 static int
 tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 			    tapdisk_message_t *request, tapdisk_message_t * const response)
 {
+	struct timeval until = { 0, 0 };
 	td_vbd_t *vbd;
 	int err = 0;
-    struct td_xenblkif *blkif, *_blkif;
+    struct td_xenblkif *blkif;
 
     ASSERT(conn);
     ASSERT(request);
@@ -878,8 +976,13 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		tapdisk_nbdserver_pause(vbd->nbdserver, true);
 	}
 
+    /*
+     * Disconnecting a device takes all of its rings off the list, so always
+     * look at the head.
+     */
     err = 0;
-    list_for_each_entry_safe(blkif, _blkif, &vbd->rings, entry) {
+    while (!list_empty(&vbd->rings)) {
+        blkif = list_first_entry(&vbd->rings, struct td_xenblkif, entry);
 
         DPRINTF("implicitly disconnecting ring %p domid=%d, devid=%d\n",
                 blkif, blkif->domid, blkif->devid);
@@ -902,8 +1005,11 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
          * proceed with tearing down the VBD, we will free memory that will later
          * be accessed by these requests, and this will lead to a crash.
          */
-        while (unlikely(tapdisk_vbd_contains_dead_rings(vbd)))
-            tapdisk_server_iterate();
+        while (unlikely(tapdisk_vbd_contains_dead_rings(vbd))) {
+            err = tapdisk_control_iterate(conn, &until);
+            if (err)
+                goto out;
+        }
     }
     else {
         DPRINTF("Ignoring dead rings in forced shutdown mode\n");
@@ -919,7 +1025,9 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 			if (!err || err != -EBUSY)
 				break;
 
-			tapdisk_server_iterate();
+			err = tapdisk_control_iterate(conn, &until);
+			if (err)
+				goto out;
 
 		} while (conn->fd >= 0);
 	}
@@ -929,10 +1037,10 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 
 	if (err == -ENOTTY) {
 
-		while (!list_empty(&vbd->pending_requests))
-			tapdisk_server_iterate();
-
 		err = 0;
+
+		while (!err && !list_empty(&vbd->pending_requests))
+			err = tapdisk_control_iterate(conn, &until);
 	}
 
 	if (err)
@@ -970,6 +1078,7 @@ tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
 			  tapdisk_message_t *request, tapdisk_message_t * const response)
 {
 	struct timeval now, next = { 0, 0 }, interval = { 0, 10000 };
+	struct timeval until = { 0, 0 };
 	int err = 0;
 	td_vbd_t *vbd;
 
@@ -1001,7 +1110,8 @@ tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
 			TV_ADD(now, interval, next);
 		}
 
-		tapdisk_server_iterate();
+		if (tapdisk_control_iterate(conn, &until))
+			break;
 
 	} while (conn->fd >= 0);
 	tapdisk_vbd_squash_pause_logging(false);
@@ -1079,12 +1189,44 @@ out:
     return err;
 }
 
+struct tapdisk_control_stats {
+	td_stats_t                  *st;
+	td_uuid_t                    uuid;
+};
+
+static int
+tapdisk_control_vbd_stats(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(stats->uuid);
+	if (!vbd)
+		return -ENODEV;
+
+	tapdisk_vbd_stats(vbd, stats->st);
+
+	return 0;
+}
+
+static int
+tapdisk_control_all_stats(void *private)
+{
+	struct tapdisk_control_stats *stats = private;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		tapdisk_vbd_stats(vbd, stats->st);
+
+	return 0;
+}
+
 static int
 tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		      tapdisk_message_t *request, tapdisk_message_t * const response)
 {
 	td_stats_t _st, *st = &_st;
-	td_vbd_t *vbd;
+	struct tapdisk_control_stats stats;
 	size_t rv;
 	void *buf;
 	int new_size;
@@ -1101,23 +1243,23 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 
 	tapdisk_stats_init(st, buf, TD_CTL_SEND_BUFSZ);
 
+	stats.st   = st;
+	stats.uuid = request->cookie;
+
 	if (request->cookie != (uint16_t)-1) {
+		int err;
 
-		vbd = tapdisk_server_get_vbd(request->cookie);
-		if (!vbd) {
-			rv = -ENODEV;
+		err = tapdisk_server_call(request->cookie,
+					  tapdisk_control_vbd_stats, &stats);
+		if (err) {
+			rv = err;
 			goto out;
 		}
 
-		tapdisk_vbd_stats(vbd, st);
-
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
-
 		tapdisk_stats_enter(st, '[');
 
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
+		tapdisk_server_call_all(tapdisk_control_all_stats, &stats);
 
 		tapdisk_stats_leave(st, ']');
 	}
@@ -1188,6 +1330,11 @@ tapdisk_control_xenblkif_connect(
     }
 
     blkif = &request->u.blkif;
+    if (request->type != TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT) {
+        blkif->flags = 0;
+        blkif->queue = 0;
+    }
+
     len = strnlen(blkif->pool, sizeof(blkif->pool));
     if (!len)
         pool = NULL;
@@ -1197,11 +1344,13 @@ tapdisk_control_xenblkif_connect(
     } else
         pool = blkif->pool;
 
-    DPRINTF("connecting VBD %d domid=%d, devid=%d, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
-            vbd->uuid, blkif->domid, blkif->devid, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
+    DPRINTF("connecting VBD %d domid=%d, devid=%d, queue %d, pool %s, evt %d, poll duration %d, poll idle threshold %d\n",
+            vbd->uuid, blkif->domid, blkif->devid, blkif->queue, pool, blkif->port, blkif->poll_duration, blkif->poll_idle_threshold);
 
-    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->gref,
-            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold, pool, vbd);
+    err = tapdisk_xenblkif_connect(blkif->domid, blkif->devid, blkif->queue,
+            blkif->gref,
+            blkif->order, blkif->port, blkif->proto, blkif->poll_duration, blkif->poll_idle_threshold,
+            !!(blkif->flags & TAPDISK_MESSAGE_BLKIF_PERSISTENT), pool, vbd);
 
 out:
 	response->cookie = request->cookie;
@@ -1214,11 +1363,35 @@ out:
     return err;
 }
 
+struct tapdisk_control_disconnect {
+    tapdisk_message_blkif_t *blkif_msg;
+    int found;
+};
+
+/*
+ * The message does not name the VBD, so look for the rings on every loop.
+ */
+static int
+tapdisk_control_xenblkif_disconnect_loop(void *private)
+{
+    struct tapdisk_control_disconnect *disconnect = private;
+    tapdisk_message_blkif_t *blkif_msg = disconnect->blkif_msg;
+    int err;
+
+    err = tapdisk_xenblkif_disconnect(blkif_msg->domid, blkif_msg->devid);
+    if (err == -ENODEV)
+        return 0;
+
+    disconnect->found = 1;
+    return err;
+}
+
 static int
 tapdisk_control_xenblkif_disconnect(
         struct tapdisk_ctl_conn *conn __attribute__((unused)),
         tapdisk_message_t * request, tapdisk_message_t * const response)
 {
+    struct tapdisk_control_disconnect disconnect;
     tapdisk_message_blkif_t *blkif_msg;
 	int err;
 
@@ -1232,7 +1405,13 @@ tapdisk_control_xenblkif_disconnect(
     DPRINTF("disconnecting domid=%d, devid=%d\n", blkif_msg->domid,
             blkif_msg->devid);
 
-    err = tapdisk_xenblkif_disconnect(blkif_msg->domid, blkif_msg->devid);
+    disconnect.blkif_msg = blkif_msg;
+    disconnect.found = 0;
+
+    err = tapdisk_server_call_all(tapdisk_control_xenblkif_disconnect_loop,
+                                  &disconnect);
+    if (!err && !disconnect.found)
+        err = -ENODEV;
     if (!err)
         response->type = TAPDISK_MESSAGE_XENBLKIF_DISCONNECT_RSP;
 	else
@@ -1288,15 +1467,19 @@ struct tapdisk_control_info message_infos[] = {
 	},
 	[TAPDISK_MESSAGE_ATTACH] = {
 		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_DETACH] = {
 		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
     [TAPDISK_MESSAGE_XENBLKIF_CONNECT] = {
 		.handler = tapdisk_control_xenblkif_connect,
-		.flags = TAPDISK_MSG_VERBOSE
+		.flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
+	},
+    [TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT] = {
+		.handler = tapdisk_control_xenblkif_connect,
+		.flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
 	},
     [TAPDISK_MESSAGE_XENBLKIF_DISCONNECT] = {
         .handler = tapdisk_control_xenblkif_disconnect,
@@ -1304,27 +1487,27 @@ struct tapdisk_control_info message_infos[] = {
     },
     [TAPDISK_MESSAGE_DISK_INFO] = {
         .handler = tapdisk_control_disk_info,
-        .flags = TAPDISK_MSG_VERBOSE
+        .flags = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD
     },
 	[TAPDISK_MESSAGE_OPEN] = {
 		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_PAUSE] = {
 		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_RESUME] = {
 		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_CLOSE] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_FORCE_SHUTDOWN] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_STATS] = {
 		.handler = tapdisk_control_stats,
@@ -1347,7 +1530,7 @@ tapdisk_control_receive_request(struct tapdisk_ctl_conn *conn)
 	if (err)
 		goto invalid;
 
-	if (conn->request.type > TAPDISK_MESSAGE_EXIT)
+	if (conn->request.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	conn->info = &message_infos[conn->request.type];
@@ -1387,6 +1570,14 @@ invalid:
 	goto error;
 }
 
+static int
+tapdisk_control_call_handler(void *private)
+{
+	struct tapdisk_ctl_conn *conn = private;
+
+	return conn->info->handler(conn, &conn->request, &conn->response);
+}
+
 static void
 tapdisk_control_process_request(event_id_t event_id,
 			char mode __attribute__((unused)), void *private)
@@ -1409,7 +1600,19 @@ tapdisk_control_process_request(event_id_t event_id,
 	memset(&conn->response, 0, sizeof(conn->response));
 	conn->response.cookie = conn->request.cookie;
 
-    err = conn->info->handler(conn, &conn->request, &conn->response);
+    if (conn->info->flags & TAPDISK_MSG_VBD)
+        /* the worker hands back while waiting, see tapdisk_control_iterate */
+        do {
+            conn->in.again = 0;
+            err = tapdisk_server_call(conn->request.cookie,
+                                      tapdisk_control_call_handler, conn);
+            if (!conn->in.again)
+                break;
+
+            tapdisk_server_iterate();
+        } while (conn->fd >= 0);
+    else
+        err = conn->info->handler(conn, &conn->request, &conn->response);
     if (err) {
         conn->response.type = TAPDISK_MESSAGE_ERROR;
         conn->response.u.response.error = -err;
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A flattened view of an image chain. For each block the map records,
+ * as a short list of extents, which image of the chain owns the data,
+ * so reads can be sent straight to that image instead of walking the
+ * chain one bitmap at a time.
+ *
+ * Blocks are resolved lazily from the drivers' in-memory metadata (see
+ * td_block_status) and kept in a small direct-mapped cache. Only the
+ * leaf ever changes underneath us: writes and discards to it drop the
+ * blocks they touch. A block whose metadata isn't cached yet, or which
+ * is too fragmented to describe, is simply left to the leaf, and the
+ * regular chain walk.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "tapdisk-extmap.h"
+#include "tapdisk-image.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "debug.h"
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define EXTMAP_BLOCK_SHIFT   12            /* 2MB, in sectors */
+#define EXTMAP_BLOCK_SECS    (1 << EXTMAP_BLOCK_SHIFT)
+#define EXTMAP_SLOTS         1024
+#define EXTMAP_EXTENTS       32
+#define EXTMAP_LAYERS_MAX    255
+#define EXTMAP_ZERO          0xff          /* no layer holds the data */
+
+struct td_extent {
+	uint16_t                    secs;
+	uint8_t                     layer;
+};
+
+struct td_extmap_block {
+	uint64_t                    blk;
+	int                         nr;        /* 0: slot unused */
+	struct td_extent            ext[EXTMAP_EXTENTS];
+};
+
+struct td_extmap {
+	int                         nr_layers;
+	td_image_t                **layers;
+	td_sector_t                 size;
+
+	struct td_extmap_block     *slots;
+
+	uint64_t                    hits;
+	uint64_t                    misses;
+	uint64_t                    builds;
+	uint64_t                    fallbacks;
+	uint64_t                    invalidations;
+};
+
+int
+tapdisk_extmap_create(td_extmap_t **_map, struct list_head *images)
+{
+	td_extmap_t *map;
+	td_image_t *image;
+	int n, err;
+
+	n = 0;
+	tapdisk_for_each_image(image, images) {
+		if (!image->driver || !image->driver->ops->td_block_status)
+			return -EOPNOTSUPP;
+		n++;
+	}
+
+	if (n < 2 || n > EXTMAP_LAYERS_MAX)
+		return -EOPNOTSUPP;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+
+	map->layers = calloc(n, sizeof(td_image_t *));
+	map->slots  = calloc(EXTMAP_SLOTS, sizeof(struct td_extmap_block));
+	if (!map->layers || !map->slots) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	tapdisk_for_each_image(image, images)
+		map->layers[map->nr_layers++] = image;
+
+	map->size = map->layers[0]->info.size;
+
+	*_map = map;
+	return 0;
+
+fail:
+	tapdisk_extmap_free(map);
+	return err;
+}
+
+void
+tapdisk_extmap_free(td_extmap_t *map)
+{
+	if (!map)
+		return;
+
+	free(map->layers);
+	free(map->slots);
+	free(map);
+}
+
+/*
+ * Who owns the run at @sec: the first image from the leaf down which has
+ * it allocated. An image shorter than @sec reads as zeros, and so does
+ * everything beneath it, as on the regular path.
+ */
+static int
+extmap_resolve(td_extmap_t *map, td_sector_t sec, int secs, uint8_t *layer)
+{
+	td_image_t *image;
+	int i, n, allocated;
+
+	for (i = 0; i < map->nr_layers; i++) {
+		image = map->layers[i];
+
+		if (sec >= image->info.size)
+			break;
+
+		secs = MIN(secs, image->info.size - sec);
+
+		n = td_block_status(image, sec, secs, &allocated);
+		if (n < 0)
+			return n;
+
+		secs = MIN(secs, n);
+		if (allocated) {
+			*layer = i;
+			return secs;
+		}
+	}
+
+	*layer = EXTMAP_ZERO;
+	return secs;
+}
+
+static int
+extmap_build(td_extmap_t *map, struct td_extmap_block *b, uint64_t blk)
+{
+	td_sector_t sec, end;
+	struct td_extent *ext;
+	uint8_t layer;
+	int n;
+
+	b->nr  = 0;
+	b->blk = blk;
+
+	sec = blk << EXTMAP_BLOCK_SHIFT;
+	end = MIN(sec + EXTMAP_BLOCK_SECS, map->size);
+
+	while (sec < end) {
+		n = extmap_resolve(map, sec, end - sec, &layer);
+		if (n <= 0)
+			goto fail;
+
+		ext = b->nr ? &b->ext[b->nr - 1] : NULL;
+		if (ext && ext->layer == layer)
+			ext->secs += n;
+		else {
+			if (b->nr == EXTMAP_EXTENTS)
+				goto fail;
+			ext = &b->ext[b->nr++];
+			ext->secs  = n;
+			ext->layer = layer;
+		}
+
+		sec += n;
+	}
+
+	map->builds++;
+	return 0;
+
+fail:
+	b->nr = 0;
+	return -EAGAIN;
+}
+
+int
+tapdisk_extmap_lookup(td_extmap_t *map, td_sector_t sec, int secs,
+		      td_image_t **image)
+{
+	struct td_extmap_block *b;
+	struct td_extent *ext;
+	uint64_t blk;
+	int i, off;
+
+	blk  = sec >> EXTMAP_BLOCK_SHIFT;
+	off  = sec & (EXTMAP_BLOCK_SECS - 1);
+	secs = MIN(secs, EXTMAP_BLOCK_SECS - off);
+
+	b = &map->slots[blk % EXTMAP_SLOTS];
+	if (b->nr && b->blk == blk)
+		map->hits++;
+	else {
+		map->misses++;
+		if (extmap_build(map, b, blk)) {
+			map->fallbacks++;
+			*image = map->layers[0];
+			return secs;
+		}
+	}
+
+	for (i = 0, ext = b->ext; i < b->nr; i++, ext++) {
+		if (off < ext->secs)
+			break;
+		off -= ext->secs;
+	}
+
+	ASSERT(i < b->nr);
+
+	*image = ext->layer == EXTMAP_ZERO ? NULL : map->layers[ext->layer];
+	return MIN(secs, ext->secs - off);
+}
+
+static inline void
+extmap_drop(td_extmap_t *map, struct td_extmap_block *b,
+	    uint64_t first, uint64_t last)
+{
+	if (b->nr && b->blk >= first && b->blk <= last) {
+		b->nr = 0;
+		map->invalidations++;
+	}
+}
+
+void
+tapdisk_extmap_invalidate(td_extmap_t *map, td_sector_t sec, int secs)
+{
+	uint64_t blk, first, last;
+	int i;
+
+	if (secs <= 0)
+		return;
+
+	first = sec >> EXTMAP_BLOCK_SHIFT;
+	last  = (sec + secs - 1) >> EXTMAP_BLOCK_SHIFT;
+
+	if (last - first >= EXTMAP_SLOTS)
+		for (i = 0; i < EXTMAP_SLOTS; i++)
+			extmap_drop(map, &map->slots[i], first, last);
+	else
+		for (blk = first; blk <= last; blk++)
+			extmap_drop(map, &map->slots[blk % EXTMAP_SLOTS],
+				    first, last);
+}
+
+void
+tapdisk_extmap_stats(td_extmap_t *map, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "layers", "d", map->nr_layers);
+	tapdisk_stats_field(st, "hits", "llu", map->hits);
+	tapdisk_stats_field(st, "misses", "llu", map->misses);
+	tapdisk_stats_field(st, "builds", "llu", map->builds);
+	tapdisk_stats_field(st, "fallbacks", "llu", map->fallbacks);
+	tapdisk_stats_field(st, "invalidations", "llu", map->invalidations);
+}
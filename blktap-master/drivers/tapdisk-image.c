@@ -107,10 +107,11 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	if (treq.op != TD_OP_READ && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -133,7 +134,8 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 {
 	td_driver_t *driver;
 	td_disk_info_t *info;
-	int i, rdonly, secs, err;
+	int i, rdonly, err;
+	td_sector_t secs;
 
 	driver = image->driver;
 	if (!driver)
@@ -154,6 +156,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -165,6 +168,8 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 			goto fail;
 		}
 		break;
+	case TD_OP_FLUSH:
+		break;
 	default:
 		err = -EOPNOTSUPP;
 		goto fail;
@@ -189,7 +194,7 @@ tapdisk_image_close(td_image_t *image)
 
 int
 tapdisk_image_open(int type, const char *name, int flags,
-		   struct td_vbd_encryption *encryption, td_image_t **_image)
+		   struct td_vbd_open_params *params, td_image_t **_image)
 {
 	td_image_t *image;
 	int err;
@@ -212,7 +217,7 @@ tapdisk_image_open(int type, const char *name, int flags,
 		goto fail;
 	}
 
-	err = td_open(image, encryption);
+	err = td_open(image, params);
 	if (err)
 		goto fail;
 
@@ -227,7 +232,7 @@ fail:
 }
 
 static int
-tapdisk_image_open_parent(td_image_t *image, struct td_vbd_encryption *encryption,
+tapdisk_image_open_parent(td_image_t *image, struct td_vbd_open_params *params,
 			  td_image_t **_parent)
 {
 	td_image_t *parent = NULL;
@@ -248,7 +253,7 @@ tapdisk_image_open_parent(td_image_t *image, struct td_vbd_encryption *encryptio
 	if (((id.flags & TD_OPEN_NO_O_DIRECT) == TD_OPEN_NO_O_DIRECT) &&
             ((id.flags & TD_OPEN_LOCAL_CACHE) == TD_OPEN_LOCAL_CACHE))
 		id.flags &= ~TD_OPEN_NO_O_DIRECT;
-	err = tapdisk_image_open(id.type, id.name, id.flags, encryption, &parent);
+	err = tapdisk_image_open(id.type, id.name, id.flags, params, &parent);
 	if (err)
 		return err;
 
@@ -258,13 +263,13 @@ out:
 }
 
 static int
-tapdisk_image_open_parents(td_image_t *image, struct td_vbd_encryption *encryption)
+tapdisk_image_open_parents(td_image_t *image, struct td_vbd_open_params *params)
 {
 	td_image_t *parent;
 	int err;
 
 	do {
-		err = tapdisk_image_open_parent(image, encryption, &parent);
+		err = tapdisk_image_open_parent(image, params, &parent);
 		if (err)
 			break;
 
@@ -298,14 +303,14 @@ tapdisk_image_close_chain(struct list_head *list)
  */
 static int
 __tapdisk_image_open_chain(int type, const char *name, int flags,
-			   struct td_vbd_encryption *encryption, struct list_head *_head,
+			   struct td_vbd_open_params *params, struct list_head *_head,
 			   int prt_devnum)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
 	td_image_t *image;
 	int err;
 
-	err = tapdisk_image_open(type, name, flags, encryption, &image);
+	err = tapdisk_image_open(type, name, flags, params, &image);
 	if (err)
 		goto fail;
 
@@ -316,7 +321,7 @@ __tapdisk_image_open_chain(int type, const char *name, int flags,
 		snprintf(dev, sizeof(dev),
 			 "%s%d", BLKTAP2_IO_DEVICE, prt_devnum);
 		err = tapdisk_image_open(DISK_TYPE_AIO, dev,
-					 flags|TD_OPEN_RDONLY, encryption, &image);
+					 flags|TD_OPEN_RDONLY, params, &image);
 		if (err)
 			goto fail;
 
@@ -324,7 +329,7 @@ __tapdisk_image_open_chain(int type, const char *name, int flags,
 		goto done;
 	}
 
-	err = tapdisk_image_open_parents(image, encryption);
+	err = tapdisk_image_open_parents(image, params);
 	if (err)
 		goto fail;
 
@@ -375,7 +380,7 @@ fail:
 }
 
 static int
-tapdisk_image_open_x_chain(const char *path, struct td_vbd_encryption *encryption,
+tapdisk_image_open_x_chain(const char *path, struct td_vbd_open_params *params,
 			   struct list_head *_head)
 {
 	struct list_head head = LIST_HEAD_INIT(head);
@@ -447,7 +452,7 @@ tapdisk_image_open_x_chain(const char *path, struct td_vbd_encryption *encryptio
 				goto fail;
 		}
 
-		err = tapdisk_image_open(type, path, flags, encryption, &image);
+		err = tapdisk_image_open(type, path, flags, params, &image);
 		if (err)
 			goto fail;
 
@@ -459,7 +464,7 @@ tapdisk_image_open_x_chain(const char *path, struct td_vbd_encryption *encryptio
 		goto fail;
 	}
 
-	err = tapdisk_image_open_parents(image, encryption);
+	err = tapdisk_image_open_parents(image, params);
 	if (err)
 		goto fail;
 
@@ -483,14 +488,14 @@ fail:
 
 int
 tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
-			 struct td_vbd_encryption *encryption, struct list_head *head)
+			 struct td_vbd_open_params *params, struct list_head *head)
 {
 	const char *name;
 	int type, err;
 
 	type = tapdisk_disktype_parse_params(desc, &name);
 	if (type >= 0)
-		return __tapdisk_image_open_chain(type, name, flags, encryption,
+		return __tapdisk_image_open_chain(type, name, flags, params,
 						  head, prt_devnum);
 
 	err = type;
@@ -499,7 +504,7 @@ tapdisk_image_open_chain(const char *desc, int flags, int prt_devnum,
 		switch (desc[2]) {
 		case 'c':
 			if (!strncmp(desc, "x-chain", strlen("x-chain")))
-				err = tapdisk_image_open_x_chain(name, encryption, head);
+				err = tapdisk_image_open_x_chain(name, params, head);
 			break;
 		}
 	}
@@ -76,10 +76,10 @@ struct td_image_handle {
 #define tapdisk_image_entry(_head)		\
 	list_entry(_head, td_image_t, next)
 
-int tapdisk_image_open(int, const char *, int, struct td_vbd_encryption *, td_image_t **);
+int tapdisk_image_open(int, const char *, int, struct td_vbd_open_params *, td_image_t **);
 void tapdisk_image_close(td_image_t *);
 
-int tapdisk_image_open_chain(const char *, int, int, struct td_vbd_encryption *, struct list_head *);
+int tapdisk_image_open_chain(const char *, int, int, struct td_vbd_open_params *, struct list_head *);
 void tapdisk_image_close_chain(struct list_head *);
 int tapdisk_image_validate_chain(struct list_head *);
 
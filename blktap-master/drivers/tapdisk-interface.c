@@ -68,7 +68,7 @@ td_load(td_image_t *image)
 }
 
 int
-__td_open(td_image_t *image, struct td_vbd_encryption *encryption, td_disk_info_t *info)
+__td_open(td_image_t *image, struct td_vbd_open_params *params, td_disk_info_t *info)
 {
 	int err;
 	td_driver_t *driver;
@@ -86,7 +86,7 @@ __td_open(td_image_t *image, struct td_vbd_encryption *encryption, td_disk_info_
 	}
 
 	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
-		err = driver->ops->td_open(driver, image->name, encryption, image->flags);
+		err = driver->ops->td_open(driver, image->name, params, image->flags);
 		if (err) {
 			if (!image->driver)
 				tapdisk_driver_free(driver);
@@ -107,9 +107,9 @@ __td_open(td_image_t *image, struct td_vbd_encryption *encryption, td_disk_info_
 }
 
 int
-td_open(td_image_t *image, struct td_vbd_encryption *encryption)
+td_open(td_image_t *image, struct td_vbd_open_params *params)
 {
-	return __td_open(image, encryption, NULL);
+	return __td_open(image, params, NULL);
 }
 
 int
@@ -125,6 +125,7 @@ td_close(td_image_t *image)
 	if (!driver->refcnt && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
 		driver->ops->td_close(driver);
 		td_flag_clear(driver->state, TD_DRIVER_OPEN);
+		tapdisk_server_forget_files();
 	}
 
 	DPRINTF("closed image %s (%d users, state: 0x%08x, type: %d)\n",
@@ -234,6 +235,83 @@ fail:
 	td_complete_request(treq, err);
 }
 
+/*
+ * Discards are advisory: a driver that does not implement them passes the
+ * request on to the next image, and the end of the chain completes it.
+ */
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_discard) {
+		td_forward_request(treq);
+		return;
+	}
+
+	driver->ops->td_queue_discard(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Flushes only concern writable images. A driver that does not implement
+ * them passes the request on, read-only images have nothing to sync.
+ */
+void
+td_queue_flush(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (td_flag_test(image->flags, TD_OPEN_RDONLY)) {
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	if (!driver->ops->td_queue_flush) {
+		td_forward_request(treq);
+		return;
+	}
+
+	driver->ops->td_queue_flush(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -266,6 +344,13 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_fdsync(struct tiocb *tiocb, int fd,
+	       td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_fdsync_tiocb(tiocb, fd, cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -279,6 +364,27 @@ td_debug(td_image_t *image)
 	tapdisk_driver_debug(driver);
 }
 
+int
+td_block_status(td_image_t *image, td_sector_t sec, int secs, int *allocated)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_block_status)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_block_status(driver, sec, secs, allocated);
+}
+
+int
+td_parent_block_status(td_request_t treq, int *allocated)
+{
+	return tapdisk_vbd_parent_block_status(treq, allocated);
+}
+
 __noreturn void
 td_panic(void)
 {
@@ -36,8 +36,8 @@
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
 
-int td_open(td_image_t *, struct td_vbd_encryption *);
-int __td_open(td_image_t *, struct td_vbd_encryption *, td_disk_info_t *);
+int td_open(td_image_t *, struct td_vbd_open_params *);
+int __td_open(td_image_t *, struct td_vbd_open_params *, td_disk_info_t *);
 int td_load(td_image_t *);
 int td_close(td_image_t *);
 int td_get_parent_id(td_image_t *, td_disk_id_t *);
@@ -45,16 +45,21 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
+int td_block_status(td_image_t *, td_sector_t, int, int *);
+int td_parent_block_status(td_request_t, int *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
 void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+void td_prep_fdsync(struct tiocb *, int, td_queue_callback_t, void *);
 void td_panic(void) __noreturn;
 
 #endif
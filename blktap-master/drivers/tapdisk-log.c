@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "tapdisk-log.h"
 #include "tapdisk-utils.h"
@@ -67,6 +68,13 @@ struct tlog {
 
 static struct tlog tapdisk_log;
 
+/*
+ * Worker threads log concurrently with the main thread reopening or
+ * closing the log. Recursive, as flushing the syslog ring runs the main
+ * loop, which may log in turn.
+ */
+static pthread_mutex_t tlog_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 static void
 tlog_logfile_vprint(const char *fmt, va_list ap)
 {
@@ -168,7 +176,9 @@ tlog_vsyslog(int prio, const char *fmt, va_list ap)
 {
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 
+	pthread_mutex_lock(&tlog_lock);
 	tapdisk_vsyslog(syslog, prio, fmt, ap);
+	pthread_mutex_unlock(&tlog_lock);
 }
 
 void
@@ -222,13 +232,19 @@ tlog_reopen(void)
 {
 	int err;
 
+	pthread_mutex_lock(&tlog_lock);
+
 	tlog_logfile_close(true);
 	err = tlog_logfile_open(tapdisk_log.name, tapdisk_log.level);
 	if (err)
-		return err;
+		goto out;
 
 	tlog_syslog_close();
-	return tlog_syslog_open(tapdisk_log.ident, tapdisk_log.facility);
+	err = tlog_syslog_open(tapdisk_log.ident, tapdisk_log.facility);
+
+out:
+	pthread_mutex_unlock(&tlog_lock);
+	return err;
 }
 
 void
@@ -237,20 +253,28 @@ tlog_close(void)
 	DPRINTF("tapdisk-log: closing after %lu errors\n",
 		tapdisk_log.errors);
 
+	pthread_mutex_lock(&tlog_lock);
+
 	tlog_logfile_close(false);
 	tlog_syslog_close();
 
 	free(tapdisk_log.ident);
 	tapdisk_log.ident = NULL;
+
+	pthread_mutex_unlock(&tlog_lock);
 }
 
 void
 tlog_precious(int force_flush)
 {
+	pthread_mutex_lock(&tlog_lock);
+
 	if (!tapdisk_log.precious || force_flush)
 		tapdisk_logfile_flush(&tapdisk_log.logfile);
 
 	tapdisk_log.precious = 1;
+
+	pthread_mutex_unlock(&tlog_lock);
 }
 
 void
@@ -259,9 +283,11 @@ __tlog_write(int level, const char *fmt, ...)
 	va_list ap;
 
 	if (level <= tapdisk_log.level) {
+		pthread_mutex_lock(&tlog_lock);
 		va_start(ap, fmt);
 		tlog_logfile_vprint(fmt, ap);
 		va_end(ap);
+		pthread_mutex_unlock(&tlog_lock);
 	}
 }
 
@@ -274,7 +300,7 @@ __tlog_error(const char *fmt, ...)
 	tlog_vsyslog(LOG_ERR, fmt, ap);
 	va_end(ap);
 
-	tapdisk_log.errors++;
+	__atomic_add_fetch(&tapdisk_log.errors, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -205,7 +205,7 @@ end:
     return err;
 }
 int
-td_metrics_vbd_start(int domain, int id, stats_t *vbd_stats)
+td_metrics_vbd_start(int domain, int id, int queue, stats_t *vbd_stats)
 {
     int err = 0;
 
@@ -214,8 +214,12 @@ td_metrics_vbd_start(int domain, int id, stats_t *vbd_stats)
 
     shm_init(&vbd_stats->shm);
 
-    err = asprintf(&vbd_stats->shm.path, TAPDISK_METRICS_VBD_PATHF,
-            td_metrics.path, domain, id);
+    if (queue)
+        err = asprintf(&vbd_stats->shm.path, TAPDISK_METRICS_VBDQ_PATHF,
+                td_metrics.path, domain, id, queue);
+    else
+        err = asprintf(&vbd_stats->shm.path, TAPDISK_METRICS_VBD_PATHF,
+                td_metrics.path, domain, id);
     if(unlikely(err == -1)){
         err = errno;
         EPRINTF("failed to allocate memory to store vbd metrics path: %s\n",
@@ -34,6 +34,7 @@
 #define TAPDISK_METRICS_PATHF        "/dev/shm/td3-%d"
 #define TAPDISK_METRICS_VDI_PATHF    "%s/vdi-%hu"
 #define TAPDISK_METRICS_VBD_PATHF    "%s/vbd-%d-%d"
+#define TAPDISK_METRICS_VBDQ_PATHF   "%s/vbd-%d-%d-q%d"
 #define TAPDISK_METRICS_BLKTAP_PATHF "%s/blktap-%d"
 #define TAPDISK_METRICS_NBD_PATHF "%s/nbd-%d"
 
@@ -63,8 +64,9 @@ int td_metrics_vdi_start(int minor, stats_t *vdi_stats);
 /* Destroys the files created to store the metrics from tapdisk to the vdi */
 int td_metrics_vdi_stop(stats_t *vdi_stats);
 
-/* Creates the metrics file to store the stats from blkfront to tapdisk */
-int td_metrics_vbd_start(int domain, int id, stats_t *vbd_stats);
+/* Creates the metrics file to store the stats from blkfront to tapdisk, one
+ * per ring; queue 0 keeps the single-queue name */
+int td_metrics_vbd_start(int domain, int id, int queue, stats_t *vbd_stats);
 
 /* Destroys the files created to store metrics from blkfront to tapdisk */
 int td_metrics_vbd_stop(stats_t *vbd_stats);
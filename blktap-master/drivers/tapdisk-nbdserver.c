@@ -33,8 +33,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -57,7 +60,61 @@
 #include "config.h"
 #endif
 
-#define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
+/* NBD clients aren't blkif rings: keep the classic depth */
+#define NBD_SERVER_NUM_REQS (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ)
+
+/*
+ * Every request owns a buffer of NBD_SERVER_BUF_SIZE, carved from one
+ * aligned allocation made with the client. Larger writes borrow a
+ * buffer from the client's arena instead: power-of-two sized, reused
+ * across requests, and kept only up to NBD_SERVER_ARENA_SIZE bytes (and
+ * TAPDISK_NBD_ARENA_BUFS buffers); anything beyond that is freed when
+ * its request is done. Requests above NBD_SERVER_MAX_REQ_SIZE are
+ * refused.
+ */
+#define NBD_SERVER_BUF_SIZE      (128 << 10)
+#define NBD_SERVER_BUF_ALIGN     4096
+#define NBD_SERVER_MAX_REQ_SIZE  (32 << 20)
+#define NBD_SERVER_ARENA_SIZE    (2 * NBD_SERVER_MAX_REQ_SIZE)
+
+/*
+ * Requests taken off a client socket per callback, so one busy client
+ * doesn't starve the others.
+ */
+#define NBD_SERVER_RX_BATCH      16
+
+/*
+ * Reply vectors gathered into one sendmsg.
+ */
+#define NBD_SERVER_TX_IOVS       256
+
+/*
+ * Structured read replies send zeroes as hole chunks, for runs of at
+ * least NBD_SERVER_HOLE_MIN on NBD_SERVER_HOLE_GRAIN boundaries, in at
+ * most NBD_SERVER_MAX_CHUNKS chunks per reply.
+ */
+#define NBD_SERVER_HOLE_GRAIN    4096
+#define NBD_SERVER_HOLE_MIN      (64 << 10)
+#define NBD_SERVER_MAX_CHUNKS    16
+#define NBD_SERVER_TX_HDR_SIZE   (NBD_SERVER_MAX_CHUNKS * 32)
+#define NBD_SERVER_REPLY_IOVS    (2 * NBD_SERVER_MAX_CHUNKS + 1)
+
+/*
+ * Block status: extents per reply, sectors asked of the chain at a
+ * time, and how long to wait on image metadata (retries of
+ * NBD_SERVER_STATUS_DELAY us) before answering "allocated".
+ */
+#define NBD_SERVER_MAX_EXTENTS   4096
+#define NBD_SERVER_STATUS_SPAN   (1 << 20)
+#define NBD_SERVER_STATUS_DELAY  1000
+#define NBD_SERVER_STATUS_RETRIES 100
+
+/*
+ * NBD_CMD_WRITE_ZEROES that has to hit the disk is written from one
+ * shared, never-touched anonymous mapping of this size; longer ranges
+ * go out as one request with a vector of such chunks.
+ */
+#define NBD_SERVER_ZERO_SIZE     NBD_SERVER_MAX_REQ_SIZE
 
 /*
  * Server
@@ -79,6 +136,25 @@ struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
 	struct td_iovec         iov;
+
+	void                   *buf;
+	size_t                  buf_size;
+
+	uint16_t                cmd;
+	uint16_t                cmd_flags;
+	uint64_t                from;
+	uint32_t                len;
+	int                     status_tries;
+
+	char                    tx_hdr[NBD_SERVER_TX_HDR_SIZE];
+	size_t                  tx_hdr_len;
+	struct iovec            tx_iov[NBD_SERVER_REPLY_IOVS];
+	int                     tx_iovcnt;
+	size_t                  tx_len;
+	size_t                  tx_off;
+	struct nbd_structured_reply *tx_last;
+
+	struct list_head        next;
 };
 
 td_nbdserver_req_t *
@@ -94,6 +170,92 @@ tapdisk_nbdserver_alloc_request(td_nbdserver_client_t *client)
 	return req;
 }
 
+static void *
+tapdisk_nbdserver_slot_buf(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	return (char *)client->bufs + (req - client->reqs) * NBD_SERVER_BUF_SIZE;
+}
+
+/*
+ * Takes the smallest cached arena buffer of at least len bytes, or
+ * allocates a new one.
+ */
+static int
+tapdisk_nbdserver_arena_get(td_nbdserver_client_t *client, size_t len,
+		void **_buf, size_t *_size)
+{
+	int i, best = -1;
+	size_t size;
+	int err;
+
+	for (i = 0; i < client->n_arena; i++)
+		if (client->arena_size[i] >= len &&
+		    (best < 0 || client->arena_size[i] < client->arena_size[best]))
+			best = i;
+
+	if (best >= 0) {
+		*_buf  = client->arena[best];
+		*_size = client->arena_size[best];
+
+		client->arena_bytes -= *_size;
+		client->n_arena--;
+		client->arena[best]      = client->arena[client->n_arena];
+		client->arena_size[best] = client->arena_size[client->n_arena];
+		return 0;
+	}
+
+	size = NBD_SERVER_BUF_SIZE << 1;
+	while (size < len)
+		size <<= 1;
+
+	err = posix_memalign(_buf, NBD_SERVER_BUF_ALIGN, size);
+	if (err)
+		return -err;
+
+	*_size = size;
+	return 0;
+}
+
+/*
+ * Caches a buffer back in the arena, making room by dropping smaller
+ * buffers. What doesn't fit is freed.
+ */
+static void
+tapdisk_nbdserver_arena_put(td_nbdserver_client_t *client, void *buf,
+		size_t size)
+{
+	int i, min;
+
+	while (client->n_arena &&
+	       (client->n_arena == TAPDISK_NBD_ARENA_BUFS ||
+		client->arena_bytes + size > NBD_SERVER_ARENA_SIZE)) {
+		for (i = 1, min = 0; i < client->n_arena; i++)
+			if (client->arena_size[i] < client->arena_size[min])
+				min = i;
+
+		if (client->arena_size[min] >= size)
+			break;
+
+		free(client->arena[min]);
+		client->arena_bytes -= client->arena_size[min];
+		client->n_arena--;
+		client->arena[min]      = client->arena[client->n_arena];
+		client->arena_size[min] = client->arena_size[client->n_arena];
+	}
+
+	if (client->n_arena == TAPDISK_NBD_ARENA_BUFS ||
+	    client->arena_bytes + size > NBD_SERVER_ARENA_SIZE) {
+		free(buf);
+		return;
+	}
+
+	client->arena[client->n_arena]      = buf;
+	client->arena_size[client->n_arena] = size;
+	client->n_arena++;
+	client->arena_bytes += size;
+}
+
 static void
 tapdisk_nbdserver_set_free_request(td_nbdserver_client_t *client,
 		td_nbdserver_req_t *req)
@@ -102,6 +264,12 @@ tapdisk_nbdserver_set_free_request(td_nbdserver_client_t *client,
 	ASSERT(req);
 	BUG_ON(client->n_reqs_free >= client->n_reqs);
 
+	if (unlikely(req->buf_size > NBD_SERVER_BUF_SIZE)) {
+		tapdisk_nbdserver_arena_put(client, req->buf, req->buf_size);
+		req->buf      = tapdisk_nbdserver_slot_buf(client, req);
+		req->buf_size = NBD_SERVER_BUF_SIZE;
+	}
+
 	client->reqs_free[client->n_reqs_free++] = req;
 }
 
@@ -110,6 +278,12 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 		td_nbdserver_req_t *req)
 {
 	tapdisk_nbdserver_set_free_request(client, req);
+
+	if (unlikely(client->rx_masked) && client->client_event_id >= 0) {
+		tapdisk_server_mask_event(client->client_event_id, 0);
+		client->rx_masked = false;
+	}
+
 	if (unlikely(client->dead && !tapdisk_nbdserver_reqs_pending(client)))
 		tapdisk_nbdserver_free_client(client);
 }
@@ -117,11 +291,26 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 static void
 tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 {
+	int i;
+
 	if (client->reqs) {
+		for (i = 0; i < client->n_reqs; i++)
+			if (client->reqs[i].buf_size > NBD_SERVER_BUF_SIZE)
+				free(client->reqs[i].buf);
 		free(client->reqs);
 		client->reqs = NULL;
 	}
 
+	for (i = 0; i < client->n_arena; i++)
+		free(client->arena[i]);
+	client->n_arena     = 0;
+	client->arena_bytes = 0;
+
+	if (client->bufs) {
+		free(client->bufs);
+		client->bufs = NULL;
+	}
+
 	if (client->iovecs) {
 		free(client->iovecs);
 		client->iovecs = NULL;
@@ -143,12 +332,20 @@ tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
 
 	INFO("Reqs init");
 
-	client->reqs = malloc(n_reqs * sizeof(td_nbdserver_req_t));
+	client->reqs = calloc(n_reqs, sizeof(td_nbdserver_req_t));
 	if (!client->reqs) {
 		err = -errno;
 		goto fail;
 	}
 
+	err = posix_memalign(&client->bufs, NBD_SERVER_BUF_ALIGN,
+			(size_t)n_reqs * NBD_SERVER_BUF_SIZE);
+	if (err) {
+		client->bufs = NULL;
+		err = -err;
+		goto fail;
+	}
+
 	client->iovecs = malloc(n_reqs * sizeof(struct td_iovec));
 	if (!client->iovecs) {
 		err = - errno;
@@ -165,8 +362,12 @@ tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
 	client->n_reqs_free = 0;
 
 	for (i = 0; i < n_reqs; i++) {
-		client->reqs[i].vreq.iov = &client->iovecs[i];
-		tapdisk_nbdserver_set_free_request(client, &client->reqs[i]);
+		td_nbdserver_req_t *req = &client->reqs[i];
+
+		req->vreq.iov = &client->iovecs[i];
+		req->buf      = tapdisk_nbdserver_slot_buf(client, req);
+		req->buf_size = NBD_SERVER_BUF_SIZE;
+		tapdisk_nbdserver_set_free_request(client, req);
 	}
 
 	return 0;
@@ -197,6 +398,8 @@ tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 		return client->client_event_id;
 	}
 
+	client->rx_masked = false;
+
 	return client->client_event_id;
 }
 
@@ -237,6 +440,17 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 
 	client->client_fd = -1;
 	client->client_event_id = -1;
+	client->client_write_event_id = -1;
+	client->rx_state = TD_NBDSERVER_RX_HEADER;
+	client->rx_off = 0;
+	client->rx_req = NULL;
+	client->rx_masked = false;
+	client->no_zeroes = false;
+	client->structured = false;
+	client->meta_context = 0;
+	INIT_LIST_HEAD(&client->replies);
+	INIT_LIST_HEAD(&client->status_reqs);
+	client->status_event_id = -1;
 	client->server = server;
 	INIT_LIST_HEAD(&client->clientlist);
 	list_add(&client->clientlist, &server->clients);
@@ -256,6 +470,8 @@ fail:
 void
 tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 {
+	td_nbdserver_req_t *req, *tmp;
+
 	INFO("Free client");
 
 	ASSERT(client);
@@ -263,6 +479,32 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
+	if (client->client_write_event_id >= 0) {
+		tapdisk_server_unregister_event(client->client_write_event_id);
+		client->client_write_event_id = -1;
+	}
+
+	if (client->status_event_id >= 0) {
+		tapdisk_server_unregister_event(client->status_event_id);
+		client->status_event_id = -1;
+	}
+
+	/* replies not yet sent, and any half-received request, go */
+	list_for_each_entry_safe(req, tmp, &client->replies, next) {
+		list_del(&req->next);
+		tapdisk_nbdserver_set_free_request(client, req);
+	}
+
+	list_for_each_entry_safe(req, tmp, &client->status_reqs, next) {
+		list_del(&req->next);
+		tapdisk_nbdserver_set_free_request(client, req);
+	}
+
+	if (client->rx_req) {
+		tapdisk_nbdserver_set_free_request(client, client->rx_req);
+		client->rx_req = NULL;
+	}
+
 	if (likely(!tapdisk_nbdserver_reqs_pending(client))) {
 		list_del(&client->clientlist);
 		tapdisk_nbdserver_reqs_free(client);
@@ -280,287 +522,1623 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
-static void
-__tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
-		void *token, int final)
+static inline void
+nbd_put16(void *p, uint16_t v)
 {
-	td_nbdserver_client_t *client = token;
-	td_nbdserver_t *server = client->server;
-	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
-	unsigned long long interval;
-	struct timeval now;
-	struct nbd_reply reply;
-	int tosend = 0;
-	int sent = 0;
-	int len = 0;
-
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
-
-	gettimeofday(&now, NULL);
-	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
 
-	if (interval > 20 * 1000 * 1000) {
-		INFO("request took %llu seconds to complete", interval);
-	}
+static inline void
+nbd_put32(void *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
 
-	if (client->client_fd < 0) {
-		ERR("Finishing request for client that has disappeared");
-		goto finish;
-	}
+static inline void
+nbd_put64(void *p, uint64_t v)
+{
+	v = htonll(v);
+	memcpy(p, &v, sizeof(v));
+}
 
-	tosend = len = sizeof(reply);
-	while (tosend > 0) {
-		sent = send(client->client_fd,
-			    ((char *)&reply) + (len - tosend),
-			    tosend, 0);
-		if (sent <= 0) {
-			sent = errno;
-			ERR("Short send/error in callback: %s", strerror(sent));
-			goto finish;
-		}	
-		tosend -= sent;
-	}
+static inline uint16_t
+nbd_get16(const void *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
 
-	switch(vreq->op) {
-	case TD_OP_READ:
-		tosend = len = vreq->iov->secs << SECTOR_SHIFT;
-		server->nbd_stats.stats->read_reqs_completed++;
-		server->nbd_stats.stats->read_sectors += vreq->iov->secs;
-		server->nbd_stats.stats->read_total_ticks += interval;
-		while (tosend > 0) {
-			sent = send(client->client_fd,
-					vreq->iov->base + (len - tosend),
-					tosend, 0);
-			if (sent <= 0) {
-				sent = errno;
-				ERR("Short send/error in callback: %s", strerror(sent));
-				goto finish;
-			}
+static inline uint32_t
+nbd_get32(const void *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
 
-			tosend -= sent;
-		}
-		break;
-	case TD_OP_WRITE:
-		server->nbd_stats.stats->write_reqs_completed++;
-		server->nbd_stats.stats->write_sectors += vreq->iov->secs;
-		server->nbd_stats.stats->write_total_ticks += interval;
+/*
+ * NBD errors are positive errnos from a fixed set.
+ */
+static uint32_t
+tapdisk_nbdserver_errno(int err)
+{
+	if (err < 0)
+		err = -err;
+
+	switch (err) {
+	case 0:
+	case EPERM:
+	case EIO:
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case ENOTSUP:
+	case ESHUTDOWN:
+		return err;
 	default:
-		break;
+		return EIO;
 	}
+}
 
-	if (error)
-		server->nbd_stats.stats->io_errors++;
-
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req);
+/*
+ * Replies are built in the request: chunk headers go to tx_hdr, and
+ * tx_iov gathers them with the payload, in wire order.
+ */
+static void
+tapdisk_nbdserver_tx_reset(td_nbdserver_req_t *req)
+{
+	req->tx_hdr_len = 0;
+	req->tx_iovcnt  = 0;
+	req->tx_len     = 0;
+	req->tx_off     = 0;
+	req->tx_last    = NULL;
 }
 
 static void
-tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
+tapdisk_nbdserver_tx_add(td_nbdserver_req_t *req, void *base, size_t len)
 {
-	td_nbdserver_client_t *client;
-	char buffer[256];
-	int rc;
-	uint64_t tmp64;
-	uint32_t tmp32;
+	struct iovec *iov;
 
-	ASSERT(server);
-	ASSERT(new_fd >= 0);
+	if (!len)
+		return;
 
-	INFO("Got a new client!");
+	if (req->tx_iovcnt) {
+		iov = &req->tx_iov[req->tx_iovcnt - 1];
+		if ((char *)iov->iov_base + iov->iov_len == (char *)base) {
+			iov->iov_len += len;
+			goto out;
+		}
+	}
 
-	/* Spit out the NBD connection stuff */
+	BUG_ON(req->tx_iovcnt >= NBD_SERVER_REPLY_IOVS);
 
-	memcpy(buffer, "NBDMAGIC", 8);
-	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
-	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
-	tmp64 = htonll(server->info.size * server->info.sector_size);
-	INFO("Sending size %"PRIu64"", ntohll(tmp64));
-	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
-	tmp32 = htonl(0);
-	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
-	bzero(buffer + 28, 124);
+	iov = &req->tx_iov[req->tx_iovcnt++];
+	iov->iov_base = base;
+	iov->iov_len  = len;
 
-	rc = send(new_fd, buffer, 152, 0);
+out:
+	req->tx_len += len;
+}
 
-	if (rc != 152) {
-		int err = errno;
-		close(new_fd);
-		if (rc == -1)
-			INFO("Short write in negotiation: %s", strerror(err));
-		else
-			INFO("Short write in negotiation: wrote %d bytes instead of 152\n",
-					rc);
-		return;
-	}
+static void *
+tapdisk_nbdserver_tx_hdr(td_nbdserver_req_t *req, size_t len)
+{
+	void *hdr;
 
-	INFO("About to alloc client");
-	client = tapdisk_nbdserver_alloc_client(server);
-	if (client == NULL) {
-		ERR("Error allocating client");
-		close(new_fd);
-		return;
-	}
+	BUG_ON(req->tx_hdr_len + len > sizeof(req->tx_hdr));
 
-	INFO("Got an allocated client at %p", client);
-	client->client_fd = new_fd;
+	hdr = req->tx_hdr + req->tx_hdr_len;
+	req->tx_hdr_len += len;
+	tapdisk_nbdserver_tx_add(req, hdr, len);
 
-	INFO("About to enable client on fd %d", client->client_fd);
-	if (tapdisk_nbdserver_enable_client(client) < 0) {
-		ERR("Error enabling client");
-		tapdisk_nbdserver_free_client(client);
-		close(new_fd);
-	}
+	return hdr;
 }
 
-void
-tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+/*
+ * Starts a structured reply chunk: @hdr_len bytes of type-specific
+ * header (returned for the caller to fill in), @length bytes of chunk
+ * payload in all.
+ */
+static void *
+tapdisk_nbdserver_tx_chunk(td_nbdserver_req_t *req, uint16_t type,
+		size_t hdr_len, uint32_t length)
 {
-	td_nbdserver_client_t *client = data;
-	td_nbdserver_t *server = client->server;
-	int rc;
-	int len;
-	int hdrlen;
-	int n;
-	int fd = client->client_fd;
-	char *ptr;
-	td_vbd_request_t *vreq;
-	struct nbd_request request;
-	td_nbdserver_req_t *req;
+	struct nbd_structured_reply *chunk;
 
-	req = tapdisk_nbdserver_alloc_request(client);
-	if (!req) {
-		ERR("Couldn't allocate request in clientcb - killing client");
-		tapdisk_nbdserver_free_client(client);
-		return;
-	}
+	chunk = tapdisk_nbdserver_tx_hdr(req, sizeof(*chunk) + hdr_len);
+	chunk->magic  = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	chunk->flags  = 0;
+	chunk->type   = htons(type);
+	memcpy(chunk->handle, req->id, sizeof(chunk->handle));
+	chunk->length = htonl(length);
 
-	vreq = &req->vreq;
+	req->tx_last = chunk;
 
-	memset(req, 0, sizeof(td_nbdserver_req_t));
-	/* Read the request the client has sent */
+	return chunk + 1;
+}
 
-	hdrlen = sizeof(struct nbd_request);
+static bool
+tapdisk_nbdserver_zero(const char *buf, size_t len)
+{
+	const uint64_t *p = (const uint64_t *)buf;
+	const uint64_t *end = (const uint64_t *)(buf + len);
 
-	n = 0;
-	ptr = (char *) &request;
-	while (n < hdrlen) {
-		// FIXME: need to select() on fd with a sensible timeout
-		rc = recv(fd, ptr + n, hdrlen - n, 0);
-		if (rc == 0) {
-			INFO("Client closed connection");
-			goto fail;
-		}
-		if (rc < 0) {
-			rc = errno;
-			ERR("failed to receive from client: %s. Closing connection",
-					strerror(rc));
-			goto fail;
+	while (p < end)
+		if (*p++)
+			return false;
+
+	return true;
+}
+
+/*
+ * First run of zeroes worth sending as a hole, at or after @pos: at
+ * least NBD_SERVER_HOLE_MIN bytes, on NBD_SERVER_HOLE_GRAIN boundaries.
+ * Returns its offset, or @len with *hole = 0 if there is none.
+ */
+static size_t
+tapdisk_nbdserver_find_hole(const char *buf, size_t pos, size_t len,
+		size_t *hole)
+{
+	size_t start = pos, end = pos;
+
+	while (end + NBD_SERVER_HOLE_GRAIN <= len) {
+		if (tapdisk_nbdserver_zero(buf + end, NBD_SERVER_HOLE_GRAIN)) {
+			end += NBD_SERVER_HOLE_GRAIN;
+			continue;
 		}
-		n += rc;
-	}
 
-	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
-		ERR("Not enough magic");
-		goto fail;
+		if (end - start >= NBD_SERVER_HOLE_MIN)
+			break;
+
+		end  += NBD_SERVER_HOLE_GRAIN;
+		start = end;
 	}
 
-	request.from = ntohll(request.from);
-	request.type = ntohl(request.type);
-	len = ntohl(request.len);
-	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
-		ERR("Non sector-aligned request (%"PRIu64", %d)",
-				request.from, len);
+	if (end - start >= NBD_SERVER_HOLE_MIN) {
+		*hole = end - start;
+		return start;
 	}
 
-	bzero(req->id, sizeof(req->id));
-	memcpy(req->id, request.handle, sizeof(request.handle));
+	*hole = 0;
+	return len;
+}
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERR("posix_memalign failed (%d)", rc);
-		goto fail;
-	}
+static void
+tapdisk_nbdserver_tx_data(td_nbdserver_req_t *req, size_t pos, size_t len)
+{
+	void *hdr;
 
-	vreq->sec = request.from >> SECTOR_SHIFT;
-	vreq->iovcnt = 1;
-	vreq->iov = &req->iov;
-	vreq->iov->secs = len >> SECTOR_SHIFT;
-	vreq->token = client;
-	vreq->cb = __tapdisk_nbdserver_request_cb;
-	vreq->name = req->id;
-	vreq->vbd = server->vbd;
+	hdr = tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_OFFSET_DATA,
+					 8, 8 + len);
+	nbd_put64(hdr, req->from + pos);
+	tapdisk_nbdserver_tx_add(req, (char *)req->iov.base + pos, len);
+}
 
-	switch(request.type) {
-	case TAPDISK_NBD_CMD_READ:
-		vreq->op = TD_OP_READ;
-                server->nbd_stats.stats->read_reqs_submitted++;
-		break;
-	case TAPDISK_NBD_CMD_WRITE:
-		vreq->op = TD_OP_WRITE;
-		server->nbd_stats.stats->write_reqs_submitted++;
-		n = 0;
-		while (n < len) {
-			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
-			if (rc <= 0) {
-				ERR("Short send or error in "
-						"callback: %d", rc);
-				goto fail;
-			}
+static void
+tapdisk_nbdserver_tx_hole(td_nbdserver_req_t *req, size_t pos, size_t len)
+{
+	char *hdr;
 
-			n += rc;
-		};
+	hdr = tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_OFFSET_HOLE,
+					 12, 12);
+	nbd_put64(hdr, req->from + pos);
+	nbd_put32(hdr + 8, len);
+}
 
-		break;
-	case TAPDISK_NBD_CMD_DISC:
-		INFO("Received close message. Sending reconnect "
-				"header");
-		tapdisk_nbdserver_free_client(client);
-		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
-		INFO("Sent initial connection message");
-		return;
+/*
+ * Structured read reply: the data, with long runs of zeroes sent as
+ * hole chunks instead. A DF read gets a single chunk.
+ */
+static void
+tapdisk_nbdserver_tx_read(td_nbdserver_req_t *req)
+{
+	const char *buf = req->iov.base;
+	size_t len = req->iov.secs << SECTOR_SHIFT;
+	size_t pos, start, hole;
+	int chunks;
 
-	default:
-		ERR("Unsupported operation: 0x%x", request.type);
-		goto fail;
+	if (!len) {
+		tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_NONE, 0, 0);
+		return;
 	}
 
-	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
-	if (rc) {
-		ERR("tapdisk_vbd_queue_request failed: %d", rc);
-		goto fail;
+	if (req->cmd_flags & TAPDISK_NBD_CMD_FLAG_DF) {
+		start = tapdisk_nbdserver_find_hole(buf, 0, len, &hole);
+		if (start == 0 && hole == len)
+			tapdisk_nbdserver_tx_hole(req, 0, len);
+		else
+			tapdisk_nbdserver_tx_data(req, 0, len);
+		return;
 	}
 
-	return;
+	pos    = 0;
+	chunks = 0;
 
-fail:
-	tapdisk_nbdserver_free_client(client);
-	return;
+	while (pos < len) {
+		if (chunks + 3 > NBD_SERVER_MAX_CHUNKS) {
+			tapdisk_nbdserver_tx_data(req, pos, len - pos);
+			break;
+		}
+
+		start = tapdisk_nbdserver_find_hole(buf, pos, len, &hole);
+		if (start > pos) {
+			tapdisk_nbdserver_tx_data(req, pos, start - pos);
+			chunks++;
+		}
+
+		if (hole) {
+			tapdisk_nbdserver_tx_hole(req, start, hole);
+			chunks++;
+		}
+
+		pos = start + hole;
+	}
 }
 
 static void
-tapdisk_nbdserver_fdreceiver_cb(int fd, char *msg, void *data)
+tapdisk_nbdserver_tx_simple(td_nbdserver_req_t *req, int error)
 {
-	td_nbdserver_t *server = data;
+	struct nbd_reply *reply;
 
-	ASSERT(server);
-	ASSERT(msg);
-	ASSERT(fd >= 0);
-
-	INFO("Received fd %d with msg: %s", fd, msg);
+	reply = tapdisk_nbdserver_tx_hdr(req, sizeof(*reply));
+	reply->magic = htonl(NBD_REPLY_MAGIC);
+	reply->error = htonl(tapdisk_nbdserver_errno(error));
+	memcpy(reply->handle, req->id, sizeof(reply->handle));
 
-	tapdisk_nbdserver_newclient_fd(server, fd);
+	if (req->cmd == TAPDISK_NBD_CMD_READ)
+		tapdisk_nbdserver_tx_add(req, req->iov.base,
+					 req->iov.secs << SECTOR_SHIFT);
 }
 
 static void
-tapdisk_nbdserver_newclient(event_id_t id, char mode, void *data)
+tapdisk_nbdserver_tx_error(td_nbdserver_req_t *req, int error)
 {
-	struct sockaddr_storage their_addr;
-	socklen_t sin_size = sizeof(their_addr);
+	char *hdr;
+
+	hdr = tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_ERROR, 6, 6);
+	nbd_put32(hdr, tapdisk_nbdserver_errno(error));
+	nbd_put16(hdr + 4, 0);
+}
+
+/*
+ * Vectors for what's left of a reply, at most @max.
+ */
+static int
+tapdisk_nbdserver_reply_iov(td_nbdserver_req_t *req, struct iovec *iov,
+		int max)
+{
+	size_t off = req->tx_off;
+	int i, n = 0;
+
+	for (i = 0; i < req->tx_iovcnt && n < max; i++) {
+		struct iovec *v = &req->tx_iov[i];
+
+		if (off >= v->iov_len) {
+			off -= v->iov_len;
+			continue;
+		}
+
+		iov[n].iov_base = (char *)v->iov_base + off;
+		iov[n].iov_len  = v->iov_len - off;
+		off = 0;
+		n++;
+	}
+
+	return n;
+}
+
+static int tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client);
+
+static void
+tapdisk_nbdserver_writecb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+
+	if (tapdisk_nbdserver_send_replies(client))
+		tapdisk_nbdserver_free_client(client);
+}
+
+static int
+tapdisk_nbdserver_wait_writable(td_nbdserver_client_t *client)
+{
+	event_id_t id;
+
+	if (client->client_write_event_id >= 0)
+		return 0;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+					   client->client_fd, TV_ZERO,
+					   tapdisk_nbdserver_writecb,
+					   client);
+	if (id < 0) {
+		ERR("Error registering write event on client: %d", id);
+		return id;
+	}
+
+	client->client_write_event_id = id;
+	return 0;
+}
+
+/*
+ * Sends as much of the queued replies as the socket takes, gathering
+ * several per sendmsg. When the socket fills up, the rest goes out from
+ * the write event. An error means the client is beyond use; the caller
+ * frees it.
+ */
+static int
+tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client)
+{
+	struct iovec iov[NBD_SERVER_TX_IOVS];
+	td_nbdserver_req_t *req, *tmp;
+	struct msghdr msg;
+	ssize_t sent;
+	size_t left;
+	int n, err;
+
+	while (!list_empty(&client->replies)) {
+		n = 0;
+		list_for_each_entry(req, &client->replies, next) {
+			n += tapdisk_nbdserver_reply_iov(req, iov + n,
+							 NBD_SERVER_TX_IOVS - n);
+			if (n == NBD_SERVER_TX_IOVS)
+				break;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = n;
+
+		sent = sendmsg(client->client_fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return tapdisk_nbdserver_wait_writable(client);
+
+			err = -errno;
+			ERR("Short send/error in callback: %s", strerror(-err));
+			return err;
+		}
+
+		list_for_each_entry_safe(req, tmp, &client->replies, next) {
+			left = req->tx_len - req->tx_off;
+			if ((size_t)sent < left) {
+				req->tx_off += sent;
+				break;
+			}
+
+			sent -= left;
+			list_del(&req->next);
+			tapdisk_nbdserver_free_request(client, req);
+		}
+	}
+
+	if (client->client_write_event_id >= 0) {
+		tapdisk_server_unregister_event(client->client_write_event_id);
+		client->client_write_event_id = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queues a built reply. Nothing is sent until the caller kicks the
+ * queue.
+ */
+static void
+tapdisk_nbdserver_queue_reply(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	if (req->tx_last)
+		req->tx_last->flags = htons(NBD_REPLY_FLAG_DONE);
+
+	list_add_tail(&req->next, &client->replies);
+}
+
+static int
+tapdisk_nbdserver_kick(td_nbdserver_client_t *client)
+{
+	if (client->client_write_event_id >= 0)
+		return 0;
+
+	return tapdisk_nbdserver_send_replies(client);
+}
+
+/*
+ * Replies for a request: simple, unless structured replies were
+ * negotiated.
+ */
+static void
+tapdisk_nbdserver_reply(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, int error)
+{
+	tapdisk_nbdserver_tx_reset(req);
+
+	if (!client->structured)
+		tapdisk_nbdserver_tx_simple(req, error);
+	else if (error)
+		tapdisk_nbdserver_tx_error(req, error);
+	else if (req->cmd == TAPDISK_NBD_CMD_READ)
+		tapdisk_nbdserver_tx_read(req);
+	else
+		tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_NONE, 0, 0);
+
+	tapdisk_nbdserver_queue_reply(client, req);
+}
+
+static void
+__tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
+		void *token, int final)
+{
+	td_nbdserver_client_t *client = token;
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = container_of(vreq, td_nbdserver_req_t, vreq);
+	unsigned long long interval;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	interval = timeval_to_us(&now) - timeval_to_us(&vreq->ts);
+
+	if (interval > 20 * 1000 * 1000) {
+		INFO("request took %llu seconds to complete", interval);
+	}
+
+	switch(vreq->op) {
+	case TD_OP_READ:
+		server->nbd_stats.stats->read_reqs_completed++;
+		server->nbd_stats.stats->read_sectors += req->iov.secs;
+		server->nbd_stats.stats->read_total_ticks += interval;
+		break;
+	case TD_OP_WRITE:
+		server->nbd_stats.stats->write_reqs_completed++;
+		server->nbd_stats.stats->write_sectors += req->iov.secs;
+		server->nbd_stats.stats->write_total_ticks += interval;
+	default:
+		break;
+	}
+
+	/* trim is advisory: an image that can't give space back is fine */
+	if (vreq->op == TD_OP_DISCARD && error == -EOPNOTSUPP)
+		error = 0;
+
+	if (error)
+		server->nbd_stats.stats->io_errors++;
+
+	/*
+	 * A dead client's socket may already carry a new session (see
+	 * NBD_CMD_DISC), so its replies are dropped.
+	 */
+	if (client->dead || client->client_fd < 0) {
+		ERR("Finishing request for client that has disappeared");
+		tapdisk_nbdserver_free_request(client, req);
+		return;
+	}
+
+	tapdisk_nbdserver_reply(client, req, error);
+
+	if (tapdisk_nbdserver_kick(client))
+		tapdisk_nbdserver_free_client(client);
+}
+
+/*
+ * NBD_CMD_BLOCK_STATUS for base:allocation, from the allocation state
+ * of the image chain: what no image holds reads back as zeroes. Merged
+ * extents go out in one chunk; the reply may stop short of the request
+ * where the chain can't tell yet, but always covers something. Returns
+ * -EAGAIN (before replying) if nothing could be told yet.
+ */
+static int
+tapdisk_nbdserver_block_status(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	td_nbdserver_t *server = client->server;
+	td_sector_t sec, end;
+	uint32_t *desc, flags;
+	int i, n, nr, max, secs, allocated;
+	char *hdr;
+
+	sec  = req->from >> SECTOR_SHIFT;
+	end  = (req->from + req->len) >> SECTOR_SHIFT;
+	max  = req->cmd_flags & TAPDISK_NBD_CMD_FLAG_REQ_ONE ?
+		1 : NBD_SERVER_MAX_EXTENTS;
+	desc = req->buf;
+	nr   = 0;
+
+	while (sec < end) {
+		secs = end - sec > NBD_SERVER_STATUS_SPAN ?
+			NBD_SERVER_STATUS_SPAN : end - sec;
+
+		n = tapdisk_vbd_block_status(server->vbd, sec, secs,
+					     &allocated);
+		if (n < 0) {
+			if (nr)
+				break;
+
+			if ((n == -EAGAIN || n == -EBUSY) &&
+			    req->status_tries++ < NBD_SERVER_STATUS_RETRIES)
+				return -EAGAIN;
+
+			/* can't tell: allocated is always a safe answer */
+			allocated = 1;
+			n = secs;
+		}
+
+		flags = allocated ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+
+		if (nr && desc[2 * nr - 1] == flags)
+			desc[2 * nr - 2] += n << SECTOR_SHIFT;
+		else {
+			if (nr == max)
+				break;
+			desc[2 * nr]     = n << SECTOR_SHIFT;
+			desc[2 * nr + 1] = flags;
+			nr++;
+		}
+
+		sec += n;
+	}
+
+	for (i = 0; i < 2 * nr; i++)
+		desc[i] = htonl(desc[i]);
+
+	tapdisk_nbdserver_tx_reset(req);
+	hdr = tapdisk_nbdserver_tx_chunk(req, NBD_REPLY_TYPE_BLOCK_STATUS,
+					 4, 4 + nr * 8);
+	nbd_put32(hdr, client->meta_context);
+	tapdisk_nbdserver_tx_add(req, desc, nr * 8);
+
+	tapdisk_nbdserver_queue_reply(client, req);
+
+	return 0;
+}
+
+static void
+tapdisk_nbdserver_status_cb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	td_nbdserver_req_t *req, *tmp;
+	struct list_head retry;
+
+	tapdisk_server_unregister_event(client->status_event_id);
+	client->status_event_id = -1;
+
+	INIT_LIST_HEAD(&retry);
+	list_splice(&client->status_reqs, &retry);
+	INIT_LIST_HEAD(&client->status_reqs);
+
+	list_for_each_entry_safe(req, tmp, &retry, next) {
+		list_del(&req->next);
+		if (tapdisk_nbdserver_block_status(client, req) == -EAGAIN)
+			list_add_tail(&req->next, &client->status_reqs);
+	}
+
+	if (!list_empty(&client->status_reqs)) {
+		client->status_event_id =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					-1, TV_USECS(NBD_SERVER_STATUS_DELAY),
+					tapdisk_nbdserver_status_cb, client);
+		if (client->status_event_id < 0) {
+			ERR("Error registering block status timer: %d",
+			    client->status_event_id);
+			goto fail;
+		}
+	}
+
+	if (tapdisk_nbdserver_kick(client))
+		goto fail;
+
+	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+}
+
+static int
+tapdisk_nbdserver_status_request(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	int err;
+
+	req->status_tries = 0;
+
+	err = tapdisk_nbdserver_block_status(client, req);
+	if (err != -EAGAIN)
+		return err;
+
+	list_add_tail(&req->next, &client->status_reqs);
+
+	if (client->status_event_id < 0) {
+		client->status_event_id =
+			tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					-1, TV_USECS(NBD_SERVER_STATUS_DELAY),
+					tapdisk_nbdserver_status_cb, client);
+		if (client->status_event_id < 0) {
+			err = client->status_event_id;
+			ERR("Error registering block status timer: %d", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_set_nonblock(int fd, bool nonblock)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -errno;
+
+	if (nonblock)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	if (fcntl(fd, F_SETFL, flags) == -1)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Newstyle negotiation
+ *
+ * Option replies are small and the client waits for each before
+ * sending more, so they are sent straight out; a client that doesn't
+ * read them is dropped.
+ */
+static int
+tapdisk_nbdserver_send_all(td_nbdserver_client_t *client,
+		struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t sent;
+	size_t len;
+	int i;
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = iovcnt;
+
+	do {
+		sent = sendmsg(client->client_fd, &msg, MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0) {
+		int err = -errno;
+		ERR("Failed to send in negotiation: %s", strerror(-err));
+		return err;
+	}
+
+	if ((size_t)sent != len) {
+		ERR("Short write in negotiation: wrote %zd bytes instead of %zu",
+		    sent, len);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_opt_reply(td_nbdserver_client_t *client, uint32_t type,
+		const void *data, uint32_t len)
+{
+	struct nbd_option_reply reply;
+	struct iovec iov[2];
+
+	reply.magic  = htonll(NBD_OPT_REPLY_MAGIC);
+	reply.option = client->rx_opt.option;
+	reply.type   = htonl(type);
+	reply.len    = htonl(len);
+
+	iov[0].iov_base = &reply;
+	iov[0].iov_len  = sizeof(reply);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len  = len;
+
+	return tapdisk_nbdserver_send_all(client, iov, len ? 2 : 1);
+}
+
+static uint16_t
+tapdisk_nbdserver_export_flags(td_nbdserver_client_t *client)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS;
+
+	if (client->server->vbd->flags & TD_OPEN_RDONLY)
+		flags |= NBD_FLAG_READ_ONLY;
+
+	if (client->structured)
+		flags |= NBD_FLAG_SEND_DF;
+
+	flags |= NBD_FLAG_SEND_FLUSH;
+	if (!(flags & NBD_FLAG_READ_ONLY))
+		flags |= NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
+			NBD_FLAG_SEND_FAST_ZERO;
+
+	return flags;
+}
+
+static void
+tapdisk_nbdserver_start_transmission(td_nbdserver_client_t *client)
+{
+	INFO("Negotiated: %s replies%s", client->structured ?
+	     "structured" : "simple",
+	     client->meta_context ? ", block status" : "");
+
+	client->rx_state = TD_NBDSERVER_RX_HEADER;
+	client->rx_off   = 0;
+}
+
+/*
+ * NBD_OPT_EXPORT_NAME: no option reply, just the export details. There
+ * is only the one export, whatever its name.
+ */
+static int
+tapdisk_nbdserver_opt_export_name(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	char buf[8 + 2 + 124];
+	struct iovec iov;
+	int err;
+
+	memset(buf, 0, sizeof(buf));
+	nbd_put64(buf, server->info.size * server->info.sector_size);
+	nbd_put16(buf + 8, tapdisk_nbdserver_export_flags(client));
+
+	iov.iov_base = buf;
+	iov.iov_len  = client->no_zeroes ? 10 : sizeof(buf);
+
+	err = tapdisk_nbdserver_send_all(client, &iov, 1);
+	if (err)
+		return err;
+
+	tapdisk_nbdserver_start_transmission(client);
+	return 0;
+}
+
+/*
+ * NBD_OPT_INFO and NBD_OPT_GO: export name, then the info types asked
+ * for. We always send NBD_INFO_EXPORT, and the block sizes if asked.
+ */
+static int
+tapdisk_nbdserver_opt_go(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	const char *data = client->rx_opt_data;
+	uint32_t len = ntohl(client->rx_opt.len);
+	uint32_t name_len;
+	uint16_t n_info, i;
+	bool block_size = false;
+	char info[14];
+	int err;
+
+	if (len < 6)
+		goto invalid;
+
+	name_len = nbd_get32(data);
+	if (name_len > len - 6)
+		goto invalid;
+
+	n_info = nbd_get16(data + 4 + name_len);
+	if (len != 6 + name_len + 2 * n_info)
+		goto invalid;
+
+	for (i = 0; i < n_info; i++)
+		if (nbd_get16(data + 6 + name_len + 2 * i) ==
+		    NBD_INFO_BLOCK_SIZE)
+			block_size = true;
+
+	nbd_put16(info, NBD_INFO_EXPORT);
+	nbd_put64(info + 2, server->info.size * server->info.sector_size);
+	nbd_put16(info + 10, tapdisk_nbdserver_export_flags(client));
+
+	err = tapdisk_nbdserver_opt_reply(client, NBD_REP_INFO, info, 12);
+	if (err)
+		return err;
+
+	if (block_size) {
+		nbd_put16(info, NBD_INFO_BLOCK_SIZE);
+		nbd_put32(info + 2, SECTOR_SIZE);
+		nbd_put32(info + 6, NBD_SERVER_BUF_ALIGN);
+		nbd_put32(info + 10, NBD_SERVER_MAX_REQ_SIZE);
+
+		err = tapdisk_nbdserver_opt_reply(client, NBD_REP_INFO,
+						  info, 14);
+		if (err)
+			return err;
+	}
+
+	err = tapdisk_nbdserver_opt_reply(client, NBD_REP_ACK, NULL, 0);
+	if (err)
+		return err;
+
+	if (ntohl(client->rx_opt.option) == NBD_OPT_GO)
+		tapdisk_nbdserver_start_transmission(client);
+
+	return 0;
+
+invalid:
+	return tapdisk_nbdserver_opt_reply(client, NBD_REP_ERR_INVALID,
+					   NULL, 0);
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. The only
+ * context is base:allocation; listing with no queries, or a "base:"
+ * query, names it too.
+ */
+static int
+tapdisk_nbdserver_opt_meta_context(td_nbdserver_client_t *client)
+{
+	const char *data = client->rx_opt_data;
+	uint32_t len = ntohl(client->rx_opt.len);
+	const size_t base_len = strlen(NBD_META_BASE_ALLOCATION);
+	uint32_t name_len, n_queries, q_len, i, pos;
+	bool set, selected = false;
+	char reply[4 + 64];
+	int err;
+
+	set = ntohl(client->rx_opt.option) == NBD_OPT_SET_META_CONTEXT;
+
+	if (set && !client->structured)
+		goto invalid;
+
+	if (len < 8)
+		goto invalid;
+
+	name_len = nbd_get32(data);
+	if (name_len > len - 8)
+		goto invalid;
+
+	pos = 4 + name_len;
+	n_queries = nbd_get32(data + pos);
+	pos += 4;
+
+	for (i = 0; i < n_queries; i++) {
+		if (len - pos < 4)
+			goto invalid;
+		q_len = nbd_get32(data + pos);
+		pos += 4;
+		if (q_len > len - pos)
+			goto invalid;
+
+		if (q_len == base_len &&
+		    !memcmp(data + pos, NBD_META_BASE_ALLOCATION, q_len))
+			selected = true;
+		else if (!set && q_len == 5 && !memcmp(data + pos, "base:", 5))
+			selected = true;
+
+		pos += q_len;
+	}
+
+	if (pos != len)
+		goto invalid;
+
+	if (!set && !n_queries)
+		selected = true;
+
+	if (set)
+		client->meta_context = selected ? 1 : 0;
+
+	if (selected) {
+		nbd_put32(reply, set ? client->meta_context : 0);
+		memcpy(reply + 4, NBD_META_BASE_ALLOCATION, base_len);
+
+		err = tapdisk_nbdserver_opt_reply(client, NBD_REP_META_CONTEXT,
+						  reply, 4 + base_len);
+		if (err)
+			return err;
+	}
+
+	return tapdisk_nbdserver_opt_reply(client, NBD_REP_ACK, NULL, 0);
+
+invalid:
+	return tapdisk_nbdserver_opt_reply(client, NBD_REP_ERR_INVALID,
+					   NULL, 0);
+}
+
+/*
+ * An option has been received in full.
+ */
+static int
+tapdisk_nbdserver_option(td_nbdserver_client_t *client)
+{
+	uint32_t option = ntohl(client->rx_opt.option);
+	uint32_t len = ntohl(client->rx_opt.len);
+	char name[4];
+
+	client->rx_state = TD_NBDSERVER_RX_OPTION;
+	client->rx_off   = 0;
+
+	switch (option) {
+	case NBD_OPT_EXPORT_NAME:
+		return tapdisk_nbdserver_opt_export_name(client);
+
+	case NBD_OPT_ABORT:
+		INFO("Client aborted negotiation");
+		tapdisk_nbdserver_opt_reply(client, NBD_REP_ACK, NULL, 0);
+		return -ECONNRESET;
+
+	case NBD_OPT_LIST:
+		if (len)
+			break;
+		nbd_put32(name, 0);
+		return tapdisk_nbdserver_opt_reply(client, NBD_REP_SERVER,
+						   name, 4) ? :
+			tapdisk_nbdserver_opt_reply(client, NBD_REP_ACK,
+						    NULL, 0);
+
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO:
+		return tapdisk_nbdserver_opt_go(client);
+
+	case NBD_OPT_STRUCTURED_REPLY:
+		if (len)
+			break;
+		client->structured = true;
+		return tapdisk_nbdserver_opt_reply(client, NBD_REP_ACK,
+						   NULL, 0);
+
+	case NBD_OPT_LIST_META_CONTEXT:
+	case NBD_OPT_SET_META_CONTEXT:
+		return tapdisk_nbdserver_opt_meta_context(client);
+
+	default:
+		INFO("Unsupported option %u", option);
+		return tapdisk_nbdserver_opt_reply(client, NBD_REP_ERR_UNSUP,
+						   NULL, 0);
+	}
+
+	return tapdisk_nbdserver_opt_reply(client, NBD_REP_ERR_INVALID,
+					   NULL, 0);
+}
+
+static int
+tapdisk_nbdserver_option_header(td_nbdserver_client_t *client)
+{
+	uint32_t len;
+
+	client->rx_off = 0;
+
+	if (ntohll(client->rx_opt.magic) != NBD_OPTS_MAGIC) {
+		ERR("Bad option magic");
+		return -EINVAL;
+	}
+
+	len = ntohl(client->rx_opt.len);
+	if (len > sizeof(client->rx_opt_data)) {
+		ERR("Option %u too large (%u bytes)",
+		    ntohl(client->rx_opt.option), len);
+		return -EINVAL;
+	}
+
+	if (len) {
+		client->rx_state = TD_NBDSERVER_RX_OPTION_DATA;
+		return 0;
+	}
+
+	return tapdisk_nbdserver_option(client);
+}
+
+static int
+tapdisk_nbdserver_client_flags(td_nbdserver_client_t *client)
+{
+	uint32_t flags = ntohl(client->rx_cflags);
+
+	client->rx_off = 0;
+
+	if (!(flags & NBD_FLAG_C_FIXED_NEWSTYLE))
+		INFO("Client doesn't do fixed newstyle");
+
+	if (flags & ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+		ERR("Unknown client flags 0x%x", flags);
+		return -EINVAL;
+	}
+
+	client->no_zeroes = !!(flags & NBD_FLAG_C_NO_ZEROES);
+	client->rx_state  = TD_NBDSERVER_RX_OPTION;
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_send_greeting(td_nbdserver_client_t *client,
+				const void *buf, size_t len)
+{
+	ssize_t rc;
+
+	rc = send(client->client_fd, buf, len, 0);
+	if (rc == len)
+		return 0;
+
+	if (rc == -1)
+		INFO("Short write in negotiation: %s", strerror(errno));
+	else
+		INFO("Short write in negotiation: wrote %zd bytes instead of %zu\n",
+		     rc, len);
+	return -EIO;
+}
+
+/*
+ * Oldstyle: the export size and flags go out right away, and the client
+ * starts sending requests. Older block-nbd clients know nothing else.
+ */
+static int
+tapdisk_nbdserver_greet_oldstyle(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	char buffer[152];
+	uint64_t tmp64;
+	uint32_t tmp32;
+
+	memcpy(buffer, "NBDMAGIC", 8);
+	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
+	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+	tmp64 = htonll(server->info.size * server->info.sector_size);
+	INFO("Sending size %"PRIu64"", ntohll(tmp64));
+	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
+	tmp32 = htonl(tapdisk_nbdserver_export_flags(client));
+	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
+	bzero(buffer + 28, 124);
+
+	return tapdisk_nbdserver_send_greeting(client, buffer, sizeof(buffer));
+}
+
+/*
+ * Fixed newstyle: the size and flags follow option haggling, as the
+ * reply to NBD_OPT_GO or NBD_OPT_EXPORT_NAME.
+ */
+static int
+tapdisk_nbdserver_greet_newstyle(td_nbdserver_client_t *client)
+{
+	char buffer[18];
+	uint64_t tmp64;
+	uint16_t tmp16;
+
+	memcpy(buffer, "NBDMAGIC", 8);
+	tmp64 = htonll(NBD_OPTS_MAGIC);
+	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+	tmp16 = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	memcpy(buffer + 16, &tmp16, sizeof(tmp16));
+
+	return tapdisk_nbdserver_send_greeting(client, buffer, sizeof(buffer));
+}
+
+static void
+tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd,
+			       bool newstyle)
+{
+	td_nbdserver_client_t *client;
+	int rc;
+
+	ASSERT(server);
+	ASSERT(new_fd >= 0);
+
+	INFO("Got a new %s client!", newstyle ? "newstyle" : "oldstyle");
+
+	/* the handshake is small, and sent before the client is polled */
+	rc = tapdisk_nbdserver_set_nonblock(new_fd, false);
+	if (rc) {
+		ERR("Couldn't set client socket blocking: %s", strerror(-rc));
+		close(new_fd);
+		return;
+	}
+
+	INFO("About to alloc client");
+	client = tapdisk_nbdserver_alloc_client(server);
+	if (client == NULL) {
+		ERR("Error allocating client");
+		close(new_fd);
+		return;
+	}
+
+	INFO("Got an allocated client at %p", client);
+	client->client_fd = new_fd;
+	client->newstyle  = newstyle;
+
+	if (newstyle) {
+		rc = tapdisk_nbdserver_greet_newstyle(client);
+		client->rx_state = TD_NBDSERVER_RX_CLIENT_FLAGS;
+	} else {
+		rc = tapdisk_nbdserver_greet_oldstyle(client);
+		client->rx_state = TD_NBDSERVER_RX_HEADER;
+	}
+	if (rc)
+		goto fail;
+
+	rc = tapdisk_nbdserver_set_nonblock(new_fd, true);
+	if (rc) {
+		ERR("Couldn't set client socket non-blocking: %s",
+		    strerror(-rc));
+		goto fail;
+	}
+
+	INFO("About to enable client on fd %d", client->client_fd);
+	if (tapdisk_nbdserver_enable_client(client) < 0) {
+		ERR("Error enabling client");
+		goto fail;
+	}
+
+	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(new_fd);
+}
+
+/*
+ * Receives into buf until len bytes have arrived (counting rx_off).
+ * Returns 0 once complete, -EAGAIN if the socket ran dry first.
+ */
+static int
+tapdisk_nbdserver_recv(td_nbdserver_client_t *client, void *buf, size_t len)
+{
+	ssize_t rc;
+	int err;
+
+	do {
+		rc = recv(client->client_fd, (char *)buf + client->rx_off,
+			  len - client->rx_off, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc == 0) {
+		INFO("Client closed connection");
+		return -ECONNRESET;
+	}
+
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EAGAIN;
+		err = -errno;
+		ERR("failed to receive from client: %s. Closing connection",
+				strerror(-err));
+		return err;
+	}
+
+	client->rx_off += rc;
+
+	return client->rx_off < len ? -EAGAIN : 0;
+}
+
+static int
+tapdisk_nbdserver_grow_buf(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, size_t len)
+{
+	size_t size;
+	void *buf;
+	int err;
+
+	if (likely(len <= req->buf_size))
+		return 0;
+
+	ASSERT(req->buf_size == NBD_SERVER_BUF_SIZE);
+
+	err = tapdisk_nbdserver_arena_get(client, len, &buf, &size);
+	if (err)
+		return err;
+
+	req->buf      = buf;
+	req->buf_size = size;
+
+	return 0;
+}
+
+static td_nbdserver_req_t *
+tapdisk_nbdserver_rx_done(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req = client->rx_req;
+
+	client->rx_state = TD_NBDSERVER_RX_HEADER;
+	client->rx_off   = 0;
+	client->rx_req   = NULL;
+
+	return req;
+}
+
+static int
+tapdisk_nbdserver_queue_request(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req = tapdisk_nbdserver_rx_done(client);
+	int err;
+
+	err = tapdisk_vbd_queue_request(client->server->vbd, &req->vreq);
+	if (err) {
+		ERR("tapdisk_vbd_queue_request failed: %d", err);
+		tapdisk_nbdserver_set_free_request(client, req);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Answers the request being received right away, without queueing it:
+ * with an error, or with success for requests there's nothing to do for.
+ */
+static int
+tapdisk_nbdserver_reject(td_nbdserver_client_t *client, int error)
+{
+	td_nbdserver_req_t *req = tapdisk_nbdserver_rx_done(client);
+
+	tapdisk_nbdserver_reply(client, req, error);
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_start_status(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = client->rx_req;
+	uint64_t size;
+	int err;
+
+	if (!client->meta_context) {
+		ERR("Block status without a negotiated context");
+		return tapdisk_nbdserver_reject(client, -EINVAL);
+	}
+
+	size = server->info.size * server->info.sector_size;
+
+	if (!req->len || req->from > size || req->len > size - req->from ||
+	    ((req->from | req->len) & (SECTOR_SIZE - 1)))
+		return tapdisk_nbdserver_reject(client, -EINVAL);
+
+	err = tapdisk_nbdserver_grow_buf(client, req, NBD_SERVER_MAX_EXTENTS * 8);
+	if (err)
+		return tapdisk_nbdserver_reject(client, err);
+
+	req = tapdisk_nbdserver_rx_done(client);
+
+	return tapdisk_nbdserver_status_request(client, req);
+}
+
+/*
+ * Points the request being received at @len bytes from @buf (a NULL
+ * buffer for discards, no vector at all for flushes).
+ */
+static void
+tapdisk_nbdserver_prep_vreq(td_nbdserver_client_t *client, void *buf,
+		uint32_t len)
+{
+	td_nbdserver_req_t *req = client->rx_req;
+	td_vbd_request_t *vreq = &req->vreq;
+
+	req->iov.base = buf;
+	req->iov.secs = len >> SECTOR_SHIFT;
+
+	vreq->sec    = req->from >> SECTOR_SHIFT;
+	vreq->iovcnt = vreq->op == TD_OP_FLUSH ? 0 : 1;
+	vreq->iov    = &req->iov;
+	vreq->token  = client;
+	vreq->cb     = __tapdisk_nbdserver_request_cb;
+	vreq->name   = req->id;
+	vreq->vbd    = client->server->vbd;
+}
+
+static void *
+tapdisk_nbdserver_zeroes(void)
+{
+	static void *zeroes;
+	void *p;
+
+	if (zeroes)
+		return zeroes;
+
+	p = mmap(NULL, NBD_SERVER_ZERO_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	zeroes = p;
+	return zeroes;
+}
+
+/*
+ * Whether no image in the chain holds any of the range, i.e. it already
+ * reads back as zeroes. Only asks what the images know right now.
+ */
+static bool
+tapdisk_nbdserver_range_is_hole(td_nbdserver_t *server, uint64_t from,
+		uint32_t len)
+{
+	td_sector_t sec, end;
+	int n, secs, allocated;
+
+	sec = from >> SECTOR_SHIFT;
+	end = (from + len) >> SECTOR_SHIFT;
+
+	while (sec < end) {
+		secs = end - sec > NBD_SERVER_STATUS_SPAN ?
+			NBD_SERVER_STATUS_SPAN : end - sec;
+
+		n = tapdisk_vbd_block_status(server->vbd, sec, secs,
+					     &allocated);
+		if (n <= 0 || allocated)
+			return false;
+
+		sec += n;
+	}
+
+	return true;
+}
+
+/*
+ * NBD_CMD_WRITE_ZEROES. A range nothing in the chain holds already
+ * reads as zeroes, and is left alone -- no block gets allocated for it
+ * -- unless the client insists (NBD_CMD_FLAG_NO_HOLE). Anything else is
+ * a write of zeroes, which NBD_CMD_FLAG_FAST_ZERO asks us to refuse
+ * instead, so the client can pick its own fallback.
+ */
+static int
+tapdisk_nbdserver_start_zeroes(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req = client->rx_req;
+	struct td_iovec *iov;
+	uint32_t left, n;
+	uint64_t size;
+	void *zeroes;
+	int i, nr, err;
+
+	size = server->info.size * server->info.sector_size;
+
+	if (req->from > size || req->len > size - req->from ||
+	    ((req->from | req->len) & (SECTOR_SIZE - 1)))
+		return tapdisk_nbdserver_reject(client, -EINVAL);
+
+	if (!req->len)
+		return tapdisk_nbdserver_reject(client, 0);
+
+	if (!(req->cmd_flags & TAPDISK_NBD_CMD_FLAG_NO_HOLE) &&
+	    tapdisk_nbdserver_range_is_hole(server, req->from, req->len))
+		return tapdisk_nbdserver_reject(client, 0);
+
+	if (req->cmd_flags & TAPDISK_NBD_CMD_FLAG_FAST_ZERO)
+		return tapdisk_nbdserver_reject(client, -ENOTSUP);
+
+	zeroes = tapdisk_nbdserver_zeroes();
+	if (!zeroes)
+		return tapdisk_nbdserver_reject(client, -ENOMEM);
+
+	/* the request completes, and is answered, once all chunks are in */
+	nr  = (req->len + NBD_SERVER_ZERO_SIZE - 1) / NBD_SERVER_ZERO_SIZE;
+	err = tapdisk_nbdserver_grow_buf(client, req, nr * sizeof(*iov));
+	if (err)
+		return tapdisk_nbdserver_reject(client, err);
+
+	iov = req->buf;
+	for (i = 0, left = req->len; i < nr; i++, left -= n) {
+		n = left < NBD_SERVER_ZERO_SIZE ? left : NBD_SERVER_ZERO_SIZE;
+		iov[i].base = zeroes;
+		iov[i].secs = n >> SECTOR_SHIFT;
+	}
+
+	req->vreq.op = TD_OP_WRITE;
+	tapdisk_nbdserver_prep_vreq(client, zeroes, req->len);
+	req->vreq.iov    = iov;
+	req->vreq.iovcnt = nr;
+	server->nbd_stats.stats->write_reqs_submitted++;
+
+	return tapdisk_nbdserver_queue_request(client);
+}
+
+/*
+ * A request header is in: set up the request, then either wait for the
+ * write payload or queue it. Returns 1 if the client went away.
+ */
+static int
+tapdisk_nbdserver_start_request(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	struct nbd_request *request = &client->rx_hdr;
+	td_nbdserver_req_t *req = client->rx_req;
+	td_vbd_request_t *vreq = &req->vreq;
+	uint64_t from;
+	uint32_t type, len;
+	bool newstyle;
+	int fd, err;
+
+	client->rx_off = 0;
+
+	if (request->magic != htonl(NBD_REQUEST_MAGIC)) {
+		ERR("Not enough magic");
+		return -EINVAL;
+	}
+
+	from = ntohll(request->from);
+	type = ntohl(request->type);
+	len  = ntohl(request->len);
+	if (((len & 0x1ff) != 0) || ((from & 0x1ff) != 0)) {
+		ERR("Non sector-aligned request (%"PRIu64", %d)",
+				from, len);
+	}
+
+	memset(vreq, 0, sizeof(*vreq));
+	bzero(req->id, sizeof(req->id));
+	memcpy(req->id, request->handle, sizeof(request->handle));
+
+	req->cmd       = type & 0xffff;
+	req->cmd_flags = type >> 16;
+	req->from      = from;
+	req->len       = len;
+
+	switch(req->cmd) {
+	case TAPDISK_NBD_CMD_READ:
+		vreq->op = TD_OP_READ;
+		break;
+	case TAPDISK_NBD_CMD_WRITE:
+		vreq->op = TD_OP_WRITE;
+		break;
+	case TAPDISK_NBD_CMD_FLUSH:
+		vreq->op = TD_OP_FLUSH;
+		break;
+	case TAPDISK_NBD_CMD_TRIM:
+		vreq->op = TD_OP_DISCARD;
+		break;
+	case TAPDISK_NBD_CMD_DISC:
+		INFO("Received close message. Sending reconnect "
+				"header");
+		fd       = client->client_fd;
+		newstyle = client->newstyle;
+		tapdisk_nbdserver_free_client(client);
+		INFO("About to send initial connection message");
+		tapdisk_nbdserver_newclient_fd(server, fd, newstyle);
+		INFO("Sent initial connection message");
+		return 1;
+	case TAPDISK_NBD_CMD_WRITE_ZEROES:
+		return tapdisk_nbdserver_start_zeroes(client);
+	case TAPDISK_NBD_CMD_BLOCK_STATUS:
+		return tapdisk_nbdserver_start_status(client);
+	default:
+		ERR("Unsupported operation: 0x%x", req->cmd);
+		return tapdisk_nbdserver_reject(client, -EINVAL);
+	}
+
+	switch (vreq->op) {
+	case TD_OP_FLUSH:
+		tapdisk_nbdserver_prep_vreq(client, NULL, 0);
+		return tapdisk_nbdserver_queue_request(client);
+	case TD_OP_DISCARD:
+		if (!len)
+			return tapdisk_nbdserver_reject(client, 0);
+		tapdisk_nbdserver_prep_vreq(client, NULL, len);
+		return tapdisk_nbdserver_queue_request(client);
+	}
+
+	if (len > NBD_SERVER_MAX_REQ_SIZE) {
+		ERR("Request too large (%u bytes)", len);
+		return -EINVAL;
+	}
+
+	err = tapdisk_nbdserver_grow_buf(client, req, len);
+	if (err) {
+		ERR("Couldn't allocate %u byte buffer: %s", len, strerror(-err));
+		return err;
+	}
+
+	tapdisk_nbdserver_prep_vreq(client, req->buf, len);
+
+	if (vreq->op == TD_OP_WRITE) {
+		server->nbd_stats.stats->write_reqs_submitted++;
+		if (len) {
+			client->rx_state = TD_NBDSERVER_RX_PAYLOAD;
+			return 0;
+		}
+	} else
+		server->nbd_stats.stats->read_reqs_submitted++;
+
+	return tapdisk_nbdserver_queue_request(client);
+}
+
+void
+tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	td_nbdserver_req_t *req;
+	int i, err = 0;
+
+	for (i = 0; i < NBD_SERVER_RX_BATCH; i++) {
+		switch (client->rx_state) {
+		case TD_NBDSERVER_RX_CLIENT_FLAGS:
+			err = tapdisk_nbdserver_recv(client, &client->rx_cflags,
+						     sizeof(client->rx_cflags));
+			if (!err)
+				err = tapdisk_nbdserver_client_flags(client);
+			break;
+
+		case TD_NBDSERVER_RX_OPTION:
+			err = tapdisk_nbdserver_recv(client, &client->rx_opt,
+						     sizeof(client->rx_opt));
+			if (!err)
+				err = tapdisk_nbdserver_option_header(client);
+			break;
+
+		case TD_NBDSERVER_RX_OPTION_DATA:
+			err = tapdisk_nbdserver_recv(client, client->rx_opt_data,
+						     ntohl(client->rx_opt.len));
+			if (!err)
+				err = tapdisk_nbdserver_option(client);
+			break;
+
+		case TD_NBDSERVER_RX_HEADER:
+			if (!client->rx_req) {
+				client->rx_req =
+					tapdisk_nbdserver_alloc_request(client);
+				if (!client->rx_req) {
+					/* resumes once a request completes */
+					tapdisk_server_mask_event(
+						client->client_event_id, 1);
+					client->rx_masked = true;
+					goto out;
+				}
+			}
+
+			err = tapdisk_nbdserver_recv(client, &client->rx_hdr,
+						     sizeof(client->rx_hdr));
+			if (!err)
+				err = tapdisk_nbdserver_start_request(client);
+			break;
+
+		case TD_NBDSERVER_RX_PAYLOAD:
+			req = client->rx_req;
+			err = tapdisk_nbdserver_recv(client, req->iov.base,
+						     ntohl(client->rx_hdr.len));
+			if (!err)
+				err = tapdisk_nbdserver_queue_request(client);
+			break;
+		}
+
+		if (err == 1)
+			return;
+
+		if (err == -EAGAIN)
+			break;
+
+		if (err)
+			goto fail;
+	}
+
+out:
+	/* replies made here: rejects and block status */
+	if (tapdisk_nbdserver_kick(client))
+		goto fail;
+
+	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+}
+
+static void
+tapdisk_nbdserver_fdreceiver_cb(int fd, char *msg, void *data)
+{
+	td_nbdserver_t *server = data;
+
+	ASSERT(server);
+	ASSERT(msg);
+	ASSERT(fd >= 0);
+
+	INFO("Received fd %d with msg: %s", fd, msg);
+
+	tapdisk_nbdserver_newclient_fd(server, fd,
+		server->newstyle & TD_NBDSERVER_NEWSTYLE_FDRECV);
+}
+
+static void
+tapdisk_nbdserver_newclient(event_id_t id, char mode, void *data)
+{
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size = sizeof(their_addr);
 	char s[INET6_ADDRSTRLEN+1];
 	int new_fd;
 	td_nbdserver_t *server = data;
@@ -584,7 +2162,8 @@ tapdisk_nbdserver_newclient(event_id_t id, char mode, void *data)
 
 	INFO("server: got connection from %s\n", s);
 
-	tapdisk_nbdserver_newclient_fd(server, new_fd);
+	tapdisk_nbdserver_newclient_fd(server, new_fd,
+		server->newstyle & TD_NBDSERVER_NEWSTYLE_INET);
 }
 
 static void
@@ -608,7 +2187,41 @@ tapdisk_nbdserver_newclient_unix(event_id_t id, char mode, void *data)
 
 	INFO("server: got connection\n");
 
-	tapdisk_nbdserver_newclient_fd(server, new_fd);
+	tapdisk_nbdserver_newclient_fd(server, new_fd,
+		server->newstyle & TD_NBDSERVER_NEWSTYLE_UNIX);
+}
+
+static int
+tapdisk_nbdserver_newstyle_listeners(void)
+{
+	char *env, *list, *tok, *save;
+	int mask = 0;
+
+	env = getenv("TAPDISK3_NBD_NEWSTYLE");
+	if (!env)
+		return 0;
+
+	list = strdup(env);
+	if (!list)
+		return 0;
+
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "all"))
+			mask |= TD_NBDSERVER_NEWSTYLE_ALL;
+		else if (!strcmp(tok, "fdrecv"))
+			mask |= TD_NBDSERVER_NEWSTYLE_FDRECV;
+		else if (!strcmp(tok, "inet"))
+			mask |= TD_NBDSERVER_NEWSTYLE_INET;
+		else if (!strcmp(tok, "unix"))
+			mask |= TD_NBDSERVER_NEWSTYLE_UNIX;
+		else
+			ERR("Unknown listener '%s' in TAPDISK3_NBD_NEWSTYLE",
+			    tok);
+	}
+
+	free(list);
+	return mask;
 }
 
 td_nbdserver_t *
@@ -630,6 +2243,7 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 	server->fdrecv_listening_event_id = -1;
 	server->unix_listening_fd = -1;
 	server->unix_listening_event_id = -1;
+	server->newstyle = tapdisk_nbdserver_newstyle_listeners();
 	INIT_LIST_HEAD(&server->clients);
 
 	if (td_metrics_nbd_start(&server->nbd_stats, server->vbd->tap->minor)) {
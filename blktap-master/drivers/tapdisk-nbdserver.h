@@ -42,15 +42,82 @@ typedef struct td_nbdserver_client td_nbdserver_client_t;
 #include <stdbool.h>
 
 #define NBD_NEGOTIATION_MAGIC 0x00420281861253LL
+#define NBD_OPTS_MAGIC 0x49484156454F5054LL /* "IHAVEOPT" */
+#define NBD_OPT_REPLY_MAGIC 0x3e889045565a9LL
 #define NBD_REQUEST_MAGIC 0x25609513
 #define NBD_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+/* handshake flags (server) and client flags */
+#define NBD_FLAG_FIXED_NEWSTYLE		(1 << 0)
+#define NBD_FLAG_NO_ZEROES		(1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE	NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES		NBD_FLAG_NO_ZEROES
+
+/* transmission flags */
+#define NBD_FLAG_HAS_FLAGS		(1 << 0)
+#define NBD_FLAG_READ_ONLY		(1 << 1)
+#define NBD_FLAG_SEND_FLUSH		(1 << 2)
+#define NBD_FLAG_SEND_TRIM		(1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES	(1 << 6)
+#define NBD_FLAG_SEND_DF		(1 << 7)
+#define NBD_FLAG_SEND_FAST_ZERO		(1 << 11)
+
+/* options */
+#define NBD_OPT_EXPORT_NAME		1
+#define NBD_OPT_ABORT			2
+#define NBD_OPT_LIST			3
+#define NBD_OPT_INFO			6
+#define NBD_OPT_GO			7
+#define NBD_OPT_STRUCTURED_REPLY	8
+#define NBD_OPT_LIST_META_CONTEXT	9
+#define NBD_OPT_SET_META_CONTEXT	10
+
+/* option replies */
+#define NBD_REP_ACK			1
+#define NBD_REP_SERVER			2
+#define NBD_REP_INFO			3
+#define NBD_REP_META_CONTEXT		4
+#define NBD_REP_FLAG_ERROR		(1U << 31)
+#define NBD_REP_ERR_UNSUP		(NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_INVALID		(NBD_REP_FLAG_ERROR | 3)
+#define NBD_REP_ERR_TOO_BIG		(NBD_REP_FLAG_ERROR | 9)
+
+#define NBD_INFO_EXPORT			0
+#define NBD_INFO_BLOCK_SIZE		3
+
+/* structured reply chunks */
+#define NBD_REPLY_FLAG_DONE		(1 << 0)
+#define NBD_REPLY_TYPE_NONE		0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_OFFSET_HOLE	2
+#define NBD_REPLY_TYPE_BLOCK_STATUS	5
+#define NBD_REPLY_TYPE_ERROR		((1 << 15) | 1)
+
+/* base:allocation extent flags */
+#define NBD_STATE_HOLE			(1 << 0)
+#define NBD_STATE_ZERO			(1 << 1)
+
+#define NBD_META_BASE_ALLOCATION	"base:allocation"
 
 enum {
 	TAPDISK_NBD_CMD_READ = 0,
 	TAPDISK_NBD_CMD_WRITE = 1,
-	TAPDISK_NBD_CMD_DISC = 2
+	TAPDISK_NBD_CMD_DISC = 2,
+	TAPDISK_NBD_CMD_FLUSH = 3,
+	TAPDISK_NBD_CMD_TRIM = 4,
+	TAPDISK_NBD_CMD_WRITE_ZEROES = 6,
+	TAPDISK_NBD_CMD_BLOCK_STATUS = 7
 };
 
+/*
+ * Command flags, in the upper 16 bits of nbd_request.type.
+ */
+#define TAPDISK_NBD_CMD_FLAG_NO_HOLE	(1 << 1)
+#define TAPDISK_NBD_CMD_FLAG_DF		(1 << 2)
+#define TAPDISK_NBD_CMD_FLAG_REQ_ONE	(1 << 3)
+#define TAPDISK_NBD_CMD_FLAG_FAST_ZERO	(1 << 4)
+
 struct nbd_request {
 	uint32_t magic;
 	uint32_t type;	
@@ -65,12 +132,58 @@ struct nbd_reply {
 	char handle[8];		
 };
 
+struct nbd_structured_reply {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	char handle[8];
+	uint32_t length;
+} __attribute__ ((packed));
+
+/*
+ * Newstyle negotiation: option requests from the client, and the
+ * server's replies to them.
+ */
+struct nbd_option {
+	uint64_t magic;
+	uint32_t option;
+	uint32_t len;
+} __attribute__ ((packed));
+
+struct nbd_option_reply {
+	uint64_t magic;
+	uint32_t option;
+	uint32_t type;
+	uint32_t len;
+} __attribute__ ((packed));
+
+#define TAPDISK_NBD_MAX_OPTION_LEN 8192
+
+/*
+ * Large write buffers a client keeps around for reuse.
+ */
+#define TAPDISK_NBD_ARENA_BUFS 8
+
 
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdclient"
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbdserver"
 #define TAPDISK_NBDSERVER_SOCK_PATH BLKTAP2_CONTROL_DIR"/nbd"
 
+/*
+ * Listeners default to the oldstyle handshake, which is all that older
+ * block-nbd clients understand. Newstyle (option haggling, structured
+ * replies, block status) is enabled per listener with
+ * TAPDISK3_NBD_NEWSTYLE: a comma-separated list of "fdrecv", "inet" and
+ * "unix", or "all".
+ */
+#define TD_NBDSERVER_NEWSTYLE_FDRECV  (1 << 0)
+#define TD_NBDSERVER_NEWSTYLE_INET    (1 << 1)
+#define TD_NBDSERVER_NEWSTYLE_UNIX    (1 << 2)
+#define TD_NBDSERVER_NEWSTYLE_ALL     (TD_NBDSERVER_NEWSTYLE_FDRECV | \
+				       TD_NBDSERVER_NEWSTYLE_INET |   \
+				       TD_NBDSERVER_NEWSTYLE_UNIX)
+
 struct td_nbdserver {
 	td_vbd_t               *vbd;
 	td_disk_info_t          info;
@@ -109,9 +222,28 @@ struct td_nbdserver {
 
 	struct list_head        clients;
 
+	/**
+	 * Listeners greeting clients with fixed newstyle negotiation
+	 * (TD_NBDSERVER_NEWSTYLE_*); the others speak oldstyle.
+	 */
+	int                     newstyle;
+
 	stats_t                 nbd_stats;
 };
 
+/*
+ * Where the client's receive state machine is: reading a request header,
+ * or reading the payload of a write into the request's buffer. Before
+ * that, the newstyle handshake: client flags, then options.
+ */
+enum td_nbdserver_rx_state {
+	TD_NBDSERVER_RX_HEADER = 0,
+	TD_NBDSERVER_RX_PAYLOAD,
+	TD_NBDSERVER_RX_CLIENT_FLAGS,
+	TD_NBDSERVER_RX_OPTION,
+	TD_NBDSERVER_RX_OPTION_DATA,
+};
+
 struct td_nbdserver_client {
 	int                     n_reqs;
 	td_nbdserver_req_t     *reqs;
@@ -119,9 +251,69 @@ struct td_nbdserver_client {
 	int                     n_reqs_free;
 	td_nbdserver_req_t    **reqs_free;
 
+	/**
+	 * Request buffers, one per request, and the arena larger writes
+	 * borrow from: arena_bytes is what the cached buffers add up to.
+	 */
+	void                   *bufs;
+	void                   *arena[TAPDISK_NBD_ARENA_BUFS];
+	size_t                  arena_size[TAPDISK_NBD_ARENA_BUFS];
+	int                     n_arena;
+	size_t                  arena_bytes;
+
 	int                     client_fd;
 	int                     client_event_id;
 
+	/**
+	 * Write event, registered only while replies are backed up on a full
+	 * socket.
+	 */
+	int                     client_write_event_id;
+
+	/**
+	 * Partially received request. The header is read into rx_hdr, a write
+	 * payload into rx_req's buffer; rx_off counts the bytes of either
+	 * received so far.
+	 */
+	enum td_nbdserver_rx_state rx_state;
+	struct nbd_request      rx_hdr;
+	size_t                  rx_off;
+	td_nbdserver_req_t     *rx_req;
+
+	/**
+	 * Handshake: client flags and the option being received.
+	 */
+	uint32_t                rx_cflags;
+	struct nbd_option       rx_opt;
+	char                    rx_opt_data[TAPDISK_NBD_MAX_OPTION_LEN];
+
+	/**
+	 * What was negotiated: the handshake, structured replies, and the
+	 * id of the base:allocation context for NBD_CMD_BLOCK_STATUS (0 if
+	 * none).
+	 */
+	bool                    newstyle;
+	bool                    no_zeroes;
+	bool                    structured;
+	uint32_t                meta_context;
+
+	/**
+	 * Block status requests waiting for image metadata, retried off a
+	 * timer.
+	 */
+	struct list_head        status_reqs;
+	int                     status_event_id;
+
+	/**
+	 * The read event is masked while all requests are in flight.
+	 */
+	bool                    rx_masked;
+
+	/**
+	 * Completed requests whose replies are still (partly) unsent.
+	 */
+	struct list_head        replies;
+
 	td_nbdserver_t         *server;
 	struct list_head        clientlist;
 
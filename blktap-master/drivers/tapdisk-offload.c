@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "debug.h"
+#include "tapdisk.h"
+#include "tapdisk-server.h"
+#include "tapdisk-offload.h"
+#include "timeout-math.h"
+
+#define TD_OFFLOAD_MAX_THREADS       16
+
+/*
+ * Jobs go back to the event loop they came from: each loop has a list
+ * of finished jobs, and an eventfd to wake it up. It is set up on the
+ * first tapdisk_offload_get or submit from that loop, and torn down
+ * once the last reference is put and no jobs are left in flight.
+ * Only the loop itself touches @users and @pending.
+ */
+struct td_offload_home {
+	pthread_mutex_t              lock;
+	td_offload_job_t            *done;
+	int                          fd;
+	event_id_t                   id;
+	int                          users;
+	int                          pending;
+};
+
+static struct {
+	pthread_mutex_t              lock;
+	pthread_cond_t               cond;
+	td_offload_job_t            *head;
+	td_offload_job_t            *tail;
+	int                          threads;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct td_offload_home *offload_home;
+
+static void
+tapdisk_offload_release(struct td_offload_home *home)
+{
+	if (home->users || home->pending)
+		return;
+
+	tapdisk_server_unregister_event(home->id);
+	close(home->fd);
+	pthread_mutex_destroy(&home->lock);
+	free(home);
+
+	offload_home = NULL;
+}
+
+static void
+tapdisk_offload_done_cb(event_id_t id, char mode, void *private)
+{
+	struct td_offload_home *home = private;
+	td_offload_job_t *job, *list, *fifo;
+	uint64_t n;
+
+	if (read(home->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		EPRINTF("offload: failed to read eventfd: %s\n",
+			strerror(errno));
+
+	pthread_mutex_lock(&home->lock);
+	list       = home->done;
+	home->done = NULL;
+	pthread_mutex_unlock(&home->lock);
+
+	/* finished jobs were pushed LIFO; complete them in order */
+	fifo = NULL;
+	while (list) {
+		job       = list;
+		list      = job->next;
+		job->next = fifo;
+		fifo      = job;
+		home->pending--;
+	}
+
+	/* a done() may put the last reference: hold one until we're through */
+	home->users++;
+
+	while (fifo) {
+		job  = fifo;
+		fifo = job->next;
+		job->done(job);
+	}
+
+	home->users--;
+	tapdisk_offload_release(home);
+}
+
+static struct td_offload_home *
+tapdisk_offload_home(void)
+{
+	struct td_offload_home *home;
+
+	if (offload_home)
+		return offload_home;
+
+	home = calloc(1, sizeof(*home));
+	if (!home)
+		return NULL;
+
+	pthread_mutex_init(&home->lock, NULL);
+
+	home->fd = eventfd(0, EFD_NONBLOCK);
+	if (home->fd == -1)
+		goto fail;
+
+	home->id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						 home->fd, TV_ZERO,
+						 tapdisk_offload_done_cb,
+						 home);
+	if (home->id < 0) {
+		close(home->fd);
+		goto fail;
+	}
+
+	offload_home = home;
+	return home;
+
+fail:
+	pthread_mutex_destroy(&home->lock);
+	free(home);
+	return NULL;
+}
+
+static void
+tapdisk_offload_return(td_offload_job_t *job)
+{
+	struct td_offload_home *home = job->home;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&home->lock);
+	job->next  = home->done;
+	home->done = job;
+	pthread_mutex_unlock(&home->lock);
+
+	if (write(home->fd, &one, sizeof(one)) != sizeof(one))
+		EPRINTF("offload: failed to kick loop: %s\n", strerror(errno));
+}
+
+static void *
+tapdisk_offload_worker(void *arg)
+{
+	td_offload_job_t *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.head)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		job       = pool.head;
+		pool.head = job->next;
+		if (!pool.head)
+			pool.tail = NULL;
+		pthread_mutex_unlock(&pool.lock);
+
+		job->work(job);
+		tapdisk_offload_return(job);
+	}
+
+	return NULL;
+}
+
+int
+tapdisk_offload_start(int threads)
+{
+	sigset_t set, old;
+	pthread_t thread;
+	int i, err;
+
+	pthread_mutex_lock(&pool.lock);
+
+	if (threads > TD_OFFLOAD_MAX_THREADS)
+		threads = TD_OFFLOAD_MAX_THREADS;
+
+	if (threads <= pool.threads)
+		goto out;
+
+	/* workers never take signals */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = pool.threads; i < threads; i++) {
+		err = pthread_create(&thread, NULL,
+				     tapdisk_offload_worker, NULL);
+		if (err) {
+			EPRINTF("offload: failed to start worker %d: %s\n",
+				i, strerror(err));
+			break;
+		}
+		pthread_detach(thread);
+		pool.threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pool.threads)
+		DPRINTF("offload: %d worker threads\n", pool.threads);
+
+out:
+	threads = pool.threads;
+	pthread_mutex_unlock(&pool.lock);
+	return threads;
+}
+
+int
+tapdisk_offload_get(void)
+{
+	struct td_offload_home *home;
+
+	home = tapdisk_offload_home();
+	if (!home)
+		return -ENOMEM;
+
+	home->users++;
+	return 0;
+}
+
+void
+tapdisk_offload_put(void)
+{
+	struct td_offload_home *home = offload_home;
+
+	if (!home)
+		return;
+
+	home->users--;
+	tapdisk_offload_release(home);
+}
+
+int
+tapdisk_offload_submit(td_offload_job_t *job)
+{
+	struct td_offload_home *home;
+
+	if (!pool.threads)
+		return -ENOSYS;
+
+	home = tapdisk_offload_home();
+	if (!home)
+		return -ENOSYS;
+
+	job->home = home;
+	job->next = NULL;
+	home->pending++;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.tail)
+		pool.tail->next = job;
+	else
+		pool.head = job;
+	pool.tail = job;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	return 0;
+}
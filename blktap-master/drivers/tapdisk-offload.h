@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_OFFLOAD_H__
+#define __TAPDISK_OFFLOAD_H__
+
+/*
+ * A small pool of worker threads for CPU-bound work on the data path.
+ * A job's work() runs on a worker, then its done() runs back on the
+ * event loop which submitted it.
+ */
+
+typedef struct td_offload_job td_offload_job_t;
+typedef void (*td_offload_fn_t)(td_offload_job_t *);
+
+struct td_offload_job {
+	td_offload_fn_t              work;
+	td_offload_fn_t              done;
+
+	/* private */
+	struct td_offload_home      *home;
+	td_offload_job_t            *next;
+};
+
+/*
+ * Grows the pool to @threads workers (it never shrinks). Returns the
+ * number of workers running.
+ */
+int tapdisk_offload_start(int threads);
+
+/*
+ * Take and drop a reference on the calling loop's completion channel,
+ * so it stays set up between submits. Users get it once the pool is
+ * started, and put it from the same loop when they are done.
+ */
+int tapdisk_offload_get(void);
+void tapdisk_offload_put(void);
+
+/*
+ * Queues @job for the pool. Returns -ENOSYS if there is no pool, and
+ * the caller is to do the work itself.
+ */
+int tapdisk_offload_submit(td_offload_job_t *job);
+
+#endif /* __TAPDISK_OFFLOAD_H__ */
@@ -35,10 +35,17 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -219,6 +226,9 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
 
+	if (iocb->aio_lio_opcode == IO_CMD_FDSYNC)
+		return fdatasync(fd) ? -errno : 0;
+
 	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
 		return -errno;
 
@@ -553,6 +563,676 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_IO_URING
+/*
+ * io_uring
+ *
+ * iocbs are copied straight into the shared submission ring and
+ * completions are reaped from the shared completion ring. The ring fd
+ * polls readable while completions are outstanding, so reaping costs
+ * no syscall. With SQPOLL, a kernel thread picks up submissions and
+ * we only enter the kernel to wake it after it went idle.
+ */
+
+#define URING_MAX_FILES         4096
+#define URING_MAX_BUFS          1024
+#define URING_SQ_THREAD_IDLE    50 /* ms */
+
+struct uring_buf {
+	char                 *base;
+	size_t                len;
+	int                   idx;
+};
+
+struct uring {
+	int                   ring_fd;
+	int                   event_id;
+
+	void                 *sq_ring;
+	size_t                sq_ring_sz;
+	void                 *cq_ring;
+	size_t                cq_ring_sz;
+	struct io_uring_sqe  *sqes;
+	size_t                sqes_sz;
+
+	unsigned int         *sq_head;
+	unsigned int         *sq_tail;
+	unsigned int         *sq_mask;
+	unsigned int         *sq_flags;
+	unsigned int         *sq_array;
+
+	unsigned int         *cq_head;
+	unsigned int         *cq_tail;
+	unsigned int         *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	struct io_event      *aio_events;
+
+	/* fixed files: slot n holds fd n, if set */
+	char                 *files;
+	int                   n_files;
+
+	/* fixed buffers, sorted by base address */
+	struct uring_buf     *bufs;
+	int                   n_bufs;
+	int                  *free_bufs;
+	int                   n_free_bufs;
+
+	int                   flags;
+};
+
+#define URING_FLAG_SQPOLL       (1<<0)
+#define URING_FLAG_FIXED_FILES  (1<<1)
+#define URING_FLAG_FIXED_BUFS   (1<<2)
+
+static inline int
+__uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned int to_submit, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_sz);
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_sz);
+	uring->cq_ring = NULL;
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_sz);
+		uring->sq_ring = NULL;
+	}
+
+	/* drops all registered files and buffers */
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+
+	free(uring->files);
+	uring->files = NULL;
+
+	free(uring->bufs);
+	uring->bufs = NULL;
+
+	free(uring->free_bufs);
+	uring->free_bufs = NULL;
+}
+
+static int
+tapdisk_uring_map_rings(struct tqueue *queue, struct io_uring_params *p)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned int i;
+	void *ptr;
+
+	uring->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	uring->cq_ring_sz = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_sz > uring->sq_ring_sz)
+			uring->sq_ring_sz = uring->cq_ring_sz;
+		uring->cq_ring_sz = uring->sq_ring_sz;
+	}
+
+	ptr = mmap(NULL, uring->sq_ring_sz, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sq_ring = ptr;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		ptr = mmap(NULL, uring->cq_ring_sz, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, uring->ring_fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			return -errno;
+		uring->cq_ring = ptr;
+	}
+
+	uring->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, uring->sqes_sz, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	uring->sqes = ptr;
+
+	uring->sq_head  = uring->sq_ring + p->sq_off.head;
+	uring->sq_tail  = uring->sq_ring + p->sq_off.tail;
+	uring->sq_mask  = uring->sq_ring + p->sq_off.ring_mask;
+	uring->sq_flags = uring->sq_ring + p->sq_off.flags;
+	uring->sq_array = uring->sq_ring + p->sq_off.array;
+
+	uring->cq_head  = uring->cq_ring + p->cq_off.head;
+	uring->cq_tail  = uring->cq_ring + p->cq_off.tail;
+	uring->cq_mask  = uring->cq_ring + p->cq_off.ring_mask;
+	uring->cqes     = uring->cq_ring + p->cq_off.cqes;
+
+	/* sqes are used in ring order, so the index array is fixed */
+	for (i = 0; i < p->sq_entries; i++)
+		uring->sq_array[i] = i;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_setup_ring(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+
+	if (queue->flags & TIO_URING_SQPOLL) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_THREAD_IDLE;
+	}
+
+	fd = __uring_setup(qlen, &p);
+	if (fd < 0)
+		return -errno;
+
+	uring->ring_fd = fd;
+
+	if ((p.flags & IORING_SETUP_SQPOLL) &&
+	    !(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+		DPRINTF("io_uring: SQPOLL requires fixed files on this kernel, "
+			"disabling\n");
+		close(uring->ring_fd);
+
+		p.flags &= ~IORING_SETUP_SQPOLL;
+		fd = __uring_setup(qlen, &p);
+		if (fd < 0) {
+			uring->ring_fd = -1;
+			return -errno;
+		}
+
+		uring->ring_fd = fd;
+	}
+
+	if (p.flags & IORING_SETUP_SQPOLL)
+		uring->flags |= URING_FLAG_SQPOLL;
+
+	/*
+	 * The queue never has more than qlen iocbs in flight, and the
+	 * kernel sizes the CQ at twice the SQ, so neither ring can
+	 * overflow.
+	 */
+	return tapdisk_uring_map_rings(queue, &p);
+}
+
+static int
+tapdisk_uring_setup_files(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_rsrc_register reg;
+	int err;
+
+	uring->files = calloc(URING_MAX_FILES, sizeof(char));
+	if (!uring->files)
+		return -errno;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr    = URING_MAX_FILES;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_FILES2,
+			       &reg, sizeof(reg));
+	if (err < 0)
+		return -errno;
+
+	uring->n_files = URING_MAX_FILES;
+	uring->flags  |= URING_FLAG_FIXED_FILES;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_setup_bufs(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_rsrc_register reg;
+	int i, err;
+
+	uring->bufs = calloc(URING_MAX_BUFS, sizeof(struct uring_buf));
+	uring->free_bufs = calloc(URING_MAX_BUFS, sizeof(int));
+	if (!uring->bufs || !uring->free_bufs)
+		return -errno;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr    = URING_MAX_BUFS;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS2,
+			       &reg, sizeof(reg));
+	if (err < 0)
+		return -errno;
+
+	for (i = 0; i < URING_MAX_BUFS; i++)
+		uring->free_bufs[i] = URING_MAX_BUFS - 1 - i;
+	uring->n_free_bufs = URING_MAX_BUFS;
+
+	uring->flags |= URING_FLAG_FIXED_BUFS;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private);
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_id = -1;
+
+	err = tapdisk_uring_setup_ring(queue, qlen);
+	if (err)
+		goto fail;
+
+	/*
+	 * Registered files and buffers are an optimization only.
+	 * Run without them if the kernel won't have it.
+	 */
+	if (queue->flags & TIO_URING_FIXED_FILES) {
+		err = tapdisk_uring_setup_files(queue);
+		if (err)
+			DPRINTF("io_uring: no fixed files: %d\n", err);
+	}
+
+	if (queue->flags & TIO_URING_FIXED_BUFS) {
+		err = tapdisk_uring_setup_bufs(queue);
+		if (err)
+			DPRINTF("io_uring: no fixed buffers: %d\n", err);
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->ring_fd, TV_ZERO,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_file_slot(struct uring *uring, int fd)
+{
+	struct io_uring_files_update up;
+	int err;
+
+	if (!(uring->flags & URING_FLAG_FIXED_FILES))
+		return -1;
+
+	if (fd < 0 || fd >= uring->n_files)
+		return -1;
+
+	if (uring->files[fd])
+		return fd;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = fd;
+	up.fds    = (unsigned long)&fd;
+
+	err = __uring_register(uring->ring_fd,
+			       IORING_REGISTER_FILES_UPDATE, &up, 1);
+	if (err < 0)
+		return -1;
+
+	uring->files[fd] = 1;
+
+	return fd;
+}
+
+static void
+tapdisk_uring_forget_files(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int fd, unset = -1;
+
+	for (fd = 0; fd < uring->n_files; fd++) {
+		if (!uring->files[fd])
+			continue;
+
+		memset(&up, 0, sizeof(up));
+		up.offset = fd;
+		up.fds    = (unsigned long)&unset;
+
+		__uring_register(uring->ring_fd,
+				 IORING_REGISTER_FILES_UPDATE, &up, 1);
+
+		uring->files[fd] = 0;
+	}
+}
+
+static int
+__uring_update_buf(struct uring *uring, int idx, void *base, size_t len)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec iov;
+	int err;
+
+	iov.iov_base = base;
+	iov.iov_len  = len;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = idx;
+	up.data   = (unsigned long)&iov;
+	up.nr     = 1;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS_UPDATE,
+			       &up, sizeof(up));
+
+	return err < 0 ? -errno : 0;
+}
+
+/*
+ * returns the slot of the first buffer ending above @addr
+ */
+static int
+tapdisk_uring_buf_lookup(struct uring *uring, const char *addr)
+{
+	int lo = 0, hi = uring->n_bufs;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct uring_buf *b = &uring->bufs[mid];
+
+		if (addr < b->base + b->len)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+static int
+tapdisk_uring_buf_index(struct uring *uring, const char *buf, size_t len)
+{
+	struct uring_buf *b;
+	int i;
+
+	if (!uring->n_bufs)
+		return -1;
+
+	i = tapdisk_uring_buf_lookup(uring, buf);
+	if (i == uring->n_bufs)
+		return -1;
+
+	b = &uring->bufs[i];
+	if (buf < b->base || buf + len > b->base + b->len)
+		return -1;
+
+	return b->idx;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t len)
+{
+	struct uring *uring = queue->tio_data;
+	struct uring_buf *b;
+	int i, idx, err;
+
+	if (!(uring->flags & URING_FLAG_FIXED_BUFS))
+		return -EOPNOTSUPP;
+
+	if (!uring->n_free_bufs)
+		return -ENOSPC;
+
+	i = tapdisk_uring_buf_lookup(uring, buf);
+	if (i < uring->n_bufs && uring->bufs[i].base < (char *)buf + len)
+		return -EEXIST;
+
+	idx = uring->free_bufs[uring->n_free_bufs - 1];
+
+	err = __uring_update_buf(uring, idx, buf, len);
+	if (err)
+		return err;
+
+	uring->n_free_bufs--;
+
+	b = &uring->bufs[i];
+	memmove(b + 1, b, (uring->n_bufs - i) * sizeof(*b));
+	b->base = buf;
+	b->len  = len;
+	b->idx  = idx;
+	uring->n_bufs++;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	struct uring_buf *b;
+	int i;
+
+	if (!uring->n_bufs)
+		return;
+
+	i = tapdisk_uring_buf_lookup(uring, buf);
+	if (i == uring->n_bufs || uring->bufs[i].base != buf)
+		return;
+
+	b = &uring->bufs[i];
+
+	/* in-flight I/O keeps its reference to the old buffer */
+	__uring_update_buf(uring, b->idx, NULL, 0);
+
+	uring->free_bufs[uring->n_free_bufs++] = b->idx;
+
+	uring->n_bufs--;
+	memmove(b, b + 1, (uring->n_bufs - i) * sizeof(*b));
+}
+
+static inline void
+tapdisk_uring_prep_sqe(struct uring *uring,
+		       struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	int fd, idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_FSYNC:
+	case IO_CMD_FDSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		if (iocb->aio_lio_opcode == IO_CMD_FDSYNC)
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		break;
+
+	default:
+		sqe->addr = (unsigned long)iocb->u.c.buf;
+		sqe->len  = iocb->u.c.nbytes;
+		sqe->off  = iocb->u.c.offset;
+
+		idx = tapdisk_uring_buf_index(uring, iocb->u.c.buf,
+					      iocb->u.c.nbytes);
+		if (idx >= 0) {
+			sqe->opcode    = iocb->aio_lio_opcode == IO_CMD_PWRITE ?
+				IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = idx;
+		} else
+			sqe->opcode    = iocb->aio_lio_opcode == IO_CMD_PWRITE ?
+				IORING_OP_WRITE : IORING_OP_READ;
+		break;
+	}
+
+	fd = tapdisk_uring_file_slot(uring, iocb->aio_fildes);
+	if (fd >= 0)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	else
+		fd = iocb->aio_fildes;
+
+	sqe->fd        = fd;
+	sqe->user_data = (unsigned long)iocb;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned int tail, mask;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *uring->sq_tail;
+	mask = *uring->sq_mask;
+
+	for (i = 0; i < merged; i++)
+		tapdisk_uring_prep_sqe(uring, &uring->sqes[(tail + i) & mask],
+				       queue->iocbs[i]);
+
+	__atomic_store_n(uring->sq_tail, tail + merged, __ATOMIC_RELEASE);
+
+	if (uring->flags & URING_FLAG_SQPOLL) {
+		submitted = merged;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			__uring_enter(uring->ring_fd, 0, IORING_ENTER_SQ_WAKEUP);
+	} else {
+		submitted = __uring_enter(uring->ring_fd, merged, 0);
+		if (submitted < 0) {
+			err = -errno;
+			submitted = 0;
+		} else if (submitted < merged)
+			err = -EIO;
+
+		/* take back whatever the kernel did not consume */
+		if (submitted < merged)
+			__atomic_store_n(uring->sq_tail, tail + submitted,
+					 __ATOMIC_RELEASE);
+	}
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	unsigned int head, tail, mask;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	struct io_uring_cqe *cqe;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	mask = *uring->cq_mask;
+
+	for (ret = 0; head != tail && ret < queue->size; ret++, head++) {
+		cqe = &uring->cqes[head & mask];
+		ep  = &uring->aio_events[ret];
+
+		ep->obj = (struct iocb *)(unsigned long)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+	.tio_forget_files      = tapdisk_uring_forget_files,
+};
+#endif /* HAVE_IO_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -574,13 +1254,21 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	const struct tio *tio;
 	int err;
 
-	switch (drv) {
+	switch (drv & TIO_DRV_MASK) {
 	case TIO_DRV_LIO:
 		tio = &td_tio_lio;
 		break;
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+	case TIO_DRV_URING:
+#ifdef HAVE_IO_URING
+		tio = &td_tio_uring;
+		break;
+#else
+		err = -EOPNOTSUPP;
+		goto fail;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -619,6 +1307,7 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 	memset(queue, 0, sizeof(struct tqueue));
 
 	queue->size   = size;
+	queue->flags  = drv & ~TIO_DRV_MASK;
 	queue->filter = filter;
 
 	if (!size)
@@ -679,6 +1368,36 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+/*
+ * Buffers and files the I/O driver may pin for cheaper submission.
+ * Registration is advisory: drivers without support ignore it.
+ */
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t len)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, buf, len);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
+/*
+ * Call after closing files, their fd numbers may get reused.
+ */
+void
+tapdisk_queue_forget_files(struct tqueue *queue)
+{
+	if (queue->tio && queue->tio->tio_forget_files)
+		queue->tio->tio_forget_files(queue);
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
@@ -696,6 +1415,20 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+void
+tapdisk_prep_fdsync_tiocb(struct tiocb *tiocb, int fd,
+			  td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	io_prep_fdsync(iocb, fd);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
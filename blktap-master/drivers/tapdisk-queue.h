@@ -57,6 +57,7 @@ struct tlist {
 
 struct tqueue {
 	int                   size;
+	int                   flags;
 
 	const struct tio     *tio;
 	void                 *tio_data;
@@ -93,13 +94,29 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: pre-registration of long-lived I/O state */
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t len);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
+	void (*tio_forget_files)      (struct tqueue *queue);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
+#define TIO_DRV_MASK              0xff
+
+/*
+ * io_uring options, or'ed into the drv argument of tapdisk_init_queue.
+ */
+#define TIO_URING_SQPOLL          (1<<8)
+#define TIO_URING_FIXED_FILES     (1<<9)
+#define TIO_URING_FIXED_BUFS      (1<<10)
+
 /*
  * Interface for request producer (i.e., tapdisk)
  * NB: the following functions may cause additional tiocbs to be queued:
@@ -121,7 +138,12 @@ int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t len);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
+void tapdisk_queue_forget_files(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+void tapdisk_prep_fdsync_tiocb(struct tiocb *, int,
+			       td_queue_callback_t, void *);
 
 #endif
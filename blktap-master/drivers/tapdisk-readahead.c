@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Read-ahead for sequential guest reads. The last few read streams are
+ * followed by where they are due to continue; a read starting there
+ * (or a little further on) extends the stream. Once a stream has
+ * stayed sequential for RA_TRIGGER reads, the data after it is read
+ * ahead into a small set of windows, a window at a time, each up to
+ * twice the size of the one before, and never across a VHD block
+ * boundary. Reads falling entirely within a window are served from
+ * it, or, while the window is still being read, wait for it.
+ *
+ * Windows are dropped once read entirely, when needed for another
+ * stream, or when a write or discard touches them: both when it is
+ * issued and when it completes, since a prefetch issued in between may
+ * have read the old contents. Whatever was read ahead but never asked
+ * for counts as wasted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-readahead.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-image.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-stats.h"
+#include "tapdisk-log.h"
+#include "debug.h"
+
+#define DBG(_level, _f, _a...) tlog_write(_level, _f, ##_a)
+
+#define MIN(a, b)            ((a) < (b) ? (a) : (b))
+
+#define RA_STREAMS           4
+#define RA_WINDOWS           4
+#define RA_TRIGGER           2
+#define RA_GAP_SECS          64            /* still sequential if skipped */
+#define RA_MIN_SECS          256           /* 128K */
+#define RA_MAX_SECS          2048          /* 1M */
+#define RA_BLOCK_SECS        4096          /* 2M, a VHD block */
+#define RA_WAITERS           32
+
+enum {
+	RA_FREE = 0,
+	RA_INFLIGHT,
+	RA_READY,
+};
+
+struct td_ra_stream {
+	td_sector_t                 next;      /* where the last read ended */
+	td_sector_t                 ahead;     /* read ahead up to here */
+	int                         seq;       /* sequential reads so far */
+	int                         secs;      /* next window size */
+	uint64_t                    stamp;
+};
+
+struct td_ra_window {
+	td_readahead_t             *ra;
+	int                         state;
+	int                         stale;     /* written to while in flight */
+
+	td_sector_t                 sec;
+	int                         secs;
+	int                         used;      /* sectors served */
+	uint64_t                    stamp;
+
+	char                       *buf;
+	struct td_iovec             iov;
+	td_vbd_request_t            vreq;
+
+	td_request_t                waiters[RA_WAITERS];
+	int                         nr_waiters;
+};
+
+struct td_readahead {
+	td_vbd_t                   *vbd;
+	td_sector_t                 size;
+	uint64_t                    clock;
+
+	struct td_ra_stream         streams[RA_STREAMS];
+	struct td_ra_window         windows[RA_WINDOWS];
+
+	uint64_t                    prefetches;
+	uint64_t                    prefetched;
+	uint64_t                    hits;
+	uint64_t                    waits;
+	uint64_t                    wasted;
+};
+
+int
+tapdisk_readahead_create(td_readahead_t **_ra, td_vbd_t *vbd)
+{
+	td_readahead_t *ra;
+	int i;
+
+	if (list_empty(&vbd->images))
+		return -EINVAL;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return -ENOMEM;
+
+	ra->vbd  = vbd;
+	ra->size = list_first_entry(&vbd->images, td_image_t, next)->info.size;
+
+	for (i = 0; i < RA_WINDOWS; i++)
+		ra->windows[i].ra = ra;
+
+	*_ra = ra;
+	return 0;
+}
+
+/*
+ * By now the queue is quiesced, but a prefetch may still sit on one of
+ * the VBD's lists, not issued or not yet returned.
+ */
+void
+tapdisk_readahead_free(td_readahead_t *ra)
+{
+	struct td_ra_window *w;
+	int i;
+
+	if (!ra)
+		return;
+
+	for (i = 0; i < RA_WINDOWS; i++) {
+		w = &ra->windows[i];
+		if (w->state == RA_INFLIGHT)
+			list_del(&w->vreq.next);
+		free(w->buf);
+	}
+
+	free(ra);
+}
+
+static void
+readahead_drop(td_readahead_t *ra, struct td_ra_window *w)
+{
+	if (w->used < w->secs)
+		ra->wasted += w->secs - w->used;
+
+	w->state = RA_FREE;
+	w->stale = 0;
+}
+
+static void
+readahead_complete(td_readahead_t *ra, struct td_ra_window *w,
+		   td_request_t treq)
+{
+	memcpy(treq.buf, w->buf + ((treq.sec - w->sec) << SECTOR_SHIFT),
+	       treq.secs << SECTOR_SHIFT);
+
+	w->used += treq.secs;
+	ra->hits += treq.secs;
+
+	td_complete_request(treq, 0);
+}
+
+static void
+readahead_done(td_vbd_request_t *vreq, int error, void *token, int final)
+{
+	struct td_ra_window *w = container_of(vreq, struct td_ra_window, vreq);
+	td_readahead_t *ra = token;
+	td_request_t treq;
+	int i;
+
+	if (error || w->stale) {
+		/* nothing to serve: the waiters go to the images after all */
+		for (i = 0; i < w->nr_waiters; i++) {
+			treq = w->waiters[i];
+			td_queue_read(treq.image, treq);
+		}
+		w->nr_waiters = 0;
+		readahead_drop(ra, w);
+		return;
+	}
+
+	w->state = RA_READY;
+
+	for (i = 0; i < w->nr_waiters; i++)
+		readahead_complete(ra, w, w->waiters[i]);
+	w->nr_waiters = 0;
+
+	if (w->used >= w->secs)
+		readahead_drop(ra, w);
+}
+
+/*
+ * A window to read into: a free one, or the ready one used least
+ * recently. Windows in flight stay where they are.
+ */
+static struct td_ra_window *
+readahead_get_window(td_readahead_t *ra)
+{
+	struct td_ra_window *w, *lru;
+	int i;
+
+	lru = NULL;
+
+	for (i = 0; i < RA_WINDOWS; i++) {
+		w = &ra->windows[i];
+
+		if (w->state == RA_FREE) {
+			lru = w;
+			break;
+		}
+
+		if (w->state == RA_READY && (!lru || w->stamp < lru->stamp))
+			lru = w;
+	}
+
+	if (!lru)
+		return NULL;
+
+	if (!lru->buf &&
+	    posix_memalign((void **)&lru->buf, 4096,
+			   RA_MAX_SECS << SECTOR_SHIFT)) {
+		lru->buf = NULL;
+		return NULL;
+	}
+
+	if (lru->state == RA_READY)
+		readahead_drop(ra, lru);
+
+	return lru;
+}
+
+static void
+readahead_issue(td_readahead_t *ra, struct td_ra_stream *s)
+{
+	td_vbd_request_t *vreq;
+	struct td_ra_window *w;
+	td_sector_t sec, end;
+
+	sec = s->ahead;
+	end = MIN(sec + s->secs, (sec | (RA_BLOCK_SECS - 1)) + 1);
+	end = MIN(end, ra->size);
+	if (sec >= end)
+		return;
+
+	w = readahead_get_window(ra);
+	if (!w)
+		return;
+
+	w->state      = RA_INFLIGHT;
+	w->sec        = sec;
+	w->secs       = end - sec;
+	w->used       = 0;
+	w->stamp      = ra->clock;
+	w->nr_waiters = 0;
+
+	w->iov.base = w->buf;
+	w->iov.secs = w->secs;
+
+	vreq = &w->vreq;
+	memset(vreq, 0, sizeof(*vreq));
+	vreq->op     = TD_OP_READ;
+	vreq->sec    = sec;
+	vreq->iov    = &w->iov;
+	vreq->iovcnt = 1;
+	vreq->cb     = readahead_done;
+	vreq->token  = ra;
+	vreq->name   = "readahead";
+
+	tapdisk_vbd_queue_request(ra->vbd, vreq);
+
+	DBG(TLOG_DBG, "%s: reading ahead 0x%08"PRIx64" secs 0x%04x\n",
+	    ra->vbd->name, sec, w->secs);
+
+	ra->prefetches++;
+	ra->prefetched += w->secs;
+
+	s->ahead = end;
+	s->secs  = MIN(s->secs << 1, RA_MAX_SECS);
+}
+
+void
+tapdisk_readahead_observe(td_readahead_t *ra, td_vbd_request_t *vreq)
+{
+	struct td_ra_stream *s, *lru;
+	td_sector_t sec;
+	int i, secs;
+
+	if (vreq->token == ra)
+		return;
+
+	sec  = vreq->sec;
+	secs = 0;
+	for (i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+
+	ra->clock++;
+
+	lru = NULL;
+	for (i = 0; i < RA_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (s->seq && sec >= s->next && sec <= s->next + RA_GAP_SECS)
+			goto found;
+		if (!lru || s->stamp < lru->stamp)
+			lru = s;
+	}
+
+	s = lru;
+	memset(s, 0, sizeof(*s));
+	s->secs = RA_MIN_SECS;
+
+found:
+	s->seq++;
+	s->next  = sec + secs;
+	s->stamp = ra->clock;
+
+	if (s->seq < RA_TRIGGER)
+		return;
+
+	if (td_flag_test(ra->vbd->state, TD_VBD_QUIESCE_REQUESTED) ||
+	    td_flag_test(ra->vbd->state, TD_VBD_QUIESCED))
+		return;
+
+	/* fell behind the guest: start over from where it is */
+	if (s->ahead < s->next)
+		s->ahead = s->next;
+
+	if (s->ahead - s->next < s->secs)
+		readahead_issue(ra, s);
+}
+
+int
+tapdisk_readahead_read(td_readahead_t *ra, td_request_t treq)
+{
+	struct td_ra_window *w;
+	int i;
+
+	if (treq.vreq->token == ra)
+		return -ENOENT;
+
+	for (i = 0; i < RA_WINDOWS; i++) {
+		w = &ra->windows[i];
+
+		if (w->state == RA_FREE || w->stale)
+			continue;
+
+		if (treq.sec < w->sec ||
+		    treq.sec + treq.secs > w->sec + w->secs)
+			continue;
+
+		w->stamp = ra->clock;
+
+		if (w->state == RA_INFLIGHT) {
+			if (w->nr_waiters == RA_WAITERS)
+				return -ENOENT;
+			w->waiters[w->nr_waiters++] = treq;
+			ra->waits++;
+			return 0;
+		}
+
+		readahead_complete(ra, w, treq);
+		if (w->used >= w->secs)
+			readahead_drop(ra, w);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void
+tapdisk_readahead_invalidate(td_readahead_t *ra, td_sector_t sec, int secs)
+{
+	struct td_ra_window *w;
+	int i;
+
+	for (i = 0; i < RA_WINDOWS; i++) {
+		w = &ra->windows[i];
+
+		if (w->state == RA_FREE ||
+		    sec >= w->sec + w->secs || sec + secs <= w->sec)
+			continue;
+
+		if (w->state == RA_INFLIGHT)
+			w->stale = 1;
+		else
+			readahead_drop(ra, w);
+	}
+}
+
+void
+tapdisk_readahead_stats(td_readahead_t *ra, td_stats_t *st)
+{
+	double prefetched = ra->prefetched ? : 1;
+
+	tapdisk_stats_field(st, "prefetches", "llu", ra->prefetches);
+	tapdisk_stats_field(st, "prefetched", "llu", ra->prefetched);
+	tapdisk_stats_field(st, "hits", "llu", ra->hits);
+	tapdisk_stats_field(st, "waits", "llu", ra->waits);
+	tapdisk_stats_field(st, "wasted", "llu", ra->wasted);
+	tapdisk_stats_field(st, "hit_ratio", ".3f", ra->hits / prefetched);
+	tapdisk_stats_field(st, "waste_ratio", ".3f", ra->wasted / prefetched);
+}
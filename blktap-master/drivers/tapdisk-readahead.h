@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_READAHEAD_H__
+#define __TAPDISK_READAHEAD_H__
+
+#include "tapdisk.h"
+
+typedef struct td_readahead td_readahead_t;
+
+int tapdisk_readahead_create(td_readahead_t **, td_vbd_t *);
+void tapdisk_readahead_free(td_readahead_t *);
+
+/*
+ * A read is about to be issued: follow the streams, and prefetch ahead
+ * of those that turned out sequential.
+ */
+void tapdisk_readahead_observe(td_readahead_t *, td_vbd_request_t *);
+
+/*
+ * Serves @treq from prefetched data, right away or once the prefetch
+ * is in. Returns -ENOENT if it isn't covered, and is to be issued.
+ */
+int tapdisk_readahead_read(td_readahead_t *, td_request_t treq);
+
+void tapdisk_readahead_invalidate(td_readahead_t *, td_sector_t sec, int secs);
+
+void tapdisk_readahead_stats(td_readahead_t *, td_stats_t *);
+
+#endif /* __TAPDISK_READAHEAD_H__ */
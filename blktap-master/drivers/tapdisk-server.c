@@ -36,8 +36,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 #ifdef HAVE_EVENTFD
@@ -46,6 +48,7 @@
 #include <sys/syscall.h>
 #endif
 
+#include "debug.h"
 #include "tapdisk-syslog.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
@@ -53,6 +56,7 @@
 #include "tapdisk-log.h"
 #include "td-blkif.h"
 #include "timeout-math.h"
+#include "td-spsc.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -61,13 +65,58 @@
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
-#define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
+/*
+ * The queue defers what doesn't fit, and AIO contexts come out of the
+ * host-wide aio-max-nr, so this stays at one classic ring's worth.
+ */
+#define TAPDISK_TIOCBS              (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ + 50)
 
-typedef struct tapdisk_server {
+#define TAPDISK_MAX_WORKERS         64
+#define TAPDISK_LOOP_CALLS          16
+
+/*
+ * An event loop: a scheduler, an I/O queue and the VBDs served from them.
+ *
+ * The main thread always runs server.loop, which also carries the control
+ * socket, low memory and log events. With TAPDISK3_THREADS=N, VBDs are
+ * instead sharded over N worker loops by minor number, each worker running
+ * tapdisk_server_iterate() on its own thread. Workers share no data path
+ * state; the main thread talks to them through a pair of SPSC queues and
+ * an eventfd in each direction.
+ */
+typedef struct tapdisk_loop {
+	int                          id;
 	int                          run;
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	int                          kick_fd;   /* wakes this loop */
+	event_id_t                   kick_evid;
+	int                          pending;   /* signals to handle, as
+						   a (1 << signo) mask */
+	enum memory_mode_t           mem_mode;  /* as last seen by this
+						   loop */
+
+	/* worker loops only */
+	pthread_t                    thread;
+	int                          reply_fd;  /* wakes the main thread */
+	struct td_spsc               calls;     /* main -> worker */
+	struct td_spsc               replies;   /* worker -> main */
+	int                          err;       /* startup result */
+} tapdisk_loop_t;
+
+struct tapdisk_call {
+	int                        (*fn)(void *);
+	void                        *arg;
+	int                          ret;
+};
+
+typedef struct tapdisk_server {
+	tapdisk_loop_t               loop;
+	tapdisk_loop_t              *workers;
+	int                          nr_workers;
+	int                          nr_vbds;
 	char                        *name;
 	char                        *ident;
 	int                          facility;
@@ -99,13 +148,56 @@ typedef struct tapdisk_server {
 
 static tapdisk_server_t server;
 
+#ifndef HAVE_EVENTFD
+int eventfd(unsigned int initval, int flags)
+{
+	return syscall(SYS_eventfd2, initval, flags);
+}
+#endif
+
+static __thread tapdisk_loop_t *tapdisk_loop_self;
+
 unsigned int PAGE_SIZE;
 unsigned int PAGE_MASK;
 unsigned int PAGE_SHIFT;
 
+static void tapdisk_server_stop_workers(void);
+
+/*
+ * The loop the calling thread runs.
+ */
+static inline tapdisk_loop_t *
+tapdisk_server_loop(void)
+{
+	return tapdisk_loop_self ? tapdisk_loop_self : &server.loop;
+}
+
+/*
+ * The loop serving minor @uuid.
+ */
+static inline tapdisk_loop_t *
+tapdisk_server_uuid_loop(td_uuid_t uuid)
+{
+	if (!server.nr_workers)
+		return &server.loop;
+
+	return &server.workers[uuid % server.nr_workers];
+}
+
+#define tapdisk_loop_for_each_vbd(loop, vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, &(loop)->vbds, next)
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	tapdisk_loop_for_each_vbd(tapdisk_server_loop(), vbd, tmp)
+
+#define tapdisk_server_for_each_worker(loop)				\
+	for (loop = server.workers;					\
+	     loop < server.workers + server.nr_workers; loop++)
 
+/*
+ * Images are only shared between VBDs of the same loop: their state is not
+ * safe to touch from more than one thread.
+ */
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -127,7 +219,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &tapdisk_server_loop()->vbds;
 }
 
 td_vbd_t *
@@ -135,7 +227,7 @@ tapdisk_server_get_vbd(uint16_t uuid)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(tapdisk_server_uuid_loop(uuid), vbd, tmp)
 		if (vbd->uuid == uuid)
 			return vbd;
 
@@ -145,7 +237,8 @@ tapdisk_server_get_vbd(uint16_t uuid)
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	list_add_tail(&vbd->next, &tapdisk_server_loop()->vbds);
+	__atomic_add_fetch(&server.nr_vbds, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -153,13 +246,33 @@ tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	__atomic_sub_fetch(&server.nr_vbds, 1, __ATOMIC_RELAXED);
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_loop()->aio_queue, tiocb);
+}
+
+int
+tapdisk_server_register_iobuf(void *buf, size_t len)
+{
+	return tapdisk_queue_register_buffer(&tapdisk_server_loop()->aio_queue,
+					     buf, len);
+}
+
+void
+tapdisk_server_unregister_iobuf(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&tapdisk_server_loop()->aio_queue, buf);
+}
+
+void
+tapdisk_server_forget_files(void)
+{
+	tapdisk_queue_forget_files(&tapdisk_server_loop()->aio_queue);
 }
 
 void
@@ -167,7 +280,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&tapdisk_server_loop()->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -176,37 +289,56 @@ tapdisk_server_debug(void)
 	tlog_precious(1);
 }
 
+static void
+tapdisk_server_kick(tapdisk_loop_t *loop)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	n = write(loop->kick_fd, &one, sizeof(one));
+	if (n != sizeof(one))
+		EPRINTF("failed to kick loop %d: %s\n", loop->id,
+			n < 0 ? strerror(errno) : "short write");
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	if (__atomic_load_n(&server.nr_vbds, __ATOMIC_RELAXED))
+		return;
+
+	server.loop.run = 0;
+	if (tapdisk_loop_self)
+		tapdisk_server_kick(&server.loop);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      struct timeval timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_loop()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_loop()->scheduler,
+					  event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&tapdisk_server_loop()->scheduler,
+				    event, masked);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, TV_SECS(seconds));
+	scheduler_set_max_timeout(&tapdisk_server_loop()->scheduler,
+				  TV_SECS(seconds));
 }
 
 static void
@@ -242,7 +374,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&tapdisk_server_loop()->aio_queue);
 }
 
 static void
@@ -288,17 +420,72 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+/*
+ * TAPDISK3_AIO selects the I/O driver: "lio" (default), "rwio", or
+ * "uring", optionally followed by ",sqpoll", ",fixed-files" and
+ * ",fixed-bufs".
+ */
 static int
-tapdisk_server_init_aio(void)
+tapdisk_server_aio_drv(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	char *env, *opts, *opt, *saveptr = NULL;
+	int drv = TIO_DRV_LIO;
+
+	env = getenv("TAPDISK3_AIO");
+	if (!env)
+		return drv;
+
+	opts = strdup(env);
+	if (!opts)
+		return drv;
+
+	for (opt = strtok_r(opts, ",", &saveptr); opt;
+	     opt = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(opt, "lio"))
+			drv = TIO_DRV_LIO;
+		else if (!strcmp(opt, "rwio"))
+			drv = TIO_DRV_RWIO;
+		else if (!strcmp(opt, "uring"))
+			drv = TIO_DRV_URING;
+		else if (!strcmp(opt, "sqpoll"))
+			drv |= TIO_URING_SQPOLL;
+		else if (!strcmp(opt, "fixed-files"))
+			drv |= TIO_URING_FIXED_FILES;
+		else if (!strcmp(opt, "fixed-bufs"))
+			drv |= TIO_URING_FIXED_BUFS;
+		else
+			EPRINTF("ignoring unknown TAPDISK3_AIO option '%s'\n",
+				opt);
+	}
+
+	free(opts);
+
+	return drv;
+}
+
+static int
+tapdisk_server_init_aio(tapdisk_loop_t *loop)
+{
+	int err, drv;
+
+	drv = tapdisk_server_aio_drv();
+
+	err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+				 drv, NULL);
+	if (err && (drv & TIO_DRV_MASK) == TIO_DRV_URING) {
+		EPRINTF("io_uring setup failed: %d, falling back to libaio\n",
+			err);
+		err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_server_close_aio(tapdisk_loop_t *loop)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&loop->aio_queue);
 }
 
 int
@@ -351,8 +538,9 @@ tapdisk_server_close(void)
 	if (likely(server.tlog_reopen_evid >= 0))
 		tapdisk_server_unregister_event(server.tlog_reopen_evid);
 
+	tapdisk_server_stop_workers();
 	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close_aio(&server.loop);
 }
 
 void
@@ -364,7 +552,7 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&tapdisk_server_loop()->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %s\n", strerror(-ret));
 
@@ -380,12 +568,15 @@ tapdisk_server_iterate(void)
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (server.loop.run)
 		tapdisk_server_iterate();
 }
 
+/*
+ * Acts on a signal for the VBDs of the calling thread's loop.
+ */
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	struct td_xenblkif *blkif;
@@ -418,11 +609,393 @@ tapdisk_server_signal_handler(int signal)
 			list_for_each_entry(blkif, &vbd->rings, entry)
 				tapdisk_start_polling(blkif);
 		break;
+	}
+}
 
-	case SIGHUP:
+/*
+ * Signals are only ever delivered to the main thread, workers block them.
+ * Those concerning VBDs are passed on to each worker, to be handled from
+ * its own loop.
+ */
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_loop_t *loop;
+
+	if (signal == SIGHUP) {
 		tapdisk_server_event_set_timeout(server.tlog_reopen_evid, TV_ZERO);
-		break;
+		return;
+	}
+
+	tapdisk_server_handle_signal(signal);
+
+	tapdisk_server_for_each_worker(loop) {
+		__atomic_or_fetch(&loop->pending, 1 << signal, __ATOMIC_RELAXED);
+		tapdisk_server_kick(loop);
+	}
+}
+
+/*
+ * Brings the low memory flags of the loop's rings in line with the
+ * server's memory mode.
+ */
+static void
+tapdisk_server_update_mem_mode(tapdisk_loop_t *loop)
+{
+	td_vbd_t           *vbd,   *tmpv;
+	struct td_xenblkif *blkif, *tmpb;
+
+	loop->mem_mode = server.mem_state.mode;
+
+	tapdisk_loop_for_each_vbd(loop, vbd, tmpv)
+		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
+			if (loop->mem_mode == LOW_MEMORY_MODE) {
+				td_flag_set(blkif->stats.xenvbd->flags,
+					    BT3_LOW_MEMORY_MODE);
+				td_flag_set(blkif->vbd_stats.stats->flags,
+					    BT3_LOW_MEMORY_MODE);
+			} else {
+				td_flag_clear(blkif->stats.xenvbd->flags,
+					      BT3_LOW_MEMORY_MODE);
+				td_flag_clear(blkif->vbd_stats.stats->flags,
+					      BT3_LOW_MEMORY_MODE);
+			}
+		}
+}
+
+static void
+tapdisk_server_mem_mode_changed(void)
+{
+	tapdisk_loop_t *loop;
+
+	tapdisk_server_update_mem_mode(&server.loop);
+
+	tapdisk_server_for_each_worker(loop)
+		tapdisk_server_kick(loop);
+}
+
+/*
+ * Runs whenever the loop is kicked: handles forwarded signals and memory
+ * mode changes and, on workers, the calls queued by the main thread.
+ */
+static void
+tapdisk_server_kick_cb(event_id_t id, char mode, void *private)
+{
+	tapdisk_loop_t *loop = private;
+	struct tapdisk_call *call;
+	int signal, pending, err;
+	uint64_t one = 1, n;
+
+	if (read(loop->kick_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		EPRINTF("failed to read kick on loop %d: %s\n",
+			loop->id, strerror(errno));
+
+	pending = __atomic_exchange_n(&loop->pending, 0, __ATOMIC_RELAXED);
+	for (signal = 1; pending; signal++)
+		if (pending & (1 << signal)) {
+			pending &= ~(1 << signal);
+			tapdisk_server_handle_signal(signal);
+		}
+
+	if (loop->mem_mode != tapdisk_server_mem_mode())
+		tapdisk_server_update_mem_mode(loop);
+
+	if (loop == &server.loop)
+		return;
+
+	while ((call = td_spsc_pop(&loop->calls))) {
+		call->ret = call->fn(call->arg);
+
+		/* never full, the main thread waits for each call */
+		err = td_spsc_push(&loop->replies, call);
+		ASSERT(!err);
+
+		if (write(loop->reply_fd, &one, sizeof(one)) != sizeof(one))
+			EPRINTF("failed to reply on loop %d: %s\n",
+				loop->id, strerror(errno));
+	}
+}
+
+/*
+ * Runs @fn on @loop and waits for it to return. Only the main thread calls
+ * into workers, so each queue has a single producer and consumer.
+ */
+static int
+tapdisk_server_loop_call(tapdisk_loop_t *loop, int (*fn)(void *), void *arg)
+{
+	struct tapdisk_call call, *done;
+	uint64_t n;
+	int err;
+
+	if (loop == tapdisk_server_loop())
+		return fn(arg);
+
+	ASSERT(!tapdisk_loop_self);
+
+	call.fn  = fn;
+	call.arg = arg;
+	call.ret = -EINTR;
+
+	err = td_spsc_push(&loop->calls, &call);
+	if (err)
+		return err;
+
+	tapdisk_server_kick(loop);
+
+	while (!(done = td_spsc_pop(&loop->replies)))
+		if (read(loop->reply_fd, &n, sizeof(n)) < 0 && errno != EINTR) {
+			err = -errno;
+			EPRINTF("failed to wait for loop %d: %s\n",
+				loop->id, strerror(-err));
+			ASSERT(0);
+		}
+
+	ASSERT(done == &call);
+
+	return call.ret;
+}
+
+int
+tapdisk_server_is_worker(void)
+{
+	return tapdisk_loop_self != NULL;
+}
+
+int
+tapdisk_server_call(td_uuid_t uuid, int (*fn)(void *), void *arg)
+{
+	return tapdisk_server_loop_call(tapdisk_server_uuid_loop(uuid),
+					fn, arg);
+}
+
+int
+tapdisk_server_call_all(int (*fn)(void *), void *arg)
+{
+	tapdisk_loop_t *loop;
+	int err;
+
+	if (!server.nr_workers)
+		return fn(arg);
+
+	tapdisk_server_for_each_worker(loop) {
+		err = tapdisk_server_loop_call(loop, fn, arg);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static void *
+tapdisk_server_worker(void *private)
+{
+	tapdisk_loop_t *loop = private;
+	uint64_t one = 1;
+	int err;
+
+	tapdisk_loop_self = loop;
+
+	err = tapdisk_server_init_aio(loop);
+	if (err)
+		goto out;
+
+	loop->kick_evid =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      loop->kick_fd, TV_ZERO,
+					      tapdisk_server_kick_cb, loop);
+	if (loop->kick_evid < 0) {
+		err = loop->kick_evid;
+		tapdisk_server_close_aio(loop);
+		goto out;
+	}
+
+	loop->run = 1;
+
+out:
+	loop->err = err;
+	if (write(loop->reply_fd, &one, sizeof(one)) != sizeof(one))
+		EPRINTF("failed to report loop %d startup: %s\n",
+			loop->id, strerror(errno));
+
+	if (err)
+		return NULL;
+
+	while (loop->run)
+		tapdisk_server_iterate();
+
+	tapdisk_server_unregister_event(loop->kick_evid);
+	tapdisk_server_close_aio(loop);
+
+	return NULL;
+}
+
+static int
+tapdisk_server_worker_stop(void *private)
+{
+	tapdisk_server_loop()->run = 0;
+	return 0;
+}
+
+static void
+tapdisk_server_free_loop(tapdisk_loop_t *loop)
+{
+	if (loop->kick_fd >= 0)
+		close(loop->kick_fd);
+	if (loop->reply_fd >= 0)
+		close(loop->reply_fd);
+
+	td_spsc_free(&loop->calls);
+	td_spsc_free(&loop->replies);
+	scheduler_destroy(&loop->scheduler);
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	tapdisk_loop_t *loop;
+
+	tapdisk_server_for_each_worker(loop) {
+		tapdisk_server_loop_call(loop, tapdisk_server_worker_stop, NULL);
+		pthread_join(loop->thread, NULL);
+		tapdisk_server_free_loop(loop);
+	}
+
+	free(server.workers);
+	server.workers    = NULL;
+	server.nr_workers = 0;
+
+	if (server.loop.kick_evid >= 0)
+		tapdisk_server_unregister_event(server.loop.kick_evid);
+	if (server.loop.kick_fd >= 0)
+		close(server.loop.kick_fd);
+	server.loop.kick_evid = -1;
+	server.loop.kick_fd   = -1;
+}
+
+static int
+tapdisk_server_start_worker(tapdisk_loop_t *loop, int id)
+{
+	uint64_t n;
+	int err;
+
+	loop->id        = id;
+	loop->kick_evid = -1;
+	loop->mem_mode  = server.mem_state.mode;
+	INIT_LIST_HEAD(&loop->vbds);
+	scheduler_initialize(&loop->scheduler);
+
+	loop->kick_fd  = eventfd(0, 0);
+	loop->reply_fd = eventfd(0, 0);
+	if (loop->kick_fd == -1 || loop->reply_fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = td_spsc_init(&loop->calls, TAPDISK_LOOP_CALLS);
+	if (err)
+		goto fail;
+
+	err = td_spsc_init(&loop->replies, TAPDISK_LOOP_CALLS);
+	if (err)
+		goto fail;
+
+	err = pthread_create(&loop->thread, NULL, tapdisk_server_worker, loop);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	while (read(loop->reply_fd, &n, sizeof(n)) < 0)
+		if (errno != EINTR) {
+			err = -errno;
+			EPRINTF("failed to wait for loop %d: %s\n",
+				id, strerror(-err));
+			ASSERT(0);
+		}
+
+	err = loop->err;
+	if (err) {
+		pthread_join(loop->thread, NULL);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_server_free_loop(loop);
+	return err;
+}
+
+/*
+ * TAPDISK3_THREADS=N moves the data path of all VBDs off the main thread
+ * and onto N worker loops. Unset or 0 keeps everything on the main thread.
+ */
+static int
+tapdisk_server_start_workers(void)
+{
+	sigset_t set, old;
+	char *env;
+	int i, n, err;
+
+	env = getenv("TAPDISK3_THREADS");
+	if (!env)
+		return 0;
+
+	n = atoi(env);
+	if (n <= 0)
+		return 0;
+
+	if (n > TAPDISK_MAX_WORKERS) {
+		EPRINTF("limiting TAPDISK3_THREADS=%d to %d\n",
+			n, TAPDISK_MAX_WORKERS);
+		n = TAPDISK_MAX_WORKERS;
+	}
+
+	server.loop.kick_fd = eventfd(0, 0);
+	if (server.loop.kick_fd == -1)
+		return -errno;
+
+	server.loop.kick_evid =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      server.loop.kick_fd, TV_ZERO,
+					      tapdisk_server_kick_cb,
+					      &server.loop);
+	if (server.loop.kick_evid < 0) {
+		err = server.loop.kick_evid;
+		goto fail;
+	}
+
+	server.workers = calloc(n, sizeof(tapdisk_loop_t));
+	if (!server.workers) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* workers inherit the mask, leaving signals to the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < n; i++) {
+		err = tapdisk_server_start_worker(&server.workers[i], i + 1);
+		if (err)
+			break;
+		server.nr_workers++;
 	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		EPRINTF("failed to start worker %d: %s\n", i + 1, strerror(-err));
+		goto fail;
+	}
+
+	DPRINTF("serving VBDs from %d worker threads\n", n);
+
+	return 0;
+
+fail:
+	tapdisk_server_stop_workers();
+	return err;
 }
 
 
@@ -450,13 +1023,6 @@ tlog_reopen_cb(event_id_t id, char mode __attribute__((unused)), void *private)
  * is bad if there are a couple of thousand instances of tapdisk running.
  */
 
-#ifndef HAVE_EVENTFD
-int eventfd(unsigned int initval, int flags)
-{
-	return syscall(SYS_eventfd2, initval, flags);
-}
-#endif
-
 #define MIN_BACKOFF 8
 #define MAX_BACKOFF 512
 #define RESET_BACKOFF 512
@@ -504,18 +1070,12 @@ static void lowmem_cleanup(void)
 static void lowmem_timeout(event_id_t id, char mode, void *data)
 {
 	int ret;
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
 
 	server.mem_state.mode = NORMAL_MEMORY_MODE;
 	tapdisk_server_unregister_event(server.mem_state.mem_evid);
 	server.mem_state.mem_evid = -1;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_clear(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_clear(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_mem_mode_changed();
 
 	if ((ret = tapdisk_server_reset_lowmem_mode()) < 0) {
 		ERR(-ret, "Failed to re-init low memory handler: %s\n",
@@ -532,9 +1092,6 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	ssize_t n;
 	int backoff;
 
-	td_vbd_t           *vbd,   *tmpv;
-	struct td_xenblkif *blkif, *tmpb;
-
 	n = read(server.mem_state.efd, &result, sizeof(result));
 	if (n < 0) {
 		ERR(-errno, "Failed to read from eventfd: %s\n",
@@ -577,11 +1134,7 @@ static void lowmem_event(event_id_t id, char mode, void *data)
 	}
 	server.mem_state.mode = LOW_MEMORY_MODE;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
-		tapdisk_vbd_for_each_blkif(vbd, blkif, tmpb) {
-			td_flag_set(blkif->stats.xenvbd->flags, BT3_LOW_MEMORY_MODE);
-			td_flag_set(blkif->vbd_stats.stats->flags, BT3_LOW_MEMORY_MODE);
-	}
+	tapdisk_server_mem_mode_changed();
 
 	/* Increment backoff up to a limit */
 	if (server.mem_state.backoff < MAX_BACKOFF)
@@ -717,9 +1270,11 @@ tapdisk_server_init(void)
 	for (i = PAGE_SIZE, PAGE_SHIFT = 0; i > 1; i >>= 1, PAGE_SHIFT++);
 
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
+	INIT_LIST_HEAD(&server.loop.vbds);
+	server.loop.kick_fd   = -1;
+	server.loop.kick_evid = -1;
 
-	scheduler_initialize(&server.scheduler);
+	scheduler_initialize(&server.loop.scheduler);
 
 	if ((ret = tapdisk_server_initialize_lowmem_mode()) < 0) {
 		EPRINTF("Failed to initialize low memory handler: %s\n",
@@ -746,7 +1301,7 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_server_init_aio(&server.loop);
 	if (err)
 		goto fail;
 
@@ -754,13 +1309,17 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto fail;
+
+	server.loop.run = 1;
 
 	return 0;
 
 fail:
 	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close_aio(&server.loop);
 	return err;
 }
 
@@ -819,6 +1378,7 @@ out:
 
 int
 tapdisk_server_event_set_timeout(event_id_t event_id, struct timeval timeo) {
-	return scheduler_event_set_timeout(&server.scheduler, event_id, timeo);
+	return scheduler_event_set_timeout(&tapdisk_server_loop()->scheduler,
+					   event_id, timeo);
 }
 
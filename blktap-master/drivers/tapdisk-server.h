@@ -43,16 +43,20 @@ struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
+/**
+ * Returns the VBDs served by the calling thread's event loop.
+ */
 struct list_head *tapdisk_server_get_all_vbds(void);
 
 /**
  * Returns the VBD that corresponds to the specified minor.
- * Returns NULL if such a VBD does not exist.
+ * Returns NULL if such a VBD does not exist. Must be called from the event
+ * loop serving that minor, see tapdisk_server_call.
  */
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 
 /**
- * Adds the VBD to end of the list of VBDs.
+ * Adds the VBD to end of the list of VBDs of the calling thread's loop.
  */
 void tapdisk_server_add_vbd(td_vbd_t *);
 
@@ -62,9 +66,30 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+int tapdisk_server_register_iobuf(void *, size_t);
+void tapdisk_server_unregister_iobuf(void *);
+void tapdisk_server_forget_files(void);
 
 void tapdisk_server_check_state(void);
 
+/**
+ * Runs fn(arg) on the event loop serving the specified minor, waiting for
+ * it to complete, and returns its result. Runs it directly if that is the
+ * calling thread's loop, as is always the case without worker threads.
+ */
+int tapdisk_server_call(td_uuid_t, int (*fn)(void *), void *arg);
+
+/**
+ * Whether the calling thread is a worker, rather than the main thread.
+ */
+int tapdisk_server_is_worker(void);
+
+/**
+ * Runs fn(arg) on each event loop serving VBDs in turn, stopping at the
+ * first one to fail.
+ */
+int tapdisk_server_call_all(int (*fn)(void *), void *arg);
+
 event_id_t tapdisk_server_register_event(char, int, struct timeval, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
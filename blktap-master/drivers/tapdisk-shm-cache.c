@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "tapdisk.h"
+#include "tapdisk-shm-cache.h"
+
+#define TD_SHM_CACHE_NAME            "/tapdisk3-block-cache"
+#define TD_SHM_CACHE_MAGIC           0x7464736863616368ULL /* "tdshcach" */
+#define TD_SHM_CACHE_VERSION         1
+
+/* slots per set: a page can only live in one of the ways of its set */
+#define TD_SHM_CACHE_WAYS            8
+
+/*
+ * The segment: a header page, the slot table, then the data pages,
+ * one per slot.
+ */
+struct td_shm_cache_hdr {
+	uint64_t                     magic;
+	uint32_t                     version;
+	uint32_t                     page_size;
+	uint64_t                     size;
+	uint64_t                     sets;
+	uint64_t                     data;   /* offset of the first page */
+};
+
+struct td_shm_cache_slot {
+	uint32_t                     seq;
+	uint32_t                     stamp;  /* last use, in seconds */
+	uint64_t                     tag;    /* 0 if unused */
+	uint64_t                     page;
+	uint64_t                     __pad;
+};
+
+static struct {
+	pthread_mutex_t              lock;
+	int                          users;
+	void                        *base;
+	size_t                       size;
+	uint64_t                     sets;
+	struct td_shm_cache_slot    *slots;
+	char                        *data;
+} shm_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+tapdisk_shm_cache_create(int fd, size_t size)
+{
+	struct td_shm_cache_hdr *hdr;
+	uint64_t slots, table;
+	void *base;
+
+	slots = (size - TD_SHM_CACHE_PAGE_SIZE) /
+		(TD_SHM_CACHE_PAGE_SIZE + sizeof(struct td_shm_cache_slot));
+	slots -= slots % TD_SHM_CACHE_WAYS;
+
+	/* whatever the table leaves over */
+	table = slots * sizeof(struct td_shm_cache_slot);
+	table = (table + TD_SHM_CACHE_PAGE_SIZE - 1) &
+		~((uint64_t)TD_SHM_CACHE_PAGE_SIZE - 1);
+	while (slots &&
+	       TD_SHM_CACHE_PAGE_SIZE + table +
+	       slots * TD_SHM_CACHE_PAGE_SIZE > size)
+		slots -= TD_SHM_CACHE_WAYS;
+
+	if (!slots)
+		return -EINVAL;
+
+	if (ftruncate(fd, size))
+		return -errno;
+
+	base = mmap(NULL, TD_SHM_CACHE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return -errno;
+
+	hdr            = base;
+	hdr->version   = TD_SHM_CACHE_VERSION;
+	hdr->page_size = TD_SHM_CACHE_PAGE_SIZE;
+	hdr->size      = size;
+	hdr->sets      = slots / TD_SHM_CACHE_WAYS;
+	hdr->data      = TD_SHM_CACHE_PAGE_SIZE + table;
+	__atomic_store_n(&hdr->magic, TD_SHM_CACHE_MAGIC, __ATOMIC_RELEASE);
+
+	munmap(base, TD_SHM_CACHE_PAGE_SIZE);
+
+	DPRINTF("shm cache: created %s, %zu bytes, %"PRIu64" pages\n",
+		TD_SHM_CACHE_NAME, size, slots);
+
+	return 0;
+}
+
+static int
+tapdisk_shm_cache_map(void)
+{
+	struct td_shm_cache_hdr *hdr;
+	const char *env;
+	struct stat st;
+	long long mb;
+	void *base;
+	int fd, err;
+
+	env = getenv("TAPDISK3_SHM_CACHE_SIZE");
+	if (!env)
+		return -ENOENT;
+
+	mb = atoll(env);
+	if (mb <= 0)
+		return -ENOENT;
+
+	fd = shm_open(TD_SHM_CACHE_NAME, O_RDWR|O_CREAT, 0600);
+	if (fd < 0)
+		return -errno;
+
+	/* whoever gets here first lays the segment out */
+	if (flock(fd, LOCK_EX)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!st.st_size) {
+		err = tapdisk_shm_cache_create(fd, (size_t)mb << 20);
+		if (err)
+			goto out;
+
+		st.st_size = (size_t)mb << 20;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	hdr = base;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+	    TD_SHM_CACHE_MAGIC ||
+	    hdr->version != TD_SHM_CACHE_VERSION ||
+	    hdr->page_size != TD_SHM_CACHE_PAGE_SIZE ||
+	    hdr->size != st.st_size) {
+		EPRINTF("shm cache: %s is not a cache we know\n",
+			TD_SHM_CACHE_NAME);
+		munmap(base, st.st_size);
+		err = -EINVAL;
+		goto out;
+	}
+
+	shm_cache.base  = base;
+	shm_cache.size  = st.st_size;
+	shm_cache.sets  = hdr->sets;
+	shm_cache.slots = base + TD_SHM_CACHE_PAGE_SIZE;
+	shm_cache.data  = base + hdr->data;
+	err = 0;
+
+out:
+	close(fd);
+	return err;
+}
+
+int
+tapdisk_shm_cache_attach(void)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&shm_cache.lock);
+
+	if (!shm_cache.users) {
+		err = tapdisk_shm_cache_map();
+		if (err && err != -ENOENT)
+			EPRINTF("shm cache: failed to map %s: %d\n",
+				TD_SHM_CACHE_NAME, err);
+	}
+
+	if (!err)
+		shm_cache.users++;
+
+	pthread_mutex_unlock(&shm_cache.lock);
+
+	return err;
+}
+
+void
+tapdisk_shm_cache_detach(void)
+{
+	pthread_mutex_lock(&shm_cache.lock);
+
+	if (shm_cache.users && !--shm_cache.users) {
+		munmap(shm_cache.base, shm_cache.size);
+		shm_cache.base = NULL;
+	}
+
+	pthread_mutex_unlock(&shm_cache.lock);
+}
+
+uint64_t
+tapdisk_shm_cache_tag(const void *key, size_t len)
+{
+	const unsigned char *p = key;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h | 1;
+}
+
+static inline uint32_t
+tapdisk_shm_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static inline struct td_shm_cache_slot *
+tapdisk_shm_cache_set(uint64_t tag, uint64_t page)
+{
+	uint64_t h;
+
+	h  = tag ^ (page * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+
+	return shm_cache.slots + (h % shm_cache.sets) * TD_SHM_CACHE_WAYS;
+}
+
+static inline char *
+tapdisk_shm_cache_data(struct td_shm_cache_slot *slot)
+{
+	return shm_cache.data +
+		(size_t)(slot - shm_cache.slots) * TD_SHM_CACHE_PAGE_SIZE;
+}
+
+int
+tapdisk_shm_cache_read(uint64_t tag, uint64_t page, void *buf)
+{
+	struct td_shm_cache_slot *set, *slot;
+	uint32_t seq, now;
+	int i;
+
+	set = tapdisk_shm_cache_set(tag, page);
+
+	for (i = 0; i < TD_SHM_CACHE_WAYS; i++) {
+		slot = set + i;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (__atomic_load_n(&slot->tag, __ATOMIC_RELAXED) != tag ||
+		    __atomic_load_n(&slot->page, __ATOMIC_RELAXED) != page)
+			continue;
+
+		memcpy(buf, tapdisk_shm_cache_data(slot),
+		       TD_SHM_CACHE_PAGE_SIZE);
+
+		/* torn by a writer: no telling what we've got */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return -ENOENT;
+
+		now = tapdisk_shm_cache_now();
+		if (__atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) != now)
+			__atomic_store_n(&slot->stamp, now, __ATOMIC_RELAXED);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * The page goes into an unused way of its set, or else over the one
+ * used the longest time ago. A writer owns a slot while its count is
+ * odd; ways someone else is writing are left alone.
+ */
+void
+tapdisk_shm_cache_write(uint64_t tag, uint64_t page, const void *buf)
+{
+	struct td_shm_cache_slot *set, *slot, *victim;
+	uint32_t seq, vseq, stamp, oldest, now;
+	int i;
+
+	set    = tapdisk_shm_cache_set(tag, page);
+	victim = NULL;
+	vseq   = oldest = 0;
+	now    = tapdisk_shm_cache_now();
+
+	for (i = 0; i < TD_SHM_CACHE_WAYS; i++) {
+		slot = set + i;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->tag, __ATOMIC_RELAXED) == tag &&
+		    __atomic_load_n(&slot->page, __ATOMIC_RELAXED) == page)
+			return;
+
+		if (seq & 1)
+			continue;
+
+		if (!__atomic_load_n(&slot->tag, __ATOMIC_RELAXED)) {
+			victim = slot;
+			vseq   = seq;
+			break;
+		}
+
+		stamp = __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED);
+		if (!victim || (int32_t)(now - stamp) > (int32_t)(now - oldest)) {
+			victim = slot;
+			vseq   = seq;
+			oldest = stamp;
+		}
+	}
+
+	if (!victim)
+		return;
+
+	if (!__atomic_compare_exchange_n(&victim->seq, &vseq, vseq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&victim->tag, tag, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->page, page, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->stamp, now, __ATOMIC_RELAXED);
+	memcpy(tapdisk_shm_cache_data(victim), buf, TD_SHM_CACHE_PAGE_SIZE);
+
+	__atomic_store_n(&victim->seq, vseq + 2, __ATOMIC_RELEASE);
+}
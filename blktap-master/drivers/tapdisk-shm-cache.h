@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TAPDISK_SHM_CACHE_H__
+#define __TAPDISK_SHM_CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A page cache in a shared memory segment that every tapdisk on the
+ * host maps, for data of read-only images that many of them read,
+ * such as common parents. Opt-in: TAPDISK3_SHM_CACHE_SIZE gives the
+ * size of the segment in MiB, to whichever tapdisk creates it.
+ *
+ * Pages are TD_SHM_CACHE_PAGE_SIZE bytes, keyed by a tag naming the
+ * image and a page number. Nothing is ever invalidated: the tag must
+ * change whenever the image's contents do. Lookups take no locks: each slot carries a
+ * sequence count, odd while the slot is being written, and a reader
+ * retries nothing but misses if the count moved under it.
+ */
+
+#define TD_SHM_CACHE_PAGE_SIZE       4096
+
+/*
+ * Maps the segment, creating it if need be. Returns 0 if the cache is
+ * there to use, -ENOENT if not configured, or another error.
+ * Every successful call wants a tapdisk_shm_cache_detach.
+ */
+int tapdisk_shm_cache_attach(void);
+void tapdisk_shm_cache_detach(void);
+
+/*
+ * Makes a tag from whatever identifies an image's contents. Never 0.
+ */
+uint64_t tapdisk_shm_cache_tag(const void *key, size_t len);
+
+/*
+ * Copies page @page of image @tag into @buf. Returns -ENOENT on a miss.
+ */
+int tapdisk_shm_cache_read(uint64_t tag, uint64_t page, void *buf);
+
+/*
+ * Offers a page to the cache. Best effort: gives up on contention.
+ */
+void tapdisk_shm_cache_write(uint64_t tag, uint64_t page, const void *buf);
+
+#endif /* __TAPDISK_SHM_CACHE_H__ */
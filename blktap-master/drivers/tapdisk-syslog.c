@@ -49,6 +49,11 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#else
+int eventfd(unsigned int initval, int flags);
+#endif
 
 #include "tapdisk-server.h"
 #include "tapdisk-syslog.h"
@@ -57,6 +62,7 @@
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
+static int __tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...);
 static int tapdisk_syslog_sock_send(td_syslog_t *log,
 				    const void *msg, size_t size);
 static int tapdisk_syslog_sock_connect(td_syslog_t *log);
@@ -244,8 +250,8 @@ tapdisk_syslog_ring_warning(td_syslog_t *log)
 	n        = log->oom;
 	log->oom = 0;
 
-	err = tapdisk_syslog(log, TLOG_WARN,
-			     "tapdisk-syslog: %d messages dropped", n);
+	err = __tapdisk_syslog(log, TLOG_WARN,
+			       "tapdisk-syslog: %d messages dropped", n);
 	if (err)
 		log->oom = n;
 }
@@ -325,8 +331,8 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * In summary, no attempts to mask service blackouts in here.
  */
 
-int
-tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+static int
+__tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
 {
 	struct timeval now;
 	size_t len;
@@ -382,6 +388,31 @@ fail:
 	return err;
 }
 
+static int
+__tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
+{
+	va_list ap;
+	int err;
+
+	va_start(ap, fmt);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	va_end(ap);
+
+	return err;
+}
+
+int
+tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+{
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	pthread_mutex_unlock(&log->lock);
+
+	return err;
+}
+
 int
 tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
 {
@@ -414,10 +445,31 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
 	td_syslog_t *log = private;
 
+	pthread_mutex_lock(&log->lock);
+
 	tapdisk_syslog_ring_dispatch(log);
 
 	if (log->cons == log->prod)
 		tapdisk_syslog_sock_mask(log);
+
+	pthread_mutex_unlock(&log->lock);
+}
+
+static void
+tapdisk_syslog_kick_event(event_id_t id, char mode, void *private)
+{
+	td_syslog_t *log = private;
+	uint64_t n;
+
+	if (read(log->kick_fd, &n, sizeof(n)) < 0)
+		return;
+
+	pthread_mutex_lock(&log->lock);
+
+	if (log->cons != log->prod)
+		tapdisk_syslog_sock_unmask(log);
+
+	pthread_mutex_unlock(&log->lock);
 }
 
 static void
@@ -425,6 +477,8 @@ __tapdisk_syslog_sock_init(td_syslog_t *log)
 {
 	log->sock     = -1;
 	log->event_id = -1;
+	log->kick_fd  = -1;
+	log->kick_id  = -1;
 }
 
 static void
@@ -436,6 +490,12 @@ tapdisk_syslog_sock_close(td_syslog_t *log)
 	if (log->event_id >= 0)
 		tapdisk_server_unregister_event(log->event_id);
 
+	if (log->kick_id >= 0)
+		tapdisk_server_unregister_event(log->kick_id);
+
+	if (log->kick_fd >= 0)
+		close(log->kick_fd);
+
 	__tapdisk_syslog_sock_init(log);
 }
 
@@ -476,6 +536,24 @@ tapdisk_syslog_sock_open(td_syslog_t *log)
 
 	tapdisk_syslog_sock_mask(log);
 
+	log->owner   = pthread_self();
+	log->kick_fd = eventfd(0, 0);
+	if (log->kick_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					   log->kick_fd, TV_ZERO,
+					   tapdisk_syslog_kick_event,
+					   log);
+	if (id < 0) {
+		err = id;
+		goto fail;
+	}
+
+	log->kick_id = id;
+
 	return 0;
 
 fail:
@@ -504,7 +582,15 @@ tapdisk_syslog_sock_mask(td_syslog_t *log)
 static void
 tapdisk_syslog_sock_unmask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 0);
+	uint64_t one = 1;
+
+	if (pthread_equal(log->owner, pthread_self())) {
+		tapdisk_server_mask_event(log->event_id, 0);
+		return;
+	}
+
+	if (write(log->kick_fd, &one, sizeof(one)) != sizeof(one))
+		log->stats.fails++;
 }
 
 void
@@ -524,6 +610,7 @@ tapdisk_syslog_close(td_syslog_t *log)
 	if (log->ident)
 		free(log->ident);
 
+	pthread_mutex_destroy(&log->lock);
 	__tapdisk_syslog_init(log);
 }
 
@@ -533,6 +620,7 @@ tapdisk_syslog_open(td_syslog_t *log, const char *ident, int facility, size_t bu
 	int err;
 
 	__tapdisk_syslog_init(log);
+	pthread_mutex_init(&log->lock, NULL);
 
 	log->facility = facility;
 	log->ident = ident ? strndup(ident, TD_SYSLOG_IDENT_MAX) : NULL;
@@ -33,6 +33,7 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "scheduler.h"
 
 typedef struct _td_syslog td_syslog_t;
@@ -54,6 +55,16 @@ struct _td_syslog {
 	int              sock;
 	event_id_t       event_id;
 
+	/*
+	 * Messages may be logged from any thread, but event_id belongs to
+	 * the scheduler of the thread that opened the log. Other threads
+	 * kick it through kick_fd when the ring needs draining.
+	 */
+	pthread_mutex_t  lock;
+	pthread_t        owner;
+	int              kick_fd;
+	event_id_t       kick_id;
+
 	void            *buf;
 	size_t           bufsz;
 
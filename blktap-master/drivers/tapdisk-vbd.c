@@ -248,6 +248,50 @@ out:
     return -err;
 }
 
+/*
+ * The extent map is an optimization only: a chain it can't describe
+ * (filter drivers, standby secondaries) just goes without.
+ */
+static void
+tapdisk_vbd_add_extmap(td_vbd_t *vbd)
+{
+	int err;
+
+	if (vbd->secondary_mode == TD_VBD_SECONDARY_STANDBY) {
+		INFO("%s: no extent map with a standby secondary\n", vbd->name);
+		return;
+	}
+
+	err = tapdisk_extmap_create(&vbd->extmap, &vbd->images);
+	if (err)
+		INFO("%s: no extent map for this chain: %s\n",
+		     vbd->name, strerror(-err));
+}
+
+static void
+tapdisk_vbd_drop_extmap(td_vbd_t *vbd)
+{
+	tapdisk_extmap_free(vbd->extmap);
+	vbd->extmap = NULL;
+}
+
+static void
+tapdisk_vbd_add_readahead(td_vbd_t *vbd)
+{
+	int err;
+
+	err = tapdisk_readahead_create(&vbd->readahead, vbd);
+	if (err)
+		INFO("%s: no read-ahead: %s\n", vbd->name, strerror(-err));
+}
+
+static void
+tapdisk_vbd_drop_readahead(td_vbd_t *vbd)
+{
+	tapdisk_readahead_free(vbd->readahead);
+	vbd->readahead = NULL;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
@@ -264,6 +308,9 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
         EPRINTF("failed to destroy stats file: %s\n", strerror(-err));
     }
 
+	tapdisk_vbd_drop_extmap(vbd);
+	tapdisk_vbd_drop_readahead(vbd);
+
 	tapdisk_image_close_chain(&vbd->images);
 
 	if (vbd->secondary &&
@@ -326,7 +373,7 @@ tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 	cache->driver->info = target->driver->info;
 
 	/* try to open new cache */
-	err = td_open(cache, &vbd->encryption);
+	err = td_open(cache, &vbd->open_params);
 	if (!err)
 		goto done;
 
@@ -377,7 +424,7 @@ tapdisk_vbd_add_local_cache(td_vbd_t *vbd)
 	cache->driver->info = parent->driver->info;
 
 	/* try to open new cache */
-	err = td_open(cache, &vbd->encryption);
+	err = td_open(cache, &vbd->open_params);
 	if (!err)
 		goto done;
 
@@ -420,7 +467,7 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		goto fail;
 	}
 
-	err = tapdisk_image_open(type, path, leaf->flags, &vbd->encryption, &second);
+	err = tapdisk_image_open(type, path, leaf->flags, &vbd->open_params, &second);
 	if (err) {
 		if (type == DISK_TYPE_NBD)
 			vbd->nbd_mirror_failed = 1;
@@ -557,7 +604,7 @@ static int tapdisk_vbd_add_dirty_log(td_vbd_t *vbd)
 	driver->info = parent->driver->info;
 	log->driver  = driver;
 
-	err = td_open(log, &vbd->encryption);
+	err = td_open(log, &vbd->open_params);
 	if (err)
 		goto fail;
 
@@ -594,7 +641,7 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
-	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->encryption, &vbd->images);
+	err = tapdisk_image_open_chain(vbd->name, flags, prt_devnum, &vbd->open_params, &vbd->images);
 	if (err)
 		goto fail;
 
@@ -637,6 +684,12 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_EXTENT_MAP))
+		tapdisk_vbd_add_extmap(vbd);
+
+	if (td_flag_test(vbd->flags, TD_OPEN_READAHEAD))
+		tapdisk_vbd_add_readahead(vbd);
+
     err = vbd_stats_create(vbd);
     if (err)
         goto fail;
@@ -655,6 +708,9 @@ fail:
 		vbd->name = tmp;
 	}
 
+	tapdisk_vbd_drop_extmap(vbd);
+	tapdisk_vbd_drop_readahead(vbd);
+
 	if (!list_empty(&vbd->images))
 		tapdisk_image_close_chain(&vbd->images);
 
@@ -812,10 +868,12 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    "failed: 0x%02x, completed: 0x%02x, last activity: %010ld.%06ld, "
 	    "errors: 0x%04"PRIx64", retries: 0x%04"PRIx64", "
 	    "received: 0x%08"PRIx64", returned: 0x%08"PRIx64", "
-	    "kicked: 0x%08"PRIx64"\n",
+	    "kicked: 0x%08"PRIx64", flushes: 0x%08"PRIx64" "
+	    "(merged: 0x%08"PRIx64")\n",
 	    vbd->name, vbd->state, new, pending, failed, completed,
 	    vbd->ts.tv_sec, vbd->ts.tv_usec, vbd->errors, vbd->retries,
-	    vbd->received, vbd->returned, vbd->kicked);
+	    vbd->received, vbd->returned, vbd->kicked, vbd->flushes,
+	    vbd->flushes_merged);
 
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
@@ -1194,6 +1252,37 @@ tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	}
 }
 
+/*
+ * Completes the flushes that were merged into @vreq.
+ */
+static void
+tapdisk_vbd_complete_flushes(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_vbd_request_t *next;
+
+	if (vbd->flush == vreq)
+		vbd->flush = NULL;
+
+	while ((next = vreq->flush_next)) {
+		vreq->flush_next = next->flush_next;
+		next->flush_next = NULL;
+
+		next->error = vreq->error;
+		next->secs_pending--;
+		vbd->secs_pending--;
+		tapdisk_vbd_complete_vbd_request(vbd, next);
+	}
+}
+
+/*
+ * A flush moves no sectors, but still counts as one unit of work in flight.
+ */
+static inline int
+tapdisk_vbd_treq_pending(td_request_t treq)
+{
+	return (treq.op == TD_OP_FLUSH ? 1 : treq.secs);
+}
+
 static void
 FIXME_maybe_count_enospc_redirect(td_vbd_t *vbd, td_request_t treq)
 {
@@ -1214,10 +1303,11 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
         long long interval;
 
 	err = (res <= 0 ? res : -res);
-	vbd->secs_pending  -= treq.secs;
-	vreq->secs_pending -= treq.secs;
+	vbd->secs_pending  -= tapdisk_vbd_treq_pending(treq);
+	vreq->secs_pending -= tapdisk_vbd_treq_pending(treq);
 
-	if (err != -EBUSY) {
+	if (err != -EBUSY &&
+	    treq.op != TD_OP_DISCARD && treq.op != TD_OP_FLUSH) {
 		int write = treq.op == TD_OP_WRITE;
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
 		if (err)
@@ -1234,7 +1324,9 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       (treq.op == TD_OP_WRITE ? "write" :
+						treq.op == TD_OP_DISCARD ? "discard" :
+						treq.op == TD_OP_FLUSH ? "flush" : "read"),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
@@ -1247,12 +1339,29 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
             vbd->vdi_stats.stats->read_reqs_completed++;
             vbd->vdi_stats.stats->read_sectors += treq.secs;
             vbd->vdi_stats.stats->read_total_ticks += interval;
-        }else{
+        }else if(treq.op == TD_OP_WRITE){
             vbd->vdi_stats.stats->write_reqs_completed++;
             vbd->vdi_stats.stats->write_sectors += treq.secs;
             vbd->vdi_stats.stats->write_total_ticks += interval;
         }
 
+	/* the leaf's metadata moved on; drop what we resolved before */
+	if (vbd->extmap &&
+	    (treq.op == TD_OP_WRITE || treq.op == TD_OP_DISCARD))
+		tapdisk_extmap_invalidate(vbd->extmap, treq.sec, treq.secs);
+
+	/*
+	 * A prefetch issued while this was in flight may hold the old
+	 * contents; drop it now that the new ones are in.
+	 */
+	if (vbd->readahead &&
+	    (treq.op == TD_OP_WRITE || treq.op == TD_OP_DISCARD))
+		tapdisk_readahead_invalidate(vbd->readahead,
+					     treq.sec, treq.secs);
+
+	if (treq.op == TD_OP_FLUSH && !vreq->secs_pending)
+		tapdisk_vbd_complete_flushes(vbd, vreq);
+
 	tapdisk_vbd_complete_vbd_request(vbd, vreq);
 }
 
@@ -1269,7 +1378,8 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	vreq->submitting++;
 
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		if (treq.op != TD_OP_DISCARD && treq.op != TD_OP_FLUSH)
+			memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
 		td_complete_request(treq, 0);
 		goto done;
 	}
@@ -1284,6 +1394,20 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	treq.image = parent;
 
+	/*
+	 * A discard or flush passed on by a filter driver stops at the first
+	 * read-only image: whatever lies below is shared, and never dirty.
+	 */
+	if (treq.op == TD_OP_DISCARD || treq.op == TD_OP_FLUSH) {
+		if (td_flag_test(parent->flags, TD_OPEN_RDONLY))
+			td_complete_request(treq, 0);
+		else if (treq.op == TD_OP_DISCARD)
+			td_queue_discard(parent, treq);
+		else
+			td_queue_flush(parent, treq);
+		goto done;
+	}
+
 	/* return zeros for requests that extend beyond end of parent image */
 	if (treq.sec + treq.secs > parent->info.size) {
 		td_request_t clone  = treq;
@@ -1356,6 +1480,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 				TD_IGNORE_ENOSPC)) {
 		res = 0;
 		leaf = tapdisk_vbd_first_image(vbd);
+		tapdisk_vbd_drop_extmap(vbd);
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
 			DPRINTF("ENOSPC: disabling mirroring\n");
 			list_del_init(&leaf->next);
@@ -1404,6 +1529,87 @@ queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 	td_queue_write(vbd->secondary, clone);
 }
 
+static inline void
+queue_mirror_flush(td_vbd_t *vbd, td_request_t clone)
+{
+	clone.image = vbd->secondary;
+	td_queue_flush(vbd->secondary, clone);
+}
+
+/*
+ * All flushes issued in one pass are satisfied by a single sync: none of
+ * them is submitted before the pass is over, so the first one also covers
+ * every write completed before the others arrived.
+ */
+static void
+tapdisk_vbd_issue_flush(td_vbd_t *vbd, td_vbd_request_t *vreq,
+			td_image_t *image)
+{
+	td_vbd_request_t *leader;
+	td_request_t treq;
+
+	vbd->flushes++;
+	vreq->secs_pending++;
+	vbd->secs_pending++;
+
+	leader = vbd->flush;
+	if (leader) {
+		vreq->flush_next   = leader->flush_next;
+		leader->flush_next = vreq;
+		vbd->flushes_merged++;
+		return;
+	}
+
+	vbd->flush = vreq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op    = TD_OP_FLUSH;
+	treq.sec   = vreq->sec;
+	treq.image = image;
+	treq.cb    = tapdisk_vbd_complete_td_request;
+	treq.vreq  = vreq;
+
+	if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
+		vreq->secs_pending++;
+		vbd->secs_pending++;
+		queue_mirror_flush(vbd, treq);
+	}
+
+	td_queue_flush(image, treq);
+}
+
+/*
+ * Split a read along the extent map and hand each piece to the image
+ * owning it. Holes in the whole chain are zeroed right here, and
+ * accounted to the last image, which is where the chain walk would
+ * have ended too.
+ */
+static void
+tapdisk_vbd_queue_mapped_read(td_vbd_t *vbd, td_request_t treq)
+{
+	td_image_t *image;
+	td_request_t clone;
+
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = tapdisk_extmap_lookup(vbd->extmap,
+						   treq.sec, treq.secs, &image);
+
+		if (image) {
+			clone.image = image;
+			td_queue_read(image, clone);
+		} else {
+			clone.image = tapdisk_vbd_last_image(vbd);
+			memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+			td_complete_request(clone, 0);
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+		treq.buf  += clone.secs << SECTOR_SHIFT;
+	}
+}
+
 static int
 tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
@@ -1434,6 +1640,15 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
+	if (vreq->op == TD_OP_FLUSH) {
+		tapdisk_vbd_issue_flush(vbd, vreq, image);
+		err = 0;
+		goto out;
+	}
+
+	if (vbd->readahead && vreq->op == TD_OP_READ)
+		tapdisk_readahead_observe(vbd->readahead, vreq);
+
 	for (i = 0; i < vreq->iovcnt; i++) {
 		struct td_iovec *iov = &vreq->iov[i];
 
@@ -1470,13 +1685,36 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			 */
 			if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR)
 				queue_mirror_req(vbd, treq);
+			if (vbd->extmap)
+				tapdisk_extmap_invalidate(vbd->extmap,
+							  treq.sec, treq.secs);
+			if (vbd->readahead)
+				tapdisk_readahead_invalidate(vbd->readahead,
+							     treq.sec, treq.secs);
 			td_queue_write(treq.image, treq);
 			break;
 
 		case TD_OP_READ:
 			treq.op = TD_OP_READ;
                         vbd->vdi_stats.stats->read_reqs_submitted++;
-			td_queue_read(treq.image, treq);
+			if (vbd->readahead &&
+			    !tapdisk_readahead_read(vbd->readahead, treq))
+				break;
+			if (vbd->extmap)
+				tapdisk_vbd_queue_mapped_read(vbd, treq);
+			else
+				td_queue_read(treq.image, treq);
+			break;
+
+		case TD_OP_DISCARD:
+			treq.op = TD_OP_DISCARD;
+			if (vbd->extmap)
+				tapdisk_extmap_invalidate(vbd->extmap,
+							  treq.sec, treq.secs);
+			if (vbd->readahead)
+				tapdisk_readahead_invalidate(vbd->readahead,
+							     treq.sec, treq.secs);
+			td_queue_discard(treq.image, treq);
 			break;
 		}
 
@@ -1559,6 +1797,9 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	struct td_iovec *iov;
 	int write;
 
+	if (vreq->op == TD_OP_DISCARD)
+		return;
+
 	write = vreq->op == TD_OP_WRITE;
 
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
@@ -1571,6 +1812,8 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 	int err;
 	td_vbd_request_t *vreq, *tmp;
 
+	err = 0;
+
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
@@ -1578,12 +1821,16 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 		 * we'll back off for a while.
 		 */
 		if (err && !tapdisk_vbd_request_completed(vbd, vreq))
-			return err;
+			break;
 
 		tapdisk_vbd_count_new_request(vbd, vreq);
+		err = 0;
 	}
 
-	return 0;
+	/* the pass is over, later flushes need a sync of their own */
+	vbd->flush = NULL;
+
+	return err;
 }
 
 int
@@ -1694,6 +1941,65 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 	}
 }
 
+static int
+__tapdisk_vbd_block_status(td_vbd_t *vbd, td_image_t *image,
+			   td_sector_t sec, int secs, int *allocated)
+{
+	int n, alloc;
+
+	/* a hole in one image narrows the span to look at in the next */
+	for (; &image->next != &vbd->images;
+	     image = tapdisk_vbd_next_image(image)) {
+		n = td_block_status(image, sec, secs, &alloc);
+		if (n <= 0)
+			return n ? : -EIO;
+
+		if (alloc) {
+			*allocated = 1;
+			return n;
+		}
+
+		secs = n;
+	}
+
+	*allocated = 0;
+	return secs;
+}
+
+int
+tapdisk_vbd_block_status(td_vbd_t *vbd, td_sector_t sec, int secs,
+			 int *allocated)
+{
+	if (td_flag_test(vbd->state, TD_VBD_PAUSED))
+		return -EAGAIN;
+
+	if (list_empty(&vbd->images))
+		return -EBADF;
+
+	return __tapdisk_vbd_block_status(vbd, tapdisk_vbd_first_image(vbd),
+					  sec, secs, allocated);
+}
+
+/*
+ * Same as above, for what lies underneath the image @treq was issued
+ * to. An image at the end of the chain has nothing below it: all holes.
+ * Secondaries and retired leaves sit outside the chain, and can't tell.
+ */
+int
+tapdisk_vbd_parent_block_status(td_request_t treq, int *allocated)
+{
+	td_vbd_t *vbd = treq.vreq->vbd;
+	td_image_t *image;
+
+	tapdisk_for_each_image(image, &vbd->images)
+		if (image == treq.image)
+			return __tapdisk_vbd_block_status(vbd,
+					tapdisk_vbd_next_image(image),
+					treq.sec, treq.secs, allocated);
+
+	return -EBADF;
+}
+
 int
 tapdisk_vbd_start_nbdserver(td_vbd_t *vbd)
 {
@@ -1790,6 +2096,18 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			"read_caching",
 			"s",  read_caching ? "true": "false");
 
+	if (vbd->extmap) {
+		tapdisk_stats_field(st, "extmap", "{");
+		tapdisk_extmap_stats(vbd->extmap, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->readahead) {
+		tapdisk_stats_field(st, "readahead", "{");
+		tapdisk_readahead_stats(vbd->readahead, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
 	tapdisk_stats_leave(st, '}');
 }
 
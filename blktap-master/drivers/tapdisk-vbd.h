@@ -38,6 +38,8 @@
 #include "tapdisk-image.h"
 #include "tapdisk-blktap.h"
 #include "td-blkif.h"
+#include "tapdisk-extmap.h"
+#include "tapdisk-readahead.h"
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
@@ -135,6 +137,13 @@ struct td_vbd_handle {
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
 
+	/*
+	 * The flush issued in the current pass, if still in progress. Flushes
+	 * issued after it, but before its sync is submitted, are completed
+	 * along with it.
+	 */
+	td_vbd_request_t           *flush;
+
 	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
 
 	struct list_head            next;
@@ -148,10 +157,18 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+	uint64_t                    flushes;
+	uint64_t                    flushes_merged;
 	td_sector_count_t           secs;
 
 	struct td_nbdserver        *nbdserver;
 
+	/* where reads land in the chain, if TD_OPEN_EXTENT_MAP */
+	td_extmap_t                *extmap;
+
+	/* sequential read prefetching, if TD_OPEN_READAHEAD */
+	td_readahead_t             *readahead;
+
 	/**
 	 * We keep a copy of the disk info because we might receive a disk info
 	 * request while we're in the paused state.
@@ -163,7 +180,7 @@ struct td_vbd_handle {
 
 	char                       *logpath;
 
-	struct td_vbd_encryption   encryption;
+	struct td_vbd_open_params  open_params;
 
 	bool                       watchdog_warned;
 };
@@ -213,6 +230,16 @@ void tapdisk_vbd_detach(td_vbd_t *);
 int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
+/**
+ * Allocation state of the image chain: a run of up to @secs sectors from
+ * @sec which are allocated in some image (*allocated = 1) or in none.
+ * Returns the run length, -EAGAIN while an image is still loading the
+ * metadata to tell, or another negative error if an image can't tell.
+ */
+int tapdisk_vbd_block_status(td_vbd_t *, td_sector_t sec, int secs,
+		int *allocated);
+int tapdisk_vbd_parent_block_status(td_request_t, int *allocated);
+
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
 int tapdisk_vbd_retry_needed(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
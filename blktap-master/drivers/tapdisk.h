@@ -55,6 +55,13 @@
  *     0 if parent id successfully retrieved
  *     TD_NO_PARENT if no parent exists
  *     -errno on error
+ *
+ * td_block_status (optional) reports, without doing any I/O, whether
+ * the image itself holds the data at a sector.  It returns the number of
+ * sectors from there on which share that state, and sets *allocated;
+ * -EAGAIN means the metadata needed is not in memory yet (the driver may
+ * start fetching it), any other -errno that the question can't be
+ * answered.
  */
 
 #ifndef _TAPDISK_H_
@@ -74,11 +81,17 @@ extern unsigned int PAGE_MASK;
 extern unsigned int PAGE_SHIFT;
 
 #define MAX_SEGMENTS_PER_REQ         11
+#define MAX_SEGMENTS_PER_INDIRECT_REQ 256 /* BLKTAP3_MAX_INDIRECT_SEGMENTS */
 #define MAX_REQUESTS                 32U
 #define SECTOR_SHIFT                 9
 #define DEFAULT_SECTOR_SIZE          512
 
-#define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ)
+/*
+ * A full ring of indirect requests on persistent grants is one td_request
+ * per segment. Driver pools are sized for that; they are calloc()ed and
+ * recycled LIFO, so only the entries a VBD actually uses become resident.
+ */
+#define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * MAX_SEGMENTS_PER_INDIRECT_REQ)
 
 //#define BLK_NOT_ALLOCATED            (-99)
 #define TD_NO_PARENT                 1
@@ -87,6 +100,8 @@ extern unsigned int PAGE_SHIFT;
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
+#define TD_OP_FLUSH                  3
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -102,6 +117,8 @@ extern unsigned int PAGE_SHIFT;
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
 #define TD_OPEN_NO_O_DIRECT          0x02000
+#define TD_OPEN_EXTENT_MAP           0x04000
+#define TD_OPEN_READAHEAD            0x08000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -159,7 +176,7 @@ struct td_vbd_request {
 	int                         prev_error;
 
 	int                         submitting;
-	int                         secs_pending;
+	td_sector_t                 secs_pending;
 	int                         num_retries;
 	struct timeval		    ts;
 	struct timeval              last_try;
@@ -167,6 +184,9 @@ struct td_vbd_request {
 	td_vbd_t                   *vbd;
 	struct list_head            next;
 	struct list_head           *list_head;
+
+	/* flushes riding on this one */
+	td_vbd_request_t           *flush_next;
 };
 
 struct td_request {
@@ -192,6 +212,18 @@ struct td_vbd_encryption
 	uint8_t                    *encryption_key;
 };
 
+/*
+ * Per-VBD parameters handed down the image chain to each driver's
+ * td_open.
+ */
+struct td_vbd_open_params
+{
+	struct td_vbd_encryption   encryption;
+
+	/* vhd bitmap cache size, in bitmaps; 0 selects the default */
+	uint32_t                   bm_cache_size;
+};
+
 /* 
  * Structure describing the interface to a virtual disk implementation.
  * See note at the top of this file describing this interface.
@@ -200,14 +232,17 @@ struct tap_disk {
 	const char                  *disk_type;
 	td_flag_t                    flags;
 	int                          private_data_size;
-	int (*td_open)               (td_driver_t *, const char *, struct td_vbd_encryption *encryption, td_flag_t);
+	int (*td_open)               (td_driver_t *, const char *, struct td_vbd_open_params *params, td_flag_t);
 	int (*td_close)              (td_driver_t *);
 	int (*td_get_parent_id)      (td_driver_t *, td_disk_id_t *);
 	int (*td_validate_parent)    (td_driver_t *, td_driver_t *, td_flag_t);
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+	void (*td_queue_flush)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
+	int (*td_block_status)       (td_driver_t *, td_sector_t, int, int *);
 
     /**
      * Callback to produce RRD output.
@@ -50,7 +50,7 @@
 #include "td-req.h"
 
 struct td_xenblkif *
-tapdisk_xenblkif_find(const domid_t domid, const int devid)
+tapdisk_xenblkif_find(const domid_t domid, const int devid, const int queue)
 {
     struct td_xenblkif *blkif = NULL;
     struct td_xenio_ctx *ctx;
@@ -58,7 +58,8 @@ tapdisk_xenblkif_find(const domid_t domid, const int devid)
     tapdisk_xenio_for_each_ctx(ctx) {
         tapdisk_xenio_ctx_find_blkif(ctx, blkif,
                                      blkif->domid == domid &&
-                                     blkif->devid == devid);
+                                     blkif->devid == devid &&
+                                     (queue < 0 || blkif->queue == queue));
         if (blkif)
             return blkif;
     }
@@ -122,8 +123,12 @@ tapdisk_xenblkif_stats_create(struct td_xenblkif *blkif)
     int err = 0, len;
     char *_path = NULL;
 
-    len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d",
-            blkif->domid, blkif->devid);
+    if (blkif->queue)
+        len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d-q%d",
+                blkif->domid, blkif->devid, blkif->queue);
+    else
+        len = asprintf(&blkif->xenvbd_stats.root, "/dev/shm/vbd3-%d-%d",
+                blkif->domid, blkif->devid);
     if (unlikely(len == -1)) {
         err = errno;
         blkif->xenvbd_stats.root = NULL;
@@ -279,15 +284,10 @@ tapdisk_xenblkif_reqs_pending(const struct td_xenblkif * const blkif)
 }
 
 
-int
-tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+static int
+tapdisk_xenblkif_disconnect_ring(struct td_xenblkif * const blkif)
 {
     int err;
-    struct td_xenblkif *blkif;
-
-    blkif = tapdisk_xenblkif_find(domid, devid);
-    if (!blkif)
-        return -ENODEV;
 
     if (tapdisk_xenblkif_reqs_pending(blkif)) {
         RING_DEBUG(blkif, "disconnect from ring with %d pending requests\n",
@@ -323,6 +323,30 @@ tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
 }
 
 
+int
+tapdisk_xenblkif_disconnect(const domid_t domid, const int devid)
+{
+    int err;
+    struct td_xenblkif *blkif;
+
+    blkif = tapdisk_xenblkif_find(domid, devid, -1);
+    if (!blkif)
+        return -ENODEV;
+
+    /*
+     * Rings either get destroyed or marked dead, so they drop out of the
+     * search.
+     */
+    do {
+        err = tapdisk_xenblkif_disconnect_ring(blkif);
+        if (unlikely(err))
+            break;
+    } while ((blkif = tapdisk_xenblkif_find(domid, devid, -1)));
+
+    return err;
+}
+
+
 void
 tapdisk_xenblkif_sched_stoppolling(const struct td_xenblkif *blkif)
 {
@@ -432,9 +456,11 @@ tapdisk_xenblkif_cb_chkrng(event_id_t id __attribute__((unused)),
 
 
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue,
+        const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd)
+        int poll_idle_threshold, bool persistent, const char *pool,
+        td_vbd_t * vbd)
 {
     struct td_xenblkif *td_blkif = NULL; /* TODO rename to blkif */
     struct td_xenio_ctx *td_ctx;
@@ -449,7 +475,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     /*
      * Already connected?
      */
-    if (tapdisk_xenblkif_find(domid, devid)) {
+    if (tapdisk_xenblkif_find(domid, devid, queue)) {
         /* TODO log error */
         return -EALREADY;
     }
@@ -469,6 +495,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 
     td_blkif->domid = domid;
     td_blkif->devid = devid;
+    td_blkif->queue = queue;
     td_blkif->vbd = vbd;
     td_blkif->ctx = td_ctx;
     td_blkif->proto = proto;
@@ -481,6 +508,7 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
 	td_blkif->barrier.msg = NULL;
 	td_blkif->barrier.io_done = false;
 	td_blkif->barrier.io_err = 0;
+	td_blkif->pgnts.enabled = persistent;
 
     td_blkif->xenvbd_stats.root = NULL;
     shm_init(&td_blkif->xenvbd_stats.io_ring);
@@ -586,7 +614,8 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
         goto fail;
     }
 
-    err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid, &td_blkif->vbd_stats);
+    err = td_metrics_vbd_start(td_blkif->domid, td_blkif->devid,
+            td_blkif->queue, &td_blkif->vbd_stats);
     if (unlikely(err))
         goto fail;
 
@@ -606,7 +635,8 @@ tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
     list_add_tail(&td_blkif->entry, &vbd->rings);
 	list_add_tail(&td_blkif->entry_ctx, &td_ctx->blkifs);
 
-    DPRINTF("ring %p connected\n", td_blkif);
+    DPRINTF("ring %p connected%s\n", td_blkif,
+            persistent ? " with persistent grants" : "");
 
     return 0;
 
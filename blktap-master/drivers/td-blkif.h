@@ -62,6 +62,12 @@ struct td_xenblkif {
      */
     int devid;
 
+    /**
+     * Index of this ring among the rings of the VBD, for front-ends that use
+     * multi-queue-num-queues. Each ring has its own event channel, requests
+     * and stats, and is processed independently of the others.
+     */
+    int queue;
 
     /**
 	 * Pointer to the context this block interface belongs to.
@@ -168,6 +174,20 @@ struct td_xenblkif {
     unsigned n_reqs_bufcache_free;
     event_id_t reqs_bufcache_evtid;
 
+    /**
+     * Persistent grant cache, used if the front-end supports
+     * feature-persistent. Grants are kept mapped in a tree keyed by grant
+     * reference; the ones not used by any in-flight request sit in an LRU
+     * list, from which they get evicted once max mappings are live.
+     */
+    struct {
+        bool enabled;
+        void *root;
+        struct list_head lru;
+        unsigned int n;
+        unsigned int max;
+    } pgnts;
+
 	bool dead;
 
 	struct {
@@ -197,22 +217,24 @@ struct td_xenblkif {
 };
 
 #define RING_DEBUG(blkif, fmt, args...)                                     \
-    DPRINTF("%d/%d, ring=%p: "fmt, (blkif)->domid, (blkif)->devid, (blkif), \
-        ##args);
+    DPRINTF("%d/%d/%d, ring=%p: "fmt, (blkif)->domid, (blkif)->devid,       \
+        (blkif)->queue, (blkif), ##args);
 
 #define RING_ERR(blkif, fmt, args...)                                       \
-    EPRINTF("%d/%d, ring=%p: "fmt, (blkif)->domid, (blkif)->devid, (blkif), \
-        ##args);
+    EPRINTF("%d/%d/%d, ring=%p: "fmt, (blkif)->domid, (blkif)->devid,       \
+        (blkif)->queue, (blkif), ##args);
 
 /* TODO rename from xenio */
 #define tapdisk_xenio_for_each_ctx(_ctx) \
-	list_for_each_entry(_ctx, &_td_xenio_ctxs, entry)
+	list_for_each_entry(_ctx, tapdisk_xenio_ctxs(), entry)
 
 /**
  * Connects the tapdisk to the shared ring.
  *
  * @param domid the ID of the guest domain
  * @param devid the device ID
+ * @param queue the index of the ring (0 unless the front-end uses multiple
+ * queues)
  * @param grefs the grant references
  * @param order number of grant references
  * @param port event channel port of the guest domain to use for ring
@@ -220,17 +242,21 @@ struct td_xenblkif {
  * @param proto protocol (native, x86, or x64)
  * @param poll_duration polling duration (microseconds; 0 means no polling)
  * @param poll_idle_threshold CPU threshold above which we permit polling
+ * @param persistent whether the front-end uses persistent grants
  * @param pool name of the context
  * @param vbd the VBD
  * @returns 0 on success
  */
 int
-tapdisk_xenblkif_connect(domid_t domid, int devid, const grant_ref_t * grefs,
+tapdisk_xenblkif_connect(domid_t domid, int devid, int queue,
+        const grant_ref_t * grefs,
         int order, evtchn_port_t port, int proto, int poll_duration,
-        int poll_idle_threshold, const char *pool, td_vbd_t * vbd);
+        int poll_idle_threshold, bool persistent, const char *pool,
+        td_vbd_t * vbd);
 
 /**
- * Disconnects the tapdisk from the shared ring.
+ * Disconnects the tapdisk from the shared rings of the device, all of its
+ * queues.
  *
  * @param domid the domain ID of the guest domain
  * @param devid the device ID of the VBD
@@ -258,10 +284,11 @@ tapdisk_xenblkif_destroy(struct td_xenblkif * blkif);
  *
  * @param domid the domain ID
  * @param devid the device ID
+ * @param queue the ring index, or -1 for any ring of the device
  * @returns a pointer to the block interface if found, else NULL
  */
 struct td_xenblkif *
-tapdisk_xenblkif_find(const domid_t domid, const int devid);
+tapdisk_xenblkif_find(const domid_t domid, const int devid, const int queue);
 
 /**
  * Returns the event ID associated with the event channel. Since the event
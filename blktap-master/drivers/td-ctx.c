@@ -45,7 +45,16 @@
 
 #define ERROR(_f, _a...)           tlog_syslog(TLOG_WARN, "td-ctx: " _f, ##_a)
 
-struct list_head _td_xenio_ctxs = LIST_HEAD_INIT(_td_xenio_ctxs);
+static __thread struct list_head _td_xenio_ctxs;
+
+struct list_head *
+tapdisk_xenio_ctxs(void)
+{
+	if (unlikely(!_td_xenio_ctxs.next))
+		INIT_LIST_HEAD(&_td_xenio_ctxs);
+
+	return &_td_xenio_ctxs;
+}
 
 /**
  * TODO releases a pool?
@@ -137,6 +146,34 @@ xenio_pending_blkif(struct td_xenio_ctx * const ctx)
         dst->seg[i] = src->seg[i];              \
 }
 
+/*
+ * Indirect requests are kept in the native blkif_request_indirect layout,
+ * which fits in a blkif_request_t.
+ */
+#define blkif_get_req_indirect(dst, src)        \
+{                                               \
+    int i;                                      \
+    dst->operation = BLKIF_OP_INDIRECT;         \
+    dst->indirect_op = src->indirect_op;        \
+    dst->nr_segments = src->nr_segments;        \
+    dst->handle = src->handle;                  \
+    dst->id = src->id;                          \
+    dst->sector_number = src->sector_number;    \
+    xen_rmb();                                  \
+    for (i = 0; i < BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST; i++) \
+        dst->indirect_grefs[i] = src->indirect_grefs[i];       \
+}
+
+#define blkif_get_req_discard(dst, src)         \
+{                                               \
+    dst->operation = src->operation;            \
+    dst->flag = src->flag;                      \
+    dst->handle = src->handle;                  \
+    dst->id = src->id;                          \
+    dst->sector_number = src->sector_number;    \
+    dst->nr_sectors = src->nr_sectors;          \
+}
+
 /**
  * Utility function that retrieves a request using @idx as the ring index,
  * copying it to the @dst in a H/W independent way.
@@ -169,7 +206,16 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_32_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_32, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_request_indirect_t *idst = (void *)dst;
+                    blkif_x86_32_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(idst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_request_discard_t *ddst = (void *)dst;
+                    blkif_x86_32_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(ddst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -177,7 +223,16 @@ xenio_blkif_get_request(struct td_xenblkif * const blkif,
             {
                 blkif_x86_64_request_t *src;
                 src = RING_GET_REQUEST(&rings->x86_64, idx);
-                blkif_get_req(dst, src);
+                if (src->operation == BLKIF_OP_INDIRECT) {
+                    blkif_request_indirect_t *idst = (void *)dst;
+                    blkif_x86_64_request_indirect_t *isrc = (void *)src;
+                    blkif_get_req_indirect(idst, isrc);
+                } else if (src->operation == BLKIF_OP_DISCARD) {
+                    blkif_request_discard_t *ddst = (void *)dst;
+                    blkif_x86_64_request_discard_t *dsrc = (void *)src;
+                    blkif_get_req_discard(ddst, dsrc);
+                } else
+                    blkif_get_req(dst, src);
                 break;
             }
 
@@ -426,7 +481,7 @@ tapdisk_xenio_ctx_open(const char *pool)
     ctx->gntdev_fd = -1;
     ctx->pool = TD_XENBLKIF_DEFAULT_POOL;
 	INIT_LIST_HEAD(&ctx->blkifs);
-    list_add(&ctx->entry, &_td_xenio_ctxs);
+    list_add(&ctx->entry, tapdisk_xenio_ctxs());
 
     ctx->gntdev_fd = open("/dev/xen/gntdev", O_NONBLOCK);
     if (ctx->gntdev_fd == -1) {
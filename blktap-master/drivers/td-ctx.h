@@ -104,9 +104,11 @@ tapdisk_xenio_ctx_process_ring(struct td_xenblkif *blkif,
 		struct td_xenio_ctx *ctx, int final);
 
 /**
- * List of contexts.
+ * List of contexts of the calling thread. A context's ring event is
+ * registered with the scheduler of the event loop that opened it, so each
+ * loop keeps its own contexts.
  */
-extern struct list_head _td_xenio_ctxs;
+struct list_head *tapdisk_xenio_ctxs(void);
 
 /**
  * For each block interface of this context...
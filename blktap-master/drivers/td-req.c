@@ -37,6 +37,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <search.h>
 
 #ifdef __linux__
 #include <linux/version.h>
@@ -64,6 +65,40 @@
 #define TD_REQS_BUFCACHE_EXPIRE 3 // time in seconds
 #define TD_REQS_BUFCACHE_MIN    1 // buffers to always keep in the cache
 
+/*
+ * Size of a request buffer, large enough for an indirect request.
+ */
+#define TD_REQS_BUFSZ           (TD_XENBLKIF_MAX_SEGMENTS << XC_PAGE_SHIFT)
+
+#define TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME \
+    (XC_PAGE_SIZE / sizeof(struct blkif_request_segment))
+
+/*
+ * A discard is split into buffer-less iovecs of at most this many sectors.
+ */
+#define TD_XENBLKIF_DISCARD_SECS (1U << 30)
+
+/*
+ * Upper bound of persistently mapped grants per block interface, same as
+ * blkback's default.
+ */
+#define TD_XENBLKIF_PGNTS_MAX   1056
+
+/**
+ * A front-end grant kept mapped for as long as the ring is connected.
+ */
+struct td_xenblkif_pgnt {
+    grant_ref_t gref;
+    void *page;
+
+    /**
+     * Number of in-flight requests using this grant. Idle grants are kept
+     * in the block interface's LRU list.
+     */
+    int users;
+    struct list_head lru;
+};
+
 static void
 td_xenblkif_bufcache_free(struct td_xenblkif * const blkif);
 static inline void
@@ -109,6 +144,157 @@ td_xenblkif_bufcache_evt_reg(struct td_xenblkif * const blkif)
                                       blkif);
 }
 
+static int
+td_xenblkif_pgnt_cmp(const void *a, const void *b)
+{
+    const struct td_xenblkif_pgnt *x = a, *y = b;
+
+    if (x->gref < y->gref)
+        return -1;
+    return x->gref > y->gref;
+}
+
+static void
+td_xenblkif_pgnt_unmap(struct td_xenblkif * const blkif,
+        struct td_xenblkif_pgnt *pgnt)
+{
+    ASSERT(!pgnt->users);
+
+    tdelete(pgnt, &blkif->pgnts.root, td_xenblkif_pgnt_cmp);
+    list_del(&pgnt->lru);
+    blkif->pgnts.n--;
+
+    if (unlikely(xc_gnttab_munmap(blkif->ctx->xcg_handle, pgnt->page, 1)))
+        RING_ERR(blkif, "failed to unmap persistent grant %u: %s "
+                "(error ignored)\n", pgnt->gref, strerror(errno));
+
+    blkif->stats.pgnts.unmaps++;
+    free(pgnt);
+}
+
+/**
+ * Looks up a grant in the persistent grant cache, mapping it if this is the
+ * first time we see it. The grant is held until td_xenblkif_pgnt_put.
+ *
+ * @returns the grant, or NULL if it could not be mapped and the caller
+ * should fall back to grant copy
+ */
+static struct td_xenblkif_pgnt *
+td_xenblkif_pgnt_get(struct td_xenblkif * const blkif, grant_ref_t gref)
+{
+    struct td_xenblkif_pgnt key, *pgnt;
+    void *node;
+
+    key.gref = gref;
+    node = tfind(&key, &blkif->pgnts.root, td_xenblkif_pgnt_cmp);
+    if (node) {
+        pgnt = *(struct td_xenblkif_pgnt **)node;
+        blkif->stats.pgnts.hits++;
+        goto out;
+    }
+
+    if (blkif->pgnts.n >= blkif->pgnts.max) {
+        if (list_empty(&blkif->pgnts.lru))
+            return NULL;
+        td_xenblkif_pgnt_unmap(blkif,
+                list_first_entry(&blkif->pgnts.lru, struct td_xenblkif_pgnt,
+                    lru));
+    }
+
+    pgnt = malloc(sizeof(*pgnt));
+    if (unlikely(!pgnt))
+        return NULL;
+
+    /*
+     * The front-end grants persistent pages read/write, whichever the
+     * direction of the request that first uses them.
+     */
+    pgnt->page = xc_gnttab_map_grant_ref(blkif->ctx->xcg_handle,
+            blkif->domid, gref, PROT_READ | PROT_WRITE);
+    if (unlikely(!pgnt->page)) {
+        RING_ERR(blkif, "failed to map persistent grant %u: %s\n", gref,
+                strerror(errno));
+        free(pgnt);
+        return NULL;
+    }
+
+    pgnt->gref = gref;
+    pgnt->users = 0;
+    INIT_LIST_HEAD(&pgnt->lru);
+
+    if (unlikely(!tsearch(pgnt, &blkif->pgnts.root, td_xenblkif_pgnt_cmp))) {
+        xc_gnttab_munmap(blkif->ctx->xcg_handle, pgnt->page, 1);
+        free(pgnt);
+        return NULL;
+    }
+
+    blkif->pgnts.n++;
+    blkif->stats.pgnts.maps++;
+out:
+    if (!pgnt->users++)
+        list_del_init(&pgnt->lru);
+    return pgnt;
+}
+
+static void
+td_xenblkif_pgnt_put(struct td_xenblkif * const blkif,
+        struct td_xenblkif_pgnt *pgnt)
+{
+    ASSERT(pgnt->users > 0);
+
+    if (!--pgnt->users)
+        list_add_tail(&pgnt->lru, &blkif->pgnts.lru);
+}
+
+/**
+ * Acquires persistent grants for all segments of a request, or none.
+ */
+static int
+td_xenblkif_pgnts_get(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    int i;
+
+    for (i = 0; i < req->nr_segments; i++) {
+        req->pgnt[i] = td_xenblkif_pgnt_get(blkif, req->seg[i].gref);
+        if (unlikely(!req->pgnt[i])) {
+            while (i-- > 0)
+                td_xenblkif_pgnt_put(blkif, req->pgnt[i]);
+            return -ENOMEM;
+        }
+    }
+
+    req->n_pgnts = req->nr_segments;
+
+    return 0;
+}
+
+static void
+td_xenblkif_pgnts_put(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    while (req->n_pgnts > 0)
+        td_xenblkif_pgnt_put(blkif, req->pgnt[--req->n_pgnts]);
+}
+
+/**
+ * Unmaps all persistent grants. No request may be using them.
+ */
+static void
+td_xenblkif_pgnts_free(struct td_xenblkif * const blkif)
+{
+    while (blkif->pgnts.root)
+        td_xenblkif_pgnt_unmap(blkif,
+                *(struct td_xenblkif_pgnt **)blkif->pgnts.root);
+}
+
+static void
+td_xenblkif_bufcache_unmap(void *buf)
+{
+    tapdisk_server_unregister_iobuf(buf);
+    munmap(buf, TD_REQS_BUFSZ);
+}
+
 /**
  * Free request buffer cache.
  *
@@ -119,10 +305,9 @@ td_xenblkif_bufcache_free(struct td_xenblkif * const blkif)
 {
     ASSERT(blkif);
 
-    while (blkif->n_reqs_bufcache_free > TD_REQS_BUFCACHE_MIN){
-        munmap(blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free],
-               BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT);
-    }
+    while (blkif->n_reqs_bufcache_free > TD_REQS_BUFCACHE_MIN)
+        td_xenblkif_bufcache_unmap(
+                blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free]);
 }
 
 /**
@@ -138,10 +323,13 @@ td_xenblkif_bufcache_get(struct td_xenblkif * const blkif)
     ASSERT(blkif);
 
     if (!blkif->n_reqs_bufcache_free) {
-        buf = mmap(NULL, BLKIF_MAX_SEGMENTS_PER_REQUEST << XC_PAGE_SHIFT,
+        buf = mmap(NULL, TD_REQS_BUFSZ,
                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
         if (unlikely(buf == MAP_FAILED))
             buf = NULL;
+        else
+            /* lets the I/O driver skip page pinning per request */
+            tapdisk_server_register_iobuf(buf, TD_REQS_BUFSZ);
     } else
         buf = blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free];
 
@@ -200,8 +388,9 @@ tapdisk_xenblkif_free_request(struct td_xenblkif * const blkif,
 
     blkif->reqs_free[blkif->ring_size - (++blkif->n_reqs_free)] = &tapreq->msg;
 
-	if (likely(tapreq->msg.nr_segments))
-	    td_xenblkif_bufcache_put(blkif, tapreq->vma);
+	td_xenblkif_pgnts_put(blkif, tapreq);
+	td_xenblkif_bufcache_put(blkif, tapreq->vma);
+	tapreq->vma = NULL;
 }
 
 /**
@@ -339,7 +528,8 @@ static inline bool
 blkif_rq_wr(blkif_request_t const * const msg)
 {
 	return BLKIF_OP_WRITE == msg->operation ||
-		(BLKIF_OP_WRITE_BARRIER == msg->operation && msg->nr_segments);
+		(BLKIF_OP_WRITE_BARRIER == msg->operation && msg->nr_segments) ||
+		(BLKIF_OP_FLUSH_DISKCACHE == msg->operation && msg->nr_segments);
 }
 
 
@@ -353,90 +543,117 @@ blkif_rq_data(blkif_request_t const * const msg)
 }
 
 
-static int
-guest_copy2(struct td_xenblkif * const blkif,
-        struct td_xenblkif_req * const tapreq /* TODO rename to req */) {
+/**
+ * Fills in a grant-copy segment.
+ *
+ * @param from_guest copy from the guest's grant into @virt, else the other
+ * way round
+ */
+static inline void
+td_xenblkif_gcopy_seg(struct td_xenblkif * const blkif,
+        struct gntdev_grant_copy_segment *gcopy_seg, const bool from_guest,
+        grant_ref_t gref, unsigned int offset, void *virt, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+    if (from_guest) {
+        gcopy_seg->dest.virt = virt;
+        gcopy_seg->source.foreign.ref = gref;
+        gcopy_seg->source.foreign.offset = offset;
+        gcopy_seg->source.foreign.domid = blkif->domid;
+        gcopy_seg->flags = GNTCOPY_source_gref;
+    } else {
+        gcopy_seg->source.virt = virt;
+        gcopy_seg->dest.foreign.ref = gref;
+        gcopy_seg->dest.foreign.offset = offset;
+        gcopy_seg->dest.foreign.domid = blkif->domid;
+        gcopy_seg->flags = GNTCOPY_dest_gref;
+    }
+    gcopy_seg->len = len;
+#else
+    gcopy_seg->iov.iov_base = virt;
+    gcopy_seg->iov.iov_len = len;
+    gcopy_seg->ref = gref;
+    gcopy_seg->offset = offset;
+#endif
+}
 
-    int i = 0;
-    long err = 0;
+/**
+ * Issues a batch of grant-copy segments in one go.
+ *
+ * @returns 0 on success, -errno on failure
+ */
+static int
+td_xenblkif_gcopy(struct td_xenblkif * const blkif,
+        struct gntdev_grant_copy_segment *segs, const int count,
+        const bool from_guest)
+{
     struct ioctl_gntdev_grant_copy gcopy;
+    int i, err;
 
     ASSERT(blkif);
     ASSERT(blkif->ctx);
-    ASSERT(tapreq);
-    ASSERT(blkif_rq_data(&tapreq->msg));
-	ASSERT(tapreq->msg.nr_segments > 0);
-	ASSERT(tapreq->msg.nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
-
-    for (i = 0; i < tapreq->msg.nr_segments; i++) {
-        struct blkif_request_segment *blkif_seg = &tapreq->msg.seg[i];
-        struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-        if (blkif_rq_wr(&tapreq->msg)) {
-            /* copy from guest */
-            gcopy_seg->dest.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
-            gcopy_seg->source.foreign.ref = blkif_seg->gref;
-            gcopy_seg->source.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
-            gcopy_seg->source.foreign.domid = blkif->domid;
-            gcopy_seg->flags = GNTCOPY_source_gref;
-        } else {
-            /* copy to guest */
-            gcopy_seg->source.virt = tapreq->vma + (i << PAGE_SHIFT)
-                + (blkif_seg->first_sect << SECTOR_SHIFT);
-            gcopy_seg->dest.foreign.ref = blkif_seg->gref;
-            gcopy_seg->dest.foreign.offset = blkif_seg->first_sect << SECTOR_SHIFT;
-            gcopy_seg->dest.foreign.domid = blkif->domid;
-            gcopy_seg->flags = GNTCOPY_dest_gref;
-        }
-
-        gcopy_seg->len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
-    }
-#else
-        gcopy_seg->iov.iov_base = tapreq->vma + (i << PAGE_SHIFT)
-            + (blkif_seg->first_sect << SECTOR_SHIFT);
-        gcopy_seg->iov.iov_len = (blkif_seg->last_sect
-                - blkif_seg->first_sect
-                + 1)
-            << SECTOR_SHIFT;
-        gcopy_seg->ref = blkif_seg->gref;
-        gcopy_seg->offset = blkif_seg->first_sect << SECTOR_SHIFT;
-    }
 
-    gcopy.dir = blkif_rq_wr(&tapreq->msg);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+    gcopy.dir = from_guest;
     gcopy.domid = blkif->domid;
 #endif
-    gcopy.count = tapreq->msg.nr_segments;
-	gcopy.segments = tapreq->gcopy_segs;
+    gcopy.count = count;
+    gcopy.segments = segs;
 
-    err = -ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
-    if (err) {
-        err = -errno;
-        RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
-                "(%d segments): %s\n", tapreq->msg.id,
-                tapreq->msg.nr_segments, strerror(-err));
-        goto out;
-    }
+    err = ioctl(blkif->ctx->gntdev_fd, IOCTL_GNTDEV_GRANT_COPY, &gcopy);
+    if (err)
+        return -errno;
 
-	for (i = 0; i < tapreq->msg.nr_segments; i++) {
-		struct gntdev_grant_copy_segment *gcopy_seg = &tapreq->gcopy_segs[i];
-		if (gcopy_seg->status != GNTST_okay) {
+	for (i = 0; i < count; i++) {
+		if (segs[i].status != GNTST_okay) {
 			/*
 			 * TODO use gnttabop_error for reporting errors, defined in
 			 * xen/extras/mini-os/include/gnttab.h (header not available to
 			 * user space)
 			 */
-			RING_ERR(blkif, "req %lu: failed to grant-copy segment %d: %d\n",
-                    tapreq->msg.id, i, gcopy_seg->status);
-			err = -EIO;
-			goto out;
+			RING_ERR(blkif, "failed to grant-copy segment %d: %d\n", i,
+                    segs[i].status);
+			return -EIO;
 		}
 	}
 
-out:
+    return 0;
+}
+
+static int
+guest_copy2(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const tapreq /* TODO rename to req */) {
+
+    int i = 0;
+    long err = 0;
+    bool from_guest;
+
+    ASSERT(blkif);
+    ASSERT(tapreq);
+    ASSERT(blkif_rq_data(&tapreq->msg));
+	ASSERT(tapreq->nr_segments > 0);
+	ASSERT(tapreq->nr_segments <= ARRAY_SIZE(tapreq->gcopy_segs));
+
+    from_guest = blkif_rq_wr(&tapreq->msg);
+
+    for (i = 0; i < tapreq->nr_segments; i++) {
+        struct blkif_request_segment *blkif_seg = &tapreq->seg[i];
+        unsigned int offset = blkif_seg->first_sect << SECTOR_SHIFT;
+
+        td_xenblkif_gcopy_seg(blkif, &tapreq->gcopy_segs[i], from_guest,
+                blkif_seg->gref, offset,
+                tapreq->vma + (i << PAGE_SHIFT) + offset,
+                (blkif_seg->last_sect - blkif_seg->first_sect + 1)
+                << SECTOR_SHIFT);
+    }
+
+    err = td_xenblkif_gcopy(blkif, tapreq->gcopy_segs, tapreq->nr_segments,
+            from_guest);
+    if (err)
+        RING_ERR(blkif, "failed to grant-copy request %"PRIu64" "
+                "(%d segments): %s\n", tapreq->msg.id,
+                tapreq->nr_segments, strerror(-err));
+
     return err;
 }
 
@@ -502,7 +719,7 @@ tapdisk_xenblkif_complete_request(struct td_xenblkif * const blkif,
 			}
 			blkif->vbd_stats.stats->read_reqs_completed++;
 			ticks = &blkif->vbd_stats.stats->read_total_ticks;
-			if (likely(!err)) {
+			if (likely(!err) && !tapreq->n_pgnts) {
 				_err = guest_copy2(blkif, tapreq);
 				if (unlikely(_err)) {
 					err = _err;
@@ -605,6 +822,31 @@ __tapdisk_xenblkif_request_cb(struct td_vbd_request * const vreq,
 
     tapreq = container_of(vreq, struct td_xenblkif_req, vreq);
 
+    /*
+     * A flush carrying data is a preflush, the write, and a flush making
+     * the write itself durable: go round again for the next step.
+     */
+    if (unlikely(tapreq->msg.operation == BLKIF_OP_FLUSH_DISKCACHE &&
+                (vreq->op == TD_OP_WRITE || tapreq->flush_iovcnt) &&
+                !error && !blkif->dead)) {
+        if (vreq->op == TD_OP_FLUSH) {
+            vreq->op = TD_OP_WRITE;
+            vreq->iovcnt = tapreq->flush_iovcnt;
+            tapreq->flush_iovcnt = 0;
+        } else {
+            vreq->op = TD_OP_FLUSH;
+            vreq->iovcnt = 0;
+        }
+        vreq->error = 0;
+        vreq->num_retries = 0;
+        vreq->prev_error = 0;
+        INIT_LIST_HEAD(&vreq->next);
+        tapdisk_vbd_queue_request(blkif->vbd, vreq);
+        if (final)
+            xenio_blkif_put_response(blkif, NULL, 0, 1);
+        return;
+    }
+
     if (error) {
         if (likely(!blkif->dead)) {
             blkif->stats.errors.img++;
@@ -633,21 +875,29 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     vreq = &req->vreq;
     ASSERT(vreq);
 
-    req->vma = td_xenblkif_bufcache_get(blkif);
-    if (unlikely(!req->vma)) {
-        err = errno;
-        goto out;
+    /*
+     * With persistent grants, do the I/O straight on the guest pages,
+     * otherwise grant-copy through a bounce buffer.
+     */
+    if (!blkif->pgnts.enabled || td_xenblkif_pgnts_get(blkif, req)) {
+        if (blkif->pgnts.enabled)
+            blkif->stats.pgnts.copies++;
+        req->vma = td_xenblkif_bufcache_get(blkif);
+        if (unlikely(!req->vma)) {
+            err = errno;
+            goto out;
+        }
     }
 
-    for (i = 0; i < req->msg.nr_segments; i++) {
-        struct blkif_request_segment *seg = &req->msg.seg[i];
-        req->gref[i] = seg->gref;
+    for (i = 0; i < req->nr_segments; i++) {
+        struct blkif_request_segment *seg = &req->seg[i];
 
         /*
          * Note that first and last may be equal, which means only one sector
          * must be transferred.
          */
-        if (seg->last_sect < seg->first_sect) {
+        if (seg->last_sect < seg->first_sect ||
+                seg->last_sect >= XC_PAGE_SIZE >> SECTOR_SHIFT) {
             RING_ERR(blkif, "req %lu: invalid sectors %d-%d\n",
                     req->msg.id, seg->first_sect, seg->last_sect);
             err = EINVAL;
@@ -668,11 +918,12 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     last = NULL;
     page = req->vma;
 
-    for (i = 0; i < req->msg.nr_segments; i++) { /* for each segment */
-        struct blkif_request_segment *seg = &req->msg.seg[i];
+    for (i = 0; i < req->nr_segments; i++) { /* for each segment */
+        struct blkif_request_segment *seg = &req->seg[i];
         size_t size;
 
-        /* TODO check that first_sect/last_sect are within page */
+        if (req->n_pgnts)
+            page = req->pgnt[i]->page;
 
         next = page + (seg->first_sect << SECTOR_SHIFT);
         size = seg->last_sect - seg->first_sect + 1;
@@ -694,7 +945,8 @@ tapdisk_xenblkif_parse_request(struct td_xenblkif * const blkif,
     vreq->sec = req->msg.sector_number;
 
     if (blkif_rq_wr(&req->msg)) {
-        err = guest_copy2(blkif, req);
+        if (!req->n_pgnts)
+            err = guest_copy2(blkif, req);
         if (err) {
             RING_ERR(blkif, "req %lu: failed to copy from guest: %s\n",
                     req->msg.id, strerror(-err));
@@ -725,6 +977,180 @@ out:
 }
 
 
+/**
+ * Turns a BLKIF_OP_DISCARD request into a TD_OP_DISCARD one.
+ *
+ * @returns 0 on success, a positive error code otherwise
+ */
+static int
+tapdisk_xenblkif_parse_discard(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    blkif_request_discard_t *msg = (blkif_request_discard_t *)&req->msg;
+    td_vbd_request_t *vreq = &req->vreq;
+    uint64_t nr_sect = msg->nr_sectors;
+    int i;
+
+    if (unlikely(msg->flag & BLKIF_DISCARD_SECURE)) {
+        RING_ERR(blkif, "req %lu: secure discard not supported\n", msg->id);
+        return EOPNOTSUPP;
+    }
+
+    if (unlikely(!nr_sect || nr_sect >
+                (uint64_t)TD_XENBLKIF_DISCARD_SECS * ARRAY_SIZE(req->iov))) {
+        RING_ERR(blkif, "req %lu: bad number of sectors to discard "
+                "(%"PRIu64")\n", msg->id, nr_sect);
+        return EINVAL;
+    }
+
+    for (i = 0; nr_sect; i++) {
+        req->iov[i].base = NULL;
+        req->iov[i].secs = nr_sect > TD_XENBLKIF_DISCARD_SECS ?
+            TD_XENBLKIF_DISCARD_SECS : nr_sect;
+        nr_sect -= req->iov[i].secs;
+    }
+
+    vreq->iov = req->iov;
+    vreq->iovcnt = i;
+    vreq->sec = msg->sector_number;
+
+    snprintf(req->name, sizeof(req->name), "xenvbd-%d-%d.%"SCNx64"",
+             blkif->domid, blkif->devid, msg->id);
+
+    vreq->name = req->name;
+    vreq->token = blkif;
+    vreq->cb = __tapdisk_xenblkif_request_cb;
+
+    return 0;
+}
+
+
+/**
+ * Turns a BLKIF_OP_FLUSH_DISKCACHE request without data into a TD_OP_FLUSH
+ * one.
+ */
+static int
+tapdisk_xenblkif_parse_flush(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    td_vbd_request_t *vreq = &req->vreq;
+
+    vreq->iovcnt = 0;
+    vreq->sec = req->msg.sector_number;
+
+    snprintf(req->name, sizeof(req->name), "xenvbd-%d-%d.%"SCNx64"",
+             blkif->domid, blkif->devid, req->msg.id);
+
+    vreq->name = req->name;
+    vreq->token = blkif;
+    vreq->cb = __tapdisk_xenblkif_request_cb;
+
+    return 0;
+}
+
+
+/**
+ * Unpacks a BLKIF_OP_INDIRECT request: rewrites the request descriptor so
+ * that it carries the actual operation, and copies the segments out of the
+ * indirect pages.
+ *
+ * @returns 0 on success, a positive error code otherwise
+ */
+static int
+tapdisk_xenblkif_get_indirect(struct td_xenblkif * const blkif,
+        struct td_xenblkif_req * const req)
+{
+    blkif_request_indirect_t ind;
+    struct gntdev_grant_copy_segment *gcopy_seg;
+    int i, n_pages, n_segs, err;
+
+    memcpy(&ind, &req->msg, sizeof(ind));
+
+    req->msg.operation = ind.indirect_op;
+    req->msg.nr_segments = 0;
+    req->msg.handle = ind.handle;
+    req->msg.id = ind.id;
+    req->msg.sector_number = ind.sector_number;
+
+    req->seg = req->isegs;
+    req->nr_segments = 0;
+
+    /*
+     * Barriers are never indirect, only plain reads and writes are.
+     */
+    if (unlikely(ind.indirect_op != BLKIF_OP_READ &&
+                ind.indirect_op != BLKIF_OP_WRITE)) {
+        RING_ERR(blkif, "req %lu: invalid indirect operation %d\n",
+                req->msg.id, ind.indirect_op);
+        return EOPNOTSUPP;
+    }
+
+    if (unlikely(!ind.nr_segments ||
+                ind.nr_segments > TD_XENBLKIF_MAX_SEGMENTS)) {
+        RING_ERR(blkif, "req %lu: bad number of indirect segments (%d)\n",
+                req->msg.id, ind.nr_segments);
+        return EINVAL;
+    }
+
+    n_pages = (ind.nr_segments + TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME - 1)
+        / TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME;
+    ASSERT(n_pages <= BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST);
+
+    /*
+     * The front-end grants indirect pages persistently too, if it can.
+     */
+    if (blkif->pgnts.enabled) {
+        struct td_xenblkif_pgnt *pgnt[BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST];
+
+        for (i = 0; i < n_pages; i++) {
+            pgnt[i] = td_xenblkif_pgnt_get(blkif, ind.indirect_grefs[i]);
+            if (unlikely(!pgnt[i]))
+                break;
+        }
+
+        if (likely(i == n_pages)) {
+            for (i = 0; i < n_pages; i++) {
+                n_segs = ind.nr_segments - i * TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME;
+                if (n_segs > TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME)
+                    n_segs = TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME;
+                memcpy(req->isegs + i * TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME,
+                        pgnt[i]->page, n_segs * sizeof(req->isegs[0]));
+            }
+            err = 0;
+        } else
+            err = -ENOMEM;
+
+        while (i-- > 0)
+            td_xenblkif_pgnt_put(blkif, pgnt[i]);
+
+        if (likely(!err))
+            goto out;
+    }
+
+    for (i = 0; i < n_pages; i++) {
+        n_segs = ind.nr_segments - i * TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME;
+        if (n_segs > TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME)
+            n_segs = TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME;
+
+        gcopy_seg = &req->gcopy_segs[i];
+        td_xenblkif_gcopy_seg(blkif, gcopy_seg, true, ind.indirect_grefs[i],
+                0, req->isegs + i * TD_XENBLKIF_SEGS_PER_INDIRECT_FRAME,
+                n_segs * sizeof(req->isegs[0]));
+    }
+
+    err = td_xenblkif_gcopy(blkif, req->gcopy_segs, n_pages, true);
+    if (unlikely(err)) {
+        RING_ERR(blkif, "req %lu: failed to copy indirect segments: %s\n",
+                req->msg.id, strerror(-err));
+        return -err;
+    }
+
+out:
+    req->nr_segments = ind.nr_segments;
+    return 0;
+}
+
+
 /**
  * Initialises the standard tapdisk request (td_vbd_request_t) from the
  * intermediate ring request (td_xenblkif_req) in order to prepare it
@@ -740,7 +1166,7 @@ static inline int
 tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         struct td_xenblkif_req * const tapreq)
 {
-    int err = 0;
+    int err = 0, max_segments;
     td_vbd_request_t *vreq;
 
     ASSERT(tapreq);
@@ -750,6 +1176,20 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     memset(vreq, 0, sizeof(*vreq));
 
 	tapreq->vma = NULL;
+	tapreq->n_pgnts = 0;
+	tapreq->flush_iovcnt = 0;
+
+    if (tapreq->msg.operation == BLKIF_OP_INDIRECT) {
+        err = tapdisk_xenblkif_get_indirect(blkif, tapreq);
+        if (unlikely(err))
+            goto out;
+        max_segments = TD_XENBLKIF_MAX_SEGMENTS;
+    } else {
+        tapreq->seg = tapreq->msg.seg;
+        tapreq->nr_segments = tapreq->msg.nr_segments;
+        max_segments = BLKIF_MAX_SEGMENTS_PER_REQUEST;
+    }
+
     switch (tapreq->msg.operation) {
     case BLKIF_OP_READ:
         if (likely(blkif->stats.xenvbd))
@@ -758,6 +1198,20 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         tapreq->prot = PROT_WRITE;
         vreq->op = TD_OP_READ;
         break;
+    case BLKIF_OP_FLUSH_DISKCACHE:
+        if (likely(blkif->stats.xenvbd))
+			blkif->stats.xenvbd->st_f_req++;
+        if (!tapreq->nr_segments) {
+            vreq->op = TD_OP_FLUSH;
+            gettimeofday(&tapreq->ts, NULL);
+            err = tapdisk_xenblkif_parse_flush(blkif, tapreq);
+            goto out;
+        }
+        /*
+         * Parsed as a write, then turned into the preflush below: writes
+         * completed before this one must be durable before its data lands.
+         */
+        /* fall through */
     case BLKIF_OP_WRITE:
     case BLKIF_OP_WRITE_BARRIER:
         if (likely(blkif->stats.xenvbd))
@@ -766,6 +1220,14 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
         tapreq->prot = PROT_READ;
         vreq->op = TD_OP_WRITE;
         break;
+    case BLKIF_OP_DISCARD:
+        if (likely(blkif->stats.xenvbd))
+			blkif->stats.xenvbd->st_ds_req++;
+        tapreq->nr_segments = 0;
+        vreq->op = TD_OP_DISCARD;
+        gettimeofday(&tapreq->ts, NULL);
+        err = tapdisk_xenblkif_parse_discard(blkif, tapreq);
+        goto out;
     default:
         RING_ERR(blkif, "req %lu: invalid request type %d\n",
                 tapreq->msg.id, tapreq->msg.operation);
@@ -778,17 +1240,23 @@ tapdisk_xenblkif_make_vbd_request(struct td_xenblkif * const blkif,
     /*
      * Check that the number of segments is sane.
      */
-    if (unlikely((tapreq->msg.nr_segments == 0 &&
+    if (unlikely((tapreq->nr_segments == 0 &&
                 tapreq->msg.operation != BLKIF_OP_WRITE_BARRIER) ||
-            tapreq->msg.nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)) {
+            tapreq->nr_segments > max_segments)) {
         RING_ERR(blkif, "req %lu: bad number of segments in request (%d)\n",
-                tapreq->msg.id, tapreq->msg.nr_segments);
+                tapreq->msg.id, tapreq->nr_segments);
         err = EINVAL;
         goto out;
     }
 
-    if (likely(tapreq->msg.nr_segments))
+    if (likely(tapreq->nr_segments)) {
         err = tapdisk_xenblkif_parse_request(blkif, tapreq);
+        if (!err && tapreq->msg.operation == BLKIF_OP_FLUSH_DISKCACHE) {
+            tapreq->flush_iovcnt = vreq->iovcnt;
+            vreq->iovcnt = 0;
+            vreq->op = TD_OP_FLUSH;
+        }
+    }
     /*
      * If we only got one request from the ring and that was a barrier one,
      * check whether the barrier requests completion conditions are satisfied
@@ -837,7 +1305,7 @@ tapdisk_xenblkif_queue_request(struct td_xenblkif * const blkif,
         return err;
     }
 
-	if (likely(tapreq->msg.nr_segments)) {
+	if (likely(tapreq->vreq.iovcnt) || tapreq->vreq.op == TD_OP_FLUSH) {
 		err = tapdisk_vbd_queue_request(blkif->vbd, &tapreq->vreq);
 		if (unlikely(err)) {
 			/* TODO log error */
@@ -896,6 +1364,17 @@ tapdisk_xenblkif_reqs_free(struct td_xenblkif * const blkif)
     td_xenblkif_bufcache_free(blkif);
     td_xenblkif_bufcache_evt_unreg(blkif);
 
+    if (blkif->ctx)
+        td_xenblkif_pgnts_free(blkif);
+
+    if (blkif->reqs_bufcache) {
+        while (blkif->n_reqs_bufcache_free)
+            td_xenblkif_bufcache_unmap(
+                    blkif->reqs_bufcache[--blkif->n_reqs_bufcache_free]);
+        free(blkif->reqs_bufcache);
+        blkif->reqs_bufcache = NULL;
+    }
+
     free(blkif->reqs);
     blkif->reqs = NULL;
 
@@ -930,6 +1409,13 @@ tapdisk_xenblkif_reqs_init(struct td_xenblkif *td_blkif)
         goto fail;
     }
 
+    td_blkif->pgnts.root = NULL;
+    td_blkif->pgnts.n = 0;
+    td_blkif->pgnts.max = td_blkif->ring_size * TD_XENBLKIF_MAX_SEGMENTS;
+    if (td_blkif->pgnts.max > TD_XENBLKIF_PGNTS_MAX)
+        td_blkif->pgnts.max = TD_XENBLKIF_PGNTS_MAX;
+    INIT_LIST_HEAD(&td_blkif->pgnts.lru);
+
     td_blkif->n_reqs_free = 0;
     for (i = 0; i < td_blkif->ring_size; i++)
         tapdisk_xenblkif_free_request(td_blkif, &td_blkif->reqs[i]);
@@ -35,8 +35,14 @@
 #include <sys/types.h>
 #include <xen/io/blkif.h>
 #include <xen/gntdev.h>
+#include "blktap3.h"
 #include "td-blkif.h"
 
+/*
+ * Maximum number of segments in a request, indirect or not.
+ */
+#define TD_XENBLKIF_MAX_SEGMENTS BLKTAP3_MAX_INDIRECT_SEGMENTS
+
 /**
  * Representation of the intermediate request used to retrieve a request from
  * the shared ring and handle it over to the main tapdisk request processing
@@ -74,16 +80,43 @@ struct td_xenblkif_req {
 
     struct timeval ts;
 
+    /**
+     * The segments of the request: msg.seg for direct requests, isegs for
+     * BLKIF_OP_INDIRECT ones, in which case msg has been rewritten to carry
+     * the indirect operation.
+     */
+    struct blkif_request_segment *seg;
+    int nr_segments;
+
+    /**
+     * Segments of an indirect request, copied out of the indirect pages.
+     */
+    struct blkif_request_segment isegs[TD_XENBLKIF_MAX_SEGMENTS];
+
     /**
      * The scatter/gather list td_vbd_request_t.iov points to.
      */
-    struct td_iovec iov[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct td_iovec iov[TD_XENBLKIF_MAX_SEGMENTS];
 
-    grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     int prot;
 
 	struct gntdev_grant_copy_segment
-		gcopy_segs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+		gcopy_segs[TD_XENBLKIF_MAX_SEGMENTS];
+
+    /**
+     * Persistent grants backing each segment, if the request is served
+     * straight from the grant cache rather than through vma. n_pgnts is
+     * either 0 or nr_segments.
+     */
+    struct td_xenblkif_pgnt *pgnt[TD_XENBLKIF_MAX_SEGMENTS];
+    int n_pgnts;
+
+    /**
+     * A BLKIF_OP_FLUSH_DISKCACHE carrying data goes down as a flush, the
+     * write, then another flush. While the first flush is in flight, this
+     * holds the length of the write's scatter/gather list, 0 otherwise.
+     */
+    int flush_iovcnt;
 };
 
 struct td_xenblkif;
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TD_SPSC_H_
+#define _TD_SPSC_H_
+
+#include <errno.h>
+#include <stdlib.h>
+
+/*
+ * Bounded single-producer, single-consumer queue of pointers.
+ *
+ * Exactly one thread may push and exactly one (other) thread may pop,
+ * without any further locking. Head and tail are free-running counters,
+ * so the slot count must be a power of two. They sit on separate cache
+ * lines, each written by one side only.
+ */
+
+#define TD_SPSC_CACHELINE 64
+
+struct td_spsc {
+	void                       **slots;
+	unsigned int                 mask;
+
+	unsigned int                 head
+		__attribute__((aligned(TD_SPSC_CACHELINE)));   /* consumer */
+	unsigned int                 tail
+		__attribute__((aligned(TD_SPSC_CACHELINE)));   /* producer */
+};
+
+static inline int
+td_spsc_init(struct td_spsc *q, unsigned int size)
+{
+	if (!size || (size & (size - 1)))
+		return -EINVAL;
+
+	q->slots = calloc(size, sizeof(void *));
+	if (!q->slots)
+		return -ENOMEM;
+
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+
+	return 0;
+}
+
+static inline void
+td_spsc_free(struct td_spsc *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/*
+ * Producer side. Returns -EAGAIN if the queue is full.
+ */
+static inline int
+td_spsc_push(struct td_spsc *q, void *item)
+{
+	unsigned int tail, head;
+
+	tail = q->tail;
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head > q->mask)
+		return -EAGAIN;
+
+	q->slots[tail & q->mask] = item;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Consumer side. Returns NULL if the queue is empty.
+ */
+static inline void *
+td_spsc_pop(struct td_spsc *q)
+{
+	unsigned int head, tail;
+	void *item;
+
+	head = q->head;
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return NULL;
+
+	item = q->slots[head & q->mask];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+#endif /* _TD_SPSC_H_ */
@@ -46,6 +46,7 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "pool", "s", blkif->ctx->pool);
     tapdisk_stats_field(st, "domid", "d", blkif->domid);
     tapdisk_stats_field(st, "devid", "d", blkif->devid);
+    tapdisk_stats_field(st, "queue", "d", blkif->queue);
 
     tapdisk_stats_field(st, "reqs", "[");
     tapdisk_stats_val(st, "llu", blkif->stats.reqs.in);
@@ -63,4 +64,14 @@ tapdisk_xenblkif_stats(struct td_xenblkif * blkif, td_stats_t * st)
     tapdisk_stats_field(st, "vbd", "llu", blkif->stats.errors.vbd);
     tapdisk_stats_field(st, "img", "llu", blkif->stats.errors.img);
     tapdisk_stats_leave(st, '}');
+
+    if (blkif->pgnts.enabled) {
+        tapdisk_stats_field(st, "persistent_grants", "{");
+        tapdisk_stats_field(st, "mapped", "u", blkif->pgnts.n);
+        tapdisk_stats_field(st, "hits", "llu", blkif->stats.pgnts.hits);
+        tapdisk_stats_field(st, "maps", "llu", blkif->stats.pgnts.maps);
+        tapdisk_stats_field(st, "unmaps", "llu", blkif->stats.pgnts.unmaps);
+        tapdisk_stats_field(st, "copies", "llu", blkif->stats.pgnts.copies);
+        tapdisk_stats_leave(st, '}');
+    }
 }
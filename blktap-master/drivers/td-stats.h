@@ -48,6 +48,12 @@ struct td_xenblkif_stats {
         unsigned long long vbd;
         unsigned long long img;
     } errors;
+    struct {
+        unsigned long long hits;
+        unsigned long long maps;
+        unsigned long long unmaps;
+        unsigned long long copies;
+    } pgnts;
 
 	struct blkback_stats *xenvbd;
 };
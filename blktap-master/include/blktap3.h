@@ -40,6 +40,18 @@
 #define TAPBACK_CTL_SOCK_PATH       "/var/run/tapback.sock"
 #define BLKTAP2_DEVNAME             "tapdev"
 
+/**
+ * Maximum number of segments in a BLKIF_OP_INDIRECT request, advertised to
+ * front-ends as feature-max-indirect-segments (1 MiB with 4 KiB pages).
+ */
+#define BLKTAP3_MAX_INDIRECT_SEGMENTS 256
+
+/**
+ * Maximum number of rings per VBD, advertised to front-ends as
+ * multi-queue-max-queues.
+ */
+#define BLKTAP3_MAX_QUEUES 16
+
 /**
  * Flag defines
  */
@@ -50,14 +62,12 @@
  */
 struct blkback_stats {
 	/**
-	 * BLKIF_OP_DISCARD, not currently supported in blktap3, should always
-	 * be zero
+	 * Received BLKIF_OP_DISCARD requests.
 	 */
 	unsigned long long st_ds_req;
 
 	/**
-	 * BLKIF_OP_FLUSH_DISKCACHE, not currently supported in blktap3,
-	 * should always be zero
+	 * Received BLKIF_OP_FLUSH_DISKCACHE requests.
 	 */
 	unsigned long long st_f_req;
 
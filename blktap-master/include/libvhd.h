@@ -323,6 +323,14 @@ int vhd_set_virt_size(vhd_context_t *, uint64_t);
 int vhd_bitmap_test(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_set(vhd_context_t *, char *, uint32_t);
 void vhd_bitmap_clear(vhd_context_t *, char *, uint32_t);
+uint32_t vhd_bitmap_find(vhd_context_t *, const char *,
+			 uint32_t start, uint32_t end, int value);
+uint32_t vhd_bitmap_run(vhd_context_t *, const char *,
+			uint32_t start, uint32_t end);
+uint32_t vhd_bitmap_count(vhd_context_t *, const char *,
+			  uint32_t start, uint32_t end);
+int vhd_bitmap_full(vhd_context_t *, const char *,
+		    uint32_t start, uint32_t end);
 
 int vhd_initialize_header_parent_name(vhd_context_t *, const char *);
 int vhd_write_parent_locators(vhd_context_t *, const char *);
@@ -124,6 +124,15 @@ int tap_ctl_detach(const int id, const int minor);
 int tap_ctl_open(const int id, const int minor, const char *params, int flags,
 		 const int prt_minor, const char *secondary, int timeout,
 		 const char *logpath, uint8_t key_size, uint8_t *encryption_key);
+
+/**
+ * As tap_ctl_open, with a vhd bitmap cache size (in bitmaps) for the
+ * VBD. A @bm_cache_size of 0 keeps tapdisk's default.
+ */
+int tap_ctl_open_bm_cache(const int id, const int minor, const char *params,
+			  int flags, const int prt_minor, const char *secondary,
+			  int timeout, int bm_cache_size, const char *logpath,
+			  uint8_t key_size, uint8_t *encryption_key);
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
@@ -175,7 +184,23 @@ int tap_ctl_connect_xenblkif(const pid_t pid, const domid_t domid, const int
 		port, int proto, const char *pool, const int minor);
 
 /**
- * Instructs a tapdisk to disconnect from the shared ring.
+ * As tap_ctl_connect_xenblkif, for one ring of a multi-queue front-end
+ * and with front-end features. A tapdisk predating these refuses the
+ * request, unless @queue and @flags are both 0.
+ *
+ * @param queue the index of the ring, 0 unless the front-end uses multiple
+ * queues
+ * @param flags front-end features, TAPDISK_MESSAGE_BLKIF_*
+ */
+int tap_ctl_connect_xenblkif_ext(const pid_t pid, const domid_t domid,
+		const int devid, const int queue, int poll_duration,
+		int poll_idle_threshold, const grant_ref_t * grefs, const int order,
+		const evtchn_port_t port, int proto, const unsigned int flags,
+		const char *pool, const int minor);
+
+/**
+ * Instructs a tapdisk to disconnect from the shared ring(s) of a device;
+ * with multiple queues all of them are disconnected.
  *
  * @param pid process ID of the tapdisk
  * @param domid the ID of the guest VM
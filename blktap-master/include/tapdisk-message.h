@@ -56,6 +56,8 @@
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
 #define TAPDISK_MESSAGE_FLAG_NO_O_DIRECT 0x200
 #define TAPDISK_MESSAGE_FLAG_OPEN_ENCRYPTED 0x400
+#define TAPDISK_MESSAGE_FLAG_EXTENT_MAP  0x800
+#define TAPDISK_MESSAGE_FLAG_READAHEAD   0x1000
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -76,6 +78,7 @@ struct tapdisk_message_params {
 	uint32_t                         prt_devnum;
 	uint16_t                         req_timeout;
 	char                             secondary[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint32_t                         bm_cache_size;
 };
 
 struct tapdisk_message_image {
@@ -162,8 +165,27 @@ typedef struct tapdisk_message_blkif {
 	 * Idle CPU threshold above which polling is permitted.
 	 */
 	uint32_t poll_idle_threshold;
+
+	/*
+	 * Only looked at in TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT, which older
+	 * tapdisks refuse rather than connecting the wrong ring. They fit in
+	 * what used to be padding at the end of the message.
+	 */
+
+	/**
+	 * Features negotiated with the front-end, TAPDISK_MESSAGE_BLKIF_*.
+	 */
+	uint32_t flags;
+
+	/**
+	 * Index of the ring, for front-ends using multi-queue-num-queues; 0
+	 * otherwise.
+	 */
+	uint32_t queue;
 } tapdisk_message_blkif_t;
 
+#define TAPDISK_MESSAGE_BLKIF_PERSISTENT 0x001
+
 /**
  * Contains parameters for resuming a previously paused VBD.
  */
@@ -233,9 +255,10 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_DISK_INFO,
 	TAPDISK_MESSAGE_DISK_INFO_RSP,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -328,6 +351,9 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_XENBLKIF_CONNECT_EXT:
+		return "sring connect ext";
+
 	default:
 		return "unknown";
 	}
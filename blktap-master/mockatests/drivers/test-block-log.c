@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2018, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+
+#include "block-log.h"
+
+#include "test-suites.h"
+
+#define TEST_WORDS	32
+/* a small page, so a handful of words spans several of them */
+#define TEST_PAGE_SIZE	64
+
+static struct tdlog_data *
+setup_data(void)
+{
+	struct tdlog_data *data;
+	size_t size;
+
+	data = calloc(1, sizeof(*data));
+	assert_non_null(data);
+
+	size = sizeof(struct cbt_log_metadata) +
+		TEST_WORDS * sizeof(unsigned long);
+
+	data->bitmap    = calloc(1, size);
+	assert_non_null(data->bitmap);
+	data->map_size  = size;
+	data->page_size = TEST_PAGE_SIZE;
+	data->nr_pages  = (size + TEST_PAGE_SIZE - 1) / TEST_PAGE_SIZE;
+	data->dirty     = calloc(BITS_TO_LONGS(data->nr_pages),
+				 sizeof(unsigned long));
+	assert_non_null(data->dirty);
+
+	return data;
+}
+
+static void
+free_data(struct tdlog_data *data)
+{
+	free(data->dirty);
+	free(data->bitmap);
+	free(data);
+}
+
+static unsigned long *
+map_of(struct tdlog_data *data)
+{
+	return &BITMAP_ENTRY(0, data->bitmap);
+}
+
+/* page of the mapping holding bitmap word @i */
+static size_t
+page_of(struct tdlog_data *data, int i)
+{
+	return (sizeof(struct cbt_log_metadata) +
+		i * sizeof(unsigned long)) / data->page_size;
+}
+
+/* Test that a range within one word sets only its own bits */
+void
+test_bitmap_set_one_word(void **state)
+{
+	struct tdlog_data *data = setup_data();
+	unsigned long *map = map_of(data);
+	int i;
+
+	assert_int_equal(bitmap_set(data, 3, 5), 1);
+	assert_true(map[0] == 0xf8UL);
+	for (i = 1; i < TEST_WORDS; i++)
+		assert_true(map[i] == 0);
+
+	/* single bit, last of the word */
+	assert_int_equal(bitmap_set(data, 2 * BITS_PER_LONG - 1, 1), 1);
+	assert_true(map[1] == 1UL << (BITS_PER_LONG - 1));
+	assert_true(map[2] == 0);
+
+	for (i = 3; i < 8; i++)
+		assert_int_equal(test_bit(i, data->bitmap), 1);
+	assert_int_equal(test_bit(2, data->bitmap), 0);
+	assert_int_equal(test_bit(8, data->bitmap), 0);
+
+	/* setting it again changes nothing */
+	assert_int_equal(bitmap_set(data, 4, 2), 0);
+	assert_true(map[0] == 0xf8UL);
+
+	free_data(data);
+}
+
+/* Test that a range crossing word boundaries fills the words between */
+void
+test_bitmap_set_span_words(void **state)
+{
+	struct tdlog_data *data = setup_data();
+	unsigned long *map = map_of(data);
+
+	/* the last four bits of word 0, the first six of word 1 */
+	assert_int_equal(bitmap_set(data, BITS_PER_LONG - 4, 10), 2);
+	assert_true(map[0] == 0xfUL << (BITS_PER_LONG - 4));
+	assert_true(map[1] == 0x3fUL);
+	assert_true(map[2] == 0);
+
+	/* the last bit of word 4, all of word 5, the first bit of word 6 */
+	assert_int_equal(bitmap_set(data, 5 * BITS_PER_LONG - 1,
+				    BITS_PER_LONG + 2), 3);
+	assert_true(map[3] == 0);
+	assert_true(map[4] == 1UL << (BITS_PER_LONG - 1));
+	assert_true(map[5] == ~0UL);
+	assert_true(map[6] == 1UL);
+	assert_true(map[7] == 0);
+
+	/* overlapping what is set already only counts the words changed */
+	assert_int_equal(bitmap_set(data, 5 * BITS_PER_LONG,
+				    2 * BITS_PER_LONG), 1);
+	assert_true(map[5] == ~0UL);
+	assert_true(map[6] == ~0UL);
+	assert_true(map[7] == 0);
+
+	free_data(data);
+}
+
+/* Test that a range ending on a word boundary leaves the next word alone */
+void
+test_bitmap_set_word_boundary(void **state)
+{
+	struct tdlog_data *data = setup_data();
+	unsigned long *map = map_of(data);
+
+	/* the upper half of word 0 */
+	assert_int_equal(bitmap_set(data, BITS_PER_LONG / 2,
+				    BITS_PER_LONG / 2), 1);
+	assert_true(map[0] == ~0UL << (BITS_PER_LONG / 2));
+	assert_true(map[1] == 0);
+
+	/* exactly word 2 */
+	assert_int_equal(bitmap_set(data, 2 * BITS_PER_LONG,
+				    BITS_PER_LONG), 1);
+	assert_true(map[1] == 0);
+	assert_true(map[2] == ~0UL);
+	assert_true(map[3] == 0);
+
+	/* exactly words 8 and 9 */
+	assert_int_equal(bitmap_set(data, 8 * BITS_PER_LONG,
+				    2 * BITS_PER_LONG), 2);
+	assert_true(map[7] == 0);
+	assert_true(map[8] == ~0UL);
+	assert_true(map[9] == ~0UL);
+	assert_true(map[10] == 0);
+
+	/* the last word of the map */
+	assert_int_equal(bitmap_set(data, (TEST_WORDS - 1) * BITS_PER_LONG,
+				    BITS_PER_LONG), 1);
+	assert_true(map[TEST_WORDS - 2] == 0);
+	assert_true(map[TEST_WORDS - 1] == ~0UL);
+
+	free_data(data);
+}
+
+/* Test that only the pages holding changed words are marked dirty */
+void
+test_bitmap_set_dirty_pages(void **state)
+{
+	struct tdlog_data *data = setup_data();
+	size_t pg;
+	int i, last;
+
+	assert_true(data->nr_pages > 2);
+	assert_int_equal(data->nr_dirty, 0);
+
+	/* one word dirties its page */
+	bitmap_set(data, 0, 1);
+	assert_int_equal(data->nr_dirty, 1);
+	assert_int_equal(page_dirty(data, page_of(data, 0)), 1);
+
+	/* so does the next word on the same page, but only once */
+	if (page_of(data, 1) == page_of(data, 0)) {
+		bitmap_set(data, BITS_PER_LONG, 1);
+		assert_int_equal(data->nr_dirty, 1);
+	}
+
+	/* nothing new, nothing dirtied */
+	data->dirty[0] = 0;
+	data->nr_dirty = 0;
+	assert_int_equal(bitmap_set(data, 0, 1), 0);
+	assert_int_equal(data->nr_dirty, 0);
+
+	/* the last word is on the last page, and on none other */
+	last = TEST_WORDS - 1;
+	bitmap_set(data, last * BITS_PER_LONG + 3, 1);
+	assert_int_equal(data->nr_dirty, 1);
+	assert_int_equal(page_of(data, last), data->nr_pages - 1);
+	for (pg = 0; pg < data->nr_pages; pg++)
+		assert_int_equal(page_dirty(data, pg),
+				 pg == page_of(data, last));
+
+	/* a range across every word dirties every page holding one */
+	bitmap_set(data, 0, TEST_WORDS * BITS_PER_LONG);
+	for (pg = 0; pg < data->nr_pages; pg++)
+		assert_int_equal(page_dirty(data, pg),
+				 pg >= page_of(data, 0));
+	assert_int_equal(data->nr_dirty,
+			 page_of(data, last) - page_of(data, 0) + 1);
+
+	/* and all of the words it changed were on those pages */
+	for (i = 0; i < TEST_WORDS; i++)
+		assert_int_equal(page_dirty(data, page_of(data, i)), 1);
+
+	free_data(data);
+}
@@ -39,7 +39,8 @@
 int main(void)
 {
 	int result =
-		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL);
+		cmocka_run_group_tests_name("Stats tests", tapdisk_stats_tests, NULL, NULL) +
+		cmocka_run_group_tests_name("Block log tests", block_log_tests, NULL, NULL);
 
 	return result;
 }
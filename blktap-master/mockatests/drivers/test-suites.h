@@ -46,6 +46,18 @@ static const struct CMUnitTest tapdisk_stats_tests[] = {
 	cmocka_unit_test(test_stats_realloc_buffer_edgecase)
 };
 
+void test_bitmap_set_one_word(void **state);
+void test_bitmap_set_span_words(void **state);
+void test_bitmap_set_word_boundary(void **state);
+void test_bitmap_set_dirty_pages(void **state);
+
+static const struct CMUnitTest block_log_tests[] = {
+	cmocka_unit_test(test_bitmap_set_one_word),
+	cmocka_unit_test(test_bitmap_set_span_words),
+	cmocka_unit_test(test_bitmap_set_word_boundary),
+	cmocka_unit_test(test_bitmap_set_dirty_pages)
+};
+
 
 
 #endif /* __TEST_SUITES_H__ */
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2017, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libvhd.h"
+#include "libvhd-bitmap.h"
+
+#include "test-suites.h"
+
+/* one 2MB block worth of sectors */
+#define TEST_BITS  4096
+#define TEST_BYTES (TEST_BITS >> 3)
+
+/* offsets around 64-bit and 256-bit word boundaries */
+static const uint32_t edges[] = {
+	0, 1, 31, 32, 63, 64, 65, 127, 128, 191, 255, 256, 257,
+	511, 512, 2047, 2048, 4031, 4032, 4033, 4094, 4095, 4096
+};
+
+#define NR_EDGES (sizeof(edges) / sizeof(edges[0]))
+
+static void
+init_ctx(vhd_context_t *ctx, int old_layout)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	if (old_layout) {
+		memcpy(ctx->footer.crtr_app, "tap", 3);
+		ctx->footer.crtr_ver = 0x00000001;
+	}
+}
+
+/* alternating runs of random length, to give the word skippers work */
+static void
+fill_runs(vhd_context_t *ctx, char *map, uint32_t max_run)
+{
+	uint32_t bit, len;
+	int value;
+
+	memset(map, 0, TEST_BYTES);
+	value = rand() & 1;
+
+	for (bit = 0; bit < TEST_BITS; bit += len) {
+		len = 1 + rand() % max_run;
+		if (value) {
+			uint32_t i;
+
+			for (i = bit; i < bit + len && i < TEST_BITS; i++)
+				vhd_bitmap_set(ctx, map, i);
+		}
+		value = !value;
+	}
+}
+
+static uint32_t
+ref_find(vhd_context_t *ctx, char *map,
+	 uint32_t start, uint32_t end, int value)
+{
+	uint32_t bit;
+
+	for (bit = start; bit < end; bit++)
+		if (!!vhd_bitmap_test(ctx, map, bit) == value)
+			return bit;
+
+	return end;
+}
+
+static uint32_t
+ref_count(vhd_context_t *ctx, char *map, uint32_t start, uint32_t end)
+{
+	uint32_t bit, count = 0;
+
+	for (bit = start; bit < end; bit++)
+		count += !!vhd_bitmap_test(ctx, map, bit);
+
+	return count;
+}
+
+static void
+check_range(vhd_context_t *ctx, char *map, uint32_t start, uint32_t end)
+{
+	uint32_t run;
+
+	assert_int_equal(vhd_bitmap_find(ctx, map, start, end, 0),
+			 ref_find(ctx, map, start, end, 0));
+	assert_int_equal(vhd_bitmap_find(ctx, map, start, end, 1),
+			 ref_find(ctx, map, start, end, 1));
+	assert_int_equal(vhd_bitmap_count(ctx, map, start, end),
+			 ref_count(ctx, map, start, end));
+	assert_int_equal(vhd_bitmap_full(ctx, map, start, end),
+			 ref_count(ctx, map, start, end) == end - start);
+
+	run = start < end ?
+		ref_find(ctx, map, start, end,
+			 !vhd_bitmap_test(ctx, map, start)) - start : 0;
+	assert_int_equal(vhd_bitmap_run(ctx, map, start, end), run);
+}
+
+static void
+check_layout(int old_layout)
+{
+	vhd_context_t ctx;
+	char map[TEST_BYTES];
+	uint32_t max_run[] = { 1, 7, 70, 300, 1200 };
+	int i, j, k;
+
+	init_ctx(&ctx, old_layout);
+	srand(old_layout ? 2 : 1);
+
+	for (i = 0; i < sizeof(max_run) / sizeof(max_run[0]); i++) {
+		fill_runs(&ctx, map, max_run[i]);
+
+		for (j = 0; j < NR_EDGES; j++)
+			for (k = j; k < NR_EDGES; k++)
+				check_range(&ctx, map, edges[j], edges[k]);
+
+		for (j = 0; j < 200; j++) {
+			uint32_t a = rand() % (TEST_BITS + 1);
+			uint32_t b = rand() % (TEST_BITS + 1);
+
+			check_range(&ctx, map, a < b ? a : b, a < b ? b : a);
+		}
+	}
+}
+
+/* A single set bit is found exactly, from either side of each edge. */
+void
+test_bitmap_find_range_edges(void **state)
+{
+	vhd_context_t ctx;
+	char map[TEST_BYTES];
+	int i, j;
+
+	init_ctx(&ctx, 0);
+
+	for (i = 0; i < NR_EDGES - 1; i++) {
+		uint32_t bit = edges[i];
+
+		memset(map, 0, sizeof(map));
+		vhd_bitmap_set(&ctx, map, bit);
+
+		assert_int_equal(vhd_bitmap_find(&ctx, map, 0, TEST_BITS, 1),
+				 bit);
+		assert_int_equal(vhd_bitmap_find(&ctx, map, bit, bit + 1, 1),
+				 bit);
+		assert_int_equal(vhd_bitmap_find(&ctx, map, bit, bit + 1, 0),
+				 bit + 1);
+		assert_int_equal(vhd_bitmap_find(&ctx, map, bit, bit, 1), bit);
+		/* the end is exclusive */
+		assert_int_equal(vhd_bitmap_find(&ctx, map, 0, bit, 1), bit);
+		assert_int_equal(vhd_bitmap_find(&ctx, map, bit + 1,
+						 TEST_BITS, 1), TEST_BITS);
+
+		memset(map, 0xff, sizeof(map));
+		vhd_bitmap_clear(&ctx, map, bit);
+
+		assert_int_equal(vhd_bitmap_find(&ctx, map, 0, TEST_BITS, 0),
+				 bit);
+		assert_int_equal(vhd_bitmap_run(&ctx, map, 0, TEST_BITS),
+				 bit ? bit : 1);
+		assert_int_equal(vhd_bitmap_run(&ctx, map, bit, TEST_BITS), 1);
+		assert_false(vhd_bitmap_full(&ctx, map, 0, TEST_BITS));
+		assert_true(vhd_bitmap_full(&ctx, map, 0, bit));
+		assert_true(vhd_bitmap_full(&ctx, map, bit + 1, TEST_BITS));
+
+		for (j = 0; j < NR_EDGES; j++)
+			if (edges[j] <= bit)
+				assert_true(vhd_bitmap_full(&ctx, map,
+							    edges[j], bit));
+	}
+}
+
+/* Counts over partial first and last words match a bit-by-bit count. */
+void
+test_bitmap_count_range_edges(void **state)
+{
+	vhd_context_t ctx;
+	char map[TEST_BYTES];
+	int i, j;
+
+	init_ctx(&ctx, 0);
+
+	memset(map, 0xff, sizeof(map));
+	for (i = 0; i < NR_EDGES; i++)
+		for (j = i; j < NR_EDGES; j++)
+			assert_int_equal(vhd_bitmap_count(&ctx, map,
+							  edges[i], edges[j]),
+					 edges[j] - edges[i]);
+
+	memset(map, 0x5a, sizeof(map));
+	for (i = 0; i < NR_EDGES; i++)
+		for (j = i; j < NR_EDGES; j++)
+			assert_int_equal(vhd_bitmap_count(&ctx, map,
+							  edges[i], edges[j]),
+					 ref_count(&ctx, map,
+						   edges[i], edges[j]));
+}
+
+/* MSB-first bytes, as written by everything but the earliest tapdisks. */
+void
+test_bitmap_standard_layout(void **state)
+{
+	vhd_context_t ctx;
+	char map[TEST_BYTES];
+
+	init_ctx(&ctx, 0);
+
+	memset(map, 0, sizeof(map));
+	map[0] = 0x80;
+	assert_int_equal(vhd_bitmap_find(&ctx, map, 0, TEST_BITS, 1), 0);
+	map[0] = 0x01;
+	assert_int_equal(vhd_bitmap_find(&ctx, map, 0, TEST_BITS, 1), 7);
+
+	check_layout(0);
+}
+
+/* Host-endian 32-bit words numbered LSB first, from early tapdisks. */
+void
+test_bitmap_old_tapdisk_layout(void **state)
+{
+	vhd_context_t ctx;
+	char map[TEST_BYTES];
+	uint32_t w;
+
+	init_ctx(&ctx, 1);
+
+	memset(map, 0, sizeof(map));
+	w = 1;
+	memcpy(map, &w, sizeof(w));
+	assert_int_equal(vhd_bitmap_find(&ctx, map, 0, TEST_BITS, 1), 0);
+	w = 1U << 31;
+	memcpy(map + 4, &w, sizeof(w));
+	assert_int_equal(vhd_bitmap_find(&ctx, map, 1, TEST_BITS, 1), 63);
+
+	check_layout(1);
+}
+
+/* The AVX2 word skipper agrees with the scalar one. */
+void
+test_bitmap_skip_words_simd(void **state)
+{
+#ifdef VHD_BITMAP_AVX2
+	uint64_t words[TEST_BITS / 64];
+	uint64_t patterns[] = { 0, ~0ULL };
+	uint32_t nr, i, j;
+	int p;
+
+	if (!__builtin_cpu_supports("avx2"))
+		skip();
+
+	for (p = 0; p < 2; p++) {
+		for (nr = 0; nr <= TEST_BITS / 64; nr++) {
+			for (i = 0; i <= nr; i++) {
+				for (j = 0; j < TEST_BITS / 64; j++)
+					words[j] = patterns[p];
+				if (i < nr)
+					words[i] ^= 1ULL << (i & 63);
+
+				assert_int_equal(
+					skip_words_avx2((char *)words, nr,
+							patterns[p]),
+					skip_words_scalar((char *)words, nr,
+							  patterns[p]));
+			}
+		}
+	}
+#else
+	skip();
+#endif
+}
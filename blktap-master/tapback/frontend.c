@@ -68,6 +68,65 @@ xenbus_switch_state(vbd_t * const device,
     return err;
 }
 
+/**
+ * Reads the grant references and the event channel of a ring.
+ *
+ * @param device the VBD
+ * @param dir prefix of the ring's keys under the front-end path, e.g.
+ * "queue-1/", or an empty string for a single-queue front-end
+ * @param order number of ring pages, expressed as a page order
+ * @param gref array to fill in with the grant references
+ * @param port where to store the event channel
+ * @returns 0 on success, an error code otherwise
+ */
+static int
+read_ring(vbd_t * const device, const char * const dir, const int order,
+        grant_ref_t * const gref, evtchn_port_t * const port)
+{
+    /*
+     * +10 is for INT_MAX, +1 for NULL termination
+     */
+    char path[sizeof("queue-") + 10 + sizeof(EVENT_CHANNEL) + 10 + 1];
+    int i;
+
+    /*
+     * Read the grant references.
+     */
+    if (order) {
+        for (i = 0; i < 1 << order; i++) {
+            if (snprintf(path, sizeof(path), "%s%s%d", dir, RING_REF, i)
+                    >= (int)sizeof(path)) {
+                DBG(device, "error printing to buffer\n");
+                return EINVAL;
+            }
+            if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                        "%u", &gref[i])) {
+                WARN(device, "failed to read grant ref %s0x%x\n", dir, i);
+                return ENOENT;
+            }
+        }
+    } else {
+        snprintf(path, sizeof(path), "%s%s", dir, RING_REF);
+        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                    "%u", &gref[0])) {
+            WARN(device, "failed to read grant ref %s\n", dir);
+            return ENOENT;
+        }
+    }
+
+    /*
+     * Read the event channel.
+     */
+    snprintf(path, sizeof(path), "%s%s", dir, EVENT_CHANNEL);
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, path,
+                "%u", port)) {
+        WARN(device, "failed to read event channel %s\n", dir);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
 /**
  * Core functions that instructs the tapdisk to connect to the shared ring (if
  * not already connected).
@@ -77,6 +136,9 @@ xenbus_switch_state(vbd_t * const device,
  * This function is idempotent: if the tapback daemon gets restarted this
  * function will be called again but it won't really do anything.
  *
+ * If the front-end uses multiple queues, the tapdisk is connected to each of
+ * the rings, which are described under queue-<n>/.
+ *
  * @param device the VBD the tapdisk should connect to
  * @returns (a) 0 on success, (b) ESRCH if the tapdisk is not available, and
  * (c) an error code otherwise
@@ -91,6 +153,8 @@ connect_tap(vbd_t * const device)
     char *persistent_grants_str = NULL;
     int nr_pages = 0, proto = 0, order = 0;
     bool persistent_grants = false;
+    unsigned int flags = 0, nr_queues = 0, queue;
+    bool tap_connected = false;
 
     ASSERT(device);
 
@@ -128,45 +192,14 @@ connect_tap(vbd_t * const device)
     }
 
     /*
-     * Read the grant references.
-     */
-    if (order) {
-        int i = 0;
-        /*
-         * +10 is for INT_MAX, +1 for NULL termination
-         */
-
-        static const size_t len = sizeof(RING_REF) + 10 + 1;
-        char ring_ref[len];
-        for (i = 0; i < nr_pages; i++) {
-            if (snprintf(ring_ref, len, "%s%d", RING_REF, i) >= (int)len) {
-                DBG(device, "error printing to buffer\n");
-                err = EINVAL;
-                goto out;
-            }
-            if (1 != tapback_device_scanf_otherend(device, XBT_NULL, ring_ref,
-                        "%u", &gref[i])) {
-                WARN(device, "failed to read grant ref 0x%x\n", i);
-                err = ENOENT;
-                goto out;
-            }
-        }
-    } else {
-        if (1 != tapback_device_scanf_otherend(device, XBT_NULL, RING_REF,
-                    "%u", &gref[0])) {
-            WARN(device, "failed to read grant ref\n");
-            err = ENOENT;
-            goto out;
-        }
-    }
-
-    /*
-     * Read the event channel.
+     * How many rings does the front-end use?
      */
-    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, EVENT_CHANNEL,
-                "%u", &port)) {
-        WARN(device, "failed to read event channel\n");
-        err = ENOENT;
+    if (1 != tapback_device_scanf_otherend(device, XBT_NULL, MQ_NUM_QUEUES,
+                "%u", &nr_queues))
+        nr_queues = 1;
+    if (nr_queues < 1 || nr_queues > BLKTAP3_MAX_QUEUES) {
+        WARN(device, "invalid %s value: %u\n", MQ_NUM_QUEUES, nr_queues);
+        err = EINVAL;
         goto out;
     }
 
@@ -209,40 +242,54 @@ connect_tap(vbd_t * const device)
     else
         DBG(device, "front-end doesn't support persistent grants\n");
 
-    /*
-     * persistent grants are not yet supported
-     */
     if (persistent_grants)
-        WARN(device, "front-end supports persistent grants but we don't\n");
+        flags |= TAPDISK_MESSAGE_BLKIF_PERSISTENT;
 
-    /*
-     * Create the shared ring and ask the tapdisk to connect to it.
-     */
-    if ((err = -tap_ctl_connect_xenblkif(device->tap->pid, device->domid,
-                    device->devid, device->polling_duration, device->polling_idle_threshold,
-		    gref, order, port, proto, NULL,
-                    device->minor))) {
+    for (queue = 0; queue < nr_queues; queue++) {
         /*
-         * This happens if the tapback dameon gets restarted while there are
-         * active VBDs.
+         * +10 is for UINT_MAX, +1 for NULL termination
          */
-        if (err == EALREADY) {
-            INFO(device, "tapdisk[%d] minor=%d already connected to the "
-					"shared ring\n", device->tap->pid, device->tap->minor);
-            err = 0;
-        } else {
-            WARN(device, "tapdisk[%d] failed to connect to the shared "
-                    "ring: %s\n", device->tap->pid, strerror(err));
+        char dir[sizeof("queue-/") + 10 + 1] = "";
+
+        if (nr_queues > 1)
+            snprintf(dir, sizeof(dir), "queue-%u/", queue);
+
+        if ((err = read_ring(device, dir, order, gref, &port)))
             goto out;
+
+        /*
+         * Create the shared ring and ask the tapdisk to connect to it.
+         */
+        if ((err = -tap_ctl_connect_xenblkif_ext(device->tap->pid, device->domid,
+                        device->devid, queue, device->polling_duration,
+                        device->polling_idle_threshold, gref, order, port,
+                        proto, flags, NULL, device->minor))) {
+            /*
+             * This happens if the tapback dameon gets restarted while there
+             * are active VBDs.
+             */
+            if (err == EALREADY) {
+                INFO(device, "tapdisk[%d] minor=%d already connected to the "
+                        "shared ring %u\n", device->tap->pid,
+                        device->tap->minor, queue);
+                err = 0;
+            } else {
+                WARN(device, "tapdisk[%d] failed to connect to the shared "
+                        "ring %u: %s\n", device->tap->pid, queue,
+                        strerror(err));
+                goto out;
+            }
         }
+        tap_connected = true;
     }
 
     device->connected = true;
 
-    DBG(device, "tapdisk[%d] connected to shared ring\n", device->tap->pid);
+    DBG(device, "tapdisk[%d] connected to %u shared ring(s)\n",
+            device->tap->pid, nr_queues);
 
 out:
-    if (err && device->connected) {
+    if (err && tap_connected) {
         const int err2 = -tap_ctl_disconnect_xenblkif(device->tap->pid,
                 device->domid, device->devid, NULL);
         if (err2) {
@@ -284,9 +331,36 @@ connect_frontend(vbd_t *device) {
         abort_transaction = true;
 
         /*
-         * FIXME blkback writes discard-granularity, discard-alignment,
-         * discard-secure, feature-discard but we don't.
+         * Discard is always offered: drivers that can't reclaim space simply
+         * complete it. Secure discard is not supported.
          */
+        if ((err = tapback_device_printf(device, xst, FEAT_DISCARD, true,
+                        "%d", 1))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_DISCARD,
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst, "discard-granularity",
+                        true, "%u", device->sector_size))) {
+            WARN(device, "failed to write discard-granularity: %s\n",
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst, "discard-alignment",
+                        true, "%u", 0))) {
+            WARN(device, "failed to write discard-alignment: %s\n",
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst, "discard-secure",
+                        true, "%d", 0))) {
+            WARN(device, "failed to write discard-secure: %s\n",
+                    strerror(-err));
+            break;
+        }
 
         /*
 		 * Write the number of sectors, sector size, info, and barrier support
@@ -300,6 +374,27 @@ connect_frontend(vbd_t *device) {
             break;
         }
 
+        if ((err = tapback_device_printf(device, xst, FEAT_FLUSH, true,
+                        "%d", 1))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_FLUSH,
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst, FEAT_PERSIST, true,
+                        "%d", 1))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_PERSIST,
+                    strerror(-err));
+            break;
+        }
+
+        if ((err = tapback_device_printf(device, xst, FEAT_MAX_INDIRECT, true,
+                        "%u", BLKTAP3_MAX_INDIRECT_SEGMENTS))) {
+            WARN(device, "failed to write %s: %s\n", FEAT_MAX_INDIRECT,
+                    strerror(-err));
+            break;
+        }
+
         if ((err = tapback_device_printf(device, xst, "sector-size", true,
                         "%u", device->sector_size))) {
             WARN(device, "failed to write sector-size: %s\n", strerror(-err));
@@ -440,8 +535,20 @@ frontend_changed(vbd_t * const device, const XenbusState state)
 
     switch (state) {
         case XenbusStateInitialising:
-			if (device->hotplug_status_connected)
+			if (device->hotplug_status_connected) {
+                /*
+                 * The front-end picks the number of rings before it switches
+                 * to Initialised, so this has to be there in time.
+                 */
+                err = -tapback_device_printf(device, XBT_NULL, MQ_MAX_QUEUES,
+                        true, "%u", BLKTAP3_MAX_QUEUES);
+                if (err) {
+                    WARN(device, "failed to write %s: %s\n", MQ_MAX_QUEUES,
+                            strerror(err));
+                    break;
+                }
 				err = xenbus_switch_state(device, XenbusStateInitWait);
+            }
             break;
         case XenbusStateInitialised:
     	case XenbusStateConnected:
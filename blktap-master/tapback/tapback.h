@@ -120,6 +120,11 @@ int pretty_time(char *buf, unsigned char buf_len);
 #define RING_PAGE_ORDER         "ring-page-order"
 #define EVENT_CHANNEL           "event-channel"
 #define FEAT_PERSIST            "feature-persistent"
+#define FEAT_MAX_INDIRECT       "feature-max-indirect-segments"
+#define FEAT_DISCARD            "feature-discard"
+#define FEAT_FLUSH              "feature-flush-cache"
+#define MQ_MAX_QUEUES           "multi-queue-max-queues"
+#define MQ_NUM_QUEUES           "multi-queue-num-queues"
 #define PROTO                   "protocol"
 #define FRONTEND_KEY            "frontend"
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Scanning of VHD sector bitmaps, a 64-bit word at a time.
+ *
+ * Standard bitmaps number their bits MSB first within each byte, so a
+ * big-endian load turns a word into 64 bits in sector order, highest bit
+ * first. Bitmaps written by early tapdisks (see vhd_bitmap_test) use
+ * host-endian 32-bit words numbered LSB first instead; those are loaded
+ * so that the lowest bit comes first.
+ *
+ * Long runs of all-clear or all-set words are skipped 256 bits at a
+ * time with AVX2, when the CPU has it.
+ *
+ * Bitmaps are expected to span a whole number of 64-bit words, which
+ * sector bitmaps always do.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libvhd.h"
+#include "libvhd-bitmap.h"
+
+static inline int
+vhd_bitmap_msb_first(vhd_context_t *ctx)
+{
+	return !(vhd_creator_tapdisk(ctx) &&
+		 ctx->footer.crtr_ver == 0x00000001);
+}
+
+static inline uint64_t
+load_word(const char *map, uint32_t idx, int msb)
+{
+	uint64_t w;
+	uint32_t lo, hi;
+
+	if (msb) {
+		memcpy(&w, map + idx * sizeof(w), sizeof(w));
+		return be64toh(w);
+	}
+
+	memcpy(&lo, map + idx * sizeof(w), sizeof(lo));
+	memcpy(&hi, map + idx * sizeof(w) + sizeof(lo), sizeof(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* bits [lo, hi) of a loaded word, 0 <= lo < hi <= 64 */
+static inline uint64_t
+word_mask(uint32_t lo, uint32_t hi, int msb)
+{
+	uint64_t m;
+
+	m = hi - lo == 64 ? ~0ULL : (1ULL << (hi - lo)) - 1;
+	return msb ? m << (64 - hi) : m << lo;
+}
+
+static inline uint32_t
+word_first(uint64_t w, int msb)
+{
+	return msb ? __builtin_clzll(w) : __builtin_ctzll(w);
+}
+
+static uint32_t skip_words_init(const char *, uint32_t, uint64_t);
+
+static uint32_t (*skip_words)(const char *, uint32_t, uint64_t) =
+	skip_words_init;
+
+static uint32_t
+skip_words_init(const char *map, uint32_t nr, uint64_t pattern)
+{
+	skip_words = skip_words_scalar;
+#ifdef VHD_BITMAP_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		skip_words = skip_words_avx2;
+#endif
+	return skip_words(map, nr, pattern);
+}
+
+/*
+ * Index of the first bit equal to @value in [start, end), or @end.
+ */
+uint32_t
+vhd_bitmap_find(vhd_context_t *ctx, const char *map,
+		uint32_t start, uint32_t end, int value)
+{
+	uint32_t bit, idx, lo, hi, n;
+	uint64_t w, flip;
+	int msb;
+
+	msb  = vhd_bitmap_msb_first(ctx);
+	flip = value ? 0 : ~0ULL;
+
+	for (bit = start; bit < end; bit = (idx << 6) + hi) {
+		idx = bit >> 6;
+		lo  = bit & 63;
+		hi  = end - (idx << 6) < 64 ? end - (idx << 6) : 64;
+
+		if (!lo && hi == 64) {
+			n = skip_words(map + idx * 8, (end - bit) >> 6, flip);
+			if (n) {
+				idx += n - 1;
+				continue;
+			}
+		}
+
+		w = (load_word(map, idx, msb) ^ flip) & word_mask(lo, hi, msb);
+		if (w)
+			return (idx << 6) + word_first(w, msb);
+	}
+
+	return end;
+}
+
+/*
+ * Length of the run of equal bits starting at @start, up to @end.
+ */
+uint32_t
+vhd_bitmap_run(vhd_context_t *ctx, const char *map,
+	       uint32_t start, uint32_t end)
+{
+	int value;
+
+	if (start >= end)
+		return 0;
+
+	value = vhd_bitmap_test(ctx, (char *)map, start);
+	return vhd_bitmap_find(ctx, map, start, end, !value) - start;
+}
+
+/*
+ * Number of bits set in [start, end).
+ */
+uint32_t
+vhd_bitmap_count(vhd_context_t *ctx, const char *map,
+		 uint32_t start, uint32_t end)
+{
+	uint32_t bit, idx, lo, hi, count;
+	int msb;
+
+	msb   = vhd_bitmap_msb_first(ctx);
+	count = 0;
+
+	for (bit = start; bit < end; bit = (idx << 6) + hi) {
+		idx = bit >> 6;
+		lo  = bit & 63;
+		hi  = end - (idx << 6) < 64 ? end - (idx << 6) : 64;
+
+		count += __builtin_popcountll(load_word(map, idx, msb) &
+					      word_mask(lo, hi, msb));
+	}
+
+	return count;
+}
+
+/*
+ * Whether every bit in [start, end) is set.
+ */
+int
+vhd_bitmap_full(vhd_context_t *ctx, const char *map,
+		uint32_t start, uint32_t end)
+{
+	return vhd_bitmap_find(ctx, map, start, end, 0) == end;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. Neither the name of the copyright holder nor the names of its 
+ *     contributors may be used to endorse or promote products derived from 
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Word skippers behind vhd_bitmap_find(). Internal to libvhd; they live
+ * here so the tests can check the AVX2 one against the scalar one.
+ */
+
+#ifndef _LIBVHD_BITMAP_H_
+#define _LIBVHD_BITMAP_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VHD_BITMAP_AVX2
+#endif
+
+/* number of leading words in @map equal to @pattern (0 or ~0) */
+static inline uint32_t
+skip_words_scalar(const char *map, uint32_t nr, uint64_t pattern)
+{
+	uint32_t i;
+	uint64_t w;
+
+	for (i = 0; i < nr; i++) {
+		memcpy(&w, map + i * sizeof(w), sizeof(w));
+		if (w != pattern)
+			break;
+	}
+
+	return i;
+}
+
+#ifdef VHD_BITMAP_AVX2
+__attribute__((target("avx2")))
+static inline uint32_t
+skip_words_avx2(const char *map, uint32_t nr, uint64_t pattern)
+{
+	__m256i v, p;
+	uint32_t i;
+
+	p = _mm256_set1_epi64x(pattern);
+
+	for (i = 0; i + 4 <= nr; i += 4) {
+		v = _mm256_loadu_si256((const __m256i *)(map + i * 8));
+		if (pattern ? !_mm256_testc_si256(v, p) :
+			      !_mm256_testz_si256(v, v))
+			break;
+	}
+
+	return i + skip_words_scalar(map + i * 8, nr - i, pattern);
+}
+#endif
+
+#endif
@@ -724,19 +724,24 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 		}
 	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (ctx->opts.collect_stats &&
-		    vhd_bitmap_test(vhd, bitmap, i)) {
-			ctx_cur_stats(ctx)->secs_written++;
+	if (ctx->opts.collect_stats) {
+		ctx_cur_stats(ctx)->secs_written +=
+			vhd_bitmap_count(vhd, bitmap, 0, vhd->spb);
+
+		for (i = vhd_bitmap_find(vhd, bitmap, 0, vhd->spb, 1);
+		     i < vhd->spb;
+		     i = vhd_bitmap_find(vhd, bitmap, i + 1, vhd->spb, 1))
 			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
-		}
+	}
 
-		if (ctx->opts.check_data) {
+	if (ctx->opts.check_data) {
+		/* only sectors whose bit is clear can be at fault */
+		for (i = vhd_bitmap_find(vhd, bitmap, 0, vhd->spb, 0);
+		     i < vhd->spb;
+		     i = vhd_bitmap_find(vhd, bitmap, i + 1, vhd->spb, 0)) {
 			char *buf = data + (i << VHD_SECTOR_SHIFT);
-			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
-			int map   = vhd_bitmap_test(vhd, bitmap, i);
 
-			if (set && !map) {
+			if (vhd_util_check_zeros(buf, VHD_SECTOR_SIZE)) {
 				printf("sector 0x%x of block 0x%x has data "
 				       "where bitmap is clear\n", i, block);
 				err = -EINVAL;
@@ -38,108 +38,295 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <libaio.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 #include "canonpath.h"
 
+/*
+ * Coalescing is pipelined: up to COALESCE_DEPTH allocated blocks of the
+ * child are read at once, bitmap and data in a single aio read each,
+ * into a pool of buffers set up front. As each read lands, the runs
+ * set in its bitmap are written to the parent -- all of the block in
+ * one go if it is full. Writes to the parent go through aio too, one
+ * run after the other per block, while the other blocks keep going.
+ *
+ * For a dynamic VHD parent that only works where the parent already has
+ * the block: its runs are written straight into the parent's data area,
+ * and the parent bitmap (and batmap) is updated once, synchronously,
+ * after the last of them has landed. Blocks the parent still has to
+ * allocate, sparse parents and parents with a different block size are
+ * written with vhd_io_write, which takes care of the metadata itself.
+ */
+#define COALESCE_DEPTH               32
+
+struct coalesce_slot {
+	struct iocb                  iocb;
+	char                        *mem;
+	char                        *map;      /* bitmap, then block data */
+	char                        *data;
+	uint64_t                     block;
+	uint32_t                     pos;      /* next sector to look at */
+	int                          full;
+	int                          dirty;    /* parent bitmap to update */
+};
+
+struct coalesce_ctx {
+	vhd_context_t               *from;
+	vhd_context_t               *to;
+	int                          to_fd;
+	int                          progress;
+
+	io_context_t                 aio;
+	struct coalesce_slot         slots[COALESCE_DEPTH];
+	int                          inflight;
+	int                          err;
+
+	uint64_t                     next;     /* next block to read */
+	uint64_t                     bytes;    /* written to the parent */
+	struct timeval               start;
+	struct timeval               shown;
+};
+
+static void
+coalesce_show_progress(struct coalesce_ctx *c, int last)
+{
+	struct timeval now;
+	double secs, pct;
+
+	gettimeofday(&now, NULL);
+	if (!last &&
+	    now.tv_sec == c->shown.tv_sec &&
+	    c->next < c->from->bat.entries)
+		return;
+	c->shown = now;
+
+	secs = (now.tv_sec - c->start.tv_sec) +
+		(now.tv_usec - c->start.tv_usec) / 1000000.0;
+	pct  = last ? 100.0 :
+		((double)c->next / (double)c->from->bat.entries) * 100.0;
+
+	printf("\r%6.2f%% %8.2f MB/s", pct,
+	       secs > 0 ? c->bytes / secs / (1024 * 1024) : 0.0);
+	if (last)
+		printf("\n");
+	fflush(stdout);
+}
+
 static int
-__raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
+coalesce_submit(struct coalesce_ctx *c, struct coalesce_slot *slot)
 {
-	off64_t off;
-	size_t ret;
-
-	errno = 0;
-	off = lseek64(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off64_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
+	struct iocb *iocb = &slot->iocb;
+	int err;
 
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
-	if (ret == vhd_sectors_to_bytes(secs))
-		return 0;
+	err = io_submit(c->aio, 1, &iocb);
+	if (err != 1)
+		return err < 0 ? err : -EIO;
+
+	c->inflight++;
+	return 0;
+}
+
+/* can runs of @block be written straight into the parent's data area? */
+static int
+coalesce_parent_mapped(struct coalesce_ctx *c, uint64_t block)
+{
+	vhd_context_t *to = c->to;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
-	return (errno ? -errno : -EIO);
+	return vhd_type_dynamic(to) &&
+		to->spb == c->from->spb &&
+		!vhd_flag_test(to->oflags, VHD_OPEN_IO_WRITE_SPARSE) &&
+		block < to->bat.entries &&
+		to->bat.bat[block] != DD_BLK_UNUSED;
 }
 
-/*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
- */
+/* marks the runs written from @slot in the parent's bitmap */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-			int parent_fd, uint64_t block)
+coalesce_update_parent(struct coalesce_ctx *c, struct coalesce_slot *slot)
 {
-	int i, err;
-	void *buf;
+	vhd_context_t *from = c->from, *to = c->to;
+	uint32_t i, n;
 	char *map;
-	uint64_t sec, secs;
-
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	int err;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	if (vhd_has_batmap(to) &&
+	    vhd_batmap_test(to, &to->batmap, slot->block))
 		return 0;
 
-	err = posix_memalign(&buf, 4096, vhd->header.block_size);
+	err = vhd_read_bitmap(to, slot->block, &map);
 	if (err)
-		return -err;
+		return err;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	i = slot->full ? 0 : vhd_bitmap_find(from, slot->map, 0, from->spb, 1);
+	while (i < from->spb) {
+		n = slot->full ? from->spb :
+			vhd_bitmap_run(from, slot->map, i, from->spb);
+		for (; n; n--, i++)
+			vhd_bitmap_set(to, map, i);
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+		if (!slot->full)
+			i = vhd_bitmap_find(from, slot->map, i, from->spb, 1);
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
+	err = vhd_write_bitmap(to, slot->block, map);
 	if (err)
-		goto done;
+		goto out;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+	if (vhd_has_batmap(to) && vhd_bitmap_full(to, map, 0, to->spb)) {
+		vhd_batmap_set(to, &to->batmap, slot->block);
+		err = vhd_write_batmap(to, &to->batmap);
+	}
+
+out:
+	free(map);
+	return err;
+}
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
+/*
+ * Writes the next run of @slot's block to the parent. Returns 1 with a
+ * write in flight, 0 once the block is done.
+ */
+static int
+coalesce_write_next(struct coalesce_ctx *c, struct coalesce_slot *slot)
+{
+	vhd_context_t *from = c->from;
+	uint32_t i, secs;
+	uint64_t sec, off;
+	int err, fd;
+
+	while (slot->pos < from->spb) {
+		if (slot->full) {
+			i    = 0;
+			secs = from->spb;
+		} else {
+			i = vhd_bitmap_find(from, slot->map,
+					    slot->pos, from->spb, 1);
+			if (i == from->spb)
 				break;
+			secs = vhd_bitmap_run(from, slot->map, i, from->spb);
+		}
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
+		slot->pos = i + secs;
+		sec       = slot->block * from->spb + i;
+		c->bytes += vhd_sectors_to_bytes(secs);
+
+		if (!c->to->file) {
+			fd  = c->to_fd;
+			off = sec;
+		} else if (coalesce_parent_mapped(c, slot->block)) {
+			fd  = c->to->fd;
+			off = (uint64_t)c->to->bat.bat[slot->block] +
+				c->to->bm_secs + i;
+			slot->dirty = 1;
+		} else {
+			err = vhd_io_write(c->to,
+					   slot->data + vhd_sectors_to_bytes(i),
+					   sec, secs);
+			if (err)
+				return err;
+			continue;
+		}
+
+		io_prep_pwrite(&slot->iocb, fd,
+			       slot->data + vhd_sectors_to_bytes(i),
+			       vhd_sectors_to_bytes(secs),
+			       vhd_sectors_to_bytes(off));
+		slot->iocb.data = slot;
+
+		err = coalesce_submit(c, slot);
+		return err ? : 1;
+	}
+
+	if (slot->dirty) {
+		slot->dirty = 0;
+		return coalesce_update_parent(c, slot);
+	}
+
+	return 0;
+}
+
+/* reads the next allocated block into @slot; 0 if there is none left */
+static int
+coalesce_read_next(struct coalesce_ctx *c, struct coalesce_slot *slot)
+{
+	vhd_context_t *from = c->from;
+	uint64_t blk;
+	int err;
+
+	while (c->next < from->bat.entries) {
+		blk = c->next++;
+		if (from->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		slot->block = blk;
+		slot->pos   = 0;
+		slot->dirty = 0;
+		slot->full  = vhd_has_batmap(from) &&
+			vhd_batmap_test(from, &from->batmap, blk);
+
+		io_prep_pread(&slot->iocb, from->fd, slot->map,
+			      vhd_sectors_to_bytes(from->bm_secs + from->spb),
+			      vhd_sectors_to_bytes(from->bat.bat[blk]));
+		slot->iocb.data = slot;
+
+		err = coalesce_submit(c, slot);
 		if (err)
-			goto done;
+			return err;
 
-		i += secs;
+		return 1;
 	}
 
-	err = 0;
+	return 0;
+}
 
-done:
-	free(buf);
-	free(map);
-	return err;
+static int
+coalesce_complete(struct coalesce_ctx *c, struct io_event *ev)
+{
+	struct coalesce_slot *slot = ev->data;
+	struct iocb *iocb = ev->obj;
+	int err;
+
+	c->inflight--;
+
+	if (ev->res != iocb->u.c.nbytes) {
+		printf("coalesce: %s of block 0x%"PRIx64" failed: %ld\n",
+		       iocb->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write",
+		       slot->block, (long)ev->res);
+		return (long)ev->res < 0 ? (long)ev->res : -EIO;
+	}
+
+	/* a freshly read block: is it full after all? */
+	if (iocb->aio_lio_opcode == IO_CMD_PREAD && !slot->full)
+		slot->full = vhd_bitmap_full(c->from, slot->map,
+					     0, c->from->spb);
+
+	err = coalesce_write_next(c, slot);
+	if (err)
+		return err < 0 ? err : 0;
+
+	if (c->err)
+		return 0;
+
+	err = coalesce_read_next(c, slot);
+	return err < 0 ? err : 0;
 }
 
 static int
 vhd_util_coalesce_onto(vhd_context_t *from,
 		       vhd_context_t *to, int to_fd, int progress)
 {
-	int err;
-	uint64_t i;
+	struct io_event events[COALESCE_DEPTH];
+	struct coalesce_ctx c;
+	struct coalesce_slot *slot;
+	size_t pad, size;
+	int i, n, err;
+
+	memset(&c, 0, sizeof(c));
+	c.from     = from;
+	c.to       = to;
+	c.to_fd    = to_fd;
+	c.progress = progress;
 
 	err = vhd_get_bat(from);
 	if (err)
@@ -151,23 +338,79 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 			goto out;
 	}
 
-	for (i = 0; i < from->bat.entries; i++) {
-		if (progress) {
-			printf("\r%6.2f%%",
-			       ((float)i / (float)from->bat.entries) * 100.00);
-			fflush(stdout);
-		}
-		err = vhd_util_coalesce_block(from, to, to_fd, i);
+	if (to->file && vhd_type_dynamic(to)) {
+		err = vhd_get_bat(to);
 		if (err)
 			goto out;
+
+		if (vhd_has_batmap(to)) {
+			err = vhd_get_batmap(to);
+			if (err)
+				goto out;
+		}
 	}
 
-	err = 0;
+	err = io_setup(COALESCE_DEPTH, &c.aio);
+	if (err) {
+		printf("coalesce: io_setup failed: %d\n", err);
+		c.aio = NULL;
+		goto out;
+	}
 
-	if (progress)
-		printf("\r100.00%%\n");
+	/* pad so the data lands page aligned, right after the bitmap */
+	pad  = (4096 - (vhd_sectors_to_bytes(from->bm_secs) & 4095)) & 4095;
+	size = pad + vhd_sectors_to_bytes(from->bm_secs + from->spb);
+
+	for (i = 0; i < COALESCE_DEPTH; i++) {
+		slot = &c.slots[i];
+
+		err = posix_memalign((void **)&slot->mem, 4096, size);
+		if (err) {
+			slot->mem = NULL;
+			err = -err;
+			goto out;
+		}
+
+		slot->map  = slot->mem + pad;
+		slot->data = slot->map + vhd_sectors_to_bytes(from->bm_secs);
+	}
+
+	gettimeofday(&c.start, NULL);
+
+	for (i = 0; i < COALESCE_DEPTH; i++) {
+		err = coalesce_read_next(&c, &c.slots[i]);
+		if (err <= 0)
+			break;
+	}
+	c.err = err < 0 ? err : 0;
+
+	while (c.inflight) {
+		n = io_getevents(c.aio, 1, COALESCE_DEPTH, events, NULL);
+		if (n < 0) {
+			if (n == -EINTR)
+				continue;
+			c.err = c.err ? : n;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			err = coalesce_complete(&c, &events[i]);
+			c.err = c.err ? : err;
+		}
+
+		if (progress)
+			coalesce_show_progress(&c, 0);
+	}
+
+	err = c.err;
+	if (!err && progress)
+		coalesce_show_progress(&c, 1);
 
 out:
+	if (c.aio)
+		io_destroy(c.aio);
+	for (i = 0; i < COALESCE_DEPTH; i++)
+		free(c.slots[i].mem);
 	return err;
 }
 
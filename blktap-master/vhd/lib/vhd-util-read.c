@@ -542,9 +542,9 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 			 int hex)
 {
 	char *buf;
-	uint64_t cur;
-	int i, err, bit;
-	uint32_t blk, bm_blk, sec;
+	uint64_t cur, end;
+	int err, bit, n;
+	uint32_t blk, sec, lim;
 	int64_t s, r;
 
 	if (vhd_sectors_to_bytes(sector + count) > vhd->footer.curr_size) {
@@ -552,37 +552,35 @@ vhd_print_bitmap_extents(vhd_context_t *vhd, uint64_t sector, int count,
 		return -ERANGE;
 	}
 
-	bm_blk = -1;
-	buf    = NULL;
+	buf = NULL;
 	s = -1;
 	r = 0;
 
-	for (i = 0; i < count; i++) {
-		cur = sector + i;
+	end = sector + count;
+	for (cur = sector; cur < end; cur += n) {
 		blk = cur / vhd->spb;
 		sec = cur % vhd->spb;
+		lim = MIN(vhd->spb, sec + (end - cur));
 
-		if (blk != bm_blk) {
-			bm_blk = blk;
+		if (vhd->bat.bat[blk] == DD_BLK_UNUSED) {
+			bit = 0;
+			n   = lim - sec;
+		} else {
 			free(buf);
 			buf = NULL;
 
-			if (vhd->bat.bat[blk] != DD_BLK_UNUSED) {
-				err = vhd_read_bitmap(vhd, blk, &buf);
-				if (err)
-					goto out;
-			}
-		}
+			err = vhd_read_bitmap(vhd, blk, &buf);
+			if (err)
+				goto out;
 
-		if (vhd->bat.bat[blk] == DD_BLK_UNUSED)
-			bit = 0;
-		else
 			bit = vhd_bitmap_test(vhd, buf, sec);
+			n   = vhd_bitmap_run(vhd, buf, sec, lim);
+		}
 
 		if (bit) {
 			if (r == 0)
 				s = cur;
-			r++;
+			r += n;
 		} else {
 			if (r > 0) {
 				printf("%s ", conv(hex, s));